@@ -0,0 +1,195 @@
+/*
+ * Compares ways of scanning a shard file from a cold page cache: iostream
+ * reads (what lmkdb used to do), mmap, synchronous pread and the io_uring
+ * backed IoQueue that shard readers use, with a number of pages kept in
+ * flight. Each pass drops the file from the page cache first and counts the
+ * lines of every page it reads, standing in for parsing.
+ */
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+#include "AsyncIo.hpp"
+
+using namespace std;
+using Clock = chrono::steady_clock;
+
+constexpr size_t PAGE_SIZE = 64 * 1024;
+
+void usage(const char* program) {
+    cerr << "usage: " << program << " -f <file> [-d <depth>] [-r <runs>]\n";
+}
+
+// Evicts the clean pages of the file; false where the system cannot
+bool drop_cache(const string& path) {
+#ifdef POSIX_FADV_DONTNEED
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+    bool dropped = posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED) == 0;
+    close(fd);
+    return dropped;
+#else
+    (void)path;
+    return false;
+#endif
+}
+
+uint64_t count_lines(const char* data, size_t size) {
+    return count(data, data + size, '\n');
+}
+
+uint64_t scan_iostream(const string& path, size_t) {
+    ifstream file(path, ios::binary);
+    vector<char> page(PAGE_SIZE);
+    uint64_t lines = 0;
+    while (file.read(page.data(), PAGE_SIZE) || file.gcount() > 0) {
+        lines += count_lines(page.data(), file.gcount());
+    }
+    return lines;
+}
+
+uint64_t scan_mmap(const string& path, size_t) {
+    int fd = open(path.c_str(), O_RDONLY);
+    struct stat info;
+    if (fd < 0 || fstat(fd, &info) != 0 || info.st_size == 0) {
+        if (fd >= 0) close(fd);
+        return 0;
+    }
+
+    size_t size = info.st_size;
+    void* data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) return 0;
+
+    madvise(data, size, MADV_SEQUENTIAL);
+    uint64_t lines = count_lines(static_cast<const char*>(data), size);
+    munmap(data, size);
+    return lines;
+}
+
+uint64_t scan_pread(const string& path, size_t) {
+    int fd = open(path.c_str(), O_RDONLY);
+    vector<char> page(PAGE_SIZE);
+    uint64_t lines = 0;
+    for (uint64_t offset = 0;; offset += PAGE_SIZE) {
+        ssize_t n = preadFully(fd, offset, page.data(), PAGE_SIZE);
+        if (n <= 0) break;
+        lines += count_lines(page.data(), n);
+    }
+    close(fd);
+    return lines;
+}
+
+uint64_t scan_queue(const string& path, size_t depth) {
+    int fd = open(path.c_str(), O_RDONLY);
+    struct stat info;
+    fstat(fd, &info);
+    size_t pages = (info.st_size + PAGE_SIZE - 1) / PAGE_SIZE;
+
+    IoQueue& queue = IoQueue::forThread();
+    vector<vector<char>> buffers(depth, vector<char>(PAGE_SIZE));
+    vector<shared_ptr<IoQueue::Request>> requests(depth);
+
+    // Page p is read into buffer p % depth, depth pages ahead of the scan
+    auto issue = [&](size_t page) {
+        if (page >= pages) return;
+        requests[page % depth] = queue.read(fd, page * PAGE_SIZE,
+                                            buffers[page % depth].data(),
+                                            PAGE_SIZE);
+    };
+    for (size_t page = 0; page < depth; ++page) issue(page);
+    queue.submit();
+
+    uint64_t lines = 0;
+    for (size_t page = 0; page < pages; ++page) {
+        IoQueue::Request& request = *requests[page % depth];
+        queue.wait(request);
+        if (request.result > 0) {
+            lines += count_lines(buffers[page % depth].data(), request.result);
+        }
+        issue(page + depth);
+        queue.submit();
+    }
+    close(fd);
+    return lines;
+}
+
+int main(int argc, char* argv[]) {
+    string path;
+    size_t depth = 8;
+    size_t runs = 3;
+
+    for (int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        if (i + 1 >= argc) {
+            usage(argv[0]);
+            return 1;
+        }
+        if (arg == "-f") {
+            path = argv[++i];
+        } else if (arg == "-d") {
+            depth = max<size_t>(stoul(argv[++i]), 1);
+        } else if (arg == "-r") {
+            runs = max<size_t>(stoul(argv[++i]), 1);
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (path.empty()) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    struct Method {
+        string name;
+        function<uint64_t(const string&, size_t)> scan;
+    };
+    vector<Method> methods = {
+        {"iostream", scan_iostream},
+        {"mmap", scan_mmap},
+        {"pread", scan_pread},
+        {IoQueue::forThread().asynchronous() ? "io_uring" : "pread queue",
+         scan_queue},
+    };
+
+    struct stat info;
+    if (stat(path.c_str(), &info) != 0) {
+        cerr << "Cannot stat " << path << "\n";
+        return 1;
+    }
+    double megabytes = info.st_size / 1e6;
+
+    bool cold = drop_cache(path);
+    if (!cold) cerr << "Cannot drop the page cache, reads are warm\n";
+    cout << path << ": " << megabytes << " MB, " << runs << " runs, depth "
+         << depth << (cold ? ", cold cache" : ", warm cache") << "\n";
+
+    for (const auto& method : methods) {
+        double best = 0;
+        uint64_t lines = 0;
+        for (size_t run = 0; run < runs; ++run) {
+            drop_cache(path);
+            auto start = Clock::now();
+            lines = method.scan(path, depth);
+            double seconds =
+                chrono::duration<double>(Clock::now() - start).count();
+            best = max(best, megabytes / seconds);
+        }
+        cout << "  " << method.name << ": " << best << " MB/s (" << lines
+             << " lines)\n";
+    }
+    return 0;
+}
@@ -0,0 +1,197 @@
+/*
+ * Load generator for lmkdb server mode (lmkdb --serve <socket>).
+ * Opens a number of concurrent client connections, each of which sends a
+ * fixed number of requests round-robin from the given commands, and reports
+ * throughput and latency percentiles.
+ */
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace std;
+using Clock = chrono::steady_clock;
+
+bool write_all(int fd, const char* data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n <= 0) return false;
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+bool read_all(int fd, char* data, size_t len) {
+    while (len > 0) {
+        ssize_t n = read(fd, data, len);
+        if (n <= 0) return false;
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+bool send_request(int fd, const string& command) {
+    uint32_t len = command.size();
+    unsigned char header[4] = {
+        static_cast<unsigned char>(len >> 24),
+        static_cast<unsigned char>(len >> 16),
+        static_cast<unsigned char>(len >> 8),
+        static_cast<unsigned char>(len)};
+    return write_all(fd, reinterpret_cast<char*>(header), 4) &&
+           write_all(fd, command.data(), command.size());
+}
+
+bool receive_response(int fd, string& response) {
+    unsigned char header[4];
+    if (!read_all(fd, reinterpret_cast<char*>(header), 4)) return false;
+
+    uint32_t len = (uint32_t(header[0]) << 24) | (uint32_t(header[1]) << 16) |
+                   (uint32_t(header[2]) << 8) | uint32_t(header[3]);
+    response.resize(len);
+    return read_all(fd, response.data(), len);
+}
+
+int connect_to(const string& socket_path) {
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1) return -1;
+
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, socket_path.c_str(), sizeof(addr.sun_path) - 1);
+
+    if (connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == -1) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+struct ClientResult {
+    vector<double> latencies_us;
+    size_t response_bytes = 0;
+    bool failed = false;
+};
+
+void run_client(const string& socket_path, const vector<string>& commands,
+                size_t num_requests, size_t offset, ClientResult& result) {
+    int fd = connect_to(socket_path);
+    if (fd == -1) {
+        result.failed = true;
+        return;
+    }
+
+    result.latencies_us.reserve(num_requests);
+    string response;
+
+    for (size_t i = 0; i < num_requests; ++i) {
+        const string& command = commands[(offset + i) % commands.size()];
+
+        auto start = Clock::now();
+        if (!send_request(fd, command) || !receive_response(fd, response)) {
+            result.failed = true;
+            break;
+        }
+        auto end = Clock::now();
+
+        result.latencies_us.push_back(
+            chrono::duration<double, micro>(end - start).count());
+        result.response_bytes += response.size();
+    }
+
+    close(fd);
+}
+
+double percentile(const vector<double>& sorted, double p) {
+    if (sorted.empty()) return 0;
+    size_t idx = static_cast<size_t>(p * (sorted.size() - 1) + 0.5);
+    return sorted[min(idx, sorted.size() - 1)];
+}
+
+void usage(const char* prog) {
+    cerr << "Usage: " << prog
+         << " -s <socket> [-c <clients>] [-n <requests per client>]"
+            " -q <command> [-q <command>...]\n";
+}
+
+int main(int argc, char* argv[]) {
+    string socket_path;
+    size_t num_clients = 4;
+    size_t num_requests = 1000;
+    vector<string> commands;
+
+    for (int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        if (i + 1 >= argc) {
+            usage(argv[0]);
+            return 1;
+        }
+        if (arg == "-s") {
+            socket_path = argv[++i];
+        } else if (arg == "-c") {
+            num_clients = stoul(argv[++i]);
+        } else if (arg == "-n") {
+            num_requests = stoul(argv[++i]);
+        } else if (arg == "-q") {
+            commands.push_back(argv[++i]);
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (socket_path.empty() || commands.empty() || num_clients == 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    vector<ClientResult> results(num_clients);
+    vector<thread> clients;
+
+    auto start = Clock::now();
+    for (size_t i = 0; i < num_clients; ++i) {
+        clients.emplace_back(run_client, cref(socket_path), cref(commands),
+                             num_requests, i, ref(results[i]));
+    }
+    for (auto& client : clients) {
+        client.join();
+    }
+    auto end = Clock::now();
+
+    vector<double> latencies;
+    size_t response_bytes = 0;
+    size_t failed_clients = 0;
+    for (const auto& result : results) {
+        latencies.insert(latencies.end(), result.latencies_us.begin(),
+                         result.latencies_us.end());
+        response_bytes += result.response_bytes;
+        failed_clients += result.failed;
+    }
+    sort(latencies.begin(), latencies.end());
+
+    double seconds = chrono::duration<double>(end - start).count();
+
+    cout << "clients:      " << num_clients << "\n"
+         << "requests:     " << latencies.size() << "\n"
+         << "failed:       " << failed_clients << " clients\n"
+         << "elapsed:      " << seconds << " s\n"
+         << "throughput:   " << latencies.size() / seconds << " req/s\n"
+         << "response:     " << response_bytes / seconds / (1 << 20)
+         << " MB/s\n"
+         << "latency (us): p50 " << percentile(latencies, 0.50) << "  p90 "
+         << percentile(latencies, 0.90) << "  p99 "
+         << percentile(latencies, 0.99) << "  p999 "
+         << percentile(latencies, 0.999) << "  max "
+         << (latencies.empty() ? 0 : latencies.back()) << "\n";
+
+    return failed_clients == 0 ? 0 : 1;
+}
@@ -0,0 +1,47 @@
+#!/usr/bin/env python3
+"""Compares two lmkdb_bench result files case by case.
+
+usage: compare.py <baseline.json> <candidate.json> [--threshold 0.1]
+
+Prints the ns/row of both runs for every case and parameter combination
+present in both, and exits with 1 if any got slower by more than threshold
+(10% by default).
+"""
+
+import json
+import sys
+
+PARAMS = ("case", "rows", "shards", "threads", "skew", "selectivity", "wal",
+          "batch")
+
+
+def load(path):
+    with open(path) as f:
+        results = json.load(f)["results"]
+    return {tuple(r.get(p) for p in PARAMS): r for r in results}
+
+
+def main(argv):
+    if len(argv) not in (3, 5) or (len(argv) == 5 and argv[3] != "--threshold"):
+        print(__doc__.strip().splitlines()[2], file=sys.stderr)
+        return 2
+    threshold = float(argv[4]) if len(argv) == 5 else 0.1
+    baseline, candidate = load(argv[1]), load(argv[2])
+
+    regressed = False
+    for key in sorted(baseline.keys() & candidate.keys(), key=str):
+        before = baseline[key]["ns_per_row"]
+        after = candidate[key]["ns_per_row"]
+        change = (after - before) / before if before else 0.0
+        flag = ""
+        if change > threshold:
+            flag = "  REGRESSION"
+            regressed = True
+        label = " ".join(f"{p}={v}" for p, v in zip(PARAMS, key))
+        print(f"{label}: {before:.1f} -> {after:.1f} ns/row "
+              f"({change:+.1%}){flag}")
+    return 1 if regressed else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main(sys.argv))
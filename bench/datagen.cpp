@@ -0,0 +1,112 @@
+/*
+ * Writes synthetic bike hire tables straight into the shard format of a
+ * database, see Datagen. By default a trips table of scale * 1M rows and the
+ * stations and docks tables it joins with; --london writes the tables
+ * aux/cpu_test expects instead (london_1000, london_10_4, ... up to the
+ * scale, london_stations and london_docks).
+ */
+
+#include <cmath>
+#include <functional>
+#include <iostream>
+#include <string>
+#include "Catalog.hpp"
+#include "Datagen.hpp"
+#include "Profile.hpp"
+#include "Table.hpp"
+
+using namespace std;
+
+namespace {
+void usage(const char* program) {
+    cerr << "usage: " << program
+         << " [--db <dir>] [--scale <sf>] [--prefix <name>] [--london]\n"
+            "       [--stations <n>] [--skew <s>] [--match-rate <f>]\n"
+            "       [--shard-rows <n>] [--seed <n>]\n";
+}
+
+bool timed(const string& name, Catalog& catalog,
+           const function<bool()>& generate) {
+    Stopwatch stopwatch;
+    if (!generate()) return false;
+
+    auto table = catalog.find(name);
+    cout << "Wrote " << name << ": " << table->shardCount() << " shards, "
+         << formatBytes(table->dataSize()) << " in "
+         << stopwatch.wallNs() / 1000000 << "ms" << endl;
+    return true;
+}
+}  // namespace
+
+int main(int argc, char* argv[]) {
+    string db = "./database/";
+    string prefix = "trips";
+    bool london = false;
+    DatagenOptions options;
+
+    for (int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        if (arg == "--london") {
+            london = true;
+            continue;
+        }
+        if (i + 1 >= argc) {
+            usage(argv[0]);
+            return 1;
+        }
+        string value = argv[++i];
+        if (arg == "--db") {
+            db = value;
+        } else if (arg == "--scale") {
+            options.scale = stod(value);
+        } else if (arg == "--prefix") {
+            prefix = value;
+        } else if (arg == "--stations") {
+            options.stations = stoul(value);
+        } else if (arg == "--skew") {
+            options.skew = stod(value);
+        } else if (arg == "--match-rate") {
+            options.match_rate = stod(value);
+        } else if (arg == "--shard-rows") {
+            options.shard_rows = stoul(value);
+        } else if (arg == "--seed") {
+            options.seed = stoull(value);
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (london) prefix = "london";
+
+    Catalog catalog(db);
+    catalog.load();
+    Datagen generator(catalog, options);
+
+    vector<pair<string, size_t>> trips;
+    if (london) {
+        trips.emplace_back("london_1000", 1000);
+        for (int exponent = 4; pow(10, exponent) <= generator.tripRows();
+             ++exponent) {
+            trips.emplace_back("london_10_" + to_string(exponent),
+                               static_cast<size_t>(pow(10, exponent)));
+        }
+    } else {
+        trips.emplace_back(prefix, generator.tripRows());
+    }
+
+    for (const auto& [name, rows] : trips) {
+        if (!timed(name, catalog, [&]() {
+                return generator.trips(name, rows);
+            })) {
+            return 1;
+        }
+    }
+    string stations = prefix + "_stations", docks = prefix + "_docks";
+    if (!timed(stations, catalog, [&]() {
+            return generator.stations(stations);
+        }) ||
+        !timed(docks, catalog, [&]() { return generator.docks(docks); })) {
+        return 1;
+    }
+    return 0;
+}
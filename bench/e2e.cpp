@@ -0,0 +1,299 @@
+/*
+ * End-to-end regression benchmark. Generates a database with Datagen, then
+ * runs a fixed workload through the Interpreter, as typed at the prompt:
+ * startup, ingest through inserts, full, indexed and ordered reads, updates,
+ * deletes and two and three way joins. Each step is timed in milliseconds
+ * and written as JSON with the rows it printed.
+ *
+ * With --baseline the timings are compared to an earlier output and the run
+ * fails (exit code 1) if a step got slower by more than --threshold, and by
+ * more than --min-ms so that steps of a few milliseconds do not fail on
+ * noise. A step printing a different number of rows is reported, as the
+ * generated data only depends on the options.
+ */
+
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <streambuf>
+#include <string>
+#include <unistd.h>
+#include <vector>
+#include "Catalog.hpp"
+#include "Datagen.hpp"
+#include "Interpreter.hpp"
+#include "Profile.hpp"
+#include "utils.hpp"
+
+namespace fs = std::filesystem;
+using namespace std;
+
+namespace {
+struct Step {
+    string name;
+    vector<string> commands;
+};
+
+struct Timing {
+    string name;
+    double ms;
+    uint64_t rows;  // Lines printed
+};
+
+// Discards output, counting its lines
+class LineCounter : public streambuf {
+   public:
+    uint64_t lines = 0;
+
+   protected:
+    int overflow(int c) override {
+        if (c == '\n') lines++;
+        return c;
+    }
+    streamsize xsputn(const char* s, streamsize n) override {
+        lines += count(s, s + n, '\n');
+        return n;
+    }
+};
+
+vector<Step> workload(size_t rows) {
+    rows = max<size_t>(rows, 1);
+    auto spread = [&](size_t count, size_t i) {
+        return to_string(i * rows / count);
+    };
+
+    Step insert{"insert", {}};
+    for (size_t i = 0; i < 500; ++i) {
+        string id = to_string(rows + i + 1);
+        insert.commands.push_back(
+            "insert trips rental_id:" + id + " duration:" +
+            to_string(300 + i) + " bike_id:" + to_string(i % 15000 + 1) +
+            " start_date:2025-01-01T08:00 start_station_id:" +
+            to_string(i % 800 + 1) + " start_station_name:" +
+            Datagen::stationName(i % 800));
+    }
+    Step point{"read_index", {}};
+    for (size_t i = 0; i < 50; ++i) {
+        point.commands.push_back("read trips id:" + spread(50, i));
+    }
+    Step update{"update", {}};
+    for (size_t i = 0; i < 10; ++i) {
+        update.commands.push_back("update trips id:" + spread(10, i) +
+                                  " duration:1");
+    }
+
+    return {
+        insert,
+        {"read", {"read trips"}},
+        point,
+        {"read_order_limit", {"read trips order by duration desc limit 10"}},
+        {"read_order", {"read trips_stations order by station_name"}},
+        update,
+        {"delete_by_attribute", {"delete trips bike_id:42"}},
+        {"delete_index", {"delete trips id:0"}},
+        {"join", {"join trips.start_station_name trips_stations.station_name"}},
+        {"join_3way",
+         {"join trips.end_station_name trips_stations.station_name "
+          "trips_docks.station_name"}},
+    };
+}
+
+// Generates the database at db and runs the workload on it. Sets failed
+// if a command reported an error.
+vector<Timing> runOnce(const DatagenOptions& options, const fs::path& db,
+                       bool& failed) {
+    fs::remove_all(db);
+    vector<Timing> timings;
+    auto record = [&](const string& name, const Stopwatch& stopwatch,
+                      uint64_t rows) {
+        timings.push_back({name, stopwatch.wallNs() / 1e6, rows});
+        cerr << name << ": " << timings.back().ms << "ms" << endl;
+    };
+
+    size_t rows;
+    {
+        Stopwatch stopwatch;
+        Catalog catalog(db);
+        catalog.load();
+        Datagen generator(catalog, options);
+        if (!generator.trips("trips") ||
+            !generator.stations("trips_stations") ||
+            !generator.docks("trips_docks")) {
+            failed = true;
+            return {};
+        }
+        rows = generator.tripRows();
+        record("generate", stopwatch, rows);
+    }
+
+    {
+        LineCounter lines;
+        ostringstream errors;
+        ostream out(&lines);
+        OutputRedirect redirect(out, errors);
+
+        Stopwatch startup;
+        Interpreter interpreter(db.string());
+        record("startup", startup, 0);
+
+        for (const Step& step : workload(rows)) {
+            lines.lines = 0;
+            Stopwatch stopwatch;
+            for (const string& command : step.commands) {
+                interpreter.processCommand(command);
+            }
+            record(step.name, stopwatch, lines.lines);
+
+            if (!errors.str().empty()) {
+                cerr << step.name << " failed: " << errors.str();
+                errors.str("");
+                failed = true;
+            }
+        }
+    }
+    fs::remove_all(db);
+    return timings;
+}
+
+// Steps of a JSON file written by this program, one step per line
+map<string, Timing> readBaseline(const string& path) {
+    map<string, Timing> steps;
+    ifstream in(path);
+    auto number = [](const string& line, const string& key) {
+        size_t at = line.find("\"" + key + "\": ");
+        if (at == string::npos) return 0.0;
+        return stod(line.substr(at + key.size() + 4));
+    };
+    for (string line; getline(in, line);) {
+        size_t at = line.find("\"step\": \"");
+        if (at == string::npos) continue;
+        at += 9;
+        string name = line.substr(at, line.find('"', at) - at);
+        steps[name] = {name, number(line, "ms"),
+                       static_cast<uint64_t>(number(line, "rows"))};
+    }
+    return steps;
+}
+
+void usage(const char* program) {
+    cerr << "usage: " << program
+         << " [--scale <sf>] [--stations <n>] [--skew <s>]"
+            " [--match-rate <f>]\n"
+            "       [--shard-rows <n>] [--db <dir>] [--out <file>]\n"
+            "       [--repeat <n>] [--baseline <file>] [--threshold <f>]"
+            " [--min-ms <ms>]\n";
+}
+}  // namespace
+
+int main(int argc, char* argv[]) {
+    DatagenOptions options;
+    options.scale = 0.1;
+    fs::path db = fs::temp_directory_path() /
+                  ("lmkdb_e2e_" + to_string(getpid()));
+    string out_path, baseline_path;
+    double threshold = 0.2;
+    double min_ms = 5;
+    size_t repeat = 3;
+
+    for (int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        if (i + 1 >= argc) {
+            usage(argv[0]);
+            return 1;
+        }
+        string value = argv[++i];
+        if (arg == "--scale") {
+            options.scale = stod(value);
+        } else if (arg == "--stations") {
+            options.stations = stoul(value);
+        } else if (arg == "--skew") {
+            options.skew = stod(value);
+        } else if (arg == "--match-rate") {
+            options.match_rate = stod(value);
+        } else if (arg == "--shard-rows") {
+            options.shard_rows = stoul(value);
+        } else if (arg == "--db") {
+            db = value;
+        } else if (arg == "--out") {
+            out_path = value;
+        } else if (arg == "--repeat") {
+            repeat = max<size_t>(stoul(value), 1);
+        } else if (arg == "--baseline") {
+            baseline_path = value;
+        } else if (arg == "--threshold") {
+            threshold = stod(value);
+        } else if (arg == "--min-ms") {
+            min_ms = stod(value);
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    // Every run starts from a new database, steps report their median
+    bool failed = false;
+    vector<vector<Timing>> runs;
+    for (size_t r = 0; r < repeat && !failed; ++r) {
+        runs.push_back(runOnce(options, db, failed));
+    }
+    if (failed) return 1;
+
+    vector<Timing> timings = runs.front();
+    for (size_t i = 0; i < timings.size(); ++i) {
+        vector<double> ms;
+        for (const auto& run : runs) ms.push_back(run[i].ms);
+        ranges::sort(ms);
+        timings[i].ms = ms[ms.size() / 2];
+    }
+
+    ostringstream json;
+    json << "{\n  \"scale\": " << options.scale
+         << ",\n  \"repeat\": " << repeat
+         << ",\n  \"stations\": " << options.stations
+         << ",\n  \"skew\": " << options.skew
+         << ",\n  \"match_rate\": " << options.match_rate
+         << ",\n  \"steps\": [";
+    for (size_t i = 0; i < timings.size(); ++i) {
+        char ms[32];
+        snprintf(ms, sizeof(ms), "%.3f", timings[i].ms);
+        json << (i ? "," : "") << "\n    {\"step\": \"" << timings[i].name
+             << "\", \"ms\": " << ms << ", \"rows\": " << timings[i].rows
+             << "}";
+    }
+    json << "\n  ]\n}\n";
+    if (out_path.empty()) {
+        cout << json.str();
+    } else {
+        ofstream(out_path) << json.str();
+    }
+
+    if (!baseline_path.empty()) {
+        auto baseline = readBaseline(baseline_path);
+        if (baseline.empty()) {
+            cerr << "No steps in baseline " << baseline_path << endl;
+            return 1;
+        }
+        for (const auto& timing : timings) {
+            auto before = baseline.find(timing.name);
+            if (before == baseline.end()) continue;
+
+            double limit = before->second.ms * (1 + threshold);
+            bool regressed = timing.ms > limit &&
+                             timing.ms - before->second.ms > min_ms;
+            cerr << timing.name << ": " << before->second.ms << "ms -> "
+                 << timing.ms << "ms" << (regressed ? "  REGRESSION" : "")
+                 << endl;
+            if (before->second.rows != timing.rows) {
+                cerr << timing.name << ": printed " << timing.rows
+                     << " rows, baseline " << before->second.rows << endl;
+            }
+            failed = failed || regressed;
+        }
+    }
+    return failed ? 1 : 0;
+}
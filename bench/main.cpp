@@ -0,0 +1,544 @@
+/*
+ * In-process micro-benchmarks of the storage and join operators. Unlike
+ * aux/cpu_test, which drives the prompt through a pseudo-terminal, every case
+ * calls Table, ShardReader or JoinWorker directly on generated data, so the
+ * numbers are per operator and free of terminal and parsing overhead.
+ *
+ * Each case runs over the grid of parameters it depends on (rows, shards,
+ * threads, key skew, selectivity) and is repeated; the median run is
+ * reported. Results are written as JSON, one object per case and parameter
+ * combination, with ns per row, bytes per second and heap allocations per
+ * row, to compare builds with bench/compare.py.
+ */
+
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <streambuf>
+#include <string>
+#include <thread>
+#include <vector>
+#include "Catalog.hpp"
+#include "Datagen.hpp"
+#include "Profile.hpp"
+#include "Settings.hpp"
+#include "Table.hpp"
+#include "ThreadPool.hpp"
+#include "Wal.hpp"
+#include "utils.hpp"
+#include "worker.hpp"
+
+namespace fs = std::filesystem;
+using namespace std;
+
+namespace {
+struct Params {
+    size_t rows;
+    size_t shards;
+    size_t threads;
+    double skew;
+    double selectivity;
+    string wal;
+    size_t batch;  // join_batch_size
+};
+
+struct Measurement {
+    uint64_t wall_ns = 0;
+    uint64_t rows = 0;   // Rows the operator processed
+    uint64_t bytes = 0;  // Bytes it read or wrote
+    uint64_t allocations = 0;
+    uint64_t output_rows = 0;
+};
+
+// Which parameters a case depends on; the others stay at their first value
+enum Dimension {
+    SHARDS = 1,
+    THREADS = 2,
+    SKEW = 4,
+    SELECTIVITY = 8,
+    WAL = 16,
+    BATCH = 32,
+};
+
+struct Case {
+    string name;
+    int dimensions;
+    function<Measurement(const Params&, const fs::path&)> run;
+};
+
+// Discards output while counting it, so printing operators do their
+// formatting work without a terminal
+class CountingBuffer : public streambuf {
+   public:
+    uint64_t bytes = 0;
+
+   protected:
+    int overflow(int c) override {
+        bytes++;
+        return c;
+    }
+    streamsize xsputn(const char*, streamsize n) override {
+        bytes += n;
+        return n;
+    }
+};
+
+// Whether key is one of the selectivity share of keys that match, spread
+// over the key space so hot keys are not all matches
+bool selected(size_t key, double selectivity) {
+    uint64_t hash = key * 0x9E3779B97F4A7C15ull;
+    return double(hash >> 11) / double(1ull << 53) < selectivity;
+}
+
+string padding(size_t key) {
+    return "station_" + to_string(key % 97) + "_2024-01-01 08:00:00";
+}
+
+// Table of rows spread over shards, row i being row(i), written straight
+// to its shard files
+shared_ptr<Table> makeTable(const fs::path& dir, const string& name,
+                            const vector<string>& attributes, size_t rows,
+                            size_t shards,
+                            const function<string(size_t)>& row) {
+    fs::create_directories(dir / name);
+    vector<string> files;
+    shards = max<size_t>(shards, 1);
+    for (size_t s = 0; s < shards; ++s) {
+        files.push_back("shard_" + to_string(s) + ".csv");
+        ofstream out(dir / name / files.back(), ios::binary);
+        for (size_t i = s * rows / shards; i < (s + 1) * rows / shards; ++i) {
+            out << row(i) << '\n';
+        }
+    }
+    return make_shared<Table>(name, dir, attributes, files);
+}
+
+// Runs fn(i) for every task on pool, returning the heap allocations made
+uint64_t runTasks(ThreadPool& pool, size_t tasks,
+                  const function<void(size_t)>& fn) {
+    atomic<uint64_t> allocations{0};
+    vector<future<void>> done;
+    for (size_t i = 0; i < tasks; ++i) {
+        done.push_back(pool.submit([&, i]() {
+            uint64_t before = threadAllocations();
+            fn(i);
+            allocations += threadAllocations() - before;
+        }));
+    }
+    for (auto& task : done) task.get();
+    return allocations;
+}
+
+template <typename F>
+Measurement timed(F&& fn) {
+    Measurement result;
+    uint64_t allocations = threadAllocations();
+    Stopwatch stopwatch;
+    fn(result);
+    result.wall_ns = stopwatch.wallNs();
+    result.allocations += threadAllocations() - allocations;
+    return result;
+}
+
+Measurement benchInsert(const Params& p, const fs::path& dir) {
+    Settings::instance().wal_mode = p.wal == "none"    ? size_t(WalMode::None)
+                                    : p.wal == "sync" ? size_t(WalMode::Sync)
+                                                      : size_t(WalMode::Group);
+    Wal wal(dir);
+    Catalog catalog(dir, &wal);
+    auto table = makeTable(dir, "insert", {"k", "v"}, 0, 1, nullptr);
+    table->attach(&catalog);
+    ThreadPool pool(p.threads);
+
+    return timed([&](Measurement& m) {
+        m.allocations = runTasks(pool, p.threads, [&](size_t thread) {
+            for (size_t i = thread; i < p.rows; i += p.threads) {
+                table->insert({{"k", to_string(i)}, {"v", padding(i)}});
+            }
+        });
+        m.rows = p.rows;
+        m.bytes = table->dataSize();
+    });
+}
+
+Measurement benchPointRead(const Params& p, const fs::path& dir) {
+    auto table = makeTable(dir, "point", {"k", "v"}, p.rows, p.shards,
+                           [](size_t i) {
+                               return to_string(i) + "," + padding(i);
+                           });
+    constexpr size_t LOOKUPS = 200;
+    Zipf zipf(p.rows, p.skew);
+    mt19937_64 rng(1);
+    vector<int> ids(LOOKUPS);
+    for (int& id : ids) id = static_cast<int>(zipf(rng));
+    ThreadPool pool(p.threads);
+
+    return timed([&](Measurement& m) {
+        atomic<uint64_t> bytes{0};
+        m.allocations = runTasks(pool, p.threads, [&](size_t thread) {
+            CountingBuffer buffer;
+            ostream out(&buffer);
+            OutputRedirect redirect(out, out);
+            for (size_t i = thread; i < LOOKUPS; i += p.threads) {
+                table->read({ids[i]});
+            }
+            bytes += buffer.bytes;
+        });
+        m.rows = LOOKUPS;
+        m.output_rows = LOOKUPS;
+        m.bytes = bytes;
+    });
+}
+
+Measurement benchScan(const Params& p, const fs::path& dir) {
+    auto table = makeTable(dir, "scan", {"k", "v"}, p.rows, p.shards,
+                           [](size_t i) {
+                               return to_string(i) + "," + padding(i);
+                           });
+    auto shards = make_shared<ShardList>();
+    for (const auto& file : table->shardFiles()) {
+        shards->push_back(make_shared<Shard>((dir / "scan" / file).string()));
+    }
+    ThreadPool pool(p.threads);
+
+    return timed([&](Measurement& m) {
+        atomic<uint64_t> rows{0}, bytes{0};
+        m.allocations = runTasks(pool, shards->size(), [&](size_t s) {
+            ShardReader reader(*(*shards)[s]);
+            string_view line;
+            uint64_t count = 0;
+            while (reader.next(line)) {
+                // Touch the key, as a filter or join would
+                if (!fieldAt(line, 0).empty()) count++;
+            }
+            rows += count;
+            bytes += (*shards)[s]->size();
+        });
+        m.rows = rows;
+        m.bytes = bytes;
+    });
+}
+
+Measurement benchRead(const Params& p, const fs::path& dir) {
+    auto table = makeTable(dir, "read", {"k", "v"}, p.rows, p.shards,
+                           [](size_t i) {
+                               return to_string(i) + "," + padding(i);
+                           });
+
+    return timed([&](Measurement& m) {
+        CountingBuffer buffer;
+        ostream out(&buffer);
+        OutputRedirect redirect(out, out);
+        table->read({});
+        m.rows = p.rows;
+        m.output_rows = p.rows;
+        m.bytes = table->dataSize();
+    });
+}
+
+Measurement benchUpdate(const Params& p, const fs::path& dir) {
+    auto table = makeTable(dir, "update", {"k", "v"}, p.rows, p.shards,
+                           [](size_t i) {
+                               return to_string(i) + "," + padding(i);
+                           });
+    constexpr size_t UPDATES = 20;
+    Zipf zipf(p.rows, p.skew);
+    mt19937_64 rng(2);
+
+    return timed([&](Measurement& m) {
+        CountingBuffer buffer;
+        ostream out(&buffer);
+        OutputRedirect redirect(out, out);
+        for (size_t i = 0; i < UPDATES; ++i) {
+            table->update(zipf(rng), {{"v", "updated_" + to_string(i)}});
+        }
+        // Every update rewrites the shard of its row
+        m.rows = UPDATES * p.rows / max<size_t>(p.shards, 1);
+        m.bytes = UPDATES * table->dataSize() / max<size_t>(p.shards, 1);
+        m.output_rows = UPDATES;
+    });
+}
+
+Measurement benchDelete(const Params& p, const fs::path& dir) {
+    auto table = makeTable(dir, "delete", {"k", "v"}, p.rows, p.shards,
+                           [&](size_t i) {
+                               string key = selected(i, p.selectivity)
+                                                ? "hit"
+                                                : to_string(i);
+                               return key + "," + padding(i);
+                           });
+    uint64_t size = table->dataSize();
+
+    return timed([&](Measurement& m) {
+        table->deleteWhere({{"k", CompareOp::Equal, "hit"}});
+        m.rows = p.rows;
+        m.bytes = size;
+        m.output_rows = p.rows - table->dataSize() * p.rows / max<uint64_t>(
+                                                               size, 1);
+    });
+}
+
+// Joins a fact table of p.rows rows, whose keys come from a domain a quarter
+// of their number, with a dimension table holding each selected key once.
+// The left table is hashed one shard per task and every task probes all
+// shards of the right table, so probe_facts measures the probe loop.
+Measurement benchJoin(const Params& p, const fs::path& dir, bool probe_facts) {
+    Settings::instance().join_batch_size = p.batch;
+    size_t domain = max<size_t>(p.rows / 4, 1);
+    Zipf zipf(domain, p.skew);
+    mt19937_64 rng(3);
+    vector<size_t> fact_keys(p.rows);
+    for (size_t& key : fact_keys) key = zipf(rng);
+
+    auto facts = makeTable(dir, "facts", {"k", "v"}, p.rows, p.shards,
+                           [&](size_t i) {
+                               return "key" + to_string(fact_keys[i]) + "," +
+                                      padding(i);
+                           });
+    vector<size_t> dimension_keys;
+    for (size_t key = 0; key < domain; ++key) {
+        if (selected(key, p.selectivity)) dimension_keys.push_back(key);
+    }
+    auto dimensions = makeTable(dir, "dimensions", {"k", "w"},
+                                dimension_keys.size(), p.shards,
+                                [&](size_t i) {
+                                    return "key" +
+                                           to_string(dimension_keys[i]) +
+                                           ",w" + to_string(i);
+                                });
+
+    auto shardsOf = [&](const Table& table) {
+        ShardList shards;
+        for (const auto& file : table.shardFiles()) {
+            shards.push_back(make_shared<Shard>(
+                (dir / table.getName() / file).string()));
+        }
+        return shards;
+    };
+    const Table& left = probe_facts ? *dimensions : *facts;
+    const Table& right = probe_facts ? *facts : *dimensions;
+    size_t left_rows = probe_facts ? dimension_keys.size() : p.rows;
+    size_t right_rows = probe_facts ? p.rows : dimension_keys.size();
+    ShardList left_shards = shardsOf(left), right_shards = shardsOf(right);
+    JoinKeys keys{0, 0, nullptr, nullptr, {}};
+    ThreadPool pool(p.threads);
+
+    return timed([&](Measurement& m) {
+        vector<fs::path> outputs(left_shards.size());
+        m.allocations = runTasks(pool, left_shards.size(), [&](size_t s) {
+            outputs[s] = dir / ("join_" + to_string(s) + ".csv");
+            JoinWorker worker(outputs[s].string());
+            worker.processShardBatch(*left_shards[s], right_shards, keys);
+        });
+
+        m.rows = left_rows + right_rows * left_shards.size();
+        m.bytes = left.dataSize() + right.dataSize() * left_shards.size();
+        for (const auto& output : outputs) {
+            ifstream in(output, ios::binary);
+            m.output_rows += count(istreambuf_iterator<char>(in),
+                                   istreambuf_iterator<char>(), '\n');
+        }
+    });
+}
+
+vector<size_t> parseSizes(const string& list) {
+    vector<size_t> values;
+    stringstream in(list);
+    for (string item; getline(in, item, ',');) values.push_back(stoul(item));
+    return values;
+}
+
+vector<double> parseDoubles(const string& list) {
+    vector<double> values;
+    stringstream in(list);
+    for (string item; getline(in, item, ',');) values.push_back(stod(item));
+    return values;
+}
+
+vector<string> parseNames(const string& list) {
+    vector<string> values;
+    stringstream in(list);
+    for (string item; getline(in, item, ',');) values.push_back(item);
+    return values;
+}
+
+void usage(const char* program) {
+    cerr << "usage: " << program
+         << " [--rows <n>] [--shards <n,...>] [--threads <n,...>]\n"
+            "       [--skew <s,...>] [--selectivity <f,...>]"
+            " [--wal <none|group|sync,...>]\n"
+            "       [--batch <join batch size,...>] [--repeat <n>]"
+            " [--filter <case,...>]\n"
+            "       [--out <file>]\n";
+}
+}  // namespace
+
+int main(int argc, char* argv[]) {
+    size_t rows = 200000;
+    size_t repeat = 3;
+    vector<size_t> shard_counts = {1, 8};
+    vector<size_t> thread_counts = {1, max(2u, thread::hardware_concurrency())};
+    vector<double> skews = {0, 1.0};
+    vector<double> selectivities = {0.01, 0.5, 1};
+    vector<string> wal_modes = {"none", "group"};
+    vector<size_t> batch_sizes = {1024, 0};
+    vector<string> filter;
+    string out_path;
+
+    for (int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        if (i + 1 >= argc) {
+            usage(argv[0]);
+            return 1;
+        }
+        string value = argv[++i];
+        if (arg == "--rows") {
+            rows = stoul(value);
+        } else if (arg == "--shards") {
+            shard_counts = parseSizes(value);
+        } else if (arg == "--threads") {
+            thread_counts = parseSizes(value);
+        } else if (arg == "--skew") {
+            skews = parseDoubles(value);
+        } else if (arg == "--selectivity") {
+            selectivities = parseDoubles(value);
+        } else if (arg == "--wal") {
+            wal_modes = parseNames(value);
+        } else if (arg == "--batch") {
+            batch_sizes = parseSizes(value);
+        } else if (arg == "--repeat") {
+            repeat = max<size_t>(stoul(value), 1);
+        } else if (arg == "--filter") {
+            filter = parseNames(value);
+        } else if (arg == "--out") {
+            out_path = value;
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (shard_counts.empty() || thread_counts.empty() || skews.empty() ||
+        selectivities.empty() || wal_modes.empty() || batch_sizes.empty()) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    const vector<Case> cases = {
+        {"insert", THREADS | WAL, benchInsert},
+        {"point_read", SHARDS | THREADS | SKEW, benchPointRead},
+        {"scan", SHARDS | THREADS, benchScan},
+        {"read", SHARDS, benchRead},
+        {"update", SHARDS | SKEW, benchUpdate},
+        {"delete_by_attribute", SHARDS | SELECTIVITY, benchDelete},
+        {"join", SHARDS | THREADS | SKEW | SELECTIVITY | BATCH,
+         [](const Params& p, const fs::path& dir) {
+             return benchJoin(p, dir, false);
+         }},
+        {"join_probe", SHARDS | SKEW | SELECTIVITY | BATCH,
+         [](const Params& p, const fs::path& dir) {
+             return benchJoin(p, dir, true);
+         }},
+    };
+
+    fs::path workspace = fs::temp_directory_path() /
+                         ("lmkdb_bench_" + to_string(getpid()));
+    size_t wal_mode = Settings::instance().wal_mode;
+    size_t batch_size = Settings::instance().join_batch_size;
+
+    // Grid of the dimensions a case depends on, the others keep their
+    // first value
+    auto grid = [&](int dimensions) {
+        // Inserts are much slower per row than scans
+        vector<Params> params = {{dimensions & WAL ? rows / 10 : rows,
+                                  shard_counts[0], thread_counts[0], skews[0],
+                                  selectivities[0], wal_modes[0],
+                                  batch_sizes[0]}};
+        auto expand = [&](int dimension, const auto& values, auto field) {
+            if (!(dimensions & dimension)) return;
+            vector<Params> expanded;
+            for (const Params& p : params) {
+                for (const auto& value : values) {
+                    expanded.push_back(p);
+                    expanded.back().*field = value;
+                }
+            }
+            params = std::move(expanded);
+        };
+        expand(SHARDS, shard_counts, &Params::shards);
+        expand(THREADS, thread_counts, &Params::threads);
+        expand(SKEW, skews, &Params::skew);
+        expand(SELECTIVITY, selectivities, &Params::selectivity);
+        expand(WAL, wal_modes, &Params::wal);
+        expand(BATCH, batch_sizes, &Params::batch);
+        return params;
+    };
+
+    ostringstream json;
+    json << "{\n  \"rows\": " << rows << ",\n  \"repeat\": " << repeat
+         << ",\n  \"hardware_threads\": " << thread::hardware_concurrency()
+         << ",\n  \"results\": [";
+    bool first = true;
+
+    for (const auto& bench : cases) {
+        if (!filter.empty() &&
+            ranges::find(filter, bench.name) == filter.end()) {
+            continue;
+        }
+
+        for (const Params& p : grid(bench.dimensions)) {
+            vector<Measurement> runs;
+            for (size_t r = 0; r < repeat; ++r) {
+                fs::remove_all(workspace);
+                fs::create_directories(workspace);
+                runs.push_back(bench.run(p, workspace));
+            }
+            ranges::sort(runs, {}, &Measurement::wall_ns);
+            const Measurement& m = runs[runs.size() / 2];
+
+            double seconds = m.wall_ns / 1e9;
+            double ns_per_row = m.rows ? double(m.wall_ns) / m.rows : 0;
+            double bytes_per_second = seconds > 0 ? m.bytes / seconds : 0;
+            double allocations_per_row =
+                m.rows ? double(m.allocations) / m.rows : 0;
+
+            cerr << bench.name << " rows=" << p.rows << " shards=" << p.shards
+                 << " threads=" << p.threads << " skew=" << p.skew
+                 << " selectivity=" << p.selectivity << " wal=" << p.wal
+                 << " batch=" << p.batch << ": " << ns_per_row << " ns/row, "
+                 << formatBytes(uint64_t(bytes_per_second)) << "/s\n";
+
+            json << (first ? "" : ",") << "\n    {\"case\": \"" << bench.name
+                 << "\", \"rows\": " << p.rows << ", \"shards\": " << p.shards
+                 << ", \"threads\": " << p.threads << ", \"skew\": " << p.skew
+                 << ", \"selectivity\": " << p.selectivity << ", \"wal\": \""
+                 << p.wal << "\", \"batch\": " << p.batch
+                 << ", \"seconds\": " << seconds
+                 << ", \"rows_processed\": " << m.rows
+                 << ", \"output_rows\": " << m.output_rows
+                 << ", \"ns_per_row\": " << ns_per_row
+                 << ", \"bytes_per_second\": " << bytes_per_second
+                 << ", \"allocations_per_row\": " << allocations_per_row
+                 << "}";
+            first = false;
+        }
+    }
+    json << "\n  ]\n}\n";
+
+    Settings::instance().wal_mode = wal_mode;
+    Settings::instance().join_batch_size = batch_size;
+    fs::remove_all(workspace);
+
+    if (out_path.empty()) {
+        cout << json.str();
+    } else {
+        ofstream(out_path) << json.str();
+    }
+    return 0;
+}
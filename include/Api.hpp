@@ -2,7 +2,9 @@
 #define API_H
 
 #include <memory>
+#include <optional>
 #include <string>
+#include <unordered_map>
 #include <vector>
 #include "DBManager.hpp"
 
@@ -22,11 +24,23 @@ class DatabaseAPI {
     void updateOp(const std::string& tableName, size_t recordId,
                   const std::vector<std::string>& updatedRecord);
     void joinOp(const std::vector<std::string>& query);
+    void encodeOp(const std::string& tableName, const std::string& attr);
+    void createIndexOp(const std::string& tableName, const std::string& attr,
+                       const std::string& kind);
+    void exportOp(const std::string& tableName, const std::string& file);
+    void importOp(const std::string& tableName, const std::string& file);
+    void createMaterializedOp(const std::string& name,
+                              const std::vector<std::string>& query);
 
    private:
     std::unique_ptr<DBManager> dbManager;
 
     bool validateInteger(const std::string& input);
+    bool extractOrderBy(std::vector<std::string>& tokens,
+                        std::optional<OrderBy>& order);
+    bool parseJoin(const std::vector<std::string>& tokens,
+                   std::vector<std::string>& tables,
+                   std::unordered_map<std::string, std::string>& attrMap);
 };
 
 #endif
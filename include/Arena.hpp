@@ -0,0 +1,68 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <cstddef>
+#include <memory>
+#include <string_view>
+#include <vector>
+
+/* Bump allocator for memory that lives as long as one query task, such as
+ * join hash table nodes and keys. Allocating is a pointer increment, memory
+ * is only released all at once by reset() or when the arena is destroyed. */
+class Arena {
+   public:
+    static constexpr size_t BLOCK_SIZE = 64 * 1024;
+
+    Arena() = default;
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+
+    void* allocate(size_t size, size_t align = alignof(std::max_align_t));
+    std::string_view copy(std::string_view value);
+
+    // Releases everything, keeping the first block for reuse
+    void reset();
+
+    // Bytes of blocks taken from the heap
+    size_t bytesReserved() const { return reserved_; }
+
+   private:
+    struct Block {
+        std::unique_ptr<char[]> data;
+        size_t size;
+    };
+
+    std::vector<Block> blocks_;
+    char* cursor_ = nullptr;
+    char* end_ = nullptr;
+    size_t reserved_ = 0;
+};
+
+/* Standard allocator handing out arena memory, for containers that live no
+ * longer than their arena. Deallocation is a no-op. */
+template <typename T>
+class ArenaAllocator {
+   public:
+    using value_type = T;
+
+    explicit ArenaAllocator(Arena& arena) : arena_(&arena) {}
+    template <typename U>
+    ArenaAllocator(const ArenaAllocator<U>& other) : arena_(other.arena()) {}
+
+    T* allocate(size_t n) {
+        return static_cast<T*>(arena_->allocate(n * sizeof(T), alignof(T)));
+    }
+    void deallocate(T*, size_t) {}
+
+    Arena* arena() const { return arena_; }
+
+    template <typename U>
+    bool operator==(const ArenaAllocator<U>& other) const {
+        return arena_ == other.arena();
+    }
+
+   private:
+    Arena* arena_;
+};
+
+#endif
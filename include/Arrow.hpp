@@ -0,0 +1,132 @@
+#ifndef ARROW_H
+#define ARROW_H
+
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+/* Tables exchanged as Arrow IPC files (the Arrow columnar format with V5
+ * metadata, as written by pyarrow.ipc.new_file): a schema, record batches
+ * holding each column as a validity, an offsets and a data buffer, and a
+ * footer locating the batches. The flatbuffer metadata is built and read
+ * here. Columns are written as utf8; utf8, binary and their large variants
+ * are read, nulls as empty values. Dictionary encoded columns and
+ * compressed bodies are not supported. */
+
+// One encapsulated message: the metadata and body lengths go to the footer
+struct ArrowMessage {
+    std::string bytes;
+    int32_t metadata_length = 0;
+    int64_t body_length = 0;
+};
+
+// Where a record batch message is in a file, as listed by the footer
+struct ArrowBlock {
+    int64_t offset;
+    int32_t metadata_length;
+    int64_t body_length;
+};
+
+// Collects rows of string values into the columns of a record batch
+class ArrowBatchBuilder {
+   public:
+    explicit ArrowBatchBuilder(size_t columns);
+
+    // Appends a row with a value for every column
+    void add(const std::vector<std::string_view>& row);
+    size_t rows() const { return rows_; }
+    // Bytes of the body the batch encodes to
+    size_t bytes() const;
+
+    // Encodes the rows added so far as a record batch message and starts
+    // an empty batch
+    ArrowMessage finish();
+
+   private:
+    struct Column {
+        std::vector<int32_t> offsets{0};
+        std::string data;
+    };
+    std::vector<Column> columns_;
+    size_t rows_ = 0;
+};
+
+// Writes an Arrow IPC file of utf8 columns, record batches in call order
+class ArrowWriter {
+   public:
+    ArrowWriter(const std::filesystem::path& path,
+                const std::vector<std::string>& fields);
+
+    bool write(const ArrowMessage& batch);
+    // Writes the end of stream marker and the footer, false if any write
+    // failed
+    bool close();
+
+   private:
+    std::ofstream out_;
+    std::vector<std::string> fields_;
+    std::vector<ArrowBlock> blocks_;
+    int64_t offset_ = 0;
+};
+
+// Columns of a record batch read from a file, valid until it is read into
+// again
+class ArrowBatch {
+   public:
+    size_t rows() const { return rows_; }
+    // Value of row in column, empty if it is null
+    std::string_view value(size_t column, size_t row) const;
+    // Whether a value of column holds any of chars
+    bool contains(size_t column, std::string_view chars) const;
+    // Length of the longest value of column
+    size_t maxLength(size_t column) const;
+
+   private:
+    friend class ArrowReader;
+
+    struct Column {
+        const uint8_t* validity = nullptr;  // Null if no value is null
+        const char* offsets = nullptr;
+        bool large = false;  // 64 bit offsets
+        const char* data = nullptr;
+    };
+
+    std::string body_;
+    std::vector<Column> columns_;
+    size_t rows_ = 0;
+
+    int64_t offset(const Column& column, size_t i) const;
+};
+
+/* Reader of an Arrow IPC file. The schema and the location of the record
+ * batches come from the footer when the file is opened; batches are read
+ * on demand and may be read by several threads at once. */
+class ArrowReader {
+   public:
+    // False with error() set if path is not an Arrow IPC file of string
+    // columns
+    bool open(const std::filesystem::path& path);
+
+    const std::vector<std::string>& fields() const { return fields_; }
+    size_t batches() const { return blocks_.size(); }
+    // Body bytes of record batch i
+    int64_t batchBytes(size_t i) const { return blocks_[i].body_length; }
+
+    // Reads record batch i into batch, false with error set if it is
+    // malformed
+    bool read(size_t i, ArrowBatch& batch, std::string& error) const;
+
+    const std::string& error() const { return error_; }
+
+   private:
+    std::filesystem::path path_;
+    std::vector<std::string> fields_;
+    std::vector<bool> large_;  // Whether field i has 64 bit offsets
+    std::vector<ArrowBlock> blocks_;
+    std::string error_;
+};
+
+#endif
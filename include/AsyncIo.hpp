@@ -0,0 +1,70 @@
+#ifndef ASYNC_IO_H
+#define ASYNC_IO_H
+
+#include <sys/types.h>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <unordered_map>
+
+/* Queue of file reads that run while the caller keeps working. On Linux the
+ * reads go through an io_uring set up with raw system calls; where io_uring
+ * is not available (other systems, old kernels, sandboxes that block it)
+ * each read is a plain pread done when it is queued, so callers need no
+ * second code path.
+ *
+ * A queue belongs to one thread: requests must be waited for on the thread
+ * that queued them, and their buffers must outlive them. */
+class IoQueue {
+   public:
+    struct Request {
+        bool done = false;
+        // Bytes read, or minus the error number
+        ssize_t result = 0;
+    };
+
+    static constexpr unsigned DEPTH = 64;
+
+    // With uring false reads are always synchronous preads
+    explicit IoQueue(bool uring = true);
+    ~IoQueue();
+
+    // Queue of the calling thread
+    static IoQueue& forThread();
+
+    // Queues a read of length bytes at offset of fd into buffer. Queued
+    // reads start on the next submit() or wait().
+    std::shared_ptr<Request> read(int fd, uint64_t offset, char* buffer,
+                                  size_t length);
+
+    // Hands queued reads to the kernel without waiting for them
+    void submit();
+
+    // Returns once request is done
+    void wait(Request& request);
+
+    bool asynchronous() const { return ring_fd_ >= 0; }
+    size_t inFlight() const { return requests_.size(); }
+
+    IoQueue(const IoQueue&) = delete;
+    IoQueue& operator=(const IoQueue&) = delete;
+
+   private:
+    struct Ring;
+
+    int ring_fd_ = -1;
+    std::unique_ptr<Ring> ring_;
+    unsigned unsubmitted_ = 0;
+    std::unordered_map<Request*, std::shared_ptr<Request>> requests_;
+
+    bool setup();
+    // Submits queued reads and waits for at least min_complete completions
+    void enter(unsigned min_complete);
+    void reap();
+};
+
+// Reads length bytes at offset with pread, retrying short reads until end of
+// file. Bytes read, or minus the error number.
+ssize_t preadFully(int fd, uint64_t offset, char* buffer, size_t length);
+
+#endif
@@ -0,0 +1,112 @@
+#ifndef BTREE_H
+#define BTREE_H
+
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "Predicate.hpp"
+
+/* Persistent B+tree over the values of one attribute of a table, stored in
+ * pages of PAGE_SIZE bytes. Page 0 is the header; leaves hold entries in
+ * index order and link to the next leaf, inner pages hold the first entry
+ * of every child but the first. Entries are ordered by value like order by
+ * (compareValues, equal values bytewise), then by row, so equal values
+ * stay distinct and a row's entry can be found to erase it.
+ *
+ * Changed pages are kept in memory until flush() writes them. The header
+ * records whether the file was synced after its last change; an index that
+ * was not is rebuilt by its table. Erasing never merges pages, emptied
+ * leaves stay in the chain until the next bulk load. All operations lock
+ * the tree, keeping it consistent with the table is up to the table. */
+class BTreeIndex {
+   public:
+    // Row of a value: shard number and byte offset of the row in the shard
+    struct Entry {
+        std::string key;
+        uint32_t shard;
+        uint64_t offset;
+    };
+
+    static constexpr size_t PAGE_SIZE = 8192;
+    // Longest value an entry can hold, so that a page fits several
+    static constexpr size_t MAX_KEY_SIZE = 1024;
+
+    explicit BTreeIndex(std::filesystem::path path);
+    ~BTreeIndex();
+
+    BTreeIndex(const BTreeIndex&) = delete;
+    BTreeIndex& operator=(const BTreeIndex&) = delete;
+
+    static bool less(const Entry& a, const Entry& b);
+    static bool indexable(std::string_view key) {
+        return key.size() <= MAX_KEY_SIZE;
+    }
+
+    // Whether the file was synced after its last change when opened
+    bool clean() const { return clean_; }
+    uint64_t size() const;
+    uint32_t height() const;
+    uint32_t pages() const;
+
+    // Replaces all entries with entries, which must be in index order,
+    // filling leaves and inner pages bottom up
+    bool bulkLoad(const std::vector<Entry>& entries);
+    // False if the key is too long
+    bool insert(const Entry& entry);
+    // False if there is no such entry
+    bool erase(const Entry& entry);
+
+    // Calls visit for the entries with values in bounds, in index order.
+    // A non empty prefix also ends the scan at the first value after bounds'
+    // lower bound that does not start with it.
+    void scan(const KeyBounds& bounds, std::string_view prefix,
+              const std::function<void(const Entry&)>& visit);
+
+    // Writes changed pages, and syncs the file and marks it clean if sync is
+    // set
+    bool flush(bool sync = false);
+
+   private:
+    struct Node {
+        bool leaf = true;
+        // Next leaf, 0 for the last one
+        uint32_t next = 0;
+        std::vector<Entry> entries;
+        // Inner pages: children[i] holds the entries below entries[i]
+        std::vector<uint32_t> children;
+        bool dirty = false;
+    };
+
+    std::filesystem::path path_;
+    int fd_;
+    mutable std::mutex mutex_;
+    std::unordered_map<uint32_t, Node> nodes_;
+    uint32_t root_ = 1;
+    uint32_t page_count_ = 2;
+    uint32_t height_ = 1;
+    uint64_t entries_ = 0;
+    bool clean_ = false;
+    // Whether the header on disk says clean
+    bool marked_clean_ = false;
+
+    Node& node(uint32_t page);
+    uint32_t allocate(Node node);
+    bool markDirty();
+    bool writeHeader(bool clean);
+    static size_t encodedSize(const Node& node);
+    static size_t splitPoint(const Node& node);
+
+    // Inserts into the subtree at page. If it split, returns the first entry
+    // and the page of the new right sibling.
+    std::optional<std::pair<Entry, uint32_t>> insertInto(uint32_t page,
+                                                         const Entry& entry);
+};
+
+#endif
@@ -0,0 +1,135 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "Dictionary.hpp"
+#include "Predicate.hpp"
+#include "Shard.hpp"
+
+/* Rows of one shard read together and split into the columns an operator
+ * needs once, so that operators loop over one column of many rows instead
+ * of interpreting each row on its own. The selection vector lists the rows
+ * still selected, in order: filters narrow it without moving rows, and
+ * the next operator only visits what is left. Rows are copied into the
+ * batch, so its views stay valid until it is filled again. */
+class ColumnBatch {
+   public:
+    size_t size() const { return ends_.size(); }
+    std::string_view row(size_t i) const {
+        size_t begin = i ? ends_[i - 1] : 0;
+        return std::string_view(rows_).substr(begin, ends_[i] - begin);
+    }
+    // Byte offset of row i in its shard
+    uint64_t offset(size_t i) const { return offsets_[i]; }
+    // Field of every row in the i-th column extracted by the scan
+    const std::vector<std::string_view>& column(size_t i) const {
+        return columns_[i];
+    }
+
+    std::vector<uint32_t>& selection() { return selection_; }
+    const std::vector<uint32_t>& selection() const { return selection_; }
+
+    size_t memory() const;
+
+   private:
+    friend class BatchScan;
+
+    std::string rows_;
+    std::vector<size_t> ends_;
+    std::vector<uint64_t> offsets_;
+    std::vector<std::vector<std::string_view>> columns_;
+    std::vector<uint32_t> selection_;
+};
+
+/* Scan of a shard producing batches of up to capacity rows, with every row
+ * selected. Column i of a batch holds field columns[i].index of each row,
+ * decoded if its dictionary is set. With offsets only the rows starting at
+ * those byte offsets are read, in the order given. */
+class BatchScan {
+   public:
+    static constexpr size_t DEFAULT_CAPACITY = 1024;
+
+    struct Column {
+        int index;
+        const Dictionary* dictionary = nullptr;
+    };
+
+    BatchScan(const Shard& shard, std::vector<Column> columns,
+              size_t capacity = DEFAULT_CAPACITY,
+              const std::vector<uint64_t>* offsets = nullptr);
+
+    // False once the shard has no more rows
+    bool next(ColumnBatch& batch);
+
+    uint64_t rowsRead() const { return rows_; }
+    uintmax_t bytesRead() const { return reader_.bytesRead(); }
+
+   private:
+    ShardReader reader_;
+    std::vector<Column> columns_;
+    size_t capacity_;
+    const std::vector<uint64_t>* offsets_;
+    size_t next_offset_ = 0;
+    uint64_t rows_ = 0;
+};
+
+/* Conditions of a query compiled once against the columns of a table.
+ * Each condition becomes an instruction on the slot of its column in the
+ * batch, with its constant parsed up front: equalities and prefixes compare
+ * bytes, and the range conditions on one column merge into one range test
+ * that parses each field once. Instructions run cheapest first, each as a
+ * loop over the selection specialized on its kind and bounds. */
+class PredicateProgram {
+   public:
+    // Adds condition on column index of the table, whose values are
+    // decoded through dictionary if it is set
+    void add(int index, const Dictionary* dictionary,
+             const Condition& condition);
+    bool empty() const { return conditions_ == 0; }
+
+    // Columns a scan must extract for the program, one per slot
+    const std::vector<BatchScan::Column>& columns() const { return columns_; }
+
+    // Drops the rows that fail a condition from the selection
+    void apply(ColumnBatch& batch) const;
+    // Whether a row matches, reading only the fields the program tests
+    bool matches(std::string_view line) const;
+
+   private:
+    // Constant of a range bound, compared like compareValues
+    struct Operand {
+        std::string text;
+        double number = 0;
+        bool numeric = false;
+
+        explicit Operand(std::string value);
+        // Order of field, parsed into field_number if field_numeric
+        int compare(std::string_view field, bool field_numeric,
+                    double field_number) const;
+    };
+
+    enum class Kind { Equal, Prefix, Range };
+
+    struct Instruction {
+        Kind kind;
+        size_t slot;
+        std::string value;  // Of Equal and Prefix
+        KeyBounds bounds;   // Of Range, with its bounds parsed below
+        std::optional<Operand> lower, upper;
+    };
+
+    std::vector<BatchScan::Column> columns_;
+    std::vector<Instruction> program_;
+    size_t conditions_ = 0;
+
+    size_t slotOf(int index, const Dictionary* dictionary);
+    template <bool Lower, bool Upper>
+    static bool inRange(const Instruction& instruction, std::string_view field);
+    static bool test(const Instruction& instruction, std::string_view field);
+};
+
+#endif
@@ -0,0 +1,103 @@
+#ifndef BUFFER_POOL_H
+#define BUFFER_POOL_H
+
+#include <atomic>
+#include <cstddef>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+
+struct BlockIndex;
+struct OperatorStats;
+
+/* Cache of shard file pages shared by all tables and join tasks. Pages are
+ * keyed by file path and page number. Shard files only ever grow by appends
+ * and rewrites go to a new path, so a cached page stays valid until its file
+ * is removed; a page that is shorter than a reader needs (the tail of an
+ * appended shard) is simply read again. Unpinned pages are evicted least
+ * recently used first once the buffer_pool_memory setting is exceeded.
+ *
+ * Pages of compressed shards are their blocks, cached decoded. */
+class BufferPool {
+   public:
+    static constexpr size_t PAGE_SIZE = 64 * 1024;
+
+    struct Page {
+        std::string data;
+        std::atomic<int> pins{0};
+    };
+
+    // Pins a page for as long as the handle lives
+    class PageHandle {
+       private:
+        std::shared_ptr<Page> page_;
+
+       public:
+        PageHandle() = default;
+        explicit PageHandle(std::shared_ptr<Page> page);
+        ~PageHandle();
+
+        PageHandle(PageHandle&& other) noexcept = default;
+        PageHandle& operator=(PageHandle&& other) noexcept;
+        PageHandle(const PageHandle&) = delete;
+        PageHandle& operator=(const PageHandle&) = delete;
+
+        const std::string& data() const { return page_->data; }
+        explicit operator bool() const { return page_ != nullptr; }
+    };
+
+    static BufferPool& instance();
+
+    // Page number page of path, holding at least length bytes unless the file
+    // is shorter. Uncached fetches read the page without keeping it, for
+    // files that are read once. With blocks the file is compressed and the
+    // page is decoded from its block, adding the work to decoded if given.
+    PageHandle fetch(const std::string& path, size_t page, size_t length,
+                     bool cache = true, const BlockIndex* blocks = nullptr,
+                     OperatorStats* decoded = nullptr);
+
+    // Decodes the uncached blocks among count pages from first in parallel,
+    // ahead of a sequential scan of a compressed file
+    void prefetch(const std::string& path, size_t first, size_t count,
+                  const BlockIndex& blocks, OperatorStats* decoded = nullptr);
+
+    // Whether page of path is cached with at least length bytes
+    bool contains(const std::string& path, size_t page, size_t length) const;
+
+    // Caches a page the caller read itself, ahead of a scan
+    PageHandle adopt(const std::string& path, size_t page,
+                     std::shared_ptr<Page> loaded);
+
+    // Drops the pages of every file whose path starts with prefix, called
+    // before files are removed so a later file at the same path starts cold
+    void invalidate(const std::string& prefix);
+
+    size_t memoryUsage() const;
+
+   private:
+    using Key = std::pair<std::string, size_t>;
+
+    struct Frame {
+        std::shared_ptr<Page> page;
+        std::list<Key>::iterator lru;
+    };
+
+    mutable std::mutex mutex_;
+    std::map<Key, Frame> frames_;
+    std::list<Key> lru_;
+    size_t bytes_ = 0;
+
+    BufferPool() = default;
+    static std::shared_ptr<Page> load(const std::string& path, size_t page);
+    static std::shared_ptr<Page> decode(const std::string& path, size_t page,
+                                        const BlockIndex& blocks,
+                                        OperatorStats* decoded);
+    PageHandle insert(Key key, std::shared_ptr<Page> loaded);
+    void evict(size_t budget);
+    void erase(std::map<Key, Frame>::iterator it);
+};
+
+#endif
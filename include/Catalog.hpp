@@ -0,0 +1,115 @@
+#ifndef CATALOG_H
+#define CATALOG_H
+
+#include <atomic>
+#include <cstdint>
+#include <filesystem>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "Shard.hpp"
+
+class Table;
+class Wal;
+struct Partitioning;
+
+/* Schema and shard files of every table, kept in memory and persisted as a
+ * single catalog file that is replaced atomically. The file is only written,
+ * and the version bumped, when a table is created or dropped or publishes a
+ * shard list with different files; appends to a tail shard do not touch it.
+ *
+ * Tables are opened lazily: loading the catalog only registers them by name,
+ * their shard files are looked at when a command first uses them, or by
+ * prefetch() in the background.
+ *
+ * Views are not synchronized: DBManager holds its catalog lock exclusively
+ * while creating or dropping tables and shared while using them. */
+class Catalog {
+   public:
+    static constexpr const char* FILE_NAME = "catalog.txt";
+
+    // Tables log their appends to wal, if given
+    explicit Catalog(std::filesystem::path db_path, Wal* wal = nullptr);
+    ~Catalog();
+
+    // Reads the catalog file. Databases written before it existed are
+    // bootstrapped from the table directories and their metadata.txt.
+    void load();
+
+    // Opens the table on first use
+    std::shared_ptr<Table> find(const std::string& name);
+    // Registers a table with the shard files already written to its
+    // directory, or with one empty shard (one per partition of a
+    // partitioned table) if none are given. A clustered table starts with
+    // its empty delta. Null, with the directory removed, if the catalog
+    // cannot be persisted.
+    std::shared_ptr<Table> create(
+        const std::string& name, const std::vector<std::string>& attributes,
+        bool compressed = false,
+        const std::vector<std::string>& shard_files = {},
+        const Partitioning* partitioning = nullptr,
+        const std::string& cluster_attribute = "");
+    // False, with the table still registered, if the catalog cannot be
+    // persisted
+    bool drop(const std::string& name);
+
+    // Materialized views are tables with a join definition, stored as the
+    // tokens of the join command
+    bool defineView(const std::string& name,
+                    const std::vector<std::string>& join_spec);
+    const std::vector<std::string>* viewDefinition(
+        const std::string& name) const;
+
+    // Opens all tables not opened yet, in parallel on a background thread
+    void prefetch();
+    size_t openCount() const;
+
+    // Writes the catalog file with the current shard list of every table,
+    // false if it could not be replaced
+    bool persist();
+    uint64_t version() const { return version_; }
+    Wal* wal() const { return wal_; }
+    const std::filesystem::path& path() const { return db_path_; }
+
+   private:
+    // Catalog entry of a table that has not been opened yet
+    struct Entry {
+        std::vector<std::string> attributes;
+        std::vector<std::string> shard_files;
+        std::vector<std::string> encoded;
+        bool compressed = false;
+        // Partitioning attribute and count, count 0 if not partitioned
+        std::string partition_attribute;
+        size_t partitions = 0;
+        // Clustering attribute, empty if not clustered, and the key ranges
+        // of the sorted shards by file
+        std::string cluster_attribute;
+        std::map<std::string, KeyRange> key_ranges;
+        // Attributes with a B+tree index
+        std::vector<std::string> indexes;
+    };
+
+    std::filesystem::path db_path_;
+    Wal* wal_;
+    std::unordered_map<std::string, std::shared_ptr<Table>> tables_;
+    std::unordered_map<std::string, Entry> unopened_;
+    mutable std::mutex tables_mutex_;
+    std::thread prefetcher_;
+    std::unordered_map<std::string, std::vector<std::string>> views_;
+    std::atomic<uint64_t> version_{0};
+    std::mutex persist_mutex_;
+
+    bool loadFile();
+    void bootstrap();
+    std::shared_ptr<Table> open(const std::string& name);
+    // Removes what a crash left in the directory of a table being opened:
+    // unpublished .tmp files, shard versions replaced since and any other
+    // file the entry does not list
+    void removeUnlisted(const std::string& name, const Entry& entry) const;
+};
+
+#endif
@@ -0,0 +1,53 @@
+#ifndef COMPRESSION_H
+#define COMPRESSION_H
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "BufferPool.hpp"
+
+// LZ77 codec in the spirit of LZ4: sequences of a token byte, literals and a
+// 16 bit back reference. Fast to decode and good on the repeated names and
+// timestamps of shard rows; no entropy coding. Appends to output.
+void lzCompress(std::string_view input, std::string& output);
+
+// Decodes input into output, which is resized to raw_size. Returns false if
+// input is corrupt or does not decode to exactly raw_size bytes.
+bool lzDecompress(std::string_view input, size_t raw_size,
+                  std::string& output);
+
+/* Block index at the end of a compressed shard file. The file holds the raw
+ * lines in blocks of BLOCK_SIZE bytes, so the block of any raw offset is the
+ * offset divided by BLOCK_SIZE and a point lookup decodes one block. Blocks
+ * are the pages the buffer pool caches, decoded. A block that does not
+ * compress is stored as is, with stored_size equal to raw_size.
+ *
+ * Footer: per block <offset u64><stored_size u32><raw_size u32>, then
+ * <raw_size u64><blocks u32> and the magic "LMKZ". */
+struct BlockIndex {
+    static constexpr size_t BLOCK_SIZE = BufferPool::PAGE_SIZE;
+
+    struct Block {
+        uint64_t offset;
+        uint32_t stored_size;
+        uint32_t raw_size;
+    };
+
+    std::vector<Block> blocks;
+    uint64_t raw_size = 0;
+    uint64_t stored_size = 0;  // Of the whole file, index included
+
+    // Appends the footer to a file whose blocks have been written
+    void write(std::ostream& out) const;
+
+    // Null if path does not end in a valid footer
+    static std::shared_ptr<const BlockIndex> read(
+        const std::filesystem::path& path);
+};
+
+#endif
@@ -2,10 +2,15 @@
 #define RECORD_MANAGER_H
 
 #include <memory>
+#include <optional>
+#include <shared_mutex>
 #include <string>
 #include <unordered_map>
 #include <vector>
+#include "Catalog.hpp"
+#include "JoinCache.hpp"
 #include "Table.hpp"
+#include "Wal.hpp"
 
 class DBManager {
    public:
@@ -13,14 +18,21 @@ class DBManager {
     ~DBManager();
 
     bool createTable(const std::string& table_name,
-                     const std::vector<std::string>& attributes);
+                     const std::vector<std::string>& attributes,
+                     bool compressed = false,
+                     const std::optional<Partitioning>& partitioning =
+                         std::nullopt,
+                     const std::optional<std::string>& cluster_attribute =
+                         std::nullopt);
     bool deleteTable(const std::string& table_name);
 
     bool insertRecord(
         const std::string& table_name,
         const std::unordered_map<std::string, std::string>& record);
     void readTable(const std::string& table_name,
-                   const std::vector<int>& line_numbers);
+                   const std::vector<int>& line_numbers,
+                   const std::vector<Condition>& where = {},
+                   const std::optional<OrderBy>& order = std::nullopt);
     bool updateRecord(
         const std::string& table_name, size_t id,
         const std::unordered_map<std::string, std::string>& attrMap);
@@ -29,18 +41,60 @@ class DBManager {
     bool deleteByAttributes(
         const std::string& table_name,
         const std::unordered_map<std::string, std::string>& attrMap);
+    bool deleteWhere(const std::string& table_name,
+                     const std::vector<Condition>& where);
 
     bool joinTables(const std::vector<std::string>& tables,
-                    std::unordered_map<std::string, std::string>& attrMap);
+                    std::unordered_map<std::string, std::string>& attrMap,
+                    const std::optional<OrderBy>& order = std::nullopt);
+
+    // Stores codes from a per table dictionary instead of the values of attr
+    bool encodeAttribute(const std::string& table_name,
+                         const std::string& attr);
+    // Builds a persistent B+tree index of attr, used by reads and deletes
+    // with range, prefix or equality conditions on it
+    bool createIndex(const std::string& table_name, const std::string& attr);
+
+    // Writes the rows of a table to file in the Arrow IPC file format
+    bool exportTable(const std::string& table_name, const std::string& file);
+    // Appends the rows of an Arrow IPC file to a table, which is created
+    // with the columns of the file if it does not exist
+    bool importTable(const std::string& table_name, const std::string& file);
+
+    // Table holding the result of a join, recomputed when it is read after
+    // any of the joined tables changed
+    bool createMaterialized(
+        const std::string& name, const std::vector<std::string>& tables,
+        std::unordered_map<std::string, std::string>& attrMap);
 
    private:
     const std::string database_path;
-    std::unordered_map<std::string, std::shared_ptr<Table>> tables;
+    Wal wal;
+    Catalog catalog;
+
+    // Commands may run concurrently in server mode. Only creating and
+    // dropping tables is exclusive, tables version their shards themselves.
+    mutable std::shared_mutex catalog_mutex;
+
+    JoinCache join_cache;
+
+    // Versions of the joined tables each materialized view was computed
+    // from, empty until it is first computed by this process
+    std::unordered_map<std::string, std::vector<uint64_t>> view_versions;
+    std::mutex views_mutex;
 
-    void loadTables(const std::string& directory_path);
     std::shared_ptr<Table> findTable(const std::string& table_name);
-    std::string NewTablePath(const std::string& table_name) const;
-    std::string getMetadataPath(const std::string& table_name) const;
+    // Re-applies the appends of the write-ahead log and empties it
+    void replayWal();
+    std::shared_ptr<Table> join(
+        const std::vector<std::shared_ptr<Table>>& inputs,
+        const std::vector<std::string>& tables,
+        std::unordered_map<std::string, std::string>& attrMap);
+
+    bool isView(const std::string& table_name) const;
+    bool rejectView(const std::string& table_name) const;
+    bool viewIsStale(const std::string& table_name);
+    bool refreshView(const std::string& table_name, Table& view);
 };
 
 #endif
@@ -0,0 +1,74 @@
+#ifndef DATAGEN_H
+#define DATAGEN_H
+
+#include <cstdint>
+#include <random>
+#include <string>
+#include <vector>
+
+class Catalog;
+
+/* Zipf distribution over [0, n): exponent 0 is uniform, around 1 a few
+ * values get most of the draws. */
+class Zipf {
+   private:
+    std::vector<double> cdf_;
+
+   public:
+    Zipf(size_t n, double exponent);
+
+    size_t operator()(std::mt19937_64& rng) const;
+};
+
+struct DatagenOptions {
+    // Trips tables hold scale * 1,000,000 rows
+    double scale = 0.01;
+    // Distinct station names, the cardinality of the join keys
+    size_t stations = 800;
+    // Zipf exponent of station popularity in trips
+    double skew = 1.0;
+    // Share of trip stations found in the stations tables, the others are
+    // names of stations that do not exist
+    double match_rate = 1.0;
+    size_t shard_rows = 1000000;
+    uint64_t seed = 1;
+};
+
+/* Synthetic bike hire data shaped like the London dataset, written straight
+ * to shard files and registered in the catalog, replacing tables of the
+ * same name. Output depends only on the options, so runs are comparable.
+ * Values hold no spaces, so any of them can be used in a command:
+ *
+ * trips: rental_id,duration,bike_id,start_date,start_station_id,
+ *        start_station_name,end_date,end_station_id,end_station_name
+ * stations: station_id,station_name,latitude,longitude
+ * docks: station_name,docks,zone
+ *
+ * Shards of a trips table are generated in parallel. Errors are reported on
+ * errStream(). */
+class Datagen {
+   private:
+    Catalog& catalog_;
+    DatagenOptions options_;
+
+    // Writes rows [0, rows) as row(i, rng) into shards of shard_rows rows
+    template <typename Row>
+    bool write(const std::string& name,
+               const std::vector<std::string>& attributes, size_t rows,
+               Row&& row);
+
+   public:
+    Datagen(Catalog& catalog, const DatagenOptions& options);
+
+    size_t tripRows() const;
+
+    // rows defaults to tripRows()
+    bool trips(const std::string& name, size_t rows = 0);
+    bool stations(const std::string& name);
+    bool docks(const std::string& name);
+
+    // Name of station index; indices from options.stations on do not exist
+    static std::string stationName(size_t index);
+};
+
+#endif
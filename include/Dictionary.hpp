@@ -0,0 +1,70 @@
+#ifndef DICTIONARY_H
+#define DICTIONARY_H
+
+#include <atomic>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+/* Codes for the distinct values of a dictionary encoded column, whose shards
+ * store the decimal code in place of the value. Codes are handed out in order
+ * of first appearance and never change. A new value is appended to the
+ * dictionary file before any row holding its code is written, so every code
+ * found in a shard can be decoded, also after a crash.
+ *
+ * Values live in fixed size chunks that never move: decoding takes no lock
+ * and may run concurrently with encoding new values. */
+class Dictionary {
+   public:
+    static constexpr size_t CHUNK_SIZE = 1024;
+    static constexpr size_t MAX_CHUNKS = 4096;
+    static constexpr uint32_t MAX_CODES = CHUNK_SIZE * MAX_CHUNKS;
+
+    // Loads the values already stored in the file at path
+    explicit Dictionary(std::filesystem::path path);
+
+    // Code of value, which is added if it is new. Empty if the dictionary
+    // is full or the value could not be stored.
+    std::optional<uint32_t> encode(std::string_view value);
+
+    // Code of value, empty if it is not in the dictionary
+    std::optional<uint32_t> find(std::string_view value) const;
+
+    // Value of a code previously returned by encode() or find()
+    std::string_view decode(uint32_t code) const {
+        return chunks_[code / CHUNK_SIZE][code % CHUNK_SIZE];
+    }
+
+    uint32_t size() const { return size_.load(std::memory_order_acquire); }
+
+    // Syncs the dictionary file, unless no value was added since last time
+    bool sync();
+    const std::filesystem::path& path() const { return path_; }
+
+    // Code stored in a shard field, empty if the field is not a code
+    static std::optional<uint32_t> parseCode(std::string_view field);
+
+    Dictionary(const Dictionary&) = delete;
+    Dictionary& operator=(const Dictionary&) = delete;
+
+   private:
+    std::filesystem::path path_;
+    std::unique_ptr<std::string[]> chunks_[MAX_CHUNKS];
+    std::atomic<uint32_t> size_{0};
+    std::atomic<uint32_t> synced_{0};
+
+    // Writers only: value lookup and the file new values are appended to
+    mutable std::mutex mutex_;
+    std::unordered_map<std::string_view, uint32_t> codes_;
+    std::ofstream file_;
+
+    void add(std::string_view value);
+};
+
+#endif
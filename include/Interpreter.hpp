@@ -3,6 +3,7 @@
 
 #include <memory>
 #include <string>
+#include <vector>
 
 class DatabaseAPI;
 
@@ -16,6 +17,8 @@ class Interpreter {
 
    private:
     std::unique_ptr<DatabaseAPI> dbApi;
+
+    void explain(const std::vector<std::string>& tokens);
 };
 
 #endif
@@ -0,0 +1,38 @@
+#ifndef JOIN_CACHE_H
+#define JOIN_CACHE_H
+
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "Table.hpp"
+
+/* Results of recent joins, keyed on the join spec and only valid while every
+ * input table is still at the version it had when the join started. Results
+ * are kept as their temporary tables; the least recently used are dropped
+ * once their shards exceed the join_cache_size setting. */
+class JoinCache {
+   public:
+    std::shared_ptr<Table> find(const std::string& spec,
+                                const std::vector<uint64_t>& versions);
+    bool contains(const std::string& spec,
+                  const std::vector<uint64_t>& versions);
+    void insert(const std::string& spec, std::vector<uint64_t> versions,
+                std::shared_ptr<Table> result);
+
+   private:
+    struct Entry {
+        std::string spec;
+        std::vector<uint64_t> versions;
+        std::shared_ptr<Table> result;
+        uintmax_t bytes;
+    };
+
+    std::mutex mutex_;
+    std::list<Entry> entries_;  // Most recently used first
+    uintmax_t bytes_ = 0;
+};
+
+#endif
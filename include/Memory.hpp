@@ -0,0 +1,76 @@
+#ifndef MEMORY_H
+#define MEMORY_H
+
+#include <atomic>
+#include <cstddef>
+
+/* Bytes held by the operators of a query (hash tables and their arenas,
+ * sort and result buffers), charged to the tracker of the query and to the
+ * process wide tracker above it. A reservation that would take either over
+ * its limit is refused: sorts spill their buffer instead, joins fail the
+ * query. A limit of 0 is unlimited. Operators running on other threads
+ * install the tracker of their query with Activate. */
+class MemoryTracker {
+   private:
+    const std::atomic<size_t>& limit_;
+    MemoryTracker* parent_;
+    std::atomic<size_t> used_{0};
+    std::atomic<size_t> peak_{0};
+
+   public:
+    MemoryTracker(const std::atomic<size_t>& limit, MemoryTracker* parent);
+    ~MemoryTracker();
+
+    MemoryTracker(const MemoryTracker&) = delete;
+    MemoryTracker& operator=(const MemoryTracker&) = delete;
+
+    // Charges bytes to this tracker and its parents, or to none of them if
+    // one would exceed its limit
+    bool tryReserve(size_t bytes);
+    void release(size_t bytes);
+
+    size_t used() const { return used_.load(std::memory_order_relaxed); }
+    size_t peak() const { return peak_.load(std::memory_order_relaxed); }
+    size_t limit() const { return limit_.load(std::memory_order_relaxed); }
+
+    // Limited by the memory_limit setting
+    static MemoryTracker& global();
+    // Tracker of the query running on this thread, the global one outside
+    // of queries
+    static MemoryTracker& current();
+
+    class Activate {
+       private:
+        MemoryTracker* prev_;
+
+       public:
+        explicit Activate(MemoryTracker* tracker);
+        ~Activate();
+
+        Activate(const Activate&) = delete;
+        Activate& operator=(const Activate&) = delete;
+    };
+};
+
+/* Bytes one operator holds, resized as its structures grow and released
+ * when it goes out of scope. */
+class MemoryReservation {
+   private:
+    MemoryTracker& tracker_;
+    size_t bytes_ = 0;
+
+   public:
+    explicit MemoryReservation(
+        MemoryTracker& tracker = MemoryTracker::current());
+    ~MemoryReservation();
+
+    MemoryReservation(const MemoryReservation&) = delete;
+    MemoryReservation& operator=(const MemoryReservation&) = delete;
+
+    // Charges or releases the difference to bytes. False if refused, the
+    // reservation then keeps its previous size.
+    bool resize(size_t bytes);
+    size_t bytes() const { return bytes_; }
+};
+
+#endif
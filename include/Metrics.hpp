@@ -0,0 +1,131 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <thread>
+
+/* Process wide metrics. Metrics are registered once, typically into a
+ * function local static reference at the instrumentation point, and updated
+ * without locks afterwards. */
+class Counter {
+   private:
+    std::atomic<uint64_t> value_{0};
+
+   public:
+    void add(uint64_t n = 1) { value_.fetch_add(n, std::memory_order_relaxed); }
+    uint64_t value() const { return value_.load(std::memory_order_relaxed); }
+};
+
+class Gauge {
+   private:
+    std::atomic<int64_t> value_{0};
+
+   public:
+    void set(int64_t v) { value_.store(v, std::memory_order_relaxed); }
+    void add(int64_t n) { value_.fetch_add(n, std::memory_order_relaxed); }
+    int64_t value() const { return value_.load(std::memory_order_relaxed); }
+};
+
+/* HDR style histogram: values are bucketed by power of two, and every power
+ * of two range is split into 2^SUB_BITS linear sub-buckets, which bounds the
+ * relative error of reported percentiles to about 3%. */
+class Histogram {
+   public:
+    static constexpr int SUB_BITS = 5;
+    static constexpr size_t SUB_BUCKETS = size_t(1) << SUB_BITS;
+    static constexpr size_t NUM_BUCKETS = (65 - SUB_BITS) * SUB_BUCKETS;
+
+    void record(uint64_t value);
+
+    uint64_t count() const;
+    uint64_t sum() const { return sum_.load(std::memory_order_relaxed); }
+    uint64_t max() const { return max_.load(std::memory_order_relaxed); }
+    uint64_t percentile(double p) const;
+
+    static size_t bucketOf(uint64_t value);
+    static uint64_t bucketLow(size_t bucket);
+    static uint64_t bucketHigh(size_t bucket);
+
+   private:
+    std::array<std::atomic<uint64_t>, NUM_BUCKETS> buckets_{};
+    std::atomic<uint64_t> sum_{0};
+    std::atomic<uint64_t> max_{0};
+};
+
+/* Records the time between construction and destruction in nanoseconds. */
+class LatencyTimer {
+   private:
+    Histogram& histogram_;
+    std::chrono::steady_clock::time_point start_;
+
+   public:
+    explicit LatencyTimer(Histogram& histogram)
+        : histogram_(histogram), start_(std::chrono::steady_clock::now()) {}
+    ~LatencyTimer();
+
+    LatencyTimer(const LatencyTimer&) = delete;
+    LatencyTimer& operator=(const LatencyTimer&) = delete;
+};
+
+class Metrics {
+   public:
+    static Metrics& instance();
+
+    // Histograms record nanoseconds. labels is a Prometheus label set
+    // without braces, e.g. command="read". A name belongs to one kind of
+    // metric, asking for it as another throws std::logic_error.
+    Counter& counter(const std::string& name, const std::string& help,
+                     const std::string& labels = "");
+    Gauge& gauge(const std::string& name, const std::string& help,
+                 const std::string& labels = "");
+    Histogram& histogram(const std::string& name, const std::string& help,
+                         const std::string& labels = "");
+
+    void print(std::ostream& out) const;
+    void writePrometheus(std::ostream& out) const;
+
+    // Rewrites path with the Prometheus text format every interval, until
+    // called again with an empty path
+    void dumpPeriodically(const std::string& path,
+                          std::chrono::milliseconds interval);
+    bool dumpTo(const std::string& path) const;
+
+    ~Metrics();
+
+   private:
+    enum class Kind { Counter, Gauge, Histogram };
+
+    struct Entry {
+        std::string name;
+        std::string help;
+        std::string labels;
+        Kind kind;
+        std::unique_ptr<Counter> counter;
+        std::unique_ptr<Gauge> gauge;
+        std::unique_ptr<Histogram> histogram;
+    };
+
+    mutable std::mutex mutex_;
+    std::deque<Entry> entries_;
+
+    std::thread dumper_;
+    std::mutex dumper_mutex_;
+    std::condition_variable dumper_cv_;
+    bool dumper_stop_ = false;
+
+    Metrics() = default;
+    Entry& find(const std::string& name, const std::string& help,
+                const std::string& labels, Kind kind);
+    void stopDumper();
+};
+
+#endif
@@ -0,0 +1,61 @@
+#ifndef PREDICATE_H
+#define PREDICATE_H
+
+#include <optional>
+#include <string>
+#include <string_view>
+
+enum class CompareOp {
+    Equal,
+    Less,
+    LessEqual,
+    Greater,
+    GreaterEqual,
+    Prefix
+};
+
+/* A condition on one attribute of a row, as written in a read command:
+ * attr:value (or attr=value) matches the value exactly, attr<value,
+ * attr<=value, attr>value and attr>=value compare in the order of order by
+ * (compareValues), and attr:value* matches the values starting with value. */
+struct Condition {
+    std::string attribute;
+    CompareOp op;
+    std::string value;
+
+    // As written in a command
+    std::string text() const;
+};
+
+// Parses a condition token, false if it holds no operator or attribute
+bool parseCondition(std::string_view token, Condition& condition);
+
+// Whether the values starting with prefix are text, which sort from prefix
+// on without other values between them
+bool textPrefix(std::string_view prefix);
+
+/* Range of values a conjunction of conditions on one attribute allows, in
+ * compareValues order. Missing bounds are open. */
+struct KeyBounds {
+    std::optional<std::string> lower;
+    std::optional<std::string> upper;
+    bool lower_inclusive = true;
+    bool upper_inclusive = true;
+
+    // Narrows the range to the values condition allows
+    void add(const Condition& condition);
+    bool bounded() const { return lower || upper; }
+
+    // Whether key sorts before or after every value in the range
+    bool below(std::string_view key) const;
+    bool above(std::string_view key) const;
+    bool contains(std::string_view key) const {
+        return !below(key) && !above(key);
+    }
+    // Whether any key from min to max is in the range
+    bool overlaps(std::string_view min, std::string_view max) const {
+        return !above(min) && !below(max);
+    }
+};
+
+#endif
@@ -0,0 +1,111 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+
+struct OperatorStats {
+    std::string name;
+    std::string task;
+    uint64_t wall_ns = 0;
+    uint64_t cpu_ns = 0;
+    uint64_t rows_in = 0;
+    uint64_t rows_out = 0;
+    uint64_t bytes_read = 0;
+    uint64_t bytes_written = 0;
+    uint64_t peak_memory = 0;
+    uint64_t allocations = 0;
+};
+
+/* Collects the plan and, for explain analyze, per operator statistics of
+ * the command running on this thread. Operators running on other threads
+ * install the profile of the command they belong to with Activate. */
+class QueryProfile {
+   private:
+    bool analyze_;
+    std::vector<std::pair<int, std::string>> plan_;
+    std::vector<OperatorStats> operators_;
+    mutable std::mutex mutex_;
+
+   public:
+    explicit QueryProfile(bool analyze);
+
+    bool analyze() const { return analyze_; }
+
+    void addPlan(int depth, const std::string& line);
+    void record(OperatorStats stats);
+    void print(std::ostream& out) const;
+
+    static QueryProfile* current();
+
+    class Activate {
+       private:
+        QueryProfile* prev_;
+
+       public:
+        explicit Activate(QueryProfile* profile);
+        ~Activate();
+
+        Activate(const Activate&) = delete;
+        Activate& operator=(const Activate&) = delete;
+    };
+};
+
+/* Wall and thread CPU time since construction or the last restart(). */
+class Stopwatch {
+   private:
+    std::chrono::steady_clock::time_point wall_start_;
+    uint64_t cpu_start_;
+
+   public:
+    Stopwatch();
+
+    void restart();
+    uint64_t wallNs() const;
+    uint64_t cpuNs() const;
+
+    static uint64_t threadCpuNs();
+};
+
+/* Times one operator and records it into the active profile when it goes
+ * out of scope. Does nothing unless explain analyze is running, so callers
+ * update counters through stats(), which is null in that case. While
+ * tracing, the operator's lifetime is also recorded as a span, with the
+ * time it ran as active_ms. */
+class OperatorTimer {
+   private:
+    QueryProfile* profile_;
+    OperatorStats stats_;
+    uint64_t resumed_ns_;
+    uint64_t cpu_start_;
+    uint64_t allocations_start_;
+    // Start of the trace span, 0 when not tracing
+    uint64_t trace_start_ns_;
+    bool running_;
+
+   public:
+    OperatorTimer(const std::string& name, const std::string& task,
+                  bool paused = false);
+    ~OperatorTimer();
+
+    OperatorTimer(const OperatorTimer&) = delete;
+    OperatorTimer& operator=(const OperatorTimer&) = delete;
+
+    OperatorStats* stats() { return profile_ ? &stats_ : nullptr; }
+
+    // Excludes time spent in nested operators, e.g. printing rows while
+    // scanning
+    void pause();
+    void resume();
+};
+
+std::string formatBytes(uint64_t bytes);
+
+// Heap allocations made by the calling thread so far
+uint64_t threadAllocations();
+
+#endif
@@ -0,0 +1,24 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <string_view>
+
+/* Wire format used by server mode: every request and response is a frame
+ * made of a 4-byte big-endian payload length followed by the payload. A
+ * request payload is a single command line, a response payload is the
+ * output that command produced. */
+constexpr size_t FRAME_HEADER_SIZE = 4;
+constexpr uint32_t MAX_REQUEST_SIZE = 1 << 20;  // 1MB
+
+std::string encodeFrame(std::string_view payload);
+
+/* Removes one complete frame from the front of buffer and returns its
+ * payload, or std::nullopt if buffer does not hold a complete frame yet.
+ * Throws std::length_error if the announced length exceeds max_size. */
+std::optional<std::string> takeFrame(std::string& buffer,
+                                     uint32_t max_size = UINT32_MAX);
+
+#endif
@@ -0,0 +1,33 @@
+#ifndef RECORD_H
+#define RECORD_H
+
+#include <cstddef>
+#include <string_view>
+#include <vector>
+
+// Field at position column of a comma separated row, empty if missing
+std::string_view fieldAt(std::string_view row, int column);
+
+/* Fields of one comma separated row, as views into the row, which has to
+ * outlive them. Parsing the next row reuses the field storage, so a scan
+ * stops allocating once it has seen its widest row. */
+class RecordView {
+   private:
+    std::vector<std::string_view> fields_;
+
+   public:
+    RecordView() = default;
+    explicit RecordView(std::string_view row) { parse(row); }
+
+    // A trailing empty field is dropped, like reading fields with getline
+    void parse(std::string_view row);
+
+    size_t size() const { return fields_.size(); }
+
+    // Missing fields read as empty
+    std::string_view operator[](size_t i) const {
+        return i < fields_.size() ? fields_[i] : std::string_view();
+    }
+};
+
+#endif
@@ -0,0 +1,77 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "ThreadPool.hpp"
+
+class Interpreter;
+
+/* Serves the length-prefixed protocol from Protocol.hpp on a Unix domain
+ * socket. A single event loop thread owns all sessions and does the socket
+ * I/O; commands run on a shared worker pool against one Interpreter, so many
+ * clients can query the same loaded catalog concurrently. Requests of one
+ * session are executed one at a time, in order. A client may shut down its
+ * writing side after its last request and still read every response. */
+class Server {
+   private:
+    class Poller;
+
+    struct Session {
+        int fd;
+        std::string read_buffer;
+        std::string write_buffer;
+        std::deque<std::string> pending;
+        bool busy = false;
+        // Peer shut down its side, closed once every request read before
+        // is answered
+        bool closing = false;
+        // Registered with the poller
+        bool polled = true;
+    };
+
+    std::string socket_path_;
+    Interpreter& interpreter_;
+    std::unique_ptr<ThreadPool> pool_;
+
+    int listen_fd_;
+    int wake_pipe_[2];
+
+    uint64_t next_session_id_;
+    std::unordered_map<uint64_t, Session> sessions_;
+
+    std::mutex completed_mutex_;
+    std::vector<std::pair<uint64_t, std::string>> completed_;
+
+    void acceptClients(Poller& poller);
+    void readFromSession(Poller& poller, uint64_t id);
+    void writeToSession(Poller& poller, uint64_t id);
+    void dispatch(uint64_t id, Session& session);
+    void drainCompleted(Poller& poller);
+    // Closes a finished closing session, or waits for what it needs next
+    void updateSession(Poller& poller, uint64_t id);
+    void closeSession(Poller& poller, uint64_t id);
+
+   public:
+    Server(std::string socket_path, Interpreter& interpreter,
+           size_t num_workers);
+    ~Server();
+
+    Server(const Server&) = delete;
+    Server& operator=(const Server&) = delete;
+
+    /* Binds the socket and runs the event loop until stop() is called.
+     * Returns false if the socket could not be set up. */
+    bool run();
+
+    /* Async-signal-safe, may be called from a signal handler. */
+    void stop();
+};
+
+#endif
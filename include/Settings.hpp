@@ -0,0 +1,74 @@
+#ifndef SETTINGS_H
+#define SETTINGS_H
+
+#include <atomic>
+#include <cstddef>
+#include <ostream>
+#include <string>
+
+/* Runtime tunables, listed with "set" and changed with "set <name> <value>".
+ * Sizes accept K, M and G suffixes, settings with named values their
+ * names. */
+class Settings {
+   public:
+    static Settings& instance();
+
+    // Bytes of rows an order by may buffer before spilling sorted runs to
+    // disk
+    std::atomic<size_t> sort_memory{256 << 20};
+
+    // Bytes the operators of all running queries, and of a single query,
+    // may hold for hash tables and sort and result buffers. 0 is unlimited.
+    std::atomic<size_t> memory_limit{0};
+    std::atomic<size_t> query_memory_limit{0};
+
+    // Bytes of shard pages the buffer pool keeps cached
+    std::atomic<size_t> buffer_pool_memory{256 << 20};
+
+    // Bytes of join results kept for repeated joins, 0 disables the cache
+    std::atomic<size_t> join_cache_size{256 << 20};
+
+    // Size at which compressed tables compress their tail shard and start
+    // appending to a new one
+    std::atomic<size_t> seal_size{64 << 20};
+
+    // Size at which clustered tables merge their unsorted delta shard into
+    // the sorted shards, and size past which a merge splits a sorted shard
+    std::atomic<size_t> cluster_delta_size{4 << 20};
+    std::atomic<size_t> cluster_shard_size{64 << 20};
+
+    // 1 opens all tables in the background at startup, instead of each on
+    // its first use. Read when a database is opened.
+    std::atomic<size_t> prefetch_tables{0};
+
+    // Probe rows a join hashes, prefetches and matches together, 0 probes
+    // one row at a time
+    std::atomic<size_t> join_batch_size{1024};
+
+    // Pages a sequential shard scan keeps read ahead of the one it parses,
+    // 0 reads each page only when the scan gets to it
+    std::atomic<size_t> readahead_pages{8};
+
+    // Durability of inserts: none, group (rows are durable when the insert
+    // returns, concurrent inserts share an fsync of the write-ahead log) or
+    // sync (every insert syncs the log on its own). A WalMode.
+    std::atomic<size_t> wal_mode{1};
+
+    // Milliseconds a group commit waits for more rows before syncing, unless
+    // wal_group_records are pending. 0 syncs as soon as the previous sync is
+    // done, grouping the rows that arrived meanwhile.
+    std::atomic<size_t> wal_group_ms{0};
+    std::atomic<size_t> wal_group_records{64};
+
+    // Size of the write-ahead log at which the shards it covers are synced
+    // and the log emptied
+    std::atomic<size_t> wal_checkpoint_size{64 << 20};
+
+    bool set(const std::string& name, const std::string& value);
+    void print(std::ostream& out) const;
+
+   private:
+    Settings() = default;
+};
+
+#endif
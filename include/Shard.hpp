@@ -1,17 +1,57 @@
 #ifndef SHARD_H
 #define SHARD_H
 
+#include <atomic>
+#include <cstdint>
 #include <filesystem>
+#include <fstream>
 #include <future>
+#include <map>
 #include <memory>
+#include <optional>
 #include <string>
+#include <string_view>
 #include <unordered_map>
 #include <vector>
+#include "AsyncIo.hpp"
+#include "BufferPool.hpp"
+#include "Compression.hpp"
+#include "Metrics.hpp"
+#include "Profile.hpp"
 
+struct JoinKeys;
+
+// Smallest and largest key of a sorted shard of a clustered table
+struct KeyRange {
+    std::string min;
+    std::string max;
+};
+
+/* An immutable version of a shard file. Readers only ever look at the first
+ * size() bytes, so rows appended after this version was published stay
+ * invisible to them. Appends publish a new Shard of the same file, sharing
+ * its File. Rewrites go to a new file with a higher version number and the
+ * old file is retired: it is removed once the last snapshot holding any
+ * version of it goes away.
+ *
+ * Shards of compressed tables are .lz files of compressed blocks, see
+ * BlockIndex; size() is their raw size, which all offsets refer to. */
 class Shard {
    private:
-    std::filesystem::path path_;
-    bool temp_;
+    // The file shared by all size versions of a shard
+    struct File {
+        std::filesystem::path path;
+        bool temp;
+        std::atomic<bool> retired;
+
+        File(std::filesystem::path file_path, bool temporary);
+        ~File();
+    };
+
+    std::shared_ptr<File> file_;
+    std::shared_ptr<const BlockIndex> blocks_;
+    uintmax_t size_;
+    std::optional<KeyRange> key_range_;
     static std::filesystem::path generateTempPath(
         const std::string& prefix = "shard_");
 
@@ -23,23 +63,153 @@ class Shard {
     };
 
     explicit Shard(const std::string& file_path);
+    Shard(const std::string& file_path, uintmax_t size);
+    // A later version of the same file, size bytes long
+    Shard(const Shard& previous, uintmax_t size);
     explicit Shard();
     std::string path() const;
+    uintmax_t size() const;
+    bool temporary() const { return file_->temp; }
+
+    static constexpr const char* COMPRESSED_EXTENSION = ".lz";
+    bool compressed() const { return blocks_ != nullptr; }
+    const std::shared_ptr<const BlockIndex>& blocks() const {
+        return blocks_;
+    }
+    // Bytes the shard takes on disk
+    uintmax_t storedSize() const;
+
+    // Shard number and version encoded in a shard_<number>[.<version>].csv
+    // file name
+    static size_t numberOf(const std::filesystem::path& path);
+    static size_t versionOf(const std::filesystem::path& path);
+    std::filesystem::path nextVersionPath(bool compressed = false) const;
+
+    // Records the current file length as the committed size. Only valid
+    // while the shard is not yet visible to other threads.
+    void commit();
+    // Removes the file once no version of it is held any more
+    void retire();
 
-    Shard(Shard&& other) noexcept = default;
-    Shard& operator=(Shard&& other) noexcept = default;
+    // Set on the sorted shards of clustered tables, which hold their rows in
+    // key order. Only set while the shard is not yet visible to other
+    // threads.
+    const std::optional<KeyRange>& keyRange() const { return key_range_; }
+    void setKeyRange(std::optional<KeyRange> range) {
+        key_range_ = std::move(range);
+    }
 
     // Prevent copying
     Shard(const Shard&) = delete;
     Shard& operator=(const Shard&) = delete;
 
-    ~Shard();
-
     std::future<JoinResult> joinShards(
         const std::vector<std::shared_ptr<Shard>>& others,
-        const std::string& this_join_attr, const std::string& other_join_attr,
-        const std::unordered_map<std::string, int>& this_metadata,
-        const std::unordered_map<std::string, int>& other_metadata) const;
+        std::shared_ptr<const JoinKeys> keys) const;
+};
+
+using ShardList = std::vector<std::shared_ptr<Shard>>;
+
+/* Process wide I/O counters of the shard layer. */
+struct ShardIoMetrics {
+    Counter& bytes_read;
+    Counter& rows_read;
+    Counter& bytes_written;
+    Counter& rows_written;
+    Counter& shards_rewritten;
+    Counter& fsyncs;
+    Counter& compressed_raw_bytes;
+    Counter& compressed_stored_bytes;
+    Counter& readahead_pages;
+
+    static ShardIoMetrics& get();
+
+    void recordWrite(uint64_t bytes, uint64_t rows) {
+        bytes_written.add(bytes);
+        rows_written.add(rows);
+    }
+};
+
+/* Writes the lines of a new shard file, either plain or as compressed blocks
+ * followed by their index. */
+class ShardWriter {
+   private:
+    std::ofstream out_;
+    bool compressed_;
+    std::string block_;
+    std::string stored_;
+    BlockIndex index_;
+    uintmax_t size_;
+
+    void writeBlock();
+
+   public:
+    ShardWriter(const std::filesystem::path& path, bool compressed);
+
+    void write(std::string_view line);
+    // Writes the last block and the index, false if any write failed
+    bool close();
+
+    // Raw bytes written
+    uintmax_t size() const { return size_; }
+};
+
+/* Sequential reader over the committed lines of one shard version. Reads go
+ * through the buffer pool, except for temporary shards which are read once.
+ * Sequential scans keep the next readahead_pages pages in flight on the
+ * IoQueue of their thread while they parse the current one, and decode the
+ * next blocks of compressed shards in parallel; after a seek only the pages
+ * holding the requested lines are read. A reader is used by one thread. */
+class ShardReader {
+   private:
+    struct Pending {
+        std::shared_ptr<BufferPool::Page> page;
+        std::shared_ptr<IoQueue::Request> request;
+    };
+
+    std::string path_;
+    uintmax_t size_;
+    bool cache_;
+    std::shared_ptr<const BlockIndex> blocks_;
+    bool readahead_;
+    std::unique_ptr<OperatorTimer> decode_timer_;
+    BufferPool::PageHandle page_;
+    size_t page_number_;
+    uintmax_t offset_;
+    uintmax_t next_offset_;
+    uintmax_t bytes_;
+    uint64_t rows_;
+    std::string spanning_;
+
+    // Reads ahead of sequential scans of plain shards
+    IoQueue* queue_;
+    int fd_;
+    std::map<size_t, Pending> pending_;
+    size_t ahead_;
+    uint64_t pages_ahead_;
+
+    void fetch(size_t number, size_t needed);
+    bool readAhead(size_t number, size_t needed);
+
+   public:
+    explicit ShardReader(const Shard& shard);
+    ~ShardReader();
+
+    bool next(std::string& line);
+
+    // Zero copy variant: the view points into the buffer pool page, or into
+    // the reader for lines spanning pages, and is valid until the next call
+    bool next(std::string_view& line);
+
+    // Continue reading at byte offset, which must be the start of a line
+    void seek(uintmax_t offset) {
+        next_offset_ = offset;
+        readahead_ = false;
+    }
+
+    // Byte offset of the line last returned by next()
+    uintmax_t offset() const { return offset_; }
+    uintmax_t bytesRead() const { return bytes_; }
 };
 
 #endif
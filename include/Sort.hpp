@@ -0,0 +1,91 @@
+#ifndef SORT_H
+#define SORT_H
+
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "Memory.hpp"
+#include "Record.hpp"
+#include "Shard.hpp"
+
+struct OrderBy {
+    std::string attribute;
+    bool descending = false;
+    std::optional<size_t> limit;
+};
+
+/* Total order on field values used by order by: numeric values sort before
+ * everything else and compare by value, other values compare bytewise. */
+int compareValues(std::string_view a, std::string_view b);
+bool parseNumber(std::string_view value, double& number);
+
+/* Sorts rows on one column. A limit of at most TOP_K_HEAP_LIMIT rows keeps
+ * only the best rows in a bounded heap. Otherwise rows are buffered up to
+ * memory_budget bytes, sorted in parallel, and spilled to disk as sorted
+ * runs that are merged when the input is exhausted. The buffer is charged
+ * to the query's MemoryTracker and spilled early when a memory limit
+ * refuses it more, once it holds at least MIN_RUN_BYTES: a nearly exhausted
+ * limit is exceeded by that much rather than spilling a run per row. Ties
+ * keep input order. */
+class RowSorter {
+   public:
+    static constexpr size_t TOP_K_HEAP_LIMIT = 10000;
+    static constexpr size_t MIN_RUN_BYTES = 64 << 10;
+
+    RowSorter(int key_column, bool descending, std::optional<size_t> limit,
+              size_t memory_budget);
+    ~RowSorter();
+
+    void add(std::string row);
+    void finish(const std::function<void(const std::string&)>& emit);
+
+    size_t spilledBytes() const { return spilled_bytes_; }
+    size_t spilledRuns() const { return runs_.size(); }
+    size_t peakMemory() const { return peak_bytes_; }
+
+   private:
+    struct Entry {
+        std::string row;
+        size_t key_offset;
+        size_t key_length;
+        size_t sequence;
+        double number;
+        bool numeric;
+
+        std::string_view key() const {
+            return std::string_view(row).substr(key_offset, key_length);
+        }
+    };
+
+    int key_column_;
+    bool descending_;
+    std::optional<size_t> limit_;
+    size_t memory_budget_;
+
+    // Charged ahead of the buffer in steps of RESERVE_STEP
+    static constexpr size_t RESERVE_STEP = 1 << 20;
+    MemoryReservation memory_;
+
+    std::vector<Entry> buffer_;
+    size_t buffered_bytes_;
+    size_t peak_bytes_;
+    size_t spilled_bytes_;
+    size_t next_sequence_;
+    bool use_heap_;
+    std::vector<std::shared_ptr<Shard>> runs_;
+
+    Entry makeEntry(std::string row, size_t sequence) const;
+    bool before(const Entry& a, const Entry& b) const;
+    // Keeps the buffer charged to the query, false if a memory limit
+    // refuses it
+    bool reserveBuffer();
+    void sortBuffer();
+    void spill();
+    void merge(const std::function<void(const std::string&)>& emit);
+};
+
+#endif
@@ -1,9 +1,49 @@
 #ifndef TABLE_H
 #define TABLE_H
 
+#include <atomic>
+#include <cstdint>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <optional>
+#include <shared_mutex>
+#include <span>
 #include <unordered_map>
+#include "BTree.hpp"
+#include "Batch.hpp"
+#include "Dictionary.hpp"
+#include "Predicate.hpp"
+#include "Record.hpp"
 #include "Shard.hpp"
+#include "Sort.hpp"
+
+class ArrowReader;
+class Catalog;
+class Wal;
+
+enum class RowAction { Keep, Replace, Drop };
+
+/* Rows of a partitioned table are stored in count shards, the shard of a
+ * row chosen by a hash of its value of attribute, so that two tables
+ * partitioned on their join attributes into the same count join partition
+ * by partition. */
+struct Partitioning {
+    std::string attribute;
+    size_t count = 0;
+};
+
+// Byte offsets of rows by shard number, in shard order
+using RowOffsets = std::map<size_t, std::vector<uint64_t>>;
+
+// Range of an indexed attribute a read or delete searches its index for.
+// A non empty prefix ends the search at the first value not starting with
+// it.
+struct IndexScan {
+    std::string attribute;
+    KeyBounds bounds;
+    std::string prefix;
+};
 
 struct RecordLocation {
     std::shared_ptr<Shard> shard;
@@ -14,48 +54,254 @@ class Table {
    private:
     std::string name_;
     std::filesystem::path path_;
-    std::vector<std::shared_ptr<Shard>> shards_;
     std::unordered_map<std::string, int> metadata_;
     bool temp_;
+    Catalog* catalog_;
+
+    // Shards other than the tail receiving appends are stored compressed
+    bool compressed_;
+
+    // Shard i holds partition i, set once when the table is opened
+    std::optional<Partitioning> partitioning_;
+
+    // Attribute the rows of a clustered table are sorted on, set once when
+    // the table is opened. Its sorted shards have a key range and follow
+    // each other in key order; inserts go to the last shard, an unsorted
+    // delta, which is merged into them once it reaches cluster_delta_size.
+    std::optional<std::string> cluster_attribute_;
+
+    // Number of fields in a row, and the dictionary of every encoded column
+    // by column; empty if no column is encoded. Only changed while no other
+    // command uses the table.
+    size_t width_;
+    std::vector<std::shared_ptr<Dictionary>> dictionaries_;
+
+    // Current shard versions. Readers pin a snapshot and never block;
+    // writers are serialized by write_mutex_ and publish a new list when
+    // they are done, so a reader sees either all or none of a write.
+    std::shared_ptr<const ShardList> shards_;
+    mutable std::mutex snapshot_mutex_;
+    std::mutex write_mutex_;
+
+    // Changed by every publish, including appends, to a value no table
+    // of any name has had before
+    std::atomic<uint64_t> version_;
+
+    // B+tree index of every indexed attribute, with entries for the rows of
+    // the published shards. publish() updates them holding index_mutex_
+    // exclusively, index reads hold it shared from their snapshot to their
+    // lookup.
+    std::map<std::string, std::shared_ptr<BTreeIndex>> indexes_;
+    mutable std::shared_mutex index_mutex_;
 
     const size_t MAX_SHARD_SIZE = 1024 * 1024 * 1024;  // 1GB
 
+    // Record batches of an export end after this many rows or body bytes;
+    // an import writes the batches of up to IMPORT_SHARD_SIZE body bytes
+    // to one shard
+    const size_t EXPORT_BATCH_ROWS = 64 * 1024;
+    const size_t EXPORT_BATCH_SIZE = 16 * 1024 * 1024;   // 16MB
+    const int64_t IMPORT_SHARD_SIZE = 64 * 1024 * 1024;  // 64MB
+
     bool loadMetadata();
     void loadShards();
 
     bool validateAttributes(
         const std::unordered_map<std::string, std::string>& attributes) const;
-    RecordLocation findRecord(size_t target_idx) const;
+    // False if a value of an indexed attribute is too long to index
+    bool indexable(
+        const std::unordered_map<std::string, std::string>& values) const;
+    RecordLocation findRecord(const ShardList& shards,
+                              size_t target_idx) const;
 
     bool isTemp() const;
 
     const std::unordered_map<std::string, int>& getMetadata() const;
-    const std::vector<std::shared_ptr<Shard>>& getShards() const;
+    std::shared_ptr<const ShardList> snapshot() const;
+    // Publishes shards and updates the indexes for the rows of the shards
+    // it adds and removes, or rebuilds them if rebuild_indexes is set.
+    // False if the catalog failed to record changed shard files: the shards
+    // are published either way, but the files they replace are still the
+    // ones on record and must not be retired.
+    bool publish(std::shared_ptr<const ShardList> shards,
+                 bool rebuild_indexes = false);
+
+    // Value of column in a row, decoded if the column is encoded
+    std::string_view fieldValue(std::string_view line, int column) const;
+    // Compiles the conditions of where into program, on decoded values.
+    // False if an attribute is unknown.
+    bool compileWhere(const std::vector<Condition>& where,
+                      PredicateProgram& program) const;
+    void updateIndexes(const ShardList& before, const ShardList& after);
+    // Bulk loads index with the rows of shards. False if a value is too
+    // long to index or the index cannot be written.
+    bool buildIndex(BTreeIndex& index, int column,
+                    const ShardList& shards) const;
+    // Rows the index of scan finds, index_mutex_ must be held
+    RowOffsets lookup(const IndexScan& scan) const;
+
+    // Writes a new version of shard, compressed if compress is set, calling
+    // rewrite(line, index, replacement) for every row. Returns null if no
+    // row changed and the shard is already stored as requested.
+    template <typename F>
+    std::shared_ptr<Shard> rewriteShard(const Shard& shard, bool compress,
+                                        F&& rewrite) const;
+    bool compressOnRewrite(const ShardList& shards, const Shard& shard) const;
+    // Compresses a full tail shard, after which appends go to a new shard.
+    // replaced is set to the plain version, to retire once published.
+    bool sealTail(ShardList& shards, std::shared_ptr<Shard>& replaced);
     void setMetadata(const std::unordered_map<std::string, int>& metadata);
 
+    // Drops the rows criteria(line, index) matches, rows numbered across
+    // shards
     template <typename T>
-    bool deleteRecord(const T& criteria);
+    bool deleteRecord(T criteria);
+    // Drops the rows at offsets, leaving shards without any as they are.
+    // write_mutex_ must be held since current was taken.
+    bool dropRows(const ShardList& current, const RowOffsets& rows);
+
+    // Merges the delta of a clustered table into its sorted shards and
+    // starts a new empty delta
+    bool mergeDelta();
+    // Writes the rows of shard (if any) merged with rows, both in key order,
+    // as sorted shards of up to cluster_shard_size bytes: the first as the
+    // next version of shard, the others as new shards numbered from
+    // next_number
+    void writeMerged(const Shard* shard, std::span<const std::string> rows,
+                     size_t& next_number, ShardList& merged) const;
+    // Joins two clustered tables in one pass over their rows in key order
+    std::shared_ptr<Shard> mergeJoin(const ShardList& left,
+                                     const ShardList& right, int left_column,
+                                     int right_column,
+                                     OperatorTimer& timer) const;
+
+    // Appends a row to the tail shard, or to the shard of its partition,
+    // logging it to wal first if given
+    bool appendRecord(const std::string& record,
+                      std::optional<size_t> partition, Wal* wal,
+                      uint64_t& lsn);
+
+    std::shared_ptr<Dictionary> dictionary(int column) const;
+    // Replaces values of encoded columns by their codes. Values without a
+    // code are added to the dictionary if add is set, else false is returned.
+    bool encodeValues(std::unordered_map<std::string, std::string>& values,
+                      bool add) const;
+    // Row with the codes of encoded columns replaced by their values
+    void decodeRow(std::string_view line, RecordView& record,
+                   std::string& decoded) const;
 
    public:
     explicit Table(const std::string& name,
                    const std::filesystem::path& base_path = "./database",
                    bool temporary = false);
+    // Table as recorded in the catalog, without touching its directory
+    Table(const std::string& name, const std::filesystem::path& base_path,
+          const std::vector<std::string>& attributes,
+          const std::vector<std::string>& shard_files,
+          const std::map<std::string, KeyRange>& key_ranges = {});
+
+    // Shard lists published with different files are persisted to catalog
+    void attach(Catalog* catalog) { catalog_ = catalog; }
+    std::vector<std::string> attributes() const;
+    std::vector<std::string> shardFiles() const;
+    // Key ranges of the sorted shards of a clustered table, by file name
+    std::map<std::string, KeyRange> keyRanges() const;
+    uint64_t version() const { return version_; }
+
+    // Stores the codes of attr in its shards from now on, with values in a
+    // new dictionary file in the table directory
+    bool encodeColumn(const std::string& attr);
+    // Opens the dictionary of an attribute that is already encoded
+    void loadDictionary(const std::string& attr);
+    std::vector<std::string> encodedAttributes() const;
+    bool encoded(const std::string& attr) const;
+
+    // Builds a B+tree index of attr in the table directory from a sorted
+    // scan, kept up to date by every write from then on
+    bool createIndex(const std::string& attr);
+    // Opens the index of an attribute that is already indexed, rebuilding
+    // it if it was not synced after its last change
+    void openIndex(const std::string& attr);
+    std::vector<std::string> indexedAttributes() const;
+    std::shared_ptr<BTreeIndex> index(const std::string& attr) const;
+    // Index search a read or delete with conditions where uses: one on an
+    // attribute with an equality, else one with a range or a text prefix
+    std::optional<IndexScan> indexScan(
+        const std::vector<Condition>& where) const;
+
+    // Replaces all rows with the rows of source, as one new shard version
+    bool replaceWith(const Table& source);
+
+    // Writes the rows to file in the Arrow IPC file format, with a utf8
+    // column per attribute. Shards are converted to record batches in
+    // parallel and written in table order.
+    bool exportTo(const std::filesystem::path& file) const;
+    // Appends the rows of an Arrow IPC file, its columns matched to
+    // attributes by name, as new shards written in parallel straight from
+    // the columns of its record batches. Attributes without a column are
+    // left empty. Partitioned and clustered tables are not supported.
+    bool importFrom(const ArrowReader& reader);
 
     std::string getName() const;
     std::string tablePath() const;
+    size_t shardCount() const;
+    uintmax_t dataSize() const;
+    uintmax_t storedSize() const;
+
+    bool compressed() const { return compressed_; }
+    void setCompressed(bool compressed) { compressed_ = compressed; }
+
+    const std::optional<Partitioning>& partitioning() const {
+        return partitioning_;
+    }
+    void setPartitioning(std::optional<Partitioning> partitioning) {
+        partitioning_ = std::move(partitioning);
+    }
+    // Whether a join of this_attr with other_attr of other can pair
+    // partition i of both tables only
+    bool coPartitioned(const Table& other, const std::string& this_attr,
+                       const std::string& other_attr) const;
+    // Partition of a row with value of the partitioning attribute. Stored
+    // data depends on it, so it must not change.
+    static size_t partitionOf(std::string_view value, size_t count);
+
+    const std::optional<std::string>& clusterAttribute() const {
+        return cluster_attribute_;
+    }
+    void setClusterAttribute(std::optional<std::string> attribute) {
+        cluster_attribute_ = std::move(attribute);
+    }
+    // Range of the clustering attribute a read with conditions where is
+    // limited to, nothing if the table is not clustered
+    std::optional<KeyBounds> clusterBounds(
+        const std::vector<Condition>& where) const;
+    // Whether order is the order a clustered table returns its rows in
+    bool clusteredOrder(const std::optional<OrderBy>& order) const;
 
     bool deleteByIndex(size_t index);
-    bool deleteByAttributes(
-        const std::unordered_map<std::string, std::string>& attr_values);
+    // Deletes the rows matching all conditions of where, found by batch
+    // scans of the table, or of the rows an index finds if one applies
+    bool deleteWhere(const std::vector<Condition>& where);
 
     std::shared_ptr<Table> join(const Table& other,
                                 const std::string& this_join_attr,
                                 const std::string& other_join_attr);
-    void read(const std::vector<int>& lines);
+    // Prints the rows with the given ids (all if empty) matching all
+    // conditions of where. Reads of clustered tables limited on their
+    // clustering attribute, or ordered by it, search the sorted shards,
+    // other reads with conditions on an indexed attribute its index.
+    void read(const std::vector<int>& lines,
+              const std::vector<Condition>& where = {},
+              const std::optional<OrderBy>& order = std::nullopt);
     bool insert(
         const std::unordered_map<std::string, std::string>& updated_record);
     bool update(size_t id,
                 const std::unordered_map<std::string, std::string>& updates);
+
+    // Makes sure row is stored at offset of shard_file, as logged by an
+    // insert before a crash. applied is set if it had to be written again.
+    bool redoAppend(const std::string& shard_file, uint64_t offset,
+                    std::string_view row, bool& applied);
 };
 
 #endif
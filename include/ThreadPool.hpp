@@ -0,0 +1,47 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/* Fixed-size pool of worker threads consuming a shared FIFO task queue. */
+class ThreadPool {
+   private:
+    std::vector<std::thread> workers_;
+    std::deque<std::function<void()>> tasks_;
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    bool stopping_;
+
+    void workerLoop();
+
+   public:
+    explicit ThreadPool(
+        size_t num_threads = std::thread::hardware_concurrency());
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    size_t size() const;
+
+    void post(std::function<void()> task);
+
+    template <typename F>
+    auto submit(F&& fn) -> std::future<decltype(fn())> {
+        using R = decltype(fn());
+        auto task =
+            std::make_shared<std::packaged_task<R()>>(std::forward<F>(fn));
+        std::future<R> result = task->get_future();
+        post([task]() { (*task)(); });
+        return result;
+    }
+};
+
+#endif
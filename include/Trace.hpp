@@ -0,0 +1,89 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <atomic>
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+/* Opt-in timeline of commands, operators and shard tasks, written as Chrome
+ * trace-event JSON (chrome://tracing, ui.perfetto.dev). Every thread records
+ * complete spans into its own buffer, so recording takes no shared lock;
+ * stop() collects the buffers of all threads and writes the file. While
+ * tracing is off a span costs one relaxed atomic load. */
+class Tracer {
+   public:
+    struct Event {
+        std::string name;
+        const char* category;
+        uint64_t start_ns;
+        uint64_t duration_ns;
+        std::string detail;
+        // Time an operator was running within the span, if it paused
+        std::optional<uint64_t> active_ns;
+    };
+
+    struct ThreadEvents {
+        std::mutex mutex;
+        std::vector<Event> events;
+        uint32_t tid;
+        std::string name;
+    };
+
+   private:
+    static std::atomic<bool> enabled_;
+
+    std::mutex mutex_;
+    std::filesystem::path path_;
+    std::vector<std::shared_ptr<ThreadEvents>> threads_;
+    uint32_t next_tid_ = 1;
+
+    Tracer() = default;
+
+    ThreadEvents& local();
+
+   public:
+    static Tracer& instance();
+
+    static bool enabled() { return enabled_.load(std::memory_order_relaxed); }
+
+    // Nanoseconds on the steady clock, the time base of events
+    static uint64_t now();
+
+    // Starts a new trace to be written to path, false if one is running
+    bool start(const std::filesystem::path& path);
+    // Writes the trace and stops tracing. Returns the number of events
+    // written, nothing if not tracing or the file could not be written
+    std::optional<size_t> stop();
+    const std::filesystem::path& path() const { return path_; }
+
+    void record(Event event);
+    // Names the calling thread's row in the timeline
+    void nameThread(const std::string& name);
+};
+
+/* Records the span from construction to destruction on the calling
+ * thread if tracing was on when it started. The name and detail are only
+ * copied then, so an untraced span allocates nothing. */
+class TraceSpan {
+   private:
+    std::string name_;
+    const char* category_;
+    std::string detail_;
+    uint64_t start_ns_;
+
+   public:
+    TraceSpan(std::string_view name, const char* category,
+              std::string_view detail = {});
+    ~TraceSpan();
+
+    TraceSpan(const TraceSpan&) = delete;
+    TraceSpan& operator=(const TraceSpan&) = delete;
+};
+
+#endif
@@ -0,0 +1,117 @@
+#ifndef WAL_H
+#define WAL_H
+
+#include <condition_variable>
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <set>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+class Dictionary;
+
+// Durability of writes, the wal_mode setting
+enum class WalMode : size_t { None, Group, Sync };
+
+WalMode walMode();
+
+// fsync of a file or directory, counted in lmkdb_fsyncs_total
+bool syncFile(const std::filesystem::path& path);
+bool syncDirectory(const std::filesystem::path& path);
+
+// Renames from to to. Unless wal_mode is none, from is synced first and the
+// directory after, so to survives a crash once this returns.
+bool renameDurably(const std::filesystem::path& from,
+                   const std::filesystem::path& to);
+
+/* Write-ahead log of the rows appended to tail shards. An insert logs its
+ * row with the shard file and offset it goes to before appending it, and
+ * reports success once the log record is on disk: with wal_mode group a
+ * flusher thread syncs the log for all records written since its last sync,
+ * so concurrent writers share one fsync; with sync every record is synced
+ * on its own. Rewrites of shards are not logged, they are synced before
+ * they are renamed into place.
+ *
+ * Replay re-applies every record whose row is not at its offset, so it may
+ * run any number of times. A checkpoint syncs the shard files appended to
+ * and empties the log; it must not run while an insert is between logging
+ * and appending its row.
+ *
+ * Record: <payload length u32><checksum u32><payload>, the payload being
+ * <table>\t<shard file>\t<offset>\t<row>. A torn last record fails its
+ * checksum and ends the log. */
+class Wal {
+   public:
+    static constexpr const char* FILE_NAME = "wal.log";
+
+    struct Append {
+        std::string table;
+        std::string shard_file;
+        uint64_t offset;
+        std::string row;
+    };
+
+    explicit Wal(const std::filesystem::path& db_path);
+    ~Wal();
+
+    // Logs the append of row, without its newline, at offset of shard.
+    // Returns the sequence number to commit(), 0 if wal_mode is none, and
+    // nothing if the record could not be written.
+    std::optional<uint64_t> logAppend(
+        const std::string& table, const std::filesystem::path& shard,
+        uint64_t offset, std::string_view row,
+        const std::vector<std::shared_ptr<Dictionary>>& dictionaries);
+
+    // Returns once record lsn is durable, false if syncing it failed
+    bool commit(uint64_t lsn);
+
+    // Records of the log file at path, up to the first torn one
+    static std::vector<Append> read(const std::filesystem::path& path);
+
+    // Shard file written without logging, by replay; synced at the next
+    // checkpoint
+    void touched(const std::filesystem::path& shard);
+
+    bool checkpoint();
+    // Whether the log outgrew the wal_checkpoint_size setting
+    bool needsCheckpoint() const;
+
+    const std::filesystem::path& path() const { return path_; }
+
+    Wal(const Wal&) = delete;
+    Wal& operator=(const Wal&) = delete;
+
+   private:
+    std::filesystem::path path_;
+    int fd_;
+
+    mutable std::mutex mutex_;
+    std::condition_variable flush_cv_;
+    std::condition_variable durable_cv_;
+    uint64_t written_lsn_ = 0;
+    uint64_t durable_lsn_ = 0;
+    // Records after failed_after_ up to failed_lsn_ failed to sync
+    uint64_t failed_after_ = 0;
+    uint64_t failed_lsn_ = 0;
+    uint64_t size_ = 0;
+    bool stopping_ = false;
+
+    // Shard files appended to since the last checkpoint, and dictionaries
+    // to sync before the log
+    std::set<std::filesystem::path> dirty_;
+    std::set<std::shared_ptr<Dictionary>> dictionaries_;
+
+    std::thread flusher_;
+
+    void flush();
+    // Syncs the dictionaries and the log up to written_lsn_, with mutex_
+    // held by lock; unlocks it while syncing if unlock is set
+    bool sync(std::unique_lock<std::mutex>& lock, bool unlock);
+};
+
+#endif
@@ -1,9 +1,30 @@
 #ifndef UTILS_H
 #define UTILS_H
 
+#include <ostream>
+
 #define BOLD "\033[1m"
 #define RESET "\033[0m"
 
 void printUsage();
 
+/* Streams that command output is written to. Default to std::cout/std::cerr,
+ * but can be redirected per thread so that server sessions can capture the
+ * output of the command they are running. */
+std::ostream& outStream();
+std::ostream& errStream();
+
+class OutputRedirect {
+   public:
+    OutputRedirect(std::ostream& out, std::ostream& err);
+    ~OutputRedirect();
+
+    OutputRedirect(const OutputRedirect&) = delete;
+    OutputRedirect& operator=(const OutputRedirect&) = delete;
+
+   private:
+    std::ostream* prev_out_;
+    std::ostream* prev_err_;
+};
+
 #endif
@@ -1,28 +1,222 @@
 #ifndef WORKER_H
 #define WORKER_H
 
-#include <map>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <memory>
 #include <mutex>
+#include <optional>
+#include <span>
 #include <string>
+#include <string_view>
 #include <unordered_map>
 #include <vector>
+#include "Arena.hpp"
+#include "Dictionary.hpp"
+#include "Memory.hpp"
+#include "Record.hpp"
+#include "Shard.hpp"
+
+/* Join columns of both sides and how their keys compare. A dictionary
+ * encoded side stores codes; if both sides are encoded the join runs on the
+ * codes, with right codes translated to left codes once per join, otherwise
+ * codes are decoded to strings. */
+struct JoinKeys {
+    int left_column;
+    int right_column;
+    std::shared_ptr<Dictionary> left_dictionary;   // Null if not encoded
+    std::shared_ptr<Dictionary> right_dictionary;  // Null if not encoded
+
+    // Left code of every right code, Dictionary::MAX_CODES if the value is
+    // not in the left dictionary. Empty if both sides share a dictionary.
+    std::vector<uint32_t> right_to_left;
+
+    bool integer() const { return left_dictionary && right_dictionary; }
+};
+
+// Hash of a join key, the same on the build and the probe side
+inline uint32_t joinHash(uint32_t code) {
+    code ^= code >> 16;
+    code *= 0x85ebca6bu;
+    code ^= code >> 13;
+    code *= 0xc2b2ae35u;
+    return code ^ (code >> 16);
+}
+
+inline uint32_t joinHash(std::string_view key) {
+    uint64_t hash = 0x9e3779b97f4a7c15ull ^ key.size();
+    size_t i = 0;
+    for (; i + 8 <= key.size(); i += 8) {
+        uint64_t word;
+        std::memcpy(&word, key.data() + i, 8);
+        hash = (hash ^ word) * 0xff51afd7ed558ccdull;
+        hash ^= hash >> 32;
+    }
+    uint64_t tail = 0;
+    std::memcpy(&tail, key.data() + i, key.size() - i);
+    hash = (hash ^ tail) * 0xff51afd7ed558ccdull;
+    hash ^= hash >> 29;
+    return static_cast<uint32_t>(hash ^ (hash >> 32));
+}
+
+/* Hash table of the batched join probe: open addressing over the distinct
+ * build keys, each slot holding its key, hash and the range of its rows in
+ * one offsets array. Duplicate keys cost one slot, so a skewed build side
+ * does not grow probe sequences, and a probe is a prefetchable slot load
+ * followed by a sequential read of offsets. Keys must outlive the table. */
+template <typename Key>
+class JoinTable {
+   public:
+    // Builds the table from the key and offset of every build row
+    void build(const std::vector<Key>& keys,
+               const std::vector<uint64_t>& offsets) {
+        std::vector<uint32_t> hashes(keys.size());
+        for (size_t i = 0; i < keys.size(); ++i) {
+            hashes[i] = joinHash(keys[i]);
+        }
+
+        // Until the rows are placed, slots hold the index of their key in
+        // order of first appearance instead of the start of their rows
+        slots_.assign(1024, Slot{});
+        mask_ = slots_.size() - 1;
+        std::vector<uint32_t> group_of(keys.size());
+        uint32_t groups = 0;
+        for (size_t i = 0; i < keys.size(); ++i) {
+            Slot& slot = insert(hashes[i], keys[i]);
+            if (slot.count++ == 0) slot.begin = groups++;
+            group_of[i] = slot.begin;
+            if (size_t(groups) * 2 > slots_.size()) grow();
+        }
+
+        std::vector<uint32_t> next(groups);
+        uint32_t start = 0;
+        for (Slot& slot : slots_) {
+            if (slot.count == 0) continue;
+            next[slot.begin] = start;
+            slot.begin = start;
+            start += slot.count;
+        }
+        offsets_.resize(keys.size());
+        for (size_t i = 0; i < keys.size(); ++i) {
+            offsets_[next[group_of[i]]++] = offsets[i];
+        }
+    }
+
+    void prefetch(uint32_t hash) const {
+        __builtin_prefetch(&slots_[hash & mask_]);
+    }
+
+    // Offsets of the build rows with key, empty if there are none
+    std::span<const uint64_t> rows(uint32_t hash, const Key& key) const {
+        const Slot* slot = slotOf(hash, key);
+        if (!slot) return {};
+        return {offsets_.data() + slot->begin, slot->count};
+    }
+
+    size_t memory() const {
+        return slots_.capacity() * sizeof(Slot) +
+               offsets_.capacity() * sizeof(uint64_t);
+    }
+
+    // Upper bound of what building from rows keys takes, temporaries and
+    // the slots held while growing included
+    static size_t buildMemory(size_t rows) {
+        size_t slots = 1024;
+        while (slots < rows * 2) slots *= 2;
+        return slots * sizeof(Slot) * 3 / 2 +
+               rows * (sizeof(uint64_t) + 3 * sizeof(uint32_t));
+    }
+
+   private:
+    struct Slot {
+        uint32_t hash;
+        uint32_t count;  // 0 for an empty slot
+        uint32_t begin;  // First row in offsets_
+        Key key;
+    };
+
+    std::vector<Slot> slots_;
+    size_t mask_ = 0;
+    std::vector<uint64_t> offsets_;
+
+    const Slot* slotOf(uint32_t hash, const Key& key) const {
+        for (size_t i = hash & mask_;; i = (i + 1) & mask_) {
+            const Slot& slot = slots_[i];
+            if (slot.count == 0) return nullptr;
+            if (slot.hash == hash && slot.key == key) return &slot;
+        }
+    }
+
+    // Slot of key, empty if it is not in the table yet
+    Slot& insert(uint32_t hash, const Key& key) {
+        for (size_t i = hash & mask_;; i = (i + 1) & mask_) {
+            Slot& slot = slots_[i];
+            if (slot.count == 0) {
+                slot.hash = hash;
+                slot.key = key;
+                return slot;
+            }
+            if (slot.hash == hash && slot.key == key) return slot;
+        }
+    }
+
+    void grow() {
+        std::vector<Slot> old(slots_.size() * 2);
+        old.swap(slots_);
+        mask_ = slots_.size() - 1;
+        for (const Slot& slot : old) {
+            if (slot.count) insert(slot.hash, slot.key) = slot;
+        }
+    }
+};
 
 class JoinWorker {
    private:
     std::string output_path;
-    int join_attr_pos;
     std::mutex output_mutex;
+    std::string error_;
+
+    // Join key to offset of the row in the build shard. Keys and nodes
+    // live in the arena of the join task.
+    template <typename Key>
+    using HashTable = std::unordered_multimap<
+        Key, uint64_t, std::hash<Key>, std::equal_to<Key>,
+        ArenaAllocator<std::pair<const Key, uint64_t>>>;
 
-    // Build hash table from single shard
-    std::multimap<std::string, std::pair<std::string, std::streampos>>
-    buildHashTable(const std::string& shard_path, int attr_pos);
+    // Build hash table from single shard, keyed by key_of(field of column),
+    // rows without a key are skipped. Empty if the arena outgrew what
+    // memory could reserve.
+    template <typename Key, typename KeyOf>
+    std::optional<HashTable<Key>> buildHashTable(const Shard& shard,
+                                                 int column, KeyOf&& key_of,
+                                                 Arena& arena,
+                                                 MemoryReservation& memory);
+
+    // Keys are build_key and probe_key of the join column fields of either
+    // side
+    template <typename Key, typename BuildKey, typename ProbeKey>
+    bool hashJoin(const Shard& shard_A, const ShardList& all_shards_B,
+                  const JoinKeys& keys, BuildKey&& build_key,
+                  ProbeKey&& probe_key);
+
+    // Scans both sides in column batches of batch_size rows and probes a
+    // JoinTable a batch at a time: keys are hashed in one loop, their slots
+    // prefetched in a second and matched in a third, and the matches are
+    // written with one locked write per batch
+    template <typename Key, typename BuildKey, typename ProbeKey>
+    bool batchedHashJoin(const Shard& shard_A, const ShardList& all_shards_B,
+                         const JoinKeys& keys, BuildKey&& build_key,
+                         ProbeKey&& probe_key, size_t batch_size);
 
    public:
     JoinWorker(const std::string& output_file) : output_path(output_file) {}
 
-    bool processShardBatch(const std::string& shard_A,
-                           const std::vector<std::string>& all_shards_B,
-                           int attr_pos_A, int attr_pos_B);
+    bool processShardBatch(const Shard& shard_A, const ShardList& all_shards_B,
+                           const JoinKeys& keys);
+
+    // Why processShardBatch failed
+    const std::string& error() const { return error_; }
 };
 
 #endif
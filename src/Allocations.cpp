@@ -0,0 +1,64 @@
+#include <cstdlib>
+#include <new>
+#include "Profile.hpp"
+
+/* Global operator new and delete, replaced to count heap allocations per
+ * thread for explain analyze. Every form that ASan or the standard library
+ * would otherwise provide is replaced, so allocation and deallocation always
+ * pair up. Aligned forms keep their default implementation and are not
+ * counted. */
+
+namespace {
+thread_local uint64_t thread_allocations = 0;
+
+void* countedAlloc(std::size_t size) {
+    thread_allocations++;
+    return std::malloc(size ? size : 1);
+}
+}  // namespace
+
+uint64_t threadAllocations() {
+    return thread_allocations;
+}
+
+void* operator new(std::size_t size) {
+    if (void* p = countedAlloc(size)) return p;
+    throw std::bad_alloc();
+}
+
+void* operator new[](std::size_t size) {
+    if (void* p = countedAlloc(size)) return p;
+    throw std::bad_alloc();
+}
+
+void* operator new(std::size_t size, const std::nothrow_t&) noexcept {
+    return countedAlloc(size);
+}
+
+void* operator new[](std::size_t size, const std::nothrow_t&) noexcept {
+    return countedAlloc(size);
+}
+
+void operator delete(void* p) noexcept {
+    std::free(p);
+}
+
+void operator delete[](void* p) noexcept {
+    std::free(p);
+}
+
+void operator delete(void* p, std::size_t) noexcept {
+    std::free(p);
+}
+
+void operator delete[](void* p, std::size_t) noexcept {
+    std::free(p);
+}
+
+void operator delete(void* p, const std::nothrow_t&) noexcept {
+    std::free(p);
+}
+
+void operator delete[](void* p, const std::nothrow_t&) noexcept {
+    std::free(p);
+}
@@ -1,10 +1,29 @@
 #include "Api.hpp"
+#include <algorithm>
 #include <iostream>
 #include <memory>
+#include <string_view>
 #include <unordered_map>
+#include "utils.hpp"
 
 using namespace std;
 
+namespace {
+// Joins of partitioned tables run one thread per partition
+constexpr int MAX_PARTITIONS = 1024;
+
+// Splits "<key><sep><value>" into views of token, false if sep is missing
+bool splitToken(string_view token, char sep, string_view &key,
+                string_view &value) {
+    size_t pos = token.find(sep);
+    if (pos == string_view::npos) return false;
+
+    key = token.substr(0, pos);
+    value = token.substr(pos + 1);
+    return true;
+}
+}  // namespace
+
 DatabaseAPI::DatabaseAPI(const string &dbPath)
     : dbManager(make_unique<DBManager>(dbPath)) {}
 
@@ -21,19 +40,98 @@ bool DatabaseAPI::validateInteger(const string &input) {
     }
 }
 
+// Removes a trailing "order by <attr> [asc|desc] [limit <k>]" clause from
+// tokens. Returns false if the clause is malformed.
+bool DatabaseAPI::extractOrderBy(vector<string> &tokens,
+                                 optional<OrderBy> &order) {
+    auto it = ranges::find(tokens, "order");
+    if (it == tokens.end()) return true;
+
+    vector<string> clause(it, tokens.end());
+    tokens.erase(it, tokens.end());
+
+    if (clause.size() < 3 || clause[1] != "by") {
+        errStream() << "Error: expected order by <attr> [asc|desc] [limit <k>]"
+                    << endl;
+        return false;
+    }
+
+    OrderBy result{
+        .attribute = clause[2], .descending = false, .limit = nullopt};
+    size_t i = 3;
+
+    if (i < clause.size() && (clause[i] == "asc" || clause[i] == "desc")) {
+        result.descending = clause[i] == "desc";
+        i++;
+    }
+
+    if (i + 1 < clause.size() && clause[i] == "limit") {
+        if (!validateInteger(clause[i + 1]) || stoi(clause[i + 1]) < 0) {
+            errStream() << "Error: limit must be a non-negative integer."
+                        << endl;
+            return false;
+        }
+        result.limit = stoi(clause[i + 1]);
+        i += 2;
+    }
+
+    if (i != clause.size()) {
+        errStream() << "Error: unexpected token in order by: " << clause[i]
+                    << endl;
+        return false;
+    }
+
+    order = result;
+    return true;
+}
+
 void DatabaseAPI::createOp(const string &tableName,
-                           const vector<string> &attributes) {
+                           const vector<string> &tokens) {
+    // A trailing "with compression" stores the table in compressed shards
+    vector<string> attributes = tokens;
+    bool compressed = attributes.size() >= 2 &&
+                      attributes[attributes.size() - 2] == "with" &&
+                      attributes.back() == "compression";
+    if (compressed) attributes.resize(attributes.size() - 2);
+
+    // "cluster by <attr>" keeps its rows sorted on attr
+    optional<string> cluster_attribute;
+    size_t n = attributes.size();
+    if (n >= 3 && attributes[n - 3] == "cluster" && attributes[n - 2] == "by") {
+        cluster_attribute = attributes.back();
+        attributes.resize(n - 3);
+    }
+
+    // "partition by <attr> into <n>" hash partitions it
+    optional<Partitioning> partitioning;
+    n = attributes.size();
+    if (n >= 5 && attributes[n - 5] == "partition" &&
+        attributes[n - 4] == "by" && attributes[n - 2] == "into") {
+        if (!validateInteger(attributes[n - 1]) ||
+            stoi(attributes[n - 1]) < 1 ||
+            stoi(attributes[n - 1]) > MAX_PARTITIONS) {
+            errStream() << "Error: partition count must be between 1 and "
+                        << MAX_PARTITIONS << endl;
+            return;
+        }
+        partitioning = Partitioning{attributes[n - 3],
+                                    static_cast<size_t>(
+                                        stoi(attributes[n - 1]))};
+        attributes.resize(n - 5);
+    }
+
     for (const auto &attr : attributes) {
         if (attr == "id") {
-            cout << " id attribute name not allowed" << endl;
+            outStream() << " id attribute name not allowed" << endl;
             return;
         }
     }
 
-    if (dbManager->createTable(tableName, attributes)) {
-        cout << "Table created: " << tableName << endl;
+    if (dbManager->createTable(tableName, attributes, compressed,
+                               partitioning, cluster_attribute)) {
+        outStream() << "Table created: " << tableName << endl;
     } else {
-        cout << "Failed to create table: " << tableName << endl;
+        outStream() << "Failed to create table: " << tableName << endl;
     }
 }
 
@@ -41,31 +139,30 @@ void DatabaseAPI::deleteOp(const string &tableName,
                            const vector<string> &tokens) {
     if (tokens.empty()) {
         if (dbManager->deleteTable(tableName)) {
-            cout << "Table " << tableName << " deleted successfully." << endl;
+            outStream() << "Table " << tableName << " deleted successfully."
+                        << endl;
         } else {
-            cerr << "Failed to delete table: " << tableName << endl;
+            errStream() << "Failed to delete table: " << tableName << endl;
         }
         return;
     }
     // Case 1: delete table_name id:2 attr1 attr2 ...
     if (tokens.size() > 1 && tokens[0].starts_with("id:")) {
-        size_t pos = tokens[0].find(':');
-        if (pos == string::npos || tokens[0].substr(pos + 1).empty()) {
-            cerr << "Error: Invalid format." << endl;
+        string_view key, id;
+        if (!splitToken(tokens[0], ':', key, id) || id.empty()) {
+            errStream() << "Error: Invalid format." << endl;
             return;
         }
 
-        string idValue = tokens[0].substr(pos + 1);
+        string idValue(id);
         if (!validateInteger(idValue)) {
-            cerr << "Error: id must be a valid integer." << endl;
+            errStream() << "Error: id must be a valid integer." << endl;
             return;
         }
 
-        vector<string> attributes(tokens.begin() + 1, tokens.end());
         unordered_map<string, string> attrMap;
-
-        for (const auto &attr : attributes) {
-            attrMap[attr] = "NULL";
+        for (auto it = tokens.begin() + 1; it != tokens.end(); ++it) {
+            attrMap[*it] = "NULL";
         }
 
         dbManager->updateRecord(tableName, stoi(idValue), attrMap);
@@ -74,15 +171,15 @@ void DatabaseAPI::deleteOp(const string &tableName,
 
     // Case 2: delete table_name id:2
     if (tokens.size() == 1 && tokens[0].starts_with("id:")) {
-        size_t pos = tokens[0].find(':');
-        if (pos == string::npos || tokens[0].substr(pos + 1).empty()) {
-            cerr << "Error: Invalid format." << endl;
+        string_view key, id;
+        if (!splitToken(tokens[0], ':', key, id) || id.empty()) {
+            errStream() << "Error: Invalid format." << endl;
             return;
         }
 
-        string idValue = tokens[0].substr(pos + 1);
+        string idValue(id);
         if (!validateInteger(idValue)) {
-            cerr << "Error: id must be a valid integer." << endl;
+            errStream() << "Error: id must be a valid integer." << endl;
             return;
         }
 
@@ -90,23 +187,18 @@ void DatabaseAPI::deleteOp(const string &tableName,
         return;
     }
 
-    // Case 3: delete table_name attr1:val1 attr2:val2
-    unordered_map<string, string> attrMap;
+    // Case 3: delete table_name attr1:val1 attr2>val2 attr3:prefix*
+    vector<Condition> where;
     for (const auto &token : tokens) {
-        size_t pos = token.find(':');
-        if (pos == string::npos || token.substr(0, pos).empty() ||
-            token.substr(pos + 1).empty()) {
-            cerr << "Error: Invalid attribute-value pair format: " << token
-                 << endl;
+        Condition condition;
+        if (!parseCondition(token, condition) || condition.value.empty()) {
+            errStream() << "Error: Invalid condition: " << token << endl;
             return;
         }
-
-        string key = token.substr(0, pos);
-        string value = token.substr(pos + 1);
-        attrMap[key] = value;
+        where.push_back(std::move(condition));
     }
 
-    dbManager->deleteByAttributes(tableName, attrMap);
+    dbManager->deleteWhere(tableName, where);
 }
 
 void DatabaseAPI::insertOp(const string &tableName,
@@ -114,51 +206,56 @@ void DatabaseAPI::insertOp(const string &tableName,
     unordered_map<string, string> mp;
 
     for (const auto &token : tokens) {
-        size_t pos = token.find(':');
-
-        if (pos != string::npos) {
-            string key = token.substr(0, pos);
-            string value = token.substr(pos + 1);
+        string_view key, value;
 
-            mp[key] = value;
+        if (splitToken(token, ':', key, value)) {
+            mp[string(key)] = value;
         } else {
-            cerr << "Invalid token: " << token << endl;
+            errStream() << "Invalid token: " << token << endl;
             return;
         }
     }
 
     if (dbManager->insertRecord(tableName, mp)) {
-        cout << "Inserted into table: " << tableName << endl;
+        outStream() << "Inserted into table: " << tableName << endl;
     } else {
-        cout << "Failed to insert into table: " << tableName << endl;
+        outStream() << "Failed to insert into table: " << tableName << endl;
     }
 }
 
 void DatabaseAPI::readOp(const string &tableName,
-                         const vector<string> &tokens) {
+                         const vector<string> &query) {
     vector<int> line_numbers{};
+    vector<Condition> where;
+    vector<string> tokens = query;
+    optional<OrderBy> order;
+
+    if (!extractOrderBy(tokens, order)) return;
 
     for (const auto &token : tokens) {
         if (token.starts_with("id:")) {
-            size_t pos = token.find(':');
-            if (pos == string::npos || token.substr(pos + 1).empty()) {
-                cerr << "Error: Invalid index format." << endl;
+            string idValue = token.substr(3);
+            if (idValue.empty()) {
+                errStream() << "Error: Invalid index format." << endl;
                 return;
             }
 
-            string idValue = token.substr(pos + 1);
-
             if (!validateInteger(idValue)) {
-                cerr << "Error: id must be a valid integer." << endl;
+                errStream() << "Error: id must be a valid integer." << endl;
                 return;
             }
 
             int id = stoi(idValue);
             line_numbers.push_back(id);
+        } else if (Condition condition; parseCondition(token, condition)) {
+            where.push_back(std::move(condition));
+        } else {
+            errStream() << "Error: Invalid condition: " << token << endl;
+            return;
         }
     }
 
-    dbManager->readTable(tableName, line_numbers);
+    dbManager->readTable(tableName, line_numbers, where, order);
 }
 
 void DatabaseAPI::updateOp(const string &tableName, size_t recordId,
@@ -166,44 +263,110 @@ void DatabaseAPI::updateOp(const string &tableName, size_t recordId,
     unordered_map<string, string> mp;
 
     for (const auto &token : updatedRecord) {
-        size_t pos = token.find(':');
+        string_view key, value;
 
-        if (pos != string::npos) {
-            string key = token.substr(0, pos);
-            string value = token.substr(pos + 1);
-
-            mp[key] = value;
+        if (splitToken(token, ':', key, value)) {
+            mp[string(key)] = value;
         } else {
-            cerr << "Invalid token: " << token << endl;
+            errStream() << "Invalid token: " << token << endl;
             return;
         }
     }
 
     if (dbManager->updateRecord(tableName, recordId, mp)) {
-        cout << "Record updated in table: " << tableName << endl;
+        outStream() << "Record updated in table: " << tableName << endl;
     } else {
-        cout << "Failed to update record in table: " << tableName << endl;
+        outStream() << "Failed to update record in table: " << tableName
+                    << endl;
     }
 }
 
+// Splits "<table>.<attr>" join tokens. Returns false on a malformed token.
+bool DatabaseAPI::parseJoin(const vector<string> &tokens,
+                            vector<string> &tables,
+                            unordered_map<string, string> &attrMap) {
+    for (const auto &token : tokens) {
+        string_view table, attr;
+
+        if (splitToken(token, '.', table, attr)) {
+            attrMap[string(table)] = attr;
+            tables.emplace_back(table);
+        } else {
+            errStream() << "Invalid token: " << token << endl;
+            return false;
+        }
+    }
+    return true;
+}
+
 void DatabaseAPI::joinOp(const vector<string> &query) {
     unordered_map<string, string> attrMap;
     vector<string> tables;
+    vector<string> tokens = query;
+    optional<OrderBy> order;
+
+    if (!extractOrderBy(tokens, order)) return;
+    if (!parseJoin(tokens, tables, attrMap)) return;
 
-    for (const auto &token : query) {
-        size_t pos = token.find('.');
+    dbManager->joinTables(tables, attrMap, order);
+}
 
-        if (pos != string::npos) {
-            string key = token.substr(0, pos);
-            string value = token.substr(pos + 1);
+void DatabaseAPI::encodeOp(const string &tableName, const string &attr) {
+    if (dbManager->encodeAttribute(tableName, attr)) {
+        outStream() << "Attribute " << attr << " of table " << tableName
+                    << " is dictionary encoded" << endl;
+    } else {
+        outStream() << "Failed to encode attribute " << attr << " of table "
+                    << tableName << endl;
+    }
+}
 
-            attrMap[key] = value;
-            tables.push_back(key);
-        } else {
-            cerr << "Invalid token: " << token << endl;
-            return;
-        }
+void DatabaseAPI::createIndexOp(const string &tableName, const string &attr,
+                                const string &kind) {
+    if (kind != "btree") {
+        errStream() << "Error: Unknown index type: " << kind << endl;
+        return;
     }
 
-    dbManager->joinTables(tables, attrMap);
+    if (dbManager->createIndex(tableName, attr)) {
+        outStream() << "Index created on " << attr << " of table " << tableName
+                    << endl;
+    } else {
+        outStream() << "Failed to create index on " << attr << " of table "
+                    << tableName << endl;
+    }
+}
+
+void DatabaseAPI::exportOp(const string &tableName, const string &file) {
+    if (dbManager->exportTable(tableName, file)) {
+        outStream() << "Table " << tableName << " exported to " << file
+                    << endl;
+    } else {
+        outStream() << "Failed to export table " << tableName << endl;
+    }
+}
+
+void DatabaseAPI::importOp(const string &tableName, const string &file) {
+    if (dbManager->importTable(tableName, file)) {
+        outStream() << "Imported " << file << " into table " << tableName
+                    << endl;
+    } else {
+        outStream() << "Failed to import " << file << " into table "
+                    << tableName << endl;
+    }
+}
+
+void DatabaseAPI::createMaterializedOp(const string &name,
+                                       const vector<string> &query) {
+    unordered_map<string, string> attrMap;
+    vector<string> tables;
+
+    if (!parseJoin(query, tables, attrMap)) return;
+
+    if (dbManager->createMaterialized(name, tables, attrMap)) {
+        outStream() << "Materialized view created: " << name << endl;
+    } else {
+        outStream() << "Failed to create materialized view: " << name
+                    << endl;
+    }
 }
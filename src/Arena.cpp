@@ -0,0 +1,48 @@
+#include "Arena.hpp"
+#include <cstdint>
+#include <cstring>
+
+using namespace std;
+
+void* Arena::allocate(size_t size, size_t align) {
+    auto aligned = [align](char* p) {
+        auto address = reinterpret_cast<uintptr_t>(p);
+        return reinterpret_cast<char*>((address + align - 1) & ~(align - 1));
+    };
+
+    char* start = cursor_ ? aligned(cursor_) : nullptr;
+    if (!start || start + size > end_) {
+        // Large requests get a block of their own instead of wasting the
+        // rest of the current one
+        size_t block_size = max(BLOCK_SIZE, size + align);
+        char* block = new char[block_size];
+        blocks_.push_back({unique_ptr<char[]>(block), block_size});
+        reserved_ += block_size;
+
+        start = aligned(block);
+        if (size + align > BLOCK_SIZE / 4 && cursor_) {
+            return start;
+        }
+        end_ = block + block_size;
+    }
+
+    cursor_ = start + size;
+    return start;
+}
+
+string_view Arena::copy(string_view value) {
+    if (value.empty()) return {};
+
+    char* data = static_cast<char*>(allocate(value.size(), 1));
+    memcpy(data, value.data(), value.size());
+    return {data, value.size()};
+}
+
+void Arena::reset() {
+    if (blocks_.empty()) return;
+
+    blocks_.resize(1);
+    reserved_ = blocks_.front().size;
+    cursor_ = blocks_.front().data.get();
+    end_ = cursor_ + reserved_;
+}
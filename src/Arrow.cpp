@@ -0,0 +1,574 @@
+#include "Arrow.hpp"
+#include <algorithm>
+#include <cstring>
+#include <numeric>
+#include <stdexcept>
+
+using namespace std;
+namespace fs = std::filesystem;
+
+namespace {
+
+constexpr string_view MAGIC("ARROW1", 6);
+constexpr uint32_t CONTINUATION = 0xFFFFFFFF;
+constexpr int16_t METADATA_V5 = 4;
+
+// Members of the MessageHeader and Type unions
+constexpr uint8_t HEADER_SCHEMA = 1;
+constexpr uint8_t HEADER_RECORD_BATCH = 3;
+constexpr uint8_t TYPE_BINARY = 4;
+constexpr uint8_t TYPE_UTF8 = 5;
+constexpr uint8_t TYPE_LARGE_BINARY = 19;
+constexpr uint8_t TYPE_LARGE_UTF8 = 20;
+
+size_t padded(size_t size) { return (size + 7) & ~size_t(7); }
+
+// Little endian, like every host lmkdb runs on
+template <typename T>
+void put(string& out, T value) {
+    out.append(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+template <typename T>
+T get(string_view buffer, size_t at) {
+    if (at > buffer.size() || buffer.size() - at < sizeof(T)) {
+        throw runtime_error("truncated metadata");
+    }
+    T value;
+    memcpy(&value, buffer.data() + at, sizeof(T));
+    return value;
+}
+
+/* Flatbuffer written front to back, which the fixed shapes of Arrow
+ * metadata allow: a table is written after its vtable, and the objects it
+ * refers to after it, their offsets patched into its fields once they are
+ * written. Scalars are aligned to their size, vectors of structs to 8. */
+class FlatBuilder {
+   public:
+    // Scalar of size bytes, or with size 4 an offset patched later
+    struct Field {
+        int slot;
+        uint8_t size;
+        uint64_t value = 0;
+    };
+
+    FlatBuilder() : buf_(4, '\0') {}
+
+    // Writes a table and returns its position; at[i] is the position of
+    // fields[i]
+    size_t table(const vector<Field>& fields, vector<size_t>& at) {
+        // Larger fields first, so that no padding is needed between them
+        vector<size_t> order(fields.size());
+        iota(order.begin(), order.end(), 0);
+        ranges::stable_sort(order, greater<>(),
+                            [&](size_t i) { return fields[i].size; });
+
+        vector<uint16_t> offsets(fields.size());
+        size_t size = 4;
+        int slots = 0;
+        for (size_t i : order) {
+            size_t align = fields[i].size;
+            size = (size + align - 1) / align * align;
+            offsets[i] = static_cast<uint16_t>(size);
+            size += fields[i].size;
+            slots = max(slots, fields[i].slot + 1);
+        }
+
+        vector<uint16_t> vtable(2 + slots, 0);
+        vtable[0] = static_cast<uint16_t>(vtable.size() * 2);
+        vtable[1] = static_cast<uint16_t>(size);
+        for (size_t i = 0; i < fields.size(); ++i) {
+            vtable[2 + fields[i].slot] = offsets[i];
+        }
+
+        align(2);
+        size_t vtable_pos = buf_.size();
+        for (uint16_t entry : vtable) put(buf_, entry);
+
+        align(8);
+        size_t table_pos = buf_.size();
+        put(buf_, static_cast<int32_t>(table_pos - vtable_pos));
+        buf_.resize(table_pos + size, '\0');
+
+        at.resize(fields.size());
+        for (size_t i = 0; i < fields.size(); ++i) {
+            at[i] = table_pos + offsets[i];
+            memcpy(&buf_[at[i]], &fields[i].value, fields[i].size);
+        }
+        return table_pos;
+    }
+
+    size_t string(string_view value) {
+        align(4);
+        size_t pos = buf_.size();
+        put(buf_, static_cast<uint32_t>(value.size()));
+        buf_ += value;
+        buf_ += '\0';
+        return pos;
+    }
+
+    // Vector of count structs stored in bytes
+    size_t structs(string_view bytes, size_t count) {
+        while ((buf_.size() + 4) % 8) buf_ += '\0';
+        size_t pos = buf_.size();
+        put(buf_, static_cast<uint32_t>(count));
+        buf_ += bytes;
+        return pos;
+    }
+
+    // Vector of count offsets, element i at position + 4 + 4i
+    size_t offsets(size_t count) {
+        align(4);
+        size_t pos = buf_.size();
+        put(buf_, static_cast<uint32_t>(count));
+        buf_.resize(buf_.size() + 4 * count, '\0');
+        return pos;
+    }
+
+    void patch(size_t at, size_t target) {
+        auto offset = static_cast<uint32_t>(target - at);
+        memcpy(&buf_[at], &offset, sizeof(offset));
+    }
+
+    // The buffer with root as its root table, padded to 8 bytes
+    std::string finish(size_t root) {
+        patch(0, root);
+        align(8);
+        return std::move(buf_);
+    }
+
+   private:
+    std::string buf_;
+
+    void align(size_t n) { buf_.resize((buf_.size() + n - 1) / n * n, '\0'); }
+};
+
+// Table of a flatbuffer being read, every access checked against its bounds
+class FlatTable {
+   public:
+    FlatTable(string_view buffer, size_t pos) : buffer_(buffer), pos_(pos) {}
+
+    static FlatTable root(string_view buffer) {
+        return FlatTable(buffer, get<uint32_t>(buffer, 0));
+    }
+
+    bool has(int slot) const { return field(slot) != 0; }
+
+    template <typename T>
+    T scalar(int slot, T fallback = 0) const {
+        size_t at = field(slot);
+        return at ? get<T>(buffer_, at) : fallback;
+    }
+
+    FlatTable table(int slot) const { return FlatTable(buffer_, target(slot)); }
+
+    string_view string(int slot) const {
+        size_t at = target(slot);
+        size_t size = get<uint32_t>(buffer_, at);
+        if (buffer_.size() - at - 4 < size) {
+            throw runtime_error("truncated string");
+        }
+        return buffer_.substr(at + 4, size);
+    }
+
+    // Position of the first element of a vector and its size, nothing if
+    // it is missing
+    pair<size_t, size_t> vector(int slot) const {
+        if (!has(slot)) return {0, 0};
+        size_t at = target(slot);
+        return {at + 4, get<uint32_t>(buffer_, at)};
+    }
+
+    // Table element i of a vector starting at first
+    FlatTable element(size_t first, size_t i) const {
+        size_t at = first + 4 * i;
+        return FlatTable(buffer_, at + get<uint32_t>(buffer_, at));
+    }
+
+   private:
+    string_view buffer_;
+    size_t pos_;
+
+    // Position of the field in slot, 0 if it is not set
+    size_t field(int slot) const {
+        int64_t vtable = int64_t(pos_) - get<int32_t>(buffer_, pos_);
+        if (vtable < 0) throw runtime_error("invalid vtable");
+        size_t size = get<uint16_t>(buffer_, vtable);
+        if (size_t(4 + 2 * slot + 2) > size) return 0;
+        uint16_t offset = get<uint16_t>(buffer_, vtable + 4 + 2 * slot);
+        return offset ? pos_ + offset : 0;
+    }
+
+    size_t target(int slot) const {
+        size_t at = field(slot);
+        if (!at) throw runtime_error("missing field");
+        return at + get<uint32_t>(buffer_, at);
+    }
+};
+
+// Message table of the given header type, at[2] being its header offset
+size_t writeMessage(FlatBuilder& builder, uint8_t header,
+                    int64_t body_length, vector<size_t>& at) {
+    return builder.table({{0, 2, uint64_t(METADATA_V5)},
+                          {1, 1, header},
+                          {2, 4},
+                          {3, 8, uint64_t(body_length)}},
+                         at);
+}
+
+// Schema table of nullable utf8 fields
+size_t writeSchema(FlatBuilder& builder, const vector<string>& fields) {
+    vector<size_t> at;
+    size_t schema = builder.table({{0, 2}, {1, 4}}, at);
+    size_t list = builder.offsets(fields.size());
+    builder.patch(at[1], list);
+
+    for (size_t i = 0; i < fields.size(); ++i) {
+        size_t field = builder.table(
+            {{0, 4}, {1, 1, 1}, {2, 1, TYPE_UTF8}, {3, 4}, {5, 4}}, at);
+        builder.patch(list + 4 + 4 * i, field);
+
+        vector<size_t> field_at = at;
+        builder.patch(field_at[0], builder.string(fields[i]));
+        builder.patch(field_at[3], builder.table({}, at));
+        builder.patch(field_at[4], builder.offsets(0));
+    }
+    return schema;
+}
+
+// Message with its continuation marker and length, followed by body
+ArrowMessage encapsulate(const string& metadata, string_view body) {
+    ArrowMessage message;
+    put(message.bytes, CONTINUATION);
+    put(message.bytes, static_cast<int32_t>(metadata.size()));
+    message.bytes += metadata;
+    message.bytes += body;
+    message.metadata_length = static_cast<int32_t>(8 + metadata.size());
+    message.body_length = static_cast<int64_t>(body.size());
+    return message;
+}
+
+}  // namespace
+
+ArrowBatchBuilder::ArrowBatchBuilder(size_t columns) : columns_(columns) {}
+
+void ArrowBatchBuilder::add(const vector<string_view>& row) {
+    for (size_t i = 0; i < columns_.size(); ++i) {
+        Column& column = columns_[i];
+        if (i < row.size()) column.data += row[i];
+        column.offsets.push_back(static_cast<int32_t>(column.data.size()));
+    }
+    rows_++;
+}
+
+size_t ArrowBatchBuilder::bytes() const {
+    size_t bytes = 0;
+    for (const auto& column : columns_) {
+        bytes += padded(column.offsets.size() * sizeof(int32_t)) +
+                 padded(column.data.size());
+    }
+    return bytes;
+}
+
+ArrowMessage ArrowBatchBuilder::finish() {
+    // Every column has an empty validity buffer, no value is null
+    string body, nodes, buffers;
+    auto buffer = [&](const void* data, size_t size) {
+        put(buffers, static_cast<int64_t>(body.size()));
+        put(buffers, static_cast<int64_t>(size));
+        body.append(static_cast<const char*>(data), size);
+        body.resize(padded(body.size()), '\0');
+    };
+    for (const auto& column : columns_) {
+        put(nodes, static_cast<int64_t>(rows_));
+        put(nodes, int64_t(0));
+        buffer("", 0);
+        buffer(column.offsets.data(), column.offsets.size() * sizeof(int32_t));
+        buffer(column.data.data(), column.data.size());
+    }
+
+    FlatBuilder builder;
+    vector<size_t> at;
+    size_t message =
+        writeMessage(builder, HEADER_RECORD_BATCH, body.size(), at);
+    size_t header_at = at[2];
+    builder.patch(header_at,
+                  builder.table({{0, 8, rows_}, {1, 4}, {2, 4}}, at));
+    vector<size_t> batch_at = at;
+    builder.patch(batch_at[1], builder.structs(nodes, columns_.size()));
+    builder.patch(batch_at[2], builder.structs(buffers, 3 * columns_.size()));
+
+    for (auto& column : columns_) column = Column();
+    rows_ = 0;
+    return encapsulate(builder.finish(message), body);
+}
+
+ArrowWriter::ArrowWriter(const fs::path& path, const vector<string>& fields)
+    : out_(path, ios::binary | ios::trunc), fields_(fields) {
+    string head(MAGIC);
+    head.resize(8, '\0');
+
+    FlatBuilder builder;
+    vector<size_t> at;
+    size_t message = writeMessage(builder, HEADER_SCHEMA, 0, at);
+    size_t header_at = at[2];
+    builder.patch(header_at, writeSchema(builder, fields_));
+    head += encapsulate(builder.finish(message), "").bytes;
+
+    out_.write(head.data(), head.size());
+    offset_ = static_cast<int64_t>(head.size());
+}
+
+bool ArrowWriter::write(const ArrowMessage& batch) {
+    blocks_.push_back({offset_, batch.metadata_length, batch.body_length});
+    out_.write(batch.bytes.data(), batch.bytes.size());
+    offset_ += static_cast<int64_t>(batch.bytes.size());
+    return static_cast<bool>(out_);
+}
+
+bool ArrowWriter::close() {
+    string tail;
+    put(tail, CONTINUATION);
+    put(tail, int32_t(0));
+
+    FlatBuilder builder;
+    vector<size_t> at;
+    size_t footer =
+        builder.table({{0, 2, uint64_t(METADATA_V5)}, {1, 4}, {2, 4}, {3, 4}},
+                      at);
+    vector<size_t> footer_at = at;
+    builder.patch(footer_at[1], writeSchema(builder, fields_));
+    builder.patch(footer_at[2], builder.structs("", 0));
+
+    string blocks;
+    for (const auto& block : blocks_) {
+        put(blocks, block.offset);
+        put(blocks, block.metadata_length);
+        put(blocks, int32_t(0));
+        put(blocks, block.body_length);
+    }
+    builder.patch(footer_at[3], builder.structs(blocks, blocks_.size()));
+
+    string metadata = builder.finish(footer);
+    tail += metadata;
+    put(tail, static_cast<int32_t>(metadata.size()));
+    tail += MAGIC;
+
+    out_.write(tail.data(), tail.size());
+    out_.close();
+    return !out_.fail();
+}
+
+int64_t ArrowBatch::offset(const Column& column, size_t i) const {
+    if (column.large) {
+        int64_t offset;
+        memcpy(&offset, column.offsets + i * 8, 8);
+        return offset;
+    }
+    int32_t offset;
+    memcpy(&offset, column.offsets + i * 4, 4);
+    return offset;
+}
+
+string_view ArrowBatch::value(size_t column, size_t row) const {
+    const Column& values = columns_[column];
+    if (values.validity && !((values.validity[row / 8] >> (row % 8)) & 1)) {
+        return {};
+    }
+    int64_t begin = offset(values, row);
+    return string_view(values.data + begin, offset(values, row + 1) - begin);
+}
+
+bool ArrowBatch::contains(size_t column, string_view chars) const {
+    if (rows_ == 0) return false;
+    const Column& values = columns_[column];
+    int64_t begin = offset(values, 0);
+    string_view data(values.data + begin, offset(values, rows_) - begin);
+    return data.find_first_of(chars) != string_view::npos;
+}
+
+size_t ArrowBatch::maxLength(size_t column) const {
+    const Column& values = columns_[column];
+    int64_t longest = 0;
+    for (size_t row = 0; row < rows_; ++row) {
+        longest = max(longest, offset(values, row + 1) - offset(values, row));
+    }
+    return static_cast<size_t>(longest);
+}
+
+bool ArrowReader::open(const fs::path& path) {
+    path_ = path;
+    fields_.clear();
+    large_.clear();
+    blocks_.clear();
+
+    ifstream in(path, ios::binary);
+    if (!in) {
+        error_ = "Cannot open " + path.string();
+        return false;
+    }
+    in.seekg(0, ios::end);
+    auto size = static_cast<int64_t>(in.tellg());
+
+    try {
+        // Magic, padding and a schema message up front; footer, its length
+        // and the magic at the end
+        string head(6, '\0'), tail(10, '\0');
+        if (size < 8 + 10) throw runtime_error("file too short");
+        in.seekg(0);
+        in.read(head.data(), head.size());
+        in.seekg(size - 10);
+        in.read(tail.data(), tail.size());
+        if (!in || head != MAGIC || tail.substr(4) != MAGIC) {
+            throw runtime_error("no Arrow file magic");
+        }
+
+        int64_t footer_size = get<int32_t>(tail, 0);
+        if (footer_size <= 0 || footer_size > size - 18) {
+            throw runtime_error("invalid footer length");
+        }
+        string metadata(footer_size, '\0');
+        in.seekg(size - 10 - footer_size);
+        in.read(metadata.data(), metadata.size());
+        if (!in) throw runtime_error("cannot read footer");
+
+        FlatTable footer = FlatTable::root(metadata);
+        FlatTable schema = footer.table(1);
+        if (schema.scalar<int16_t>(0) != 0) {
+            throw runtime_error("big endian data");
+        }
+
+        auto [fields, field_count] = schema.vector(1);
+        for (size_t i = 0; i < field_count; ++i) {
+            FlatTable field = schema.element(fields, i);
+            fields_.emplace_back(field.string(0));
+            auto type = field.scalar<uint8_t>(2);
+            if (field.has(4) ||
+                (type != TYPE_UTF8 && type != TYPE_BINARY &&
+                 type != TYPE_LARGE_UTF8 && type != TYPE_LARGE_BINARY)) {
+                throw runtime_error("column " + fields_.back() +
+                                    " is not of type utf8 or binary");
+            }
+            large_.push_back(type == TYPE_LARGE_UTF8 ||
+                             type == TYPE_LARGE_BINARY);
+        }
+
+        auto [blocks, block_count] = footer.vector(3);
+        for (size_t i = 0; i < block_count; ++i) {
+            size_t at = blocks + 24 * i;
+            ArrowBlock block{get<int64_t>(metadata, at),
+                             get<int32_t>(metadata, at + 8),
+                             get<int64_t>(metadata, at + 16)};
+            // Each length is checked against what is left of the file,
+            // their sum could overflow
+            if (block.offset < 8 || block.offset > size ||
+                block.metadata_length < 8 ||
+                block.metadata_length > size - block.offset ||
+                block.body_length < 0 ||
+                block.body_length >
+                    size - block.offset - block.metadata_length) {
+                throw runtime_error("record batch outside the file");
+            }
+            blocks_.push_back(block);
+        }
+    } catch (const exception& e) {
+        error_ = "Invalid Arrow file " + path.string() + ": " + e.what();
+        return false;
+    }
+    return true;
+}
+
+bool ArrowReader::read(size_t i, ArrowBatch& batch, string& error) const {
+    const ArrowBlock& block = blocks_[i];
+    ifstream in(path_, ios::binary);
+    string message(block.metadata_length, '\0');
+    in.seekg(block.offset);
+    in.read(message.data(), message.size());
+    batch.body_.resize(block.body_length);
+    in.read(batch.body_.data(), batch.body_.size());
+    if (!in) {
+        error = "Cannot read record batch " + to_string(i) + " of " +
+                path_.string();
+        return false;
+    }
+
+    try {
+        // Files written before the continuation marker start with the
+        // metadata length
+        size_t start = get<uint32_t>(message, 0) == CONTINUATION ? 8 : 4;
+        string_view metadata = string_view(message).substr(start);
+
+        FlatTable header = FlatTable::root(metadata);
+        if (header.scalar<uint8_t>(1) != HEADER_RECORD_BATCH) {
+            throw runtime_error("not a record batch");
+        }
+        FlatTable record_batch = header.table(2);
+        if (record_batch.has(3)) {
+            throw runtime_error("compressed record batches are not supported");
+        }
+
+        auto rows = record_batch.scalar<int64_t>(0);
+        auto [nodes, node_count] = record_batch.vector(1);
+        auto [buffers, buffer_count] = record_batch.vector(2);
+        if (rows < 0 || node_count < fields_.size() ||
+            buffer_count < 3 * fields_.size()) {
+            throw runtime_error("columns missing");
+        }
+
+        // Buffer j of the body, its size in size
+        auto buffer = [&](size_t j, size_t& size) {
+            size_t at = buffers + 16 * j;
+            auto offset = get<int64_t>(metadata, at);
+            auto length = get<int64_t>(metadata, at + 8);
+            auto body_size = static_cast<int64_t>(batch.body_.size());
+            if (offset < 0 || offset > body_size || length < 0 ||
+                length > body_size - offset) {
+                throw runtime_error("buffer outside the body");
+            }
+            size = static_cast<size_t>(length);
+            return batch.body_.data() + offset;
+        };
+
+        batch.rows_ = static_cast<size_t>(rows);
+        batch.columns_.assign(fields_.size(), {});
+        for (size_t c = 0; c < fields_.size(); ++c) {
+            ArrowBatch::Column& column = batch.columns_[c];
+            if (get<int64_t>(metadata, nodes + 16 * c) != rows) {
+                throw runtime_error("column lengths differ");
+            }
+
+            size_t size;
+            const char* validity = buffer(3 * c, size);
+            if (get<int64_t>(metadata, nodes + 16 * c + 8) != 0) {
+                if (size * 8 < batch.rows_) {
+                    throw runtime_error("validity buffer too short");
+                }
+                column.validity = reinterpret_cast<const uint8_t*>(validity);
+            }
+
+            column.large = large_[c];
+            column.offsets = buffer(3 * c + 1, size);
+            if (rows == 0) continue;
+            if (size / (column.large ? 8 : 4) < batch.rows_ + 1) {
+                throw runtime_error("offsets buffer too short");
+            }
+
+            // Values must lie within the data buffer
+            column.data = buffer(3 * c + 2, size);
+            int64_t previous = batch.offset(column, 0);
+            if (previous < 0) throw runtime_error("invalid offsets");
+            for (size_t row = 1; row <= batch.rows_; ++row) {
+                int64_t offset = batch.offset(column, row);
+                if (offset < previous || offset > int64_t(size)) {
+                    throw runtime_error("invalid offsets");
+                }
+                previous = offset;
+            }
+        }
+    } catch (const exception& e) {
+        error = "Invalid record batch " + to_string(i) + " of " +
+                path_.string() + ": " + e.what();
+        return false;
+    }
+    return true;
+}
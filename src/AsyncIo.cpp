@@ -0,0 +1,249 @@
+#include "AsyncIo.hpp"
+#include <unistd.h>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+
+#ifdef __linux__
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+using namespace std;
+
+#ifdef __linux__
+struct IoQueue::Ring {
+    unsigned entries = 0;
+
+    void* sq_map = MAP_FAILED;
+    size_t sq_map_size = 0;
+    void* cq_map = MAP_FAILED;
+    size_t cq_map_size = 0;
+    void* sqe_map = MAP_FAILED;
+    size_t sqe_map_size = 0;
+
+    unsigned* sq_tail = nullptr;
+    unsigned sq_mask = 0;
+    unsigned* sq_array = nullptr;
+    io_uring_sqe* sqes = nullptr;
+
+    unsigned* cq_head = nullptr;
+    unsigned* cq_tail = nullptr;
+    unsigned cq_mask = 0;
+    io_uring_cqe* cqes = nullptr;
+
+    ~Ring() {
+        if (sqe_map != MAP_FAILED) munmap(sqe_map, sqe_map_size);
+        if (cq_map != MAP_FAILED && cq_map != sq_map) {
+            munmap(cq_map, cq_map_size);
+        }
+        if (sq_map != MAP_FAILED) munmap(sq_map, sq_map_size);
+    }
+};
+
+namespace {
+template <typename T>
+T* at(void* base, size_t offset) {
+    return reinterpret_cast<T*>(static_cast<char*>(base) + offset);
+}
+
+void* mapRing(int fd, size_t size, off_t offset) {
+    return mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, fd, offset);
+}
+}  // namespace
+
+bool IoQueue::setup() {
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+
+    int fd = static_cast<int>(syscall(__NR_io_uring_setup, DEPTH, &params));
+    if (fd < 0) return false;
+
+    // IORING_OP_READ came with the same kernel as RW_CUR_POS
+    const unsigned required = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_RW_CUR_POS;
+    if ((params.features & required) != required) {
+        close(fd);
+        return false;
+    }
+
+    auto ring = make_unique<Ring>();
+    ring->entries = params.sq_entries;
+    ring->sq_map_size =
+        max<size_t>(params.sq_off.array + params.sq_entries * sizeof(unsigned),
+                    params.cq_off.cqes +
+                        params.cq_entries * sizeof(io_uring_cqe));
+    ring->sq_map = mapRing(fd, ring->sq_map_size, IORING_OFF_SQ_RING);
+    ring->cq_map = ring->sq_map;
+    ring->cq_map_size = ring->sq_map_size;
+    ring->sqe_map_size = params.sq_entries * sizeof(io_uring_sqe);
+    ring->sqe_map = mapRing(fd, ring->sqe_map_size, IORING_OFF_SQES);
+
+    if (ring->sq_map == MAP_FAILED || ring->sqe_map == MAP_FAILED) {
+        ring.reset();
+        close(fd);
+        return false;
+    }
+
+    void* sq = ring->sq_map;
+    ring->sq_tail = at<unsigned>(sq, params.sq_off.tail);
+    ring->sq_mask = *at<unsigned>(sq, params.sq_off.ring_mask);
+    ring->sq_array = at<unsigned>(sq, params.sq_off.array);
+    ring->sqes = static_cast<io_uring_sqe*>(ring->sqe_map);
+
+    void* cq = ring->cq_map;
+    ring->cq_head = at<unsigned>(cq, params.cq_off.head);
+    ring->cq_tail = at<unsigned>(cq, params.cq_off.tail);
+    ring->cq_mask = *at<unsigned>(cq, params.cq_off.ring_mask);
+    ring->cqes = at<io_uring_cqe>(cq, params.cq_off.cqes);
+
+    ring_fd_ = fd;
+    ring_ = std::move(ring);
+    return true;
+}
+
+void IoQueue::enter(unsigned min_complete) {
+    unsigned flags = min_complete ? IORING_ENTER_GETEVENTS : 0;
+
+    while (true) {
+        long submitted = syscall(__NR_io_uring_enter, ring_fd_, unsubmitted_,
+                                 min_complete, flags, nullptr, 0);
+        if (submitted >= 0) {
+            unsubmitted_ -= static_cast<unsigned>(submitted);
+            return;
+        }
+        if (errno == EINTR) continue;
+        if (errno == EAGAIN || errno == EBUSY) {
+            reap();
+            continue;
+        }
+
+        // The ring is unusable, fail whatever is outstanding rather than
+        // leave callers waiting forever
+        int error = errno;
+        for (auto& [raw, request] : requests_) {
+            request->done = true;
+            request->result = -error;
+        }
+        requests_.clear();
+        unsubmitted_ = 0;
+        return;
+    }
+}
+
+void IoQueue::reap() {
+    unsigned head = *ring_->cq_head;
+    unsigned tail = atomic_ref<unsigned>(*ring_->cq_tail).load(
+        memory_order_acquire);
+
+    for (; head != tail; ++head) {
+        const io_uring_cqe& cqe = ring_->cqes[head & ring_->cq_mask];
+        auto it = requests_.find(reinterpret_cast<Request*>(cqe.user_data));
+        if (it == requests_.end()) continue;
+
+        it->second->done = true;
+        it->second->result = cqe.res;
+        requests_.erase(it);
+    }
+    atomic_ref<unsigned>(*ring_->cq_head).store(head, memory_order_release);
+}
+
+shared_ptr<IoQueue::Request> IoQueue::read(int fd, uint64_t offset,
+                                           char* buffer, size_t length) {
+    auto request = make_shared<Request>();
+    if (!asynchronous()) {
+        request->result = preadFully(fd, offset, buffer, length);
+        request->done = true;
+        return request;
+    }
+
+    // Every queued read has a submission slot and twice as many completion
+    // slots, so completions are never dropped
+    while (requests_.size() >= ring_->entries) {
+        enter(1);
+        reap();
+    }
+
+    unsigned tail = *ring_->sq_tail;
+    unsigned index = tail & ring_->sq_mask;
+    io_uring_sqe& sqe = ring_->sqes[index];
+    memset(&sqe, 0, sizeof(sqe));
+    sqe.opcode = IORING_OP_READ;
+    sqe.fd = fd;
+    sqe.off = offset;
+    sqe.addr = reinterpret_cast<uint64_t>(buffer);
+    sqe.len = static_cast<uint32_t>(length);
+    sqe.user_data = reinterpret_cast<uint64_t>(request.get());
+
+    ring_->sq_array[index] = index;
+    atomic_ref<unsigned>(*ring_->sq_tail).store(tail + 1,
+                                                memory_order_release);
+    unsubmitted_++;
+    requests_.emplace(request.get(), request);
+
+    return request;
+}
+#else
+struct IoQueue::Ring {};
+
+bool IoQueue::setup() {
+    return false;
+}
+
+void IoQueue::enter(unsigned) {}
+
+void IoQueue::reap() {}
+
+shared_ptr<IoQueue::Request> IoQueue::read(int fd, uint64_t offset,
+                                           char* buffer, size_t length) {
+    auto request = make_shared<Request>();
+    request->result = preadFully(fd, offset, buffer, length);
+    request->done = true;
+    return request;
+}
+#endif
+
+IoQueue::IoQueue(bool uring) {
+    if (uring) setup();
+}
+
+IoQueue::~IoQueue() {
+    // The kernel may still write into buffers of reads nobody waited for
+    while (!requests_.empty()) {
+        enter(1);
+        reap();
+    }
+    ring_.reset();
+    if (ring_fd_ >= 0) close(ring_fd_);
+}
+
+IoQueue& IoQueue::forThread() {
+    thread_local IoQueue queue;
+    return queue;
+}
+
+void IoQueue::submit() {
+    if (unsubmitted_) enter(0);
+}
+
+void IoQueue::wait(Request& request) {
+    if (!request.done) reap();
+    while (!request.done) {
+        enter(1);
+        reap();
+    }
+}
+
+ssize_t preadFully(int fd, uint64_t offset, char* buffer, size_t length) {
+    size_t total = 0;
+    while (total < length) {
+        ssize_t n = pread(fd, buffer + total, length - total,
+                          static_cast<off_t>(offset + total));
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) return -errno;
+        if (n == 0) break;
+        total += static_cast<size_t>(n);
+    }
+    return static_cast<ssize_t>(total);
+}
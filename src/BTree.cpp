@@ -0,0 +1,434 @@
+#include "BTree.hpp"
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include "Metrics.hpp"
+#include "Sort.hpp"
+#include "Wal.hpp"
+
+namespace fs = std::filesystem;
+using namespace std;
+
+namespace {
+constexpr char MAGIC[8] = {'L', 'M', 'K', 'B', 'T', 'R', 'E', '1'};
+constexpr size_t HEADER_SIZE = 8 + 4 + 4 + 4 + 8 + 1;
+constexpr size_t NODE_HEADER_SIZE = 1 + 2 + 4;
+constexpr uint8_t LEAF = 1;
+constexpr uint8_t INNER = 2;
+
+// Leaves and inner pages built by a bulk load are left this full, so the
+// first inserts do not split them
+constexpr size_t BULK_FILL = BTreeIndex::PAGE_SIZE * 9 / 10;
+// Clean pages kept in memory after a flush
+constexpr size_t CACHED_PAGES = 1024;
+
+Counter& pagesRead() {
+    static Counter& counter = Metrics::instance().counter(
+        "lmkdb_index_pages_read_total", "B+tree index pages read from disk");
+    return counter;
+}
+
+Counter& pagesWritten() {
+    static Counter& counter = Metrics::instance().counter(
+        "lmkdb_index_pages_written_total", "B+tree index pages written");
+    return counter;
+}
+
+template <typename T>
+void put(string& out, T value) {
+    out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+template <typename T>
+T get(const char*& p) {
+    T value;
+    memcpy(&value, p, sizeof(value));
+    p += sizeof(value);
+    return value;
+}
+
+size_t entrySize(const BTreeIndex::Entry& entry) {
+    return 2 + entry.key.size() + 4 + 8;
+}
+
+bool writeAt(int fd, const string& data, off_t offset) {
+    return pwrite(fd, data.data(), data.size(), offset) ==
+           static_cast<ssize_t>(data.size());
+}
+
+bool writePage(int fd, uint32_t page, const string& data) {
+    pagesWritten().add();
+    return writeAt(fd, data, off_t(page) * BTreeIndex::PAGE_SIZE);
+}
+}  // namespace
+
+BTreeIndex::BTreeIndex(fs::path path) : path_(std::move(path)) {
+    fd_ = open(path_.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd_ < 0) {
+        throw runtime_error("Cannot open index " + path_.string());
+    }
+
+    char header[HEADER_SIZE];
+    if (pread(fd_, header, HEADER_SIZE, 0) == HEADER_SIZE &&
+        memcmp(header, MAGIC, sizeof(MAGIC)) == 0) {
+        const char* p = header + sizeof(MAGIC);
+        root_ = get<uint32_t>(p);
+        page_count_ = get<uint32_t>(p);
+        height_ = get<uint32_t>(p);
+        entries_ = get<uint64_t>(p);
+        clean_ = marked_clean_ = get<uint8_t>(p) != 0;
+        return;
+    }
+
+    // New file, or one that was never completely written
+    nodes_[root_].dirty = true;
+}
+
+BTreeIndex::~BTreeIndex() {
+    flush(true);
+    close(fd_);
+}
+
+bool BTreeIndex::less(const Entry& a, const Entry& b) {
+    if (int order = compareValues(a.key, b.key)) return order < 0;
+    if (int order = a.key.compare(b.key)) return order < 0;
+    if (a.shard != b.shard) return a.shard < b.shard;
+    return a.offset < b.offset;
+}
+
+uint64_t BTreeIndex::size() const {
+    lock_guard<mutex> lock(mutex_);
+    return entries_;
+}
+
+uint32_t BTreeIndex::height() const {
+    lock_guard<mutex> lock(mutex_);
+    return height_;
+}
+
+uint32_t BTreeIndex::pages() const {
+    lock_guard<mutex> lock(mutex_);
+    return page_count_;
+}
+
+size_t BTreeIndex::encodedSize(const Node& node) {
+    size_t size = NODE_HEADER_SIZE;
+    for (const auto& entry : node.entries) size += entrySize(entry);
+    return node.leaf ? size : size + 4 * node.entries.size();
+}
+
+size_t BTreeIndex::splitPoint(const Node& node) {
+    size_t half = encodedSize(node) / 2;
+    size_t size = NODE_HEADER_SIZE;
+    size_t i = 0;
+    while (i + 1 < node.entries.size() && size < half) {
+        size += entrySize(node.entries[i++]) + (node.leaf ? 0 : 4);
+    }
+    return max<size_t>(i, 1);
+}
+
+BTreeIndex::Node& BTreeIndex::node(uint32_t page) {
+    auto it = nodes_.find(page);
+    if (it != nodes_.end()) return it->second;
+
+    string data(PAGE_SIZE, '\0');
+    if (pread(fd_, data.data(), PAGE_SIZE, off_t(page) * PAGE_SIZE) !=
+        static_cast<ssize_t>(PAGE_SIZE)) {
+        throw runtime_error("Cannot read page " + to_string(page) +
+                            " of index " + path_.string());
+    }
+    pagesRead().add();
+
+    Node node;
+    const char* p = data.data();
+    node.leaf = get<uint8_t>(p) == LEAF;
+    uint16_t count = get<uint16_t>(p);
+    uint32_t link = get<uint32_t>(p);
+    if (node.leaf) {
+        node.next = link;
+    } else {
+        node.children.push_back(link);
+    }
+
+    node.entries.resize(count);
+    for (auto& entry : node.entries) {
+        uint16_t length = get<uint16_t>(p);
+        entry.key.assign(p, length);
+        p += length;
+        entry.shard = get<uint32_t>(p);
+        entry.offset = get<uint64_t>(p);
+        if (!node.leaf) node.children.push_back(get<uint32_t>(p));
+    }
+    return nodes_[page] = std::move(node);
+}
+
+uint32_t BTreeIndex::allocate(Node node) {
+    node.dirty = true;
+    nodes_[page_count_] = std::move(node);
+    return page_count_++;
+}
+
+namespace {
+string encodeNode(bool leaf, uint32_t link,
+                  const vector<BTreeIndex::Entry>& entries,
+                  const vector<uint32_t>& children) {
+    string data;
+    data.reserve(BTreeIndex::PAGE_SIZE);
+    put<uint8_t>(data, leaf ? LEAF : INNER);
+    put<uint16_t>(data, static_cast<uint16_t>(entries.size()));
+    put<uint32_t>(data, link);
+    for (size_t i = 0; i < entries.size(); ++i) {
+        put<uint16_t>(data, static_cast<uint16_t>(entries[i].key.size()));
+        data += entries[i].key;
+        put<uint32_t>(data, entries[i].shard);
+        put<uint64_t>(data, entries[i].offset);
+        if (!leaf) put<uint32_t>(data, children[i + 1]);
+    }
+    data.resize(BTreeIndex::PAGE_SIZE, '\0');
+    return data;
+}
+}  // namespace
+
+bool BTreeIndex::writeHeader(bool clean) {
+    string header(MAGIC, sizeof(MAGIC));
+    put<uint32_t>(header, root_);
+    put<uint32_t>(header, page_count_);
+    put<uint32_t>(header, height_);
+    put<uint64_t>(header, entries_);
+    put<uint8_t>(header, clean ? 1 : 0);
+    return writeAt(fd_, header, 0);
+}
+
+bool BTreeIndex::markDirty() {
+    // The file must not claim to be clean once it may be out of date
+    if (!marked_clean_) return true;
+    marked_clean_ = false;
+    return writeHeader(false) && syncFile(path_);
+}
+
+bool BTreeIndex::flush(bool sync) {
+    lock_guard<mutex> lock(mutex_);
+    bool ok = true;
+    for (auto& [page, node] : nodes_) {
+        if (!node.dirty) continue;
+        ok = writePage(fd_, page,
+                       encodeNode(node.leaf,
+                                  node.leaf ? node.next : node.children[0],
+                                  node.entries, node.children)) &&
+             ok;
+        node.dirty = false;
+    }
+    if (nodes_.size() > CACHED_PAGES) nodes_.clear();
+
+    // Every change marks the file dirty first, so a clean file is current
+    if (marked_clean_) return ok;
+    ok = writeHeader(false) && ok;
+    if (!sync) return ok;
+    ok = syncFile(path_) && ok;
+    if (!ok) return false;
+
+    // Only pages that reached the disk count as clean
+    marked_clean_ = writeHeader(true) && syncFile(path_);
+    return marked_clean_;
+}
+
+bool BTreeIndex::bulkLoad(const vector<Entry>& entries) {
+    lock_guard<mutex> lock(mutex_);
+    if (!markDirty()) return false;
+
+    nodes_.clear();
+    if (ftruncate(fd_, PAGE_SIZE) != 0) return false;
+    page_count_ = 1;
+    entries_ = entries.size();
+    height_ = 1;
+    bool ok = true;
+
+    // First entry and page of every node of the level being built
+    vector<pair<Entry, uint32_t>> level;
+
+    Node leaf;
+    auto writeLeaf = [&](bool last) {
+        uint32_t page = page_count_++;
+        Entry first = leaf.entries.empty() ? Entry{} : leaf.entries.front();
+        ok = writePage(fd_, page,
+                       encodeNode(true, last ? 0 : page + 1, leaf.entries,
+                                  {})) &&
+             ok;
+        level.emplace_back(std::move(first), page);
+        leaf.entries.clear();
+    };
+    for (const auto& entry : entries) {
+        if (!leaf.entries.empty() &&
+            encodedSize(leaf) + entrySize(entry) > BULK_FILL) {
+            writeLeaf(false);
+        }
+        leaf.entries.push_back(entry);
+    }
+    writeLeaf(true);
+
+    while (level.size() > 1) {
+        vector<pair<Entry, uint32_t>> parents;
+        Node inner;
+        inner.leaf = false;
+        Entry first;
+
+        auto writeInner = [&]() {
+            uint32_t page = page_count_++;
+            ok = writePage(fd_, page,
+                           encodeNode(false, inner.children[0], inner.entries,
+                                      inner.children)) &&
+                 ok;
+            parents.emplace_back(std::move(first), page);
+            inner.entries.clear();
+            inner.children.clear();
+        };
+        for (auto& [entry, page] : level) {
+            if (!inner.children.empty() &&
+                encodedSize(inner) + entrySize(entry) + 4 > BULK_FILL) {
+                writeInner();
+            }
+            if (inner.children.empty()) {
+                first = std::move(entry);
+            } else {
+                inner.entries.push_back(std::move(entry));
+            }
+            inner.children.push_back(page);
+        }
+        writeInner();
+
+        level = std::move(parents);
+        height_++;
+    }
+    root_ = level.front().second;
+
+    return writeHeader(false) && ok;
+}
+
+optional<pair<BTreeIndex::Entry, uint32_t>> BTreeIndex::insertInto(
+    uint32_t page, const Entry& entry) {
+    // Nodes stay at their address while others are added, pages are only
+    // evicted by flush()
+    Node& current = node(page);
+
+    if (!current.leaf) {
+        size_t i = upper_bound(current.entries.begin(), current.entries.end(),
+                               entry, less) -
+                   current.entries.begin();
+        auto split = insertInto(current.children[i], entry);
+        if (!split) return nullopt;
+
+        current.entries.insert(current.entries.begin() + i,
+                               std::move(split->first));
+        current.children.insert(current.children.begin() + i + 1,
+                                split->second);
+    } else {
+        current.entries.insert(upper_bound(current.entries.begin(),
+                                           current.entries.end(), entry, less),
+                               entry);
+    }
+    current.dirty = true;
+    if (encodedSize(current) <= PAGE_SIZE) return nullopt;
+
+    size_t mid = splitPoint(current);
+    Node right;
+    right.leaf = current.leaf;
+    Entry first;
+
+    if (current.leaf) {
+        // The first entry of the right leaf separates the two
+        right.entries.assign(make_move_iterator(current.entries.begin() + mid),
+                             make_move_iterator(current.entries.end()));
+        right.next = current.next;
+        first = right.entries.front();
+    } else {
+        // The middle entry moves up, its right child starts the right page
+        first = std::move(current.entries[mid]);
+        right.entries.assign(
+            make_move_iterator(current.entries.begin() + mid + 1),
+            make_move_iterator(current.entries.end()));
+        right.children.assign(current.children.begin() + mid + 1,
+                              current.children.end());
+        current.children.resize(mid + 1);
+    }
+    current.entries.resize(mid);
+
+    uint32_t right_page = allocate(std::move(right));
+    if (current.leaf) current.next = right_page;
+    return make_pair(std::move(first), right_page);
+}
+
+bool BTreeIndex::insert(const Entry& entry) {
+    if (!indexable(entry.key)) return false;
+
+    lock_guard<mutex> lock(mutex_);
+    if (!markDirty()) return false;
+
+    if (auto split = insertInto(root_, entry)) {
+        Node root;
+        root.leaf = false;
+        root.entries.push_back(std::move(split->first));
+        root.children = {root_, split->second};
+        root_ = allocate(std::move(root));
+        height_++;
+    }
+    entries_++;
+    return true;
+}
+
+bool BTreeIndex::erase(const Entry& entry) {
+    lock_guard<mutex> lock(mutex_);
+
+    uint32_t page = root_;
+    while (!node(page).leaf) {
+        Node& inner = node(page);
+        page = inner.children[upper_bound(inner.entries.begin(),
+                                          inner.entries.end(), entry, less) -
+                              inner.entries.begin()];
+    }
+
+    Node& leaf = node(page);
+    auto it = lower_bound(leaf.entries.begin(), leaf.entries.end(), entry,
+                          less);
+    if (it == leaf.entries.end() || less(entry, *it)) return false;
+    if (!markDirty()) return false;
+
+    leaf.entries.erase(it);
+    leaf.dirty = true;
+    entries_--;
+    return true;
+}
+
+void BTreeIndex::scan(const KeyBounds& bounds, string_view prefix,
+                      const function<void(const Entry&)>& visit) {
+    lock_guard<mutex> lock(mutex_);
+
+    // Children before the first separator not below the lower bound only
+    // hold smaller values
+    uint32_t page = root_;
+    while (!node(page).leaf) {
+        Node& inner = node(page);
+        size_t i = 0;
+        if (bounds.lower) {
+            i = partition_point(inner.entries.begin(), inner.entries.end(),
+                                [&](const Entry& separator) {
+                                    return compareValues(separator.key,
+                                                         *bounds.lower) < 0;
+                                }) -
+                inner.entries.begin();
+        }
+        page = inner.children[i];
+    }
+
+    while (page != 0) {
+        Node& leaf = node(page);
+        for (const auto& entry : leaf.entries) {
+            if (bounds.below(entry.key)) continue;
+            if (bounds.above(entry.key)) return;
+            if (!prefix.empty() && !entry.key.starts_with(prefix)) return;
+            visit(entry);
+        }
+        page = leaf.next;
+    }
+}
@@ -0,0 +1,231 @@
+#include "Batch.hpp"
+#include <algorithm>
+#include <numeric>
+#include "Record.hpp"
+#include "Sort.hpp"
+
+using namespace std;
+
+namespace {
+
+// Value of an encoded field, codes outside dictionary are left as they are
+string_view decoded(string_view field, const Dictionary* dictionary) {
+    auto code = Dictionary::parseCode(field);
+    return code && *code < dictionary->size() ? dictionary->decode(*code)
+                                              : field;
+}
+
+// parseNumber, with plain integers read without strtod
+bool parseField(string_view field, double& number) {
+    if (field.empty() || field.size() > 15) return parseNumber(field, number);
+    uint64_t integer = 0;
+    for (char c : field) {
+        if (c < '0' || c > '9') return parseNumber(field, number);
+        integer = integer * 10 + (c - '0');
+    }
+    number = static_cast<double>(integer);
+    return true;
+}
+
+// Keeps the rows of selection whose field passes test
+template <typename Test>
+void narrow(vector<uint32_t>& selection, const vector<string_view>& fields,
+            Test&& test) {
+    size_t kept = 0;
+    for (uint32_t row : selection) {
+        selection[kept] = row;
+        kept += test(fields[row]);
+    }
+    selection.resize(kept);
+}
+
+}  // namespace
+
+size_t ColumnBatch::memory() const {
+    size_t bytes = rows_.capacity() + ends_.capacity() * sizeof(size_t) +
+                   offsets_.capacity() * sizeof(uint64_t) +
+                   selection_.capacity() * sizeof(uint32_t);
+    for (const auto& column : columns_) {
+        bytes += column.capacity() * sizeof(string_view);
+    }
+    return bytes;
+}
+
+BatchScan::BatchScan(const Shard& shard, vector<Column> columns,
+                     size_t capacity, const vector<uint64_t>* offsets)
+    : reader_(shard),
+      columns_(std::move(columns)),
+      capacity_(max<size_t>(capacity, 1)),
+      offsets_(offsets) {}
+
+bool BatchScan::next(ColumnBatch& batch) {
+    batch.rows_.clear();
+    batch.ends_.clear();
+    batch.offsets_.clear();
+
+    string_view line;
+    while (batch.size() < capacity_) {
+        if (offsets_) {
+            if (next_offset_ == offsets_->size()) break;
+            reader_.seek((*offsets_)[next_offset_++]);
+            if (!reader_.next(line)) continue;
+        } else if (!reader_.next(line)) {
+            break;
+        }
+
+        batch.rows_ += line;
+        batch.ends_.push_back(batch.rows_.size());
+        batch.offsets_.push_back(reader_.offset());
+    }
+
+    size_t size = batch.size();
+    rows_ += size;
+
+    // Column by column, each a tight loop over the rows of the batch
+    batch.columns_.resize(columns_.size());
+    for (size_t c = 0; c < columns_.size(); ++c) {
+        auto& fields = batch.columns_[c];
+        fields.resize(size);
+        int index = columns_[c].index;
+        for (size_t i = 0; i < size; ++i) {
+            fields[i] = fieldAt(batch.row(i), index);
+        }
+
+        const Dictionary* dictionary = columns_[c].dictionary;
+        if (!dictionary) continue;
+        for (auto& field : fields) field = decoded(field, dictionary);
+    }
+
+    batch.selection_.resize(size);
+    iota(batch.selection_.begin(), batch.selection_.end(), 0u);
+    return size > 0;
+}
+
+PredicateProgram::Operand::Operand(string value) : text(std::move(value)) {
+    numeric = parseNumber(text, number);
+}
+
+int PredicateProgram::Operand::compare(string_view field, bool field_numeric,
+                                       double field_number) const {
+    if (field_numeric != numeric) return field_numeric ? -1 : 1;
+    if (numeric) return (field_number > number) - (field_number < number);
+    int order = field.compare(text);
+    return (order > 0) - (order < 0);
+}
+
+size_t PredicateProgram::slotOf(int index, const Dictionary* dictionary) {
+    auto it = ranges::find_if(columns_, [index](const auto& column) {
+        return column.index == index;
+    });
+    if (it != columns_.end()) return it - columns_.begin();
+    columns_.push_back({index, dictionary});
+    return columns_.size() - 1;
+}
+
+void PredicateProgram::add(int index, const Dictionary* dictionary,
+                           const Condition& condition) {
+    size_t slot = slotOf(index, dictionary);
+    conditions_++;
+
+    Kind kind = condition.op == CompareOp::Equal    ? Kind::Equal
+                : condition.op == CompareOp::Prefix ? Kind::Prefix
+                                                    : Kind::Range;
+    auto it = ranges::find_if(program_, [&](const Instruction& instruction) {
+        return instruction.kind == Kind::Range && instruction.slot == slot;
+    });
+    if (kind != Kind::Range || it == program_.end()) {
+        // Kept in order of kind, the cheaper tests run first
+        it = ranges::upper_bound(program_, kind, {}, &Instruction::kind);
+        Instruction instruction{};
+        instruction.kind = kind;
+        instruction.slot = slot;
+        if (kind != Kind::Range) {
+            instruction.value = condition.value;
+            program_.insert(it, std::move(instruction));
+            return;
+        }
+        it = program_.insert(it, std::move(instruction));
+    }
+
+    // Range conditions of a column narrow one range
+    it->bounds.add(condition);
+    it->lower.reset();
+    it->upper.reset();
+    if (it->bounds.lower) it->lower.emplace(*it->bounds.lower);
+    if (it->bounds.upper) it->upper.emplace(*it->bounds.upper);
+}
+
+template <bool Lower, bool Upper>
+bool PredicateProgram::inRange(const Instruction& instruction,
+                               string_view field) {
+    double number = 0;
+    bool numeric = parseField(field, number);
+    if constexpr (Lower) {
+        int order = instruction.lower->compare(field, numeric, number);
+        if (order < 0 || (order == 0 && !instruction.bounds.lower_inclusive)) {
+            return false;
+        }
+    }
+    if constexpr (Upper) {
+        int order = instruction.upper->compare(field, numeric, number);
+        if (order > 0 || (order == 0 && !instruction.bounds.upper_inclusive)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool PredicateProgram::test(const Instruction& instruction,
+                            string_view field) {
+    switch (instruction.kind) {
+        case Kind::Equal:
+            return field == instruction.value;
+        case Kind::Prefix:
+            return field.starts_with(instruction.value);
+        case Kind::Range:
+            break;
+    }
+    if (!instruction.lower) return inRange<false, true>(instruction, field);
+    if (!instruction.upper) return inRange<true, false>(instruction, field);
+    return inRange<true, true>(instruction, field);
+}
+
+void PredicateProgram::apply(ColumnBatch& batch) const {
+    auto& selection = batch.selection();
+    for (const auto& instruction : program_) {
+        if (selection.empty()) return;
+        const auto& fields = batch.column(instruction.slot);
+        const string& value = instruction.value;
+
+        // One loop per kind and set of bounds, without a dispatch per row
+        if (instruction.kind == Kind::Equal) {
+            narrow(selection, fields,
+                   [&](string_view field) { return field == value; });
+        } else if (instruction.kind == Kind::Prefix) {
+            narrow(selection, fields, [&](string_view field) {
+                return field.starts_with(value);
+            });
+        } else if (!instruction.lower) {
+            narrow(selection, fields, [&](string_view field) {
+                return inRange<false, true>(instruction, field);
+            });
+        } else if (!instruction.upper) {
+            narrow(selection, fields, [&](string_view field) {
+                return inRange<true, false>(instruction, field);
+            });
+        } else {
+            narrow(selection, fields, [&](string_view field) {
+                return inRange<true, true>(instruction, field);
+            });
+        }
+    }
+}
+
+bool PredicateProgram::matches(string_view line) const {
+    return ranges::all_of(program_, [&](const Instruction& instruction) {
+        const auto& column = columns_[instruction.slot];
+        string_view field = fieldAt(line, column.index);
+        if (column.dictionary) field = decoded(field, column.dictionary);
+        return test(instruction, field);
+    });
+}
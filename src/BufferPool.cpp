@@ -0,0 +1,260 @@
+#include "BufferPool.hpp"
+#include <fstream>
+#include <future>
+#include <vector>
+#include "Compression.hpp"
+#include "Metrics.hpp"
+#include "Profile.hpp"
+#include "Settings.hpp"
+#include "utils.hpp"
+
+using namespace std;
+
+namespace {
+struct PoolMetrics {
+    Counter& hits;
+    Counter& misses;
+    Counter& evictions;
+    Gauge& bytes;
+    Counter& decoded_bytes;
+    Histogram& decode_time;
+
+    static PoolMetrics& get() {
+        static PoolMetrics metrics{
+            Metrics::instance().counter("lmkdb_buffer_pool_hits_total",
+                                        "Shard page reads served from memory"),
+            Metrics::instance().counter("lmkdb_buffer_pool_misses_total",
+                                        "Shard page reads that went to disk"),
+            Metrics::instance().counter("lmkdb_buffer_pool_evictions_total",
+                                        "Pages evicted from the buffer pool"),
+            Metrics::instance().gauge("lmkdb_buffer_pool_bytes",
+                                      "Bytes of shard pages cached"),
+            Metrics::instance().counter(
+                "lmkdb_block_decoded_bytes_total",
+                "Raw bytes decoded from compressed shard blocks"),
+            Metrics::instance().histogram(
+                "lmkdb_block_decode_seconds",
+                "Time reading and decoding one compressed shard block"),
+        };
+        return metrics;
+    }
+};
+}  // namespace
+
+BufferPool::PageHandle::PageHandle(shared_ptr<Page> page)
+    : page_(std::move(page)) {
+    page_->pins++;
+}
+
+BufferPool::PageHandle::~PageHandle() {
+    if (page_) page_->pins--;
+}
+
+BufferPool::PageHandle& BufferPool::PageHandle::operator=(
+    PageHandle&& other) noexcept {
+    if (this != &other) {
+        if (page_) page_->pins--;
+        page_ = std::move(other.page_);
+    }
+    return *this;
+}
+
+BufferPool& BufferPool::instance() {
+    static BufferPool pool;
+    return pool;
+}
+
+shared_ptr<BufferPool::Page> BufferPool::load(const string& path,
+                                              size_t page) {
+    auto result = make_shared<Page>();
+    result->data.resize(PAGE_SIZE);
+
+    ifstream file(path, ios::binary);
+    file.seekg(static_cast<streamoff>(page * PAGE_SIZE));
+    file.read(result->data.data(), PAGE_SIZE);
+    result->data.resize(file ? PAGE_SIZE : max<streamsize>(file.gcount(), 0));
+    result->data.shrink_to_fit();
+
+    return result;
+}
+
+shared_ptr<BufferPool::Page> BufferPool::decode(const string& path,
+                                                size_t page,
+                                                const BlockIndex& blocks,
+                                                OperatorStats* decoded) {
+    auto result = make_shared<Page>();
+    if (page >= blocks.blocks.size()) return result;
+
+    PoolMetrics& metrics = PoolMetrics::get();
+    LatencyTimer timer(metrics.decode_time);
+    const BlockIndex::Block& block = blocks.blocks[page];
+
+    string stored(block.stored_size, '\0');
+    ifstream file(path, ios::binary);
+    file.seekg(static_cast<streamoff>(block.offset));
+    file.read(stored.data(), block.stored_size);
+
+    bool valid = static_cast<bool>(file);
+    if (valid && block.stored_size == block.raw_size) {
+        result->data = std::move(stored);
+    } else if (valid) {
+        valid = lzDecompress(stored, block.raw_size, result->data);
+    }
+
+    if (!valid) {
+        errStream() << "Corrupt block " << page << " in " << path << endl;
+        result->data.clear();
+        return result;
+    }
+
+    metrics.decoded_bytes.add(block.raw_size);
+    if (decoded) {
+        decoded->rows_in++;
+        decoded->rows_out++;
+        decoded->bytes_read += block.stored_size;
+        decoded->bytes_written += block.raw_size;
+    }
+    return result;
+}
+
+BufferPool::PageHandle BufferPool::fetch(const string& path, size_t page,
+                                         size_t length, bool cache,
+                                         const BlockIndex* blocks,
+                                         OperatorStats* decoded) {
+    PoolMetrics& metrics = PoolMetrics::get();
+    Key key{path, page};
+
+    auto read = [&]() {
+        return blocks ? decode(path, page, *blocks, decoded) : load(path, page);
+    };
+
+    if (!cache) {
+        metrics.misses.add();
+        return PageHandle(read());
+    }
+
+    {
+        lock_guard<mutex> lock(mutex_);
+        auto it = frames_.find(key);
+        if (it != frames_.end() && it->second.page->data.size() >= length) {
+            lru_.splice(lru_.end(), lru_, it->second.lru);
+            metrics.hits.add();
+            return PageHandle(it->second.page);
+        }
+    }
+
+    // Read without holding the lock, so join tasks missing on different
+    // pages load them in parallel. Two tasks missing on the same page both
+    // read it and the longer copy wins.
+    metrics.misses.add();
+    return insert(std::move(key), read());
+}
+
+void BufferPool::prefetch(const string& path, size_t first, size_t count,
+                          const BlockIndex& blocks, OperatorStats* decoded) {
+    vector<size_t> missing;
+    {
+        lock_guard<mutex> lock(mutex_);
+        for (size_t page = first;
+             page < first + count && page < blocks.blocks.size(); ++page) {
+            if (!frames_.contains({path, page})) missing.push_back(page);
+        }
+    }
+
+    // Each task counts into its own stats, summed once all are done
+    vector<OperatorStats> task_stats(missing.size());
+    vector<future<shared_ptr<Page>>> loads;
+    for (size_t i = 0; i < missing.size(); ++i) {
+        OperatorStats* stats = decoded ? &task_stats[i] : nullptr;
+        loads.push_back(async(launch::async, [&, i, stats]() {
+            return decode(path, missing[i], blocks, stats);
+        }));
+    }
+
+    PoolMetrics& metrics = PoolMetrics::get();
+    for (size_t i = 0; i < missing.size(); ++i) {
+        metrics.misses.add();
+        insert({path, missing[i]}, loads[i].get());
+
+        if (decoded) {
+            decoded->rows_in += task_stats[i].rows_in;
+            decoded->rows_out += task_stats[i].rows_out;
+            decoded->bytes_read += task_stats[i].bytes_read;
+            decoded->bytes_written += task_stats[i].bytes_written;
+        }
+    }
+}
+
+bool BufferPool::contains(const string& path, size_t page,
+                          size_t length) const {
+    lock_guard<mutex> lock(mutex_);
+    auto it = frames_.find({path, page});
+    return it != frames_.end() && it->second.page->data.size() >= length;
+}
+
+BufferPool::PageHandle BufferPool::adopt(const string& path, size_t page,
+                                         shared_ptr<Page> loaded) {
+    PoolMetrics::get().misses.add();
+    return insert({path, page}, std::move(loaded));
+}
+
+BufferPool::PageHandle BufferPool::insert(Key key, shared_ptr<Page> loaded) {
+    PoolMetrics& metrics = PoolMetrics::get();
+
+    lock_guard<mutex> lock(mutex_);
+    auto it = frames_.find(key);
+    if (it != frames_.end()) {
+        if (it->second.page->data.size() >= loaded->data.size()) {
+            lru_.splice(lru_.end(), lru_, it->second.lru);
+            return PageHandle(it->second.page);
+        }
+        erase(it);
+    }
+
+    lru_.push_back(key);
+    frames_.emplace(std::move(key), Frame{loaded, prev(lru_.end())});
+    bytes_ += loaded->data.size();
+
+    // Pin before evicting so the page just read cannot be the victim
+    PageHandle handle(loaded);
+    evict(Settings::instance().buffer_pool_memory);
+    metrics.bytes.set(bytes_);
+
+    return handle;
+}
+
+void BufferPool::evict(size_t budget) {
+    auto it = lru_.begin();
+    while (bytes_ > budget && it != lru_.end()) {
+        auto frame = frames_.find(*it++);
+        if (frame->second.page->pins > 0) continue;
+
+        erase(frame);
+        PoolMetrics::get().evictions.add();
+    }
+}
+
+void BufferPool::erase(map<Key, Frame>::iterator it) {
+    bytes_ -= it->second.page->data.size();
+    lru_.erase(it->second.lru);
+    frames_.erase(it);
+}
+
+void BufferPool::invalidate(const string& prefix) {
+    lock_guard<mutex> lock(mutex_);
+
+    auto it = frames_.lower_bound({prefix, 0});
+    while (it != frames_.end() &&
+           it->first.first.compare(0, prefix.size(), prefix) == 0) {
+        // Pinned pages stay alive through their handles
+        bytes_ -= it->second.page->data.size();
+        lru_.erase(it->second.lru);
+        it = frames_.erase(it);
+    }
+    PoolMetrics::get().bytes.set(bytes_);
+}
+
+size_t BufferPool::memoryUsage() const {
+    lock_guard<mutex> lock(mutex_);
+    return bytes_;
+}
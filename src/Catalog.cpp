@@ -0,0 +1,421 @@
+#include "Catalog.hpp"
+#include <algorithm>
+#include <atomic>
+#include <fstream>
+#include <map>
+#include <optional>
+#include <set>
+#include <sstream>
+#include "BufferPool.hpp"
+#include "Metrics.hpp"
+#include "Table.hpp"
+#include "Wal.hpp"
+#include "utils.hpp"
+
+namespace fs = std::filesystem;
+using namespace std;
+
+namespace {
+vector<string> splitFields(const string& line) {
+    vector<string> fields;
+    istringstream ss(line);
+    string field;
+    while (getline(ss, field, ',')) {
+        fields.push_back(field);
+    }
+    return fields;
+}
+
+Gauge& openGauge() {
+    static Gauge& gauge = Metrics::instance().gauge(
+        "lmkdb_tables_open", "Tables whose shards have been opened");
+    return gauge;
+}
+
+Gauge& versionGauge() {
+    static Gauge& gauge = Metrics::instance().gauge(
+        "lmkdb_catalog_version", "Number of catalog changes persisted");
+    return gauge;
+}
+}  // namespace
+
+Catalog::Catalog(fs::path db_path, Wal* wal)
+    : db_path_(std::move(db_path)), wal_(wal) {}
+
+Catalog::~Catalog() {
+    if (prefetcher_.joinable()) prefetcher_.join();
+}
+
+void Catalog::load() {
+    // A catalog write that never replaced the file
+    error_code ec;
+    fs::remove(db_path_ / (string(FILE_NAME) + ".tmp"), ec);
+
+    if (!loadFile()) bootstrap();
+
+    for (auto& [_, table] : tables_) {
+        table->attach(this);
+    }
+    openGauge().set(tables_.size());
+}
+
+bool Catalog::loadFile() {
+    ifstream file(db_path_ / FILE_NAME);
+    if (!file.is_open()) return false;
+
+    // version,<n>
+    // table,<name>,<attr>...   followed by
+    // shard,<file>             for each of its shards, in order
+    // view,<name>,<table>.<attr>...  for materialized views
+    // dict,<table>,<attr>      for dictionary encoded attributes
+    // compressed,<table>       for tables with compressed shards
+    // partition,<table>,<attr>,<n>  for tables hash partitioned on attr
+    // cluster,<table>,<attr>   for tables clustered on attr
+    // range,<min>,<max>        after the shard line of a sorted shard
+    // index,<table>,<attr>     for attributes with a B+tree index
+    string line;
+    Entry* table = nullptr;
+
+    while (getline(file, line)) {
+        vector<string> fields = splitFields(line);
+        if (fields.empty()) continue;
+
+        if (fields[0] == "version" && fields.size() == 2) {
+            version_ = stoull(fields[1]);
+        } else if (fields[0] == "table" && fields.size() >= 2) {
+            table = &unopened_[fields[1]];
+            table->attributes.assign(fields.begin() + 2, fields.end());
+        } else if (fields[0] == "shard" && fields.size() == 2 && table) {
+            table->shard_files.push_back(fields[1]);
+        } else if (fields[0] == "range" && table &&
+                   !table->shard_files.empty()) {
+            // Either key may be empty, so the line is split here
+            string_view keys = string_view(line).substr(fields[0].size() + 1);
+            size_t comma = keys.find(',');
+            if (comma == string_view::npos) {
+                errStream() << "Invalid catalog line: " << line << endl;
+                continue;
+            }
+            table->key_ranges[table->shard_files.back()] = {
+                string(keys.substr(0, comma)), string(keys.substr(comma + 1))};
+        } else if (fields[0] == "view" && fields.size() >= 2) {
+            views_[fields[1]].assign(fields.begin() + 2, fields.end());
+        } else if (fields[0] == "dict" && fields.size() == 3 &&
+                   unopened_.contains(fields[1])) {
+            unopened_[fields[1]].encoded.push_back(fields[2]);
+        } else if (fields[0] == "compressed" && fields.size() == 2 &&
+                   unopened_.contains(fields[1])) {
+            unopened_[fields[1]].compressed = true;
+        } else if (fields[0] == "partition" && fields.size() == 4 &&
+                   unopened_.contains(fields[1])) {
+            unopened_[fields[1]].partition_attribute = fields[2];
+            unopened_[fields[1]].partitions = stoul(fields[3]);
+        } else if (fields[0] == "cluster" && fields.size() == 3 &&
+                   unopened_.contains(fields[1])) {
+            unopened_[fields[1]].cluster_attribute = fields[2];
+        } else if (fields[0] == "index" && fields.size() == 3 &&
+                   unopened_.contains(fields[1])) {
+            unopened_[fields[1]].indexes.push_back(fields[2]);
+        } else {
+            errStream() << "Invalid catalog line: " << line << endl;
+        }
+    }
+
+    versionGauge().set(version_);
+    return true;
+}
+
+void Catalog::bootstrap() {
+    if (!fs::exists(db_path_)) return;
+
+    for (const auto& entry : fs::directory_iterator(db_path_)) {
+        if (!entry.is_directory()) continue;
+
+        string name = entry.path().filename().string();
+        tables_[name] = make_shared<Table>(name, db_path_);
+    }
+    persist();
+}
+
+shared_ptr<Table> Catalog::open(const string& name) {
+    static Histogram& open_time = Metrics::instance().histogram(
+        "lmkdb_table_open_seconds",
+        "Time opening a table's shards on first use");
+
+    Entry entry;
+    {
+        lock_guard<mutex> lock(tables_mutex_);
+        auto it = unopened_.find(name);
+        if (it == unopened_.end()) return nullptr;
+        entry = it->second;
+    }
+
+    // Shard files are opened without the lock, so tables open in parallel
+    shared_ptr<Table> table;
+    {
+        LatencyTimer timer(open_time);
+        table = make_shared<Table>(name, db_path_, entry.attributes,
+                                   entry.shard_files, entry.key_ranges);
+        for (const auto& attr : entry.encoded) {
+            table->loadDictionary(attr);
+        }
+        table->setCompressed(entry.compressed);
+        if (entry.partitions) {
+            table->setPartitioning(
+                Partitioning{entry.partition_attribute, entry.partitions});
+        }
+        if (!entry.cluster_attribute.empty()) {
+            table->setClusterAttribute(entry.cluster_attribute);
+        }
+        for (const auto& attr : entry.indexes) {
+            table->openIndex(attr);
+        }
+        table->attach(this);
+    }
+
+    // Another thread may have opened it meanwhile, or it was dropped. Only
+    // the thread registering the table cleans its directory, before anyone
+    // can write to it
+    lock_guard<mutex> lock(tables_mutex_);
+    if (auto it = tables_.find(name); it != tables_.end()) return it->second;
+    auto it = unopened_.find(name);
+    if (it == unopened_.end()) return nullptr;
+    removeUnlisted(name, it->second);
+    unopened_.erase(it);
+
+    tables_[name] = table;
+    openGauge().set(tables_.size());
+    return table;
+}
+
+shared_ptr<Table> Catalog::find(const string& name) {
+    {
+        lock_guard<mutex> lock(tables_mutex_);
+        auto it = tables_.find(name);
+        if (it != tables_.end()) return it->second;
+        if (!unopened_.contains(name)) return nullptr;
+    }
+    return open(name);
+}
+
+void Catalog::prefetch() {
+    vector<string> names;
+    {
+        lock_guard<mutex> lock(tables_mutex_);
+        for (const auto& [name, _] : unopened_) names.push_back(name);
+    }
+    if (names.empty() || prefetcher_.joinable()) return;
+
+    prefetcher_ = thread([this, names = std::move(names)]() {
+        size_t workers =
+            min<size_t>(names.size(), max(1u, thread::hardware_concurrency()));
+        atomic<size_t> next{0};
+
+        vector<thread> threads;
+        for (size_t i = 0; i < workers; ++i) {
+            threads.emplace_back([&]() {
+                for (size_t j = next++; j < names.size(); j = next++) {
+                    open(names[j]);
+                }
+            });
+        }
+        for (auto& t : threads) t.join();
+    });
+}
+
+size_t Catalog::openCount() const {
+    lock_guard<mutex> lock(tables_mutex_);
+    return tables_.size();
+}
+
+shared_ptr<Table> Catalog::create(const string& name,
+                                  const vector<string>& attributes,
+                                  bool compressed,
+                                  const vector<string>& shard_files,
+                                  const Partitioning* partitioning,
+                                  const string& cluster_attribute) {
+    fs::path table_path = db_path_ / name;
+    fs::create_directory(table_path);
+    vector<string> files = shard_files;
+    size_t empty_shards = partitioning ? partitioning->count : 1;
+    for (size_t i = 0; shard_files.empty() && i < empty_shards; ++i) {
+        string file = "shard_" + to_string(i) + ".csv";
+        ofstream(table_path / file).close();
+        files.push_back(file);
+    }
+
+    auto table = make_shared<Table>(name, db_path_, attributes, files);
+    table->setCompressed(compressed);
+    if (partitioning) table->setPartitioning(*partitioning);
+    if (!cluster_attribute.empty()) {
+        table->setClusterAttribute(cluster_attribute);
+    }
+    table->attach(this);
+    {
+        lock_guard<mutex> lock(tables_mutex_);
+        tables_[name] = table;
+        openGauge().set(tables_.size());
+    }
+
+    if (!persist()) {
+        {
+            lock_guard<mutex> lock(tables_mutex_);
+            tables_.erase(name);
+            openGauge().set(tables_.size());
+        }
+        error_code ec;
+        fs::remove_all(table_path, ec);
+        return nullptr;
+    }
+    return table;
+}
+
+bool Catalog::drop(const string& name) {
+    shared_ptr<Table> table;
+    optional<Entry> entry;
+    optional<vector<string>> view;
+    {
+        lock_guard<mutex> lock(tables_mutex_);
+        if (auto it = tables_.find(name); it != tables_.end()) {
+            table = std::move(it->second);
+            tables_.erase(it);
+        }
+        if (auto it = unopened_.find(name); it != unopened_.end()) {
+            entry = std::move(it->second);
+            unopened_.erase(it);
+        }
+        openGauge().set(tables_.size());
+    }
+    if (auto it = views_.find(name); it != views_.end()) {
+        view = std::move(it->second);
+        views_.erase(it);
+    }
+    if (persist()) return true;
+
+    lock_guard<mutex> lock(tables_mutex_);
+    if (table) tables_[name] = std::move(table);
+    if (entry) unopened_[name] = std::move(*entry);
+    if (view) views_[name] = std::move(*view);
+    openGauge().set(tables_.size());
+    return false;
+}
+
+bool Catalog::defineView(const string& name, const vector<string>& join_spec) {
+    views_[name] = join_spec;
+    if (persist()) return true;
+
+    views_.erase(name);
+    return false;
+}
+
+const vector<string>* Catalog::viewDefinition(const string& name) const {
+    auto it = views_.find(name);
+    return it != views_.end() ? &it->second : nullptr;
+}
+
+bool Catalog::persist() {
+    lock_guard<mutex> lock(persist_mutex_);
+
+    // Tables not opened yet are written as they were read
+    map<string, Entry> entries;
+    {
+        lock_guard<mutex> tables_lock(tables_mutex_);
+        for (const auto& [name, entry] : unopened_) entries[name] = entry;
+        for (const auto& [name, table] : tables_) {
+            Partitioning partitioning =
+                table->partitioning().value_or(Partitioning{});
+            entries[name] = {table->attributes(),
+                             table->shardFiles(),
+                             table->encodedAttributes(),
+                             table->compressed(),
+                             partitioning.attribute,
+                             partitioning.count,
+                             table->clusterAttribute().value_or(""),
+                             table->keyRanges(),
+                             table->indexedAttributes()};
+        }
+    }
+
+    ostringstream out;
+    out << "version," << version_ + 1 << "\n";
+    for (const auto& [name, entry] : entries) {
+        out << "table," << name;
+        for (const auto& attr : entry.attributes) {
+            out << "," << attr;
+        }
+        out << "\n";
+
+        for (const auto& file : entry.shard_files) {
+            out << "shard," << file << "\n";
+            if (auto range = entry.key_ranges.find(file);
+                range != entry.key_ranges.end()) {
+                out << "range," << range->second.min << ","
+                    << range->second.max << "\n";
+            }
+        }
+        for (const auto& attr : entry.encoded) {
+            out << "dict," << name << "," << attr << "\n";
+        }
+        if (entry.compressed) out << "compressed," << name << "\n";
+        if (entry.partitions) {
+            out << "partition," << name << "," << entry.partition_attribute
+                << "," << entry.partitions << "\n";
+        }
+        if (!entry.cluster_attribute.empty()) {
+            out << "cluster," << name << "," << entry.cluster_attribute
+                << "\n";
+        }
+        for (const auto& attr : entry.indexes) {
+            out << "index," << name << "," << attr << "\n";
+        }
+    }
+    for (const auto& [name, join_spec] : views_) {
+        out << "view," << name;
+        for (const auto& token : join_spec) {
+            out << "," << token;
+        }
+        out << "\n";
+    }
+
+    // Readers of the catalog see either the old or the new file
+    fs::path path = db_path_ / FILE_NAME;
+    fs::path temp_path = path.string() + ".tmp";
+    {
+        ofstream file(temp_path, ios::trunc);
+        file << out.str();
+        file.close();
+        if (!file) {
+            errStream() << "Failed to write catalog " << temp_path << endl;
+            return false;
+        }
+    }
+    if (!renameDurably(temp_path, path)) {
+        errStream() << "Failed to replace catalog " << path << endl;
+        return false;
+    }
+
+    version_++;
+    versionGauge().set(version_);
+    return true;
+}
+
+void Catalog::removeUnlisted(const string& name, const Entry& entry) const {
+    fs::path dir = db_path_ / name;
+    set<string> listed(entry.shard_files.begin(), entry.shard_files.end());
+    listed.insert("metadata.txt");
+    for (const auto& attr : entry.encoded) {
+        listed.insert("dict_" + attr + ".txt");
+    }
+    for (const auto& attr : entry.indexes) {
+        listed.insert("index_" + attr + ".bt");
+    }
+
+    error_code ec;
+    for (const auto& file : fs::directory_iterator(dir, ec)) {
+        string file_name = file.path().filename().string();
+        if (!file.is_regular_file() || listed.contains(file_name)) continue;
+
+        BufferPool::instance().invalidate(file.path().string());
+        fs::remove(file.path(), ec);
+    }
+}
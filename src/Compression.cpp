@@ -0,0 +1,200 @@
+#include "Compression.hpp"
+#include <cstring>
+#include <fstream>
+
+namespace fs = std::filesystem;
+using namespace std;
+
+namespace {
+constexpr size_t MIN_MATCH = 4;
+constexpr size_t MAX_OFFSET = 65535;
+constexpr int HASH_BITS = 14;
+constexpr char MAGIC[4] = {'L', 'M', 'K', 'Z'};
+constexpr size_t BLOCK_ENTRY_SIZE = 16;
+constexpr size_t TRAILER_SIZE = 8 + 4 + sizeof(MAGIC);
+
+uint32_t hashOf(const char* p) {
+    uint32_t sequence;
+    memcpy(&sequence, p, sizeof(sequence));
+    return (sequence * 2654435761u) >> (32 - HASH_BITS);
+}
+
+// Lengths of 15 and more continue in bytes of 255 and a final smaller one
+void writeLength(string& out, size_t length) {
+    for (; length >= 255; length -= 255) out += char(255);
+    out += char(length);
+}
+
+void writeSequence(string& out, const char* literals, size_t literal_length,
+                   size_t match_length, size_t offset) {
+    size_t match_code = match_length ? match_length - MIN_MATCH : 0;
+    out += char((min<size_t>(literal_length, 15) << 4) |
+                min<size_t>(match_code, 15));
+
+    if (literal_length >= 15) writeLength(out, literal_length - 15);
+    out.append(literals, literal_length);
+
+    // The last sequence ends the input after its literals
+    if (!match_length) return;
+
+    out += char(offset & 0xff);
+    out += char(offset >> 8);
+    if (match_code >= 15) writeLength(out, match_code - 15);
+}
+
+bool readLength(const unsigned char*& in, const unsigned char* end,
+                size_t& length) {
+    if (length != 15) return true;
+    while (true) {
+        if (in == end) return false;
+        unsigned char byte = *in++;
+        length += byte;
+        if (byte != 255) return true;
+    }
+}
+
+template <typename T>
+void put(ostream& out, T value) {
+    out.write(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+template <typename T>
+T get(const char* p) {
+    T value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+}  // namespace
+
+void lzCompress(string_view input, string& output) {
+    const char* src = input.data();
+    const size_t n = input.size();
+
+    // Last position each hashed 4 byte sequence was seen at, plus one
+    vector<uint32_t> table(size_t(1) << HASH_BITS, 0);
+    size_t anchor = 0, pos = 0;
+
+    while (pos + MIN_MATCH <= n) {
+        uint32_t& slot = table[hashOf(src + pos)];
+        size_t candidate = slot;
+        slot = static_cast<uint32_t>(pos + 1);
+
+        if (candidate == 0 || pos - (candidate - 1) > MAX_OFFSET ||
+            memcmp(src + candidate - 1, src + pos, MIN_MATCH) != 0) {
+            pos++;
+            continue;
+        }
+        candidate--;
+
+        size_t length = MIN_MATCH;
+        while (pos + length < n &&
+               src[candidate + length] == src[pos + length]) {
+            length++;
+        }
+
+        writeSequence(output, src + anchor, pos - anchor, length,
+                      pos - candidate);
+        pos += length;
+        anchor = pos;
+    }
+
+    writeSequence(output, src + anchor, n - anchor, 0, 0);
+}
+
+bool lzDecompress(string_view input, size_t raw_size, string& output) {
+    output.resize(raw_size);
+
+    auto in = reinterpret_cast<const unsigned char*>(input.data());
+    const unsigned char* end = in + input.size();
+    char* out = output.data();
+    size_t written = 0;
+
+    while (in < end) {
+        unsigned char token = *in++;
+
+        size_t literal_length = token >> 4;
+        if (!readLength(in, end, literal_length) ||
+            literal_length > size_t(end - in) ||
+            literal_length > raw_size - written) {
+            return false;
+        }
+        memcpy(out + written, in, literal_length);
+        in += literal_length;
+        written += literal_length;
+
+        if (in == end) break;
+
+        if (end - in < 2) return false;
+        size_t offset = in[0] | (size_t(in[1]) << 8);
+        in += 2;
+
+        size_t match_length = token & 0x0f;
+        if (!readLength(in, end, match_length)) return false;
+        match_length += MIN_MATCH;
+
+        if (offset == 0 || offset > written ||
+            match_length > raw_size - written) {
+            return false;
+        }
+
+        // Matches may overlap the bytes they produce
+        const char* match = out + written - offset;
+        if (offset >= match_length) {
+            memcpy(out + written, match, match_length);
+        } else {
+            for (size_t i = 0; i < match_length; ++i) {
+                out[written + i] = match[i];
+            }
+        }
+        written += match_length;
+    }
+
+    return written == raw_size;
+}
+
+void BlockIndex::write(ostream& out) const {
+    for (const auto& block : blocks) {
+        put<uint64_t>(out, block.offset);
+        put<uint32_t>(out, block.stored_size);
+        put<uint32_t>(out, block.raw_size);
+    }
+    put<uint64_t>(out, raw_size);
+    put<uint32_t>(out, static_cast<uint32_t>(blocks.size()));
+    out.write(MAGIC, sizeof(MAGIC));
+}
+
+shared_ptr<const BlockIndex> BlockIndex::read(const fs::path& path) {
+    error_code ec;
+    uintmax_t file_size = fs::file_size(path, ec);
+    if (ec || file_size < TRAILER_SIZE) return nullptr;
+
+    ifstream file(path, ios::binary);
+    char trailer[TRAILER_SIZE];
+    file.seekg(static_cast<streamoff>(file_size - TRAILER_SIZE));
+    file.read(trailer, TRAILER_SIZE);
+    if (!file || memcmp(trailer + 12, MAGIC, sizeof(MAGIC)) != 0) {
+        return nullptr;
+    }
+
+    auto index = make_shared<BlockIndex>();
+    index->raw_size = get<uint64_t>(trailer);
+    index->stored_size = file_size;
+
+    uint32_t count = get<uint32_t>(trailer + 8);
+    uintmax_t entries_size = uintmax_t(count) * BLOCK_ENTRY_SIZE;
+    if (entries_size > file_size - TRAILER_SIZE) return nullptr;
+
+    string entries(entries_size, '\0');
+    file.seekg(static_cast<streamoff>(file_size - TRAILER_SIZE -
+                                      entries_size));
+    file.read(entries.data(), static_cast<streamsize>(entries_size));
+    if (!file) return nullptr;
+
+    index->blocks.resize(count);
+    for (uint32_t i = 0; i < count; ++i) {
+        const char* entry = entries.data() + i * BLOCK_ENTRY_SIZE;
+        index->blocks[i] = {get<uint64_t>(entry), get<uint32_t>(entry + 8),
+                             get<uint32_t>(entry + 12)};
+    }
+    return index;
+}
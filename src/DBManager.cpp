@@ -1,93 +1,363 @@
 #include "DBManager.hpp"
+#include <algorithm>
 #include <filesystem>
+#include <functional>
 #include <fstream>
+#include <iomanip>
 #include <iostream>
 #include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <sstream>
 #include <string>
 #include <unordered_map>
 #include <utility>
 #include <vector>
+#include "Arrow.hpp"
+#include "BufferPool.hpp"
+#include "Metrics.hpp"
+#include "Profile.hpp"
+#include "Settings.hpp"
+#include "utils.hpp"
 
 namespace fs = std::filesystem;
 using namespace std;
 
-DBManager::DBManager(string dbPath) : database_path(std::move(dbPath)) {
-    fs::create_directory(database_path);
-    loadTables(database_path);
+namespace {
+// Adds a plan line to the profile of an explain, if one is running. Returns
+// true if the command should only be planned, not executed.
+bool planOnly(QueryProfile* profile) {
+    return profile && !profile->analyze();
+}
+
+void planScan(QueryProfile& profile, int depth, const Table& table) {
+    string line = "Scan " + table.getName() + ": " +
+                  to_string(table.shardCount()) + " shards, " +
+                  formatBytes(table.dataSize());
+
+    uintmax_t stored = table.storedSize();
+    if (table.compressed() && stored > 0) {
+        ostringstream ratio;
+        ratio << fixed << setprecision(1)
+              << double(table.dataSize()) / double(stored);
+        line += ", " + formatBytes(stored) + " on disk (" + ratio.str() +
+                "x compression)";
+    }
+    profile.addPlan(depth, line);
+}
+
+// Reads of a clustered table that search its sorted shards
+void planClusteredScan(QueryProfile& profile, int depth, const Table& table,
+                       const KeyBounds& bounds) {
+    auto key_ranges = table.keyRanges();
+    size_t searched = ranges::count_if(key_ranges, [&](const auto& entry) {
+        return bounds.overlaps(entry.second.min, entry.second.max);
+    });
+
+    string line = (bounds.bounded() ? "Range scan " : "Ordered scan ") +
+                  table.getName() + " on " + *table.clusterAttribute() +
+                  ": ";
+    line += bounds.lower
+                ? "binary search in " + to_string(searched) + " of " +
+                      to_string(key_ranges.size()) + " sorted shards"
+                : to_string(searched) + " of " + to_string(key_ranges.size()) +
+                      " sorted shards in key order";
+    profile.addPlan(depth, line + ", merged with the delta sorted in memory");
+}
+
+// Reads and deletes that search the index of an attribute
+void planIndexScan(QueryProfile& profile, int depth, const Table& table,
+                   const IndexScan& scan) {
+    auto index = table.index(scan.attribute);
+    string line = "Index " + string(scan.prefix.empty() ? "range" : "prefix") +
+                  " scan " + table.getName() + " on " + scan.attribute +
+                  ": B+tree, " + to_string(index->size()) + " entries, " +
+                  "height " + to_string(index->height()) +
+                  ", rows read by offset";
+    profile.addPlan(depth, line);
+}
+
+string conditionText(const vector<Condition>& where) {
+    string text;
+    for (const auto& condition : where) text += " " + condition.text();
+    return text;
 }
 
-DBManager::~DBManager() = default;
+// Returns the depth the input of the output (and sort) operators starts at.
+// Presorted input is already in the requested order.
+int planOutput(QueryProfile& profile, const optional<OrderBy>& order,
+               bool presorted = false) {
+    profile.addPlan(0, "Output: stdout");
+    if (!order) return 1;
+
+    string line = "Sort on " + order->attribute +
+                  (order->descending ? " desc" : "") + ": ";
+    if (presorted) {
+        line += "none, rows arrive clustered on " + order->attribute;
+        if (order->limit) line += ", limit " + to_string(*order->limit);
+    } else if (order->limit && *order->limit <= RowSorter::TOP_K_HEAP_LIMIT) {
+        line += "top-K heap, k=" + to_string(*order->limit);
+    } else {
+        line += "parallel in-memory sort, external merge above " +
+                formatBytes(Settings::instance().sort_memory.load());
+        if (order->limit) line += ", limit " + to_string(*order->limit);
+    }
+    profile.addPlan(1, line);
+    return 2;
+}
 
-string DBManager::NewTablePath(const string& table_name) const {
-    return database_path + table_name;
+// How durable an insert is when it returns
+string walPlan() {
+    Settings& settings = Settings::instance();
+    switch (walMode()) {
+        case WalMode::None:
+            return "no write-ahead log";
+        case WalMode::Sync:
+            return "write-ahead log, fsync per row";
+        case WalMode::Group:
+            break;
+    }
+
+    string plan = "write-ahead log, group commit";
+    if (size_t delay = settings.wal_group_ms) {
+        plan += " every " + to_string(delay) + "ms or " +
+                to_string(settings.wal_group_records.load()) + " rows";
+    }
+    return plan;
+}
+
+// The "<table>.<attr>" tokens of a join, in join order
+vector<string> joinSpec(const vector<string>& tables,
+                        unordered_map<string, string>& attrMap) {
+    vector<string> spec;
+    for (const auto& table : tables) {
+        spec.push_back(table + "." + attrMap[table]);
+    }
+    return spec;
 }
 
-void DBManager::loadTables(const string& directory_path) {
-    for (const auto& table : fs::directory_iterator(directory_path)) {
-        if (fs::is_directory(table)) {
-            string table_name = table.path().filename();
-            tables.emplace(table_name, make_shared<Table>(table_name));
+vector<uint64_t> versionsOf(const vector<shared_ptr<Table>>& tables) {
+    vector<uint64_t> versions;
+    for (const auto& table : tables) {
+        versions.push_back(table->version());
+    }
+    return versions;
+}
+}  // namespace
+
+DBManager::DBManager(string dbPath)
+    : database_path(std::move(dbPath)),
+      wal(database_path),
+      catalog(database_path, &wal) {
+    fs::create_directory(database_path);
+
+    // Tables are only registered here, their shards are opened on first use
+    catalog.load();
+    replayWal();
+    if (Settings::instance().prefetch_tables) catalog.prefetch();
+}
+
+DBManager::~DBManager() {
+    wal.checkpoint();
+}
+
+void DBManager::replayWal() {
+    auto records = Wal::read(wal.path());
+    size_t applied = 0;
+
+    for (const auto& record : records) {
+        // Rows of dropped tables went with them
+        auto table = findTable(record.table);
+        if (!table) continue;
+
+        bool rewritten;
+        if (!table->redoAppend(record.shard_file, record.offset, record.row,
+                               rewritten)) {
+            break;
         }
+        if (rewritten) {
+            wal.touched(fs::path(table->tablePath()) / record.shard_file);
+            applied++;
+        }
+    }
+
+    if (applied > 0) {
+        outStream() << "Recovered " << applied
+                    << " rows from the write-ahead log" << endl;
     }
+    wal.checkpoint();
 }
 
 shared_ptr<Table> DBManager::findTable(const string& table_name) {
-    auto it = tables.find(table_name);
-    if (it != tables.end()) {
-        return it->second;
-    }
-    return nullptr;
+    return catalog.find(table_name);
 }
 
 bool DBManager::createTable(const string& table_name,
-                            const vector<string>& attributes) {
-    if (tables.find(table_name) != tables.end()) {
-        cerr << "Table already exists: " << table_name << endl;
+                            const vector<string>& attributes,
+                            bool compressed,
+                            const optional<Partitioning>& partitioning,
+                            const optional<string>& cluster_attribute) {
+    unique_lock lock(catalog_mutex);
+
+    if (findTable(table_name)) {
+        errStream() << "Table already exists: " << table_name << endl;
         return false;
     }
+    if (partitioning) {
+        if (ranges::find(attributes, partitioning->attribute) ==
+            attributes.end()) {
+            errStream() << "Unknown partition attribute: "
+                        << partitioning->attribute << endl;
+            return false;
+        }
+        // Compressed tables seal their tail shard, partitions are all
+        // appended to
+        if (compressed) {
+            errStream() << "Partitioned tables cannot be compressed" << endl;
+            return false;
+        }
+    }
 
-    string table_path = NewTablePath(table_name);
-
-    fs::create_directory(table_path);
-    ofstream metadata(table_path + "/metadata.txt");
-    ofstream init_shard(table_path + "/shard_0.csv");
+    if (cluster_attribute) {
+        if (ranges::find(attributes, *cluster_attribute) ==
+            attributes.end()) {
+            errStream() << "Unknown cluster attribute: " << *cluster_attribute
+                        << endl;
+            return false;
+        }
+        // Rows are kept in key order across the sorted shards and merged in
+        // from one unsorted delta
+        if (compressed || partitioning) {
+            errStream() << "Clustered tables cannot be compressed or "
+                           "partitioned"
+                        << endl;
+            return false;
+        }
+    }
 
-    int idx = 0;
-    for (const auto& attr : attributes) {
-        metadata << attr << "," << idx++ << "\n";
+    if (auto* profile = QueryProfile::current()) {
+        string layout = partitioning
+                            ? to_string(partitioning->count) +
+                                  " hash partitions on " +
+                                  partitioning->attribute
+                        : cluster_attribute
+                            ? "clustered on " + *cluster_attribute
+                            : "one shard";
+        profile->addPlan(0, "Create table " + table_name + ": " +
+                                to_string(attributes.size()) +
+                                " attributes, " + layout +
+                                (compressed ? ", compressed" : ""));
+        if (planOnly(profile)) return true;
     }
 
-    tables.emplace(table_name, make_shared<Table>(table_name));
-    return true;
+    return catalog.create(table_name, attributes, compressed, {},
+                          partitioning ? &*partitioning : nullptr,
+                          cluster_attribute.value_or("")) != nullptr;
 }
 
 bool DBManager::insertRecord(const string& table_name,
                              const unordered_map<string, string>& record) {
-    if (auto table = findTable(table_name)) {
-        return table->insert(record);
+    bool inserted = false;
+    {
+        shared_lock lock(catalog_mutex);
+        if (rejectView(table_name)) return false;
+        auto table = findTable(table_name);
+        if (!table) return false;
+
+        if (auto* profile = QueryProfile::current()) {
+            string shard = table->partitioning()
+                               ? "the partition of the row's " +
+                                     table->partitioning()->attribute
+                               : "tail shard";
+            profile->addPlan(0, "Append to " + shard + " of " + table_name +
+                                    ", " + walPlan());
+            if (planOnly(profile)) return true;
+        }
+        inserted = table->insert(record);
     }
-    return false;
+
+    // Inserts hold the catalog lock shared from logging a row to appending
+    // it, so the log is only emptied while none is in between
+    if (wal.needsCheckpoint()) {
+        unique_lock lock(catalog_mutex);
+        if (wal.needsCheckpoint()) wal.checkpoint();
+    }
+    return inserted;
 }
 
 void DBManager::readTable(const string& table_name,
-                          const vector<int>& line_numbers) {
+                          const vector<int>& line_numbers,
+                          const vector<Condition>& where,
+                          const optional<OrderBy>& order) {
+    shared_lock lock(catalog_mutex);
     if (auto table = findTable(table_name)) {
-        table->read(line_numbers);
+        if (auto* profile = QueryProfile::current()) {
+            // Same choice as Table::read
+            auto bounds = table->clusterBounds(where);
+            bool clustered =
+                bounds && line_numbers.empty() &&
+                (bounds->bounded() || table->clusteredOrder(order));
+
+            int depth = planOutput(
+                *profile, order, clustered && table->clusteredOrder(order));
+            if (!line_numbers.empty()) {
+                profile->addPlan(depth++, "Filter: " +
+                                              to_string(line_numbers.size()) +
+                                              " row ids");
+            }
+            if (!where.empty()) {
+                profile->addPlan(depth++, "Filter:" + conditionText(where));
+            }
+            if (viewIsStale(table_name)) {
+                profile->addPlan(depth, "Refresh materialized view " +
+                                            table_name +
+                                            ": joined tables changed");
+            }
+            auto scan = clustered || !line_numbers.empty()
+                            ? nullopt
+                            : table->indexScan(where);
+            if (clustered) {
+                planClusteredScan(*profile, depth, *table, *bounds);
+            } else if (scan) {
+                planIndexScan(*profile, depth, *table, *scan);
+            } else {
+                planScan(*profile, depth, *table);
+            }
+            if (planOnly(profile)) return;
+        }
+        if (!refreshView(table_name, *table)) return;
+        table->read(line_numbers, where, order);
     } else {
-        cerr << "Table does not exist: " << table_name << endl;
+        errStream() << "Table does not exist: " << table_name << endl;
     }
 }
 
 bool DBManager::updateRecord(const string& table_name, size_t id,
                              const unordered_map<string, string>& attrMap) {
+    shared_lock lock(catalog_mutex);
+    if (rejectView(table_name)) return false;
     if (auto table = findTable(table_name)) {
+        if (auto* profile = QueryProfile::current()) {
+            profile->addPlan(0, "Copy-on-write rewrite of the shard holding "
+                                "row " + to_string(id));
+            planScan(*profile, 1, *table);
+            if (planOnly(profile)) return true;
+        }
         return table->update(id, attrMap);
     }
     return false;
 }
 
 bool DBManager::deleteByIndex(const string& table_name, size_t id) {
+    shared_lock lock(catalog_mutex);
+    if (rejectView(table_name)) return false;
     if (auto table = findTable(table_name)) {
+        if (auto* profile = QueryProfile::current()) {
+            profile->addPlan(0, "Copy-on-write rewrite of shards, dropping "
+                                "row " + to_string(id));
+            planScan(*profile, 1, *table);
+            if (planOnly(profile)) return true;
+        }
         return table->deleteByIndex(id);
     }
     return false;
@@ -95,53 +365,457 @@ bool DBManager::deleteByIndex(const string& table_name, size_t id) {
 
 bool DBManager::deleteByAttributes(
     const string& table_name, const unordered_map<string, string>& attrMap) {
+    vector<Condition> where;
+    for (const auto& [attr, value] : attrMap) {
+        where.push_back({attr, CompareOp::Equal, value});
+    }
+    return deleteWhere(table_name, where);
+}
+
+bool DBManager::deleteWhere(const string& table_name,
+                            const vector<Condition>& where) {
+    shared_lock lock(catalog_mutex);
+    if (rejectView(table_name)) return false;
     if (auto table = findTable(table_name)) {
-        return table->deleteByAttributes(attrMap);
+        if (auto* profile = QueryProfile::current()) {
+            auto scan = table->indexScan(where);
+            profile->addPlan(0, scan ? "Copy-on-write rewrite of the shards "
+                                       "holding rows the index finds"
+                                     : "Copy-on-write rewrite of shards with "
+                                       "matching rows");
+            profile->addPlan(1, "Filter:" + conditionText(where));
+            if (scan) {
+                planIndexScan(*profile, 2, *table, *scan);
+            } else {
+                planScan(*profile, 2, *table);
+            }
+            if (planOnly(profile)) return true;
+        }
+        return table->deleteWhere(where);
     }
     return false;
 }
 
-bool DBManager::deleteTable(const string& table_name) {
+bool DBManager::createIndex(const string& table_name, const string& attr) {
+    // Exclusive like encoding, the catalog records the index once it is
+    // built
+    unique_lock lock(catalog_mutex);
+    if (rejectView(table_name)) return false;
+
+    auto table = findTable(table_name);
+    if (!table) {
+        errStream() << "Table does not exist: " << table_name << endl;
+        return false;
+    }
+    if (auto* profile = QueryProfile::current()) {
+        profile->addPlan(0, "Bulk load B+tree index on " + attr +
+                                " from a sorted scan");
+        planScan(*profile, 1, *table);
+        if (planOnly(profile)) return true;
+    }
+
+    if (!table->createIndex(attr)) return false;
+    return catalog.persist();
+}
+
+bool DBManager::exportTable(const string& table_name, const string& file) {
+    shared_lock lock(catalog_mutex);
+    auto table = findTable(table_name);
+    if (!table) {
+        errStream() << "Table does not exist: " << table_name << endl;
+        return false;
+    }
+    if (auto* profile = QueryProfile::current()) {
+        profile->addPlan(0, "Write Arrow IPC file " + file +
+                                ": record batches of up to 64K rows, "
+                                "shards converted in parallel");
+        planScan(*profile, 1, *table);
+        if (planOnly(profile)) return true;
+    }
+
+    if (!refreshView(table_name, *table)) return false;
+    return table->exportTo(file);
+}
+
+bool DBManager::importTable(const string& table_name, const string& file) {
+    // Exclusive like encoding: the table may be created, and the log is
+    // emptied before the tail shard is sealed
+    unique_lock lock(catalog_mutex);
+    if (rejectView(table_name)) return false;
+
+    ArrowReader reader;
+    if (!reader.open(file)) {
+        errStream() << reader.error() << endl;
+        return false;
+    }
+
+    auto table = findTable(table_name);
+    if (auto* profile = QueryProfile::current()) {
+        string action = table ? "Append" : "Create table and append";
+        profile->addPlan(0, action + " shards written in parallel from " +
+                                to_string(reader.batches()) +
+                                " record batches of " + file);
+        if (planOnly(profile)) return true;
+    }
+
+    if (!table) {
+        const auto& fields = reader.fields();
+        for (const auto& field : fields) {
+            bool repeated = ranges::count(fields, field) > 1;
+            if (field.empty() || field == "id" || repeated ||
+                field.find_first_of(" ,:=<>") != string::npos) {
+                errStream() << "Invalid attribute name in " << file << ": "
+                            << field << endl;
+                return false;
+            }
+        }
+        table = catalog.create(table_name, fields);
+        if (!table) return false;
+    }
+
+    wal.checkpoint();
+    return table->importFrom(reader);
+}
+
+bool DBManager::encodeAttribute(const string& table_name,
+                                const string& attr) {
+    // Exclusive, readers never see rows and dictionaries out of step
+    unique_lock lock(catalog_mutex);
+    if (rejectView(table_name)) return false;
+
     auto table = findTable(table_name);
-    string path = table->tablePath();
+    if (!table) {
+        errStream() << "Table does not exist: " << table_name << endl;
+        return false;
+    }
+    if (auto* profile = QueryProfile::current()) {
+        profile->addPlan(0, "Copy-on-write rewrite of shards, replacing " +
+                                attr + " by dictionary codes");
+        planScan(*profile, 1, *table);
+        if (planOnly(profile)) return true;
+    }
 
-    if (!fs::exists(path)) {
-        cerr << "Table does not exist: " << table_name << endl;
+    if (!table->encodeColumn(attr)) return false;
+    return catalog.persist();
+}
+
+bool DBManager::deleteTable(const string& table_name) {
+    unique_lock lock(catalog_mutex);
+
+    auto table = findTable(table_name);
+    if (!table || !fs::exists(table->tablePath())) {
+        errStream() << "Table does not exist: " << table_name << endl;
         return false;
     }
+    if (auto* profile = QueryProfile::current()) {
+        profile->addPlan(0, "Drop table " + table_name + ": remove " +
+                                to_string(table->shardCount()) +
+                                " shards, " +
+                                formatBytes(table->dataSize()));
+        if (planOnly(profile)) return true;
+    }
 
-    fs::remove_all(path);
-    tables.erase(table_name);
+    // Files go once the catalog no longer lists them
+    if (!catalog.drop(table_name)) return false;
+    BufferPool::instance().invalidate(
+        (fs::path(table->tablePath()) / "").string());
+    fs::remove_all(table->tablePath());
 
-    cout << "Table deleted successfully: " << table_name << endl;
+    // A new table of the same name must not replay the rows of this one
+    wal.checkpoint();
+    {
+        lock_guard<mutex> views_lock(views_mutex);
+        view_versions.erase(table_name);
+    }
+
+    outStream() << "Table deleted successfully: " << table_name << endl;
 
     return true;
 }
 
 bool DBManager::joinTables(const vector<string>& tables,
-                           unordered_map<string, string>& attrMap) {
+                           unordered_map<string, string>& attrMap,
+                           const optional<OrderBy>& order) {
+    shared_lock lock(catalog_mutex);
+
     try {
         if (tables.size() < 2) {
-            cerr << "Error: At least two tables are required for a join."
-                 << endl;
+            errStream()
+                << "Error: At least two tables are required for a join."
+                << endl;
             return false;
         }
 
-        auto current_table = make_shared<Table>(tables[0]);
+        vector<shared_ptr<Table>> inputs;
+        for (const auto& name : tables) {
+            auto table = findTable(name);
+            if (!table) {
+                errStream() << "Table does not exist: " << name << endl;
+                return false;
+            }
+            if (!planOnly(QueryProfile::current()) &&
+                !refreshView(name, *table)) {
+                return false;
+            }
+            inputs.push_back(table);
+        }
+
         string join_attr = attrMap[tables[0]];
 
-        for (size_t i = 1; i < tables.size(); ++i) {
-            auto next_table = make_shared<Table>(tables[i]);
+        if (auto* profile = QueryProfile::current()) {
+            // Every join runs one task per shard of the first table, each
+            // hashing its shard and probing all shards of the next table
+            size_t tasks = inputs[0]->shardCount();
+            size_t batch = Settings::instance().join_batch_size;
+            string probe =
+                batch ? " in batches of " + to_string(batch) + " rows"
+                      : " row by row";
 
-            current_table = current_table->join(*next_table, join_attr,
-                                                attrMap[next_table->getName()]);
+            // Joins pair partitions while every table so far is partitioned
+            // like the first one on its join attribute
+            auto pairwise = [&](size_t i) {
+                for (size_t j = 1; j <= i; ++j) {
+                    if (!inputs[0]->coPartitioned(*inputs[j], join_attr,
+                                                  attrMap[tables[j]])) {
+                        return false;
+                    }
+                }
+                return true;
+            };
+
+            // Joins merge while every table so far is clustered on its join
+            // attribute, their results are clustered on the first one's
+            auto merged = [&](size_t i) {
+                for (size_t j = 0; j <= i; ++j) {
+                    const string& attr = j ? attrMap[tables[j]] : join_attr;
+                    if (inputs[j]->clusterAttribute() != attr) return false;
+                }
+                return true;
+            };
+
+            function<void(size_t, int)> planJoin = [&](size_t i, int depth) {
+                if (i == 0) {
+                    planScan(*profile, depth, *inputs[0]);
+                    return;
+                }
+                if (merged(i)) {
+                    profile->addPlan(
+                        depth, "Merge join " + tables[0] + "." + join_attr +
+                                   " = " + tables[i] + "." +
+                                   attrMap[tables[i]] +
+                                   ": one pass over both inputs in key "
+                                   "order, output clustered on " +
+                                   join_attr);
+                    planJoin(i - 1, depth + 1);
+                    planScan(*profile, depth + 1, *inputs[i]);
+                    return;
+                }
+                bool codes = inputs[0]->encoded(join_attr) &&
+                             inputs[i]->encoded(attrMap[tables[i]]);
+                string tasks_line =
+                    pairwise(i)
+                        ? to_string(tasks) +
+                              " tasks (one per co-partitioned pair), build "
+                              "on left partition, probe the same right "
+                              "partition"
+                        : to_string(tasks) +
+                              " tasks (one thread per left shard), build on "
+                              "left shard, probe " +
+                              to_string(inputs[i]->shardCount()) +
+                              " right shards";
+                profile->addPlan(
+                    depth, "Hash join " + tables[0] + "." + join_attr + " = " +
+                               tables[i] + "." + attrMap[tables[i]] + ": " +
+                               tasks_line + probe +
+                               (codes ? ", on dictionary codes" : ""));
+                planJoin(i - 1, depth + 1);
+                planScan(*profile, depth + 1, *inputs[i]);
+            };
+
+            int depth = planOutput(
+                *profile, order,
+                merged(inputs.size() - 1) && order && !order->descending &&
+                    order->attribute == join_attr);
+            string spec;
+            for (const auto& token : joinSpec(tables, attrMap)) {
+                spec += token + " ";
+            }
+
+            if (join_cache.contains(spec, versionsOf(inputs))) {
+                profile->addPlan(depth, "Cached join result");
+            } else {
+                planJoin(inputs.size() - 1, depth);
+            }
+            if (planOnly(profile)) return true;
         }
 
-        current_table->read({});
+        join(inputs, tables, attrMap)->read({}, {}, order);
         return true;
 
     } catch (const exception& e) {
-        cerr << "Error in join operation: " << e.what() << endl;
+        errStream() << "Error in join operation: " << e.what() << endl;
         return false;
     }
 }
+
+shared_ptr<Table> DBManager::join(const vector<shared_ptr<Table>>& inputs,
+                                  const vector<string>& tables,
+                                  unordered_map<string, string>& attrMap) {
+    string spec;
+    for (const auto& token : joinSpec(tables, attrMap)) {
+        spec += token + " ";
+    }
+
+    // Versions are taken before the inputs are read, a write racing with
+    // the join then only makes the cached result look older than it is
+    vector<uint64_t> versions = versionsOf(inputs);
+    if (auto cached = join_cache.find(spec, versions)) {
+        return cached;
+    }
+
+    string join_attr = attrMap[tables[0]];
+    auto current_table = inputs[0];
+    for (size_t i = 1; i < inputs.size(); ++i) {
+        current_table =
+            current_table->join(*inputs[i], join_attr, attrMap[tables[i]]);
+    }
+
+    join_cache.insert(spec, std::move(versions), current_table);
+    return current_table;
+}
+
+bool DBManager::createMaterialized(const string& name,
+                                   const vector<string>& tables,
+                                   unordered_map<string, string>& attrMap) {
+    unique_lock lock(catalog_mutex);
+
+    if (findTable(name)) {
+        errStream() << "Table already exists: " << name << endl;
+        return false;
+    }
+    if (tables.size() < 2) {
+        errStream() << "Error: At least two tables are required for a join."
+                    << endl;
+        return false;
+    }
+
+    // Columns are named after the attributes of the joined tables, qualified
+    // with the table name where they would clash
+    unordered_map<string, int> occurrences;
+    for (const auto& table_name : tables) {
+        auto table = findTable(table_name);
+        if (!table) {
+            errStream() << "Table does not exist: " << table_name << endl;
+            return false;
+        }
+        if (isView(table_name)) {
+            errStream() << "Materialized views can only join tables: "
+                        << table_name << endl;
+            return false;
+        }
+        for (const auto& attr : table->attributes()) {
+            occurrences[attr]++;
+        }
+    }
+
+    vector<string> attributes;
+    for (const auto& table_name : tables) {
+        for (const auto& attr : findTable(table_name)->attributes()) {
+            attributes.push_back(occurrences[attr] > 1
+                                     ? table_name + "." + attr
+                                     : attr);
+        }
+    }
+
+    if (auto* profile = QueryProfile::current()) {
+        string spec;
+        for (const auto& token : joinSpec(tables, attrMap)) {
+            spec += " " + token;
+        }
+        profile->addPlan(0, "Create materialized view " + name + ": join" +
+                                spec + ", refreshed when read");
+        if (planOnly(profile)) return true;
+    }
+
+    auto view = catalog.create(name, attributes);
+    if (!view) return false;
+    if (!catalog.defineView(name, joinSpec(tables, attrMap))) {
+        if (catalog.drop(name)) fs::remove_all(view->tablePath());
+        return false;
+    }
+
+    try {
+        return refreshView(name, *view);
+    } catch (const exception& e) {
+        errStream() << "Error in join operation: " << e.what() << endl;
+        return false;
+    }
+}
+
+bool DBManager::isView(const string& table_name) const {
+    return catalog.viewDefinition(table_name) != nullptr;
+}
+
+bool DBManager::rejectView(const string& table_name) const {
+    if (!isView(table_name)) return false;
+
+    errStream() << "Materialized view " << table_name
+                << " can not be modified, change the joined tables instead"
+                << endl;
+    return true;
+}
+
+bool DBManager::viewIsStale(const string& table_name) {
+    const vector<string>* definition = catalog.viewDefinition(table_name);
+    if (!definition) return false;
+
+    vector<uint64_t> versions;
+    for (const auto& token : *definition) {
+        auto table = findTable(token.substr(0, token.find('.')));
+        versions.push_back(table ? table->version() : 0);
+    }
+
+    lock_guard<mutex> lock(views_mutex);
+    auto it = view_versions.find(table_name);
+    return it == view_versions.end() || it->second != versions;
+}
+
+bool DBManager::refreshView(const string& table_name, Table& view) {
+    static Counter& refreshes = Metrics::instance().counter(
+        "lmkdb_materialized_refreshes_total",
+        "Materialized views recomputed because a joined table changed");
+
+    const vector<string>* definition = catalog.viewDefinition(table_name);
+    if (!definition) return true;
+
+    vector<string> tables;
+    unordered_map<string, string> attrMap;
+    vector<shared_ptr<Table>> inputs;
+
+    for (const auto& token : *definition) {
+        size_t dot = token.find('.');
+        string name = token.substr(0, dot);
+
+        auto table = findTable(name);
+        if (!table) {
+            errStream() << "Table " << name << " joined by materialized view "
+                        << table_name << " does not exist" << endl;
+            return false;
+        }
+        tables.push_back(name);
+        attrMap[name] = token.substr(dot + 1);
+        inputs.push_back(table);
+    }
+
+    // Refreshes are serialized, concurrent readers of a stale view wait for
+    // the first one to recompute it
+    lock_guard<mutex> lock(views_mutex);
+    vector<uint64_t> versions = versionsOf(inputs);
+    auto& computed = view_versions[table_name];
+    if (computed == versions) return true;
+
+    if (!view.replaceWith(*join(inputs, tables, attrMap))) return false;
+    computed = std::move(versions);
+    refreshes.add();
+    return true;
+}
@@ -0,0 +1,222 @@
+#include "Datagen.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <filesystem>
+#include <functional>
+#include <future>
+#include "Catalog.hpp"
+#include "Shard.hpp"
+#include "Table.hpp"
+#include "ThreadPool.hpp"
+#include "utils.hpp"
+
+namespace fs = std::filesystem;
+using namespace std;
+
+namespace {
+constexpr const char* STREETS[] = {
+    "Abbey Road",       "Baker Street",    "Bank",
+    "Borough High",     "Brick Lane",      "Cheapside",
+    "Clerkenwell Road", "Drury Lane",      "Euston Road",
+    "Fleet Street",     "Gower Street",    "Great Portland",
+    "Holborn",          "Hyde Park Corner", "Kings Road",
+    "Leadenhall",       "Long Acre",       "Marylebone Road",
+    "Moorgate",         "New Cross",       "Old Street",
+    "Oxford Street",    "Park Lane",       "Piccadilly",
+    "Queensway",        "Regent Street",   "Southwark Street",
+    "Strand",           "Tower Bridge",    "Waterloo Road",
+    "Westferry",        "Whitechapel",     "Wigmore Street",
+    "York Way",         "Kennington Lane", "Vauxhall Cross",
+    "Shoreditch High",  "Farringdon Road", "Aldgate",
+    "Bethnal Green",
+};
+constexpr const char* AREAS[] = {
+    "Bloomsbury", "Borough",     "Camden",     "Canary Wharf", "Chelsea",
+    "City",       "Clerkenwell", "Covent Garden", "Fitzrovia", "Hackney",
+    "Holborn",    "Islington",   "Kensington", "Lambeth",     "Mayfair",
+    "Marylebone", "Soho",        "Southwark",  "Stratford",   "Westminster",
+};
+constexpr size_t STREET_COUNT = size(STREETS);
+constexpr size_t AREA_COUNT = size(AREAS);
+
+// Trips start spread over 2024
+constexpr int64_t YEAR_SECONDS = 366 * 86400;
+
+void appendDate(string& out, int64_t seconds) {
+    using namespace chrono;
+    sys_seconds time = sys_days(2024y / January / 1) + chrono::seconds(seconds);
+    auto day = floor<days>(time);
+    year_month_day date(day);
+    auto minutes = duration_cast<chrono::minutes>(time - day).count();
+
+    char buffer[32];
+    snprintf(buffer, sizeof(buffer), "%04d-%02u-%02uT%02d:%02d",
+             int(date.year()), unsigned(date.month()), unsigned(date.day()),
+             int(minutes / 60), int(minutes % 60));
+    out += buffer;
+}
+
+uint64_t seedOf(const string& name, uint64_t seed) {
+    return hash<string>{}(name) ^ (seed * 0x9E3779B97F4A7C15ull);
+}
+}  // namespace
+
+Zipf::Zipf(size_t n, double exponent) : cdf_(max<size_t>(n, 1)) {
+    double total = 0;
+    for (size_t i = 0; i < cdf_.size(); ++i) {
+        total += 1.0 / pow(double(i + 1), exponent);
+        cdf_[i] = total;
+    }
+    for (double& p : cdf_) p /= total;
+}
+
+size_t Zipf::operator()(mt19937_64& rng) const {
+    double u = uniform_real_distribution<double>(0, 1)(rng);
+    size_t i = lower_bound(cdf_.begin(), cdf_.end(), u) - cdf_.begin();
+    return min(i, cdf_.size() - 1);
+}
+
+Datagen::Datagen(Catalog& catalog, const DatagenOptions& options)
+    : catalog_(catalog), options_(options) {}
+
+size_t Datagen::tripRows() const {
+    return static_cast<size_t>(llround(options_.scale * 1000000));
+}
+
+string Datagen::stationName(size_t index) {
+    string name = STREETS[index % STREET_COUNT];
+    name += ' ';
+    name += AREAS[index / STREET_COUNT % AREA_COUNT];
+
+    size_t round = index / (STREET_COUNT * AREA_COUNT);
+    if (round > 0) name += " " + to_string(round + 1);
+    ranges::replace(name, ' ', '_');
+    return name;
+}
+
+template <typename Row>
+bool Datagen::write(const string& name, const vector<string>& attributes,
+                    size_t rows, Row&& row) {
+    if (catalog_.find(name) && !catalog_.drop(name)) return false;
+    fs::path dir = catalog_.path() / name;
+    error_code ec;
+    fs::remove_all(dir, ec);
+    if (!fs::create_directories(dir, ec)) {
+        errStream() << "Failed to create " << dir << endl;
+        return false;
+    }
+
+    size_t shard_rows = max<size_t>(options_.shard_rows, 1);
+    size_t shards = max<size_t>((rows + shard_rows - 1) / shard_rows, 1);
+    vector<string> files;
+    for (size_t s = 0; s < shards; ++s) {
+        files.push_back("shard_" + to_string(s) + ".csv");
+    }
+
+    ThreadPool pool(min<size_t>(shards, thread::hardware_concurrency()));
+    vector<future<bool>> written;
+    for (size_t s = 0; s < shards; ++s) {
+        written.push_back(pool.submit([&, s]() {
+            // Every shard has its own generator, so the output does not
+            // depend on the number of threads
+            mt19937_64 rng(seedOf(name, options_.seed) + s);
+            ShardWriter out(dir / files[s], false);
+            string line;
+            size_t end = min(rows, (s + 1) * shard_rows);
+            for (size_t i = s * shard_rows; i < end; ++i) {
+                line.clear();
+                row(i, rng, line);
+                out.write(line);
+            }
+            return out.close();
+        }));
+    }
+
+    bool ok = true;
+    for (auto& shard : written) ok = shard.get() && ok;
+    if (!ok) {
+        errStream() << "Failed to write table " << name << endl;
+        return false;
+    }
+
+    return catalog_.create(name, attributes, false, files) != nullptr;
+}
+
+bool Datagen::trips(const string& name, size_t rows) {
+    if (rows == 0) rows = tripRows();
+    Zipf popularity(options_.stations, options_.skew);
+
+    // Shards are written concurrently, distributions are created per row
+    auto station = [&](mt19937_64& rng) {
+        size_t index = popularity(rng);
+        double match = uniform_real_distribution<double>(0, 1)(rng);
+        return match < options_.match_rate ? index : options_.stations + index;
+    };
+
+    return write(
+        name,
+        {"rental_id", "duration", "bike_id", "start_date", "start_station_id",
+         "start_station_name", "end_date", "end_station_id",
+         "end_station_name"},
+        rows, [&](size_t i, mt19937_64& rng, string& line) {
+            int64_t start = static_cast<int64_t>(
+                double(i) / max<size_t>(rows, 1) * YEAR_SECONDS);
+            // Rides average 20 minutes
+            int64_t seconds = 60 + static_cast<int64_t>(
+                                       exponential_distribution<double>(
+                                           1.0 / 1200)(rng));
+            size_t from = station(rng), to = station(rng);
+            int bike = uniform_int_distribution<int>(1, 15000)(rng);
+
+            line += to_string(i + 1);
+            line += ',';
+            line += to_string(seconds);
+            line += ',';
+            line += to_string(bike);
+            line += ',';
+            appendDate(line, start);
+            line += ',';
+            line += to_string(from + 1);
+            line += ',';
+            line += stationName(from);
+            line += ',';
+            appendDate(line, start + seconds);
+            line += ',';
+            line += to_string(to + 1);
+            line += ',';
+            line += stationName(to);
+        });
+}
+
+bool Datagen::stations(const string& name) {
+    return write(name, {"station_id", "station_name", "latitude", "longitude"},
+                 options_.stations,
+                 [&](size_t i, mt19937_64& rng, string& line) {
+                     uniform_real_distribution<double> offset(-0.08, 0.08);
+                     double latitude = 51.507 + offset(rng);
+                     double longitude = -0.128 + offset(rng);
+                     char position[64];
+                     snprintf(position, sizeof(position), "%.6f,%.6f",
+                              latitude, longitude);
+                     line += to_string(i + 1);
+                     line += ',';
+                     line += stationName(i);
+                     line += ',';
+                     line += position;
+                 });
+}
+
+bool Datagen::docks(const string& name) {
+    return write(name, {"station_name", "docks", "zone"}, options_.stations,
+                 [&](size_t i, mt19937_64& rng, string& line) {
+                     uniform_int_distribution<int> docks(10, 60);
+                     uniform_int_distribution<int> zone(1, 3);
+                     line += stationName(i);
+                     line += ',';
+                     line += to_string(docks(rng));
+                     line += ',';
+                     line += to_string(zone(rng));
+                 });
+}
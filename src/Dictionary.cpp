@@ -0,0 +1,82 @@
+#include "Dictionary.hpp"
+#include <charconv>
+#include "Wal.hpp"
+#include "utils.hpp"
+
+namespace fs = std::filesystem;
+using namespace std;
+
+Dictionary::Dictionary(fs::path path) : path_(std::move(path)) {
+    {
+        ifstream in(path_);
+        string value;
+        while (size() < MAX_CODES && getline(in, value)) {
+            add(value);
+        }
+    }
+    file_.open(path_, ios::app);
+}
+
+void Dictionary::add(string_view value) {
+    uint32_t code = size_.load(memory_order_relaxed);
+    auto& chunk = chunks_[code / CHUNK_SIZE];
+    if (!chunk) chunk = make_unique<string[]>(CHUNK_SIZE);
+
+    string& slot = chunk[code % CHUNK_SIZE];
+    slot = value;
+    codes_.emplace(slot, code);
+
+    // Publishes the value to decode() on other threads
+    size_.store(code + 1, memory_order_release);
+}
+
+optional<uint32_t> Dictionary::encode(string_view value) {
+    lock_guard<mutex> lock(mutex_);
+
+    auto it = codes_.find(value);
+    if (it != codes_.end()) return it->second;
+
+    if (size() >= MAX_CODES) {
+        errStream() << "Dictionary " << path_ << " is full" << endl;
+        return nullopt;
+    }
+
+    file_ << value << '\n';
+    file_.flush();
+    if (!file_) {
+        errStream() << "Failed to write dictionary " << path_ << endl;
+        return nullopt;
+    }
+
+    uint32_t code = size();
+    add(value);
+    return code;
+}
+
+optional<uint32_t> Dictionary::find(string_view value) const {
+    lock_guard<mutex> lock(mutex_);
+
+    auto it = codes_.find(value);
+    if (it == codes_.end()) return nullopt;
+    return it->second;
+}
+
+bool Dictionary::sync() {
+    // Values are flushed to the file before their code is published
+    uint32_t size = this->size();
+    uint32_t synced = synced_.load();
+    if (synced >= size) return true;
+    if (!syncFile(path_)) return false;
+
+    while (synced < size && !synced_.compare_exchange_weak(synced, size)) {
+    }
+    return true;
+}
+
+optional<uint32_t> Dictionary::parseCode(string_view field) {
+    uint32_t code;
+    const char* last = field.data() + field.size();
+    auto [end, ec] = from_chars(field.data(), last, code);
+    if (ec != errc() || end != last) return nullopt;
+    return code;
+}
@@ -6,14 +6,46 @@
 #include <sstream>
 #include <stdexcept>
 #include "Api.hpp"
+#include "Memory.hpp"
+#include "Metrics.hpp"
+#include "Profile.hpp"
+#include "Settings.hpp"
+#include "Trace.hpp"
 #include "utils.hpp"
 
 using namespace std;
 
+namespace {
+constexpr const char* COMMANDS[] = {
+    "create", "insert", "update", "delete", "read", "join", "encode",
+    "export", "import", "set", "explain", "stats", "trace", "help", "other"};
+
+Histogram& commandLatency(const string& operation) {
+    // Resolved once, so recording a command never takes the registry lock
+    static const vector<Histogram*> histograms = [] {
+        vector<Histogram*> result;
+        for (const char* command : COMMANDS) {
+            result.push_back(&Metrics::instance().histogram(
+                "lmkdb_command_duration_seconds", "Command latency",
+                string("command=\"") + command + "\""));
+        }
+        return result;
+    }();
+
+    for (size_t i = 0; i + 1 < size(COMMANDS); ++i) {
+        if (operation == COMMANDS[i]) return *histograms[i];
+    }
+    return *histograms.back();
+}
+}  // namespace
+
 Interpreter::Interpreter(string_view dbDir)
     : dbApi(make_unique<DatabaseAPI>(string(dbDir))) {}
 
-Interpreter::~Interpreter() = default;
+// A trace still running at exit is written
+Interpreter::~Interpreter() {
+    if (Tracer::enabled()) Tracer::instance().stop();
+}
 
 bool Interpreter::validateInteger(const string &input) {
     try {
@@ -26,6 +58,52 @@ bool Interpreter::validateInteger(const string &input) {
     }
 }
 
+void Interpreter::explain(const vector<string> &tokens) {
+    bool analyze = tokens[1] == "analyze";
+    size_t start = analyze ? 2 : 1;
+
+    if (start >= tokens.size() || tokens[start] == "explain") {
+        errStream() << "Error: expected explain [analyze] <command>" << endl;
+        return;
+    }
+
+    // Session commands have no plan, and would take effect if run
+    string operation = tokens[start];
+    transform(operation.begin(), operation.end(), operation.begin(),
+              [](unsigned char c) { return tolower(c); });
+    if (operation == "set" || operation == "trace" || operation == "stats" ||
+        operation == "help") {
+        errStream() << "Error: cannot explain " << operation << endl;
+        return;
+    }
+
+    string command;
+    for (size_t i = start; i < tokens.size(); ++i) {
+        if (i > start) command += " ";
+        command += tokens[i];
+    }
+
+    QueryProfile profile(analyze);
+    {
+        QueryProfile::Activate activate(&profile);
+
+        if (analyze) {
+            processCommand(command);
+        } else {
+            // Only planning, discard what the command reports as done
+            ostringstream discarded;
+            OutputRedirect redirect(discarded, errStream());
+            processCommand(command);
+        }
+    }
+
+    profile.print(outStream());
+    if (analyze) {
+        outStream() << "\nPeak query memory: "
+                    << formatBytes(MemoryTracker::current().peak()) << endl;
+    }
+}
+
 void Interpreter::processCommand(const string &command) {
     vector<string> tokens;
     istringstream stream(command);
@@ -36,7 +114,7 @@ void Interpreter::processCommand(const string &command) {
     }
 
     if (tokens.empty()) {
-        cout << "Empty command." << endl;
+        outStream() << "Empty command." << endl;
         return;
     }
 
@@ -45,7 +123,31 @@ void Interpreter::processCommand(const string &command) {
 
     string operation = tokens[0];
 
-    if (operation == "create" && tokens.size() >= 3) {
+    static Gauge& in_flight = Metrics::instance().gauge(
+        "lmkdb_commands_in_flight", "Commands currently executing");
+    in_flight.add(1);
+    LatencyTimer latency(commandLatency(operation));
+    struct InFlight {
+        ~InFlight() { in_flight.add(-1); }
+    } done;
+    TraceSpan span(operation, "command", command);
+
+    // Commands run by explain are also charged to the explain
+    MemoryTracker memory(Settings::instance().query_memory_limit,
+                         &MemoryTracker::current());
+    MemoryTracker::Activate charge(&memory);
+
+    if (operation == "create" && tokens.size() >= 7 &&
+        tokens[1] == "materialized" && tokens[3] == "as" &&
+        tokens[4] == "join") {
+        vector<string> query(tokens.begin() + 5, tokens.end());
+        dbApi->createMaterializedOp(tokens[2], query);
+
+    } else if (operation == "create" && tokens.size() == 6 &&
+               tokens[1] == "index" && tokens[4] == "using") {
+        dbApi->createIndexOp(tokens[2], tokens[3], tokens[5]);
+
+    } else if (operation == "create" && tokens.size() >= 3) {
         string tableName = tokens[1];
         vector<string> attributes(tokens.begin() + 2, tokens.end());
         dbApi->createOp(tableName, attributes);
@@ -60,13 +162,13 @@ void Interpreter::processCommand(const string &command) {
 
         size_t pos = tokens[2].find(':');
         if (pos == string::npos || tokens[0].substr(pos + 1).empty()) {
-            cerr << "Error: Invalid format for specifying id." << endl;
+            errStream() << "Error: Invalid format for specifying id." << endl;
             return;
         }
 
         string idValue = tokens[2].substr(pos + 1);
         if (!validateInteger(idValue)) {
-            cerr << "Error: id must be a valid integer." << endl;
+            errStream() << "Error: id must be a valid integer." << endl;
             return;
         }
 
@@ -91,10 +193,55 @@ void Interpreter::processCommand(const string &command) {
 
         dbApi->joinOp(query);
 
+    } else if (operation == "encode" && tokens.size() == 3) {
+        dbApi->encodeOp(tokens[1], tokens[2]);
+
+    } else if (operation == "export" && tokens.size() == 3) {
+        dbApi->exportOp(tokens[1], tokens[2]);
+
+    } else if (operation == "import" && tokens.size() == 3) {
+        dbApi->importOp(tokens[1], tokens[2]);
+
+    } else if (operation == "set" && tokens.size() == 1) {
+        Settings::instance().print(outStream());
+
+    } else if (operation == "set" && tokens.size() == 3) {
+        if (!Settings::instance().set(tokens[1], tokens[2])) {
+            errStream() << "Error: unknown setting or invalid value: "
+                        << tokens[1] << " " << tokens[2] << endl;
+        }
+
+    } else if (operation == "explain" && tokens.size() >= 2) {
+        explain(tokens);
+
+    } else if (operation == "stats" && tokens.size() == 1) {
+        Metrics::instance().print(outStream());
+
+    } else if (operation == "trace" && tokens.size() == 3 &&
+               tokens[1] == "on") {
+        if (Tracer::instance().start(tokens[2])) {
+            outStream() << "Tracing to " << tokens[2] << endl;
+        } else {
+            errStream() << "Error: already tracing to "
+                        << Tracer::instance().path().string() << endl;
+        }
+
+    } else if (operation == "trace" && tokens.size() == 2 &&
+               tokens[1] == "off") {
+        if (!Tracer::enabled()) {
+            errStream() << "Error: not tracing" << endl;
+        } else if (auto events = Tracer::instance().stop()) {
+            outStream() << "Wrote " << *events << " trace events to "
+                        << Tracer::instance().path().string() << endl;
+        } else {
+            errStream() << "Error: could not write trace to "
+                        << Tracer::instance().path().string() << endl;
+        }
+
     } else if (operation == "help") {
         printUsage();
     } else {
-        cout << "Unknown command \"" << operation
-             << "\"\nType \"help\" for usage" << endl;
+        outStream() << "Unknown command \"" << operation
+                    << "\"\nType \"help\" for usage" << endl;
     }
 }
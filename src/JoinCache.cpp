@@ -0,0 +1,69 @@
+#include "JoinCache.hpp"
+#include "Metrics.hpp"
+#include "Settings.hpp"
+
+using namespace std;
+
+shared_ptr<Table> JoinCache::find(const string& spec,
+                                  const vector<uint64_t>& versions) {
+    static Counter& hits = Metrics::instance().counter(
+        "lmkdb_join_cache_hits_total", "Joins served from the result cache");
+    static Counter& misses = Metrics::instance().counter(
+        "lmkdb_join_cache_misses_total", "Joins that had to be computed");
+
+    lock_guard<mutex> lock(mutex_);
+
+    for (auto it = entries_.begin(); it != entries_.end(); ++it) {
+        if (it->spec != spec) continue;
+
+        if (it->versions != versions) {
+            // An input changed since, the result can never be used again
+            bytes_ -= it->bytes;
+            entries_.erase(it);
+            break;
+        }
+
+        entries_.splice(entries_.begin(), entries_, it);
+        hits.add();
+        return it->result;
+    }
+
+    misses.add();
+    return nullptr;
+}
+
+bool JoinCache::contains(const string& spec, const vector<uint64_t>& versions) {
+    lock_guard<mutex> lock(mutex_);
+
+    for (const auto& entry : entries_) {
+        if (entry.spec == spec) return entry.versions == versions;
+    }
+    return false;
+}
+
+void JoinCache::insert(const string& spec, vector<uint64_t> versions,
+                       shared_ptr<Table> result) {
+    size_t budget = Settings::instance().join_cache_size;
+    uintmax_t bytes = result->dataSize();
+    if (bytes > budget) return;
+
+    lock_guard<mutex> lock(mutex_);
+
+    // Two sessions may have computed the same join concurrently
+    for (auto it = entries_.begin(); it != entries_.end(); ++it) {
+        if (it->spec == spec) {
+            bytes_ -= it->bytes;
+            entries_.erase(it);
+            break;
+        }
+    }
+
+    entries_.push_front(
+        {spec, std::move(versions), std::move(result), bytes});
+    bytes_ += bytes;
+
+    while (bytes_ > budget) {
+        bytes_ -= entries_.back().bytes;
+        entries_.pop_back();
+    }
+}
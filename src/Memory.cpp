@@ -0,0 +1,110 @@
+#include "Memory.hpp"
+#include <mutex>
+#include "Metrics.hpp"
+#include "Settings.hpp"
+
+using namespace std;
+
+namespace {
+thread_local MemoryTracker* active_tracker = nullptr;
+
+Gauge& heldBytes() {
+    static Gauge& held = Metrics::instance().gauge(
+        "lmkdb_memory_used_bytes",
+        "Memory held by the operators of running queries");
+    return held;
+}
+
+void raiseTo(atomic<size_t>& peak, size_t value) {
+    size_t current = peak.load(memory_order_relaxed);
+    while (current < value &&
+           !peak.compare_exchange_weak(current, value, memory_order_relaxed)) {
+    }
+}
+}  // namespace
+
+MemoryTracker::MemoryTracker(const atomic<size_t>& limit,
+                             MemoryTracker* parent)
+    : limit_(limit), parent_(parent) {}
+
+MemoryTracker::~MemoryTracker() {
+    if (!parent_) return;
+
+    static Gauge& query_peak = Metrics::instance().gauge(
+        "lmkdb_query_memory_peak_bytes",
+        "Most memory a single query held for its operators");
+    static mutex peak_mutex;
+    lock_guard<mutex> lock(peak_mutex);
+    if (static_cast<int64_t>(peak()) > query_peak.value()) {
+        query_peak.set(static_cast<int64_t>(peak()));
+    }
+}
+
+bool MemoryTracker::tryReserve(size_t bytes) {
+    static Counter& refused = Metrics::instance().counter(
+        "lmkdb_memory_reservations_refused_total",
+        "Operator memory reservations refused by a memory limit");
+
+    size_t limit = this->limit();
+    size_t used = used_.load(memory_order_relaxed);
+    do {
+        if (limit && used + bytes > limit) {
+            refused.add();
+            return false;
+        }
+    } while (!used_.compare_exchange_weak(used, used + bytes,
+                                          memory_order_relaxed));
+
+    if (parent_ && !parent_->tryReserve(bytes)) {
+        used_.fetch_sub(bytes, memory_order_relaxed);
+        return false;
+    }
+    raiseTo(peak_, used + bytes);
+
+    if (!parent_) heldBytes().add(static_cast<int64_t>(bytes));
+    return true;
+}
+
+void MemoryTracker::release(size_t bytes) {
+    used_.fetch_sub(bytes, memory_order_relaxed);
+    if (parent_) {
+        parent_->release(bytes);
+    } else {
+        heldBytes().add(-static_cast<int64_t>(bytes));
+    }
+}
+
+MemoryTracker& MemoryTracker::global() {
+    static MemoryTracker tracker(Settings::instance().memory_limit, nullptr);
+    return tracker;
+}
+
+MemoryTracker& MemoryTracker::current() {
+    return active_tracker ? *active_tracker : global();
+}
+
+MemoryTracker::Activate::Activate(MemoryTracker* tracker)
+    : prev_(active_tracker) {
+    active_tracker = tracker;
+}
+
+MemoryTracker::Activate::~Activate() {
+    active_tracker = prev_;
+}
+
+MemoryReservation::MemoryReservation(MemoryTracker& tracker)
+    : tracker_(tracker) {}
+
+MemoryReservation::~MemoryReservation() {
+    if (bytes_) tracker_.release(bytes_);
+}
+
+bool MemoryReservation::resize(size_t bytes) {
+    if (bytes > bytes_) {
+        if (!tracker_.tryReserve(bytes - bytes_)) return false;
+    } else if (bytes < bytes_) {
+        tracker_.release(bytes_ - bytes);
+    }
+    bytes_ = bytes;
+    return true;
+}
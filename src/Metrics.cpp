@@ -0,0 +1,265 @@
+#include "Metrics.hpp"
+#include <cmath>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <set>
+#include <sstream>
+#include <stdexcept>
+
+using namespace std;
+namespace fs = std::filesystem;
+
+namespace {
+constexpr double QUANTILES[] = {0.5, 0.99, 0.999};
+
+string withLabels(const string& name, const string& labels,
+                  const string& extra = "") {
+    string all = labels;
+    if (!extra.empty()) all += (all.empty() ? "" : ",") + extra;
+    return all.empty() ? name : name + "{" + all + "}";
+}
+
+string formatMs(uint64_t ns) {
+    ostringstream out;
+    out << fixed << setprecision(3) << ns / 1e6;
+    return out.str();
+}
+}  // namespace
+
+size_t Histogram::bucketOf(uint64_t value) {
+    if (value < SUB_BUCKETS) return value;
+
+    int msb = 63 - __builtin_clzll(value);
+    int shift = msb - SUB_BITS;
+    return (shift + 1) * SUB_BUCKETS + ((value >> shift) - SUB_BUCKETS);
+}
+
+uint64_t Histogram::bucketLow(size_t bucket) {
+    if (bucket < SUB_BUCKETS) return bucket;
+
+    size_t shift = bucket / SUB_BUCKETS - 1;
+    return (bucket % SUB_BUCKETS + SUB_BUCKETS) << shift;
+}
+
+uint64_t Histogram::bucketHigh(size_t bucket) {
+    if (bucket < SUB_BUCKETS) return bucket;
+
+    size_t shift = bucket / SUB_BUCKETS - 1;
+    return bucketLow(bucket) + ((uint64_t(1) << shift) - 1);
+}
+
+void Histogram::record(uint64_t value) {
+    buckets_[bucketOf(value)].fetch_add(1, memory_order_relaxed);
+    sum_.fetch_add(value, memory_order_relaxed);
+
+    uint64_t prev = max_.load(memory_order_relaxed);
+    while (value > prev &&
+           !max_.compare_exchange_weak(prev, value, memory_order_relaxed)) {
+    }
+}
+
+uint64_t Histogram::count() const {
+    uint64_t total = 0;
+    for (const auto& bucket : buckets_) {
+        total += bucket.load(memory_order_relaxed);
+    }
+    return total;
+}
+
+uint64_t Histogram::percentile(double p) const {
+    // Counts are read once so that concurrent records cannot move the rank
+    // past the last bucket
+    array<uint64_t, NUM_BUCKETS> counts;
+    uint64_t total = 0;
+    for (size_t i = 0; i < NUM_BUCKETS; ++i) {
+        counts[i] = buckets_[i].load(memory_order_relaxed);
+        total += counts[i];
+    }
+    if (total == 0) return 0;
+
+    uint64_t rank = std::max<uint64_t>(1, ceil(p * total));
+    uint64_t seen = 0;
+    for (size_t i = 0; i < NUM_BUCKETS; ++i) {
+        seen += counts[i];
+        if (seen >= rank) return min(bucketHigh(i), max());
+    }
+    return max();
+}
+
+LatencyTimer::~LatencyTimer() {
+    histogram_.record(chrono::duration_cast<chrono::nanoseconds>(
+                          chrono::steady_clock::now() - start_)
+                          .count());
+}
+
+Metrics& Metrics::instance() {
+    static Metrics metrics;
+    return metrics;
+}
+
+Metrics::~Metrics() {
+    stopDumper();
+}
+
+Metrics::Entry& Metrics::find(const string& name, const string& help,
+                              const string& labels, Kind kind) {
+    lock_guard<mutex> lock(mutex_);
+
+    for (auto& entry : entries_) {
+        if (entry.name != name) continue;
+        if (entry.kind != kind) {
+            throw logic_error("Metric " + name +
+                              " is already registered as another kind");
+        }
+        if (entry.labels == labels) return entry;
+    }
+
+    Entry& entry = entries_.emplace_back();
+    entry.name = name;
+    entry.help = help;
+    entry.labels = labels;
+    entry.kind = kind;
+    switch (kind) {
+        case Kind::Counter:
+            entry.counter = make_unique<Counter>();
+            break;
+        case Kind::Gauge:
+            entry.gauge = make_unique<Gauge>();
+            break;
+        case Kind::Histogram:
+            entry.histogram = make_unique<Histogram>();
+            break;
+    }
+    return entry;
+}
+
+Counter& Metrics::counter(const string& name, const string& help,
+                          const string& labels) {
+    return *find(name, help, labels, Kind::Counter).counter;
+}
+
+Gauge& Metrics::gauge(const string& name, const string& help,
+                      const string& labels) {
+    return *find(name, help, labels, Kind::Gauge).gauge;
+}
+
+Histogram& Metrics::histogram(const string& name, const string& help,
+                              const string& labels) {
+    return *find(name, help, labels, Kind::Histogram).histogram;
+}
+
+void Metrics::print(ostream& out) const {
+    lock_guard<mutex> lock(mutex_);
+
+    for (const auto& entry : entries_) {
+        string name = withLabels(entry.name, entry.labels);
+
+        switch (entry.kind) {
+            case Kind::Counter:
+                out << name << " " << entry.counter->value() << "\n";
+                break;
+            case Kind::Gauge:
+                out << name << " " << entry.gauge->value() << "\n";
+                break;
+            case Kind::Histogram: {
+                const Histogram& h = *entry.histogram;
+                if (h.count() == 0) break;
+                out << name << " count " << h.count() << ", p50 "
+                    << formatMs(h.percentile(0.5)) << " ms, p99 "
+                    << formatMs(h.percentile(0.99)) << " ms, p999 "
+                    << formatMs(h.percentile(0.999)) << " ms, max "
+                    << formatMs(h.max()) << " ms\n";
+                break;
+            }
+        }
+    }
+}
+
+void Metrics::writePrometheus(ostream& out) const {
+    lock_guard<mutex> lock(mutex_);
+    set<string> described;
+
+    for (const auto& entry : entries_) {
+        if (described.insert(entry.name).second) {
+            const char* type = entry.kind == Kind::Counter ? "counter"
+                               : entry.kind == Kind::Gauge ? "gauge"
+                                                           : "summary";
+            out << "# HELP " << entry.name << " " << entry.help << "\n"
+                << "# TYPE " << entry.name << " " << type << "\n";
+        }
+
+        switch (entry.kind) {
+            case Kind::Counter:
+                out << withLabels(entry.name, entry.labels) << " "
+                    << entry.counter->value() << "\n";
+                break;
+            case Kind::Gauge:
+                out << withLabels(entry.name, entry.labels) << " "
+                    << entry.gauge->value() << "\n";
+                break;
+            case Kind::Histogram: {
+                // Histograms hold nanoseconds, Prometheus expects seconds
+                const Histogram& h = *entry.histogram;
+                for (double q : QUANTILES) {
+                    ostringstream quantile;
+                    quantile << "quantile=\"" << q << "\"";
+                    out << withLabels(entry.name, entry.labels,
+                                      quantile.str())
+                        << " " << h.percentile(q) / 1e9 << "\n";
+                }
+                out << withLabels(entry.name + "_sum", entry.labels) << " "
+                    << h.sum() / 1e9 << "\n"
+                    << withLabels(entry.name + "_count", entry.labels) << " "
+                    << h.count() << "\n";
+                break;
+            }
+        }
+    }
+}
+
+bool Metrics::dumpTo(const string& path) const {
+    // Written next to the target and renamed, so scrapers never see a
+    // partial file
+    string tmp = path + ".tmp";
+    {
+        ofstream out(tmp, ios::trunc);
+        if (!out) return false;
+        writePrometheus(out);
+        if (!out) return false;
+    }
+
+    error_code ec;
+    fs::rename(tmp, path, ec);
+    return !ec;
+}
+
+void Metrics::dumpPeriodically(const string& path,
+                               chrono::milliseconds interval) {
+    stopDumper();
+    if (path.empty()) return;
+
+    dumper_stop_ = false;
+    dumper_ = thread([this, path, interval] {
+        unique_lock<mutex> lock(dumper_mutex_);
+        do {
+            lock.unlock();
+            dumpTo(path);
+            lock.lock();
+        } while (!dumper_cv_.wait_for(lock, interval,
+                                      [this] { return dumper_stop_; }));
+        lock.unlock();
+        dumpTo(path);
+    });
+}
+
+void Metrics::stopDumper() {
+    if (!dumper_.joinable()) return;
+
+    {
+        lock_guard<mutex> lock(dumper_mutex_);
+        dumper_stop_ = true;
+    }
+    dumper_cv_.notify_all();
+    dumper_.join();
+}
@@ -0,0 +1,91 @@
+#include "Predicate.hpp"
+#include "Sort.hpp"
+
+using namespace std;
+
+string Condition::text() const {
+    if (op == CompareOp::Prefix) return attribute + ":" + value + "*";
+    constexpr const char* SYMBOLS[] = {":", "<", "<=", ">", ">="};
+    return attribute + SYMBOLS[static_cast<int>(op)] + value;
+}
+
+bool parseCondition(string_view token, Condition& condition) {
+    size_t pos = token.find_first_of(":=<>");
+    if (pos == string_view::npos || pos == 0) return false;
+
+    size_t length = 1;
+    char symbol = token[pos];
+    bool or_equal = pos + 1 < token.size() && token[pos + 1] == '=';
+
+    if (symbol == ':' || symbol == '=') {
+        condition.op = CompareOp::Equal;
+    } else if (symbol == '<') {
+        condition.op = or_equal ? CompareOp::LessEqual : CompareOp::Less;
+        length += or_equal;
+    } else {
+        condition.op = or_equal ? CompareOp::GreaterEqual : CompareOp::Greater;
+        length += or_equal;
+    }
+
+    condition.attribute = token.substr(0, pos);
+    condition.value = token.substr(pos + length);
+    if (symbol == ':' && condition.value.ends_with('*')) {
+        condition.op = CompareOp::Prefix;
+        condition.value.pop_back();
+    }
+    return true;
+}
+
+bool textPrefix(string_view prefix) {
+    return !prefix.empty() &&
+           string_view("0123456789+-.").find(prefix.front()) ==
+               string_view::npos;
+}
+
+void KeyBounds::add(const Condition& condition) {
+    const string& value = condition.value;
+    if (condition.op == CompareOp::Prefix) {
+        // Other prefixes leave the range as is, the values they match can
+        // be numbers or text
+        if (!textPrefix(value)) return;
+        if (!lower || compareValues(value, *lower) > 0) {
+            lower = value;
+            lower_inclusive = true;
+        }
+        return;
+    }
+
+    bool inclusive = condition.op == CompareOp::Equal ||
+                     condition.op == CompareOp::LessEqual ||
+                     condition.op == CompareOp::GreaterEqual;
+
+    // Of two equal bounds the exclusive one is tighter
+    if (condition.op != CompareOp::Less &&
+        condition.op != CompareOp::LessEqual) {
+        int order = lower ? compareValues(value, *lower) : 1;
+        if (order > 0 || (order == 0 && !inclusive)) {
+            lower = value;
+            lower_inclusive = inclusive;
+        }
+    }
+    if (condition.op != CompareOp::Greater &&
+        condition.op != CompareOp::GreaterEqual) {
+        int order = upper ? compareValues(value, *upper) : -1;
+        if (order < 0 || (order == 0 && !inclusive)) {
+            upper = value;
+            upper_inclusive = inclusive;
+        }
+    }
+}
+
+bool KeyBounds::below(string_view key) const {
+    if (!lower) return false;
+    int order = compareValues(key, *lower);
+    return order < 0 || (order == 0 && !lower_inclusive);
+}
+
+bool KeyBounds::above(string_view key) const {
+    if (!upper) return false;
+    int order = compareValues(key, *upper);
+    return order > 0 || (order == 0 && !upper_inclusive);
+}
@@ -0,0 +1,221 @@
+#include "Profile.hpp"
+#include <time.h>
+#include <algorithm>
+#include <iomanip>
+#include <map>
+#include <sstream>
+#include <utility>
+#include "Trace.hpp"
+
+using namespace std;
+
+namespace {
+thread_local QueryProfile* active_profile = nullptr;
+
+string formatMs(uint64_t ns) {
+    ostringstream out;
+    out << fixed << setprecision(3) << ns / 1e6;
+    return out.str();
+}
+}  // namespace
+
+string formatBytes(uint64_t bytes) {
+    const char* units[] = {"B", "KB", "MB", "GB", "TB"};
+    double value = static_cast<double>(bytes);
+    size_t unit = 0;
+
+    while (value >= 1024 && unit + 1 < size(units)) {
+        value /= 1024;
+        unit++;
+    }
+
+    ostringstream out;
+    out << fixed << setprecision(unit == 0 ? 0 : 1) << value << " "
+        << units[unit];
+    return out.str();
+}
+
+QueryProfile::QueryProfile(bool analyze) : analyze_(analyze) {}
+
+void QueryProfile::addPlan(int depth, const string& line) {
+    lock_guard<mutex> lock(mutex_);
+    plan_.emplace_back(depth, line);
+}
+
+void QueryProfile::record(OperatorStats stats) {
+    lock_guard<mutex> lock(mutex_);
+    operators_.push_back(std::move(stats));
+}
+
+void QueryProfile::print(ostream& out) const {
+    lock_guard<mutex> lock(mutex_);
+
+    out << "Plan:\n";
+    for (const auto& [depth, line] : plan_) {
+        out << string(2 + 2 * depth, ' ') << line << "\n";
+    }
+
+    if (!analyze_) return;
+
+    vector<string> header = {"operator",   "task",          "wall ms",
+                             "cpu ms",     "rows in",       "rows out",
+                             "bytes read", "bytes written", "peak mem",
+                             "allocs"};
+    vector<vector<string>> rows;
+
+    auto addRow = [&](const OperatorStats& op) {
+        rows.push_back({op.name, op.task, formatMs(op.wall_ns),
+                        formatMs(op.cpu_ns), to_string(op.rows_in),
+                        to_string(op.rows_out), formatBytes(op.bytes_read),
+                        formatBytes(op.bytes_written),
+                        op.peak_memory ? formatBytes(op.peak_memory) : "-",
+                        to_string(op.allocations)});
+    };
+
+    // Per task rows, followed by the totals of every operator that ran as
+    // more than one task
+    map<string, pair<OperatorStats, size_t>> totals;
+    vector<string> order;
+
+    for (const auto& op : operators_) {
+        addRow(op);
+
+        auto [it, inserted] = totals.try_emplace(op.name);
+        if (inserted) order.push_back(op.name);
+
+        OperatorStats& total = it->second.first;
+        total.name = op.name;
+        total.wall_ns += op.wall_ns;
+        total.cpu_ns += op.cpu_ns;
+        total.rows_in += op.rows_in;
+        total.rows_out += op.rows_out;
+        total.bytes_read += op.bytes_read;
+        total.bytes_written += op.bytes_written;
+        total.peak_memory = max(total.peak_memory, op.peak_memory);
+        total.allocations += op.allocations;
+        it->second.second++;
+    }
+
+    for (const auto& name : order) {
+        auto& [total, count] = totals[name];
+        if (count < 2) continue;
+
+        total.task = "total (" + to_string(count) + " tasks)";
+        addRow(total);
+    }
+
+    vector<size_t> widths(header.size());
+    for (size_t i = 0; i < header.size(); ++i) {
+        widths[i] = header[i].size();
+        for (const auto& row : rows) {
+            widths[i] = max(widths[i], row[i].size());
+        }
+    }
+
+    auto printRow = [&](const vector<string>& row) {
+        for (size_t i = 0; i < row.size(); ++i) {
+            // Text columns are left aligned, counters right aligned
+            out << (i < 2 ? left : right) << setw(widths[i]) << row[i]
+                << (i + 1 < row.size() ? "  " : "\n");
+        }
+    };
+
+    out << "\nOperators:\n";
+    printRow(header);
+    for (const auto& row : rows) {
+        printRow(row);
+    }
+    out << left;
+}
+
+QueryProfile* QueryProfile::current() {
+    return active_profile;
+}
+
+QueryProfile::Activate::Activate(QueryProfile* profile)
+    : prev_(active_profile) {
+    active_profile = profile;
+}
+
+QueryProfile::Activate::~Activate() {
+    active_profile = prev_;
+}
+
+Stopwatch::Stopwatch() {
+    restart();
+}
+
+void Stopwatch::restart() {
+    wall_start_ = chrono::steady_clock::now();
+    cpu_start_ = threadCpuNs();
+}
+
+uint64_t Stopwatch::wallNs() const {
+    return chrono::duration_cast<chrono::nanoseconds>(
+               chrono::steady_clock::now() - wall_start_)
+        .count();
+}
+
+uint64_t Stopwatch::cpuNs() const {
+    return threadCpuNs() - cpu_start_;
+}
+
+uint64_t Stopwatch::threadCpuNs() {
+    timespec ts{};
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000ull + ts.tv_nsec;
+}
+
+OperatorTimer::OperatorTimer(const string& name, const string& task,
+                             bool paused)
+    : profile_(nullptr),
+      resumed_ns_(0),
+      cpu_start_(0),
+      allocations_start_(0),
+      trace_start_ns_(0),
+      running_(false) {
+    QueryProfile* profile = QueryProfile::current();
+    if (profile && profile->analyze()) profile_ = profile;
+    if (Tracer::enabled()) trace_start_ns_ = Tracer::now();
+    if (!profile_ && !trace_start_ns_) return;
+
+    stats_.name = name;
+    stats_.task = task;
+    if (!paused) resume();
+}
+
+OperatorTimer::~OperatorTimer() {
+    if (!profile_ && !trace_start_ns_) return;
+
+    pause();
+    if (trace_start_ns_ && Tracer::enabled()) {
+        Tracer::instance().record({stats_.name, "operator", trace_start_ns_,
+                                   Tracer::now() - trace_start_ns_,
+                                   stats_.task, stats_.wall_ns});
+    }
+    if (profile_) profile_->record(std::move(stats_));
+}
+
+// Only the profile needs CPU time and allocations, tracing alone reads the
+// steady clock
+void OperatorTimer::pause() {
+    if (!running_) return;
+
+    stats_.wall_ns += Tracer::now() - resumed_ns_;
+    if (profile_) {
+        stats_.cpu_ns += Stopwatch::threadCpuNs() - cpu_start_;
+        stats_.allocations += threadAllocations() - allocations_start_;
+    }
+    running_ = false;
+}
+
+void OperatorTimer::resume() {
+    if ((!profile_ && !trace_start_ns_) || running_) return;
+
+    resumed_ns_ = Tracer::now();
+    if (profile_) {
+        cpu_start_ = Stopwatch::threadCpuNs();
+        allocations_start_ = threadAllocations();
+    }
+    running_ = true;
+}
@@ -0,0 +1,39 @@
+#include "Protocol.hpp"
+#include <stdexcept>
+
+using namespace std;
+
+string encodeFrame(string_view payload) {
+    auto len = static_cast<uint32_t>(payload.size());
+
+    string frame;
+    frame.reserve(FRAME_HEADER_SIZE + payload.size());
+    frame.push_back(static_cast<char>((len >> 24) & 0xff));
+    frame.push_back(static_cast<char>((len >> 16) & 0xff));
+    frame.push_back(static_cast<char>((len >> 8) & 0xff));
+    frame.push_back(static_cast<char>(len & 0xff));
+    frame.append(payload);
+
+    return frame;
+}
+
+optional<string> takeFrame(string& buffer, uint32_t max_size) {
+    if (buffer.size() < FRAME_HEADER_SIZE) return nullopt;
+
+    uint32_t len = 0;
+    for (size_t i = 0; i < FRAME_HEADER_SIZE; ++i) {
+        len = (len << 8) | static_cast<unsigned char>(buffer[i]);
+    }
+
+    if (len > max_size) {
+        throw length_error("Frame of " + to_string(len) +
+                           " bytes exceeds limit of " + to_string(max_size));
+    }
+
+    if (buffer.size() < FRAME_HEADER_SIZE + len) return nullopt;
+
+    string payload = buffer.substr(FRAME_HEADER_SIZE, len);
+    buffer.erase(0, FRAME_HEADER_SIZE + len);
+
+    return payload;
+}
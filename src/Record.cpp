@@ -0,0 +1,31 @@
+#include "Record.hpp"
+
+using namespace std;
+
+string_view fieldAt(string_view row, int column) {
+    size_t start = 0;
+    for (int i = 0; i < column; ++i) {
+        size_t comma = row.find(',', start);
+        if (comma == string_view::npos) return {};
+        start = comma + 1;
+    }
+
+    size_t end = row.find(',', start);
+    return row.substr(start, end == string_view::npos ? string_view::npos
+                                                      : end - start);
+}
+
+void RecordView::parse(string_view row) {
+    fields_.clear();
+
+    size_t start = 0;
+    while (start < row.size()) {
+        size_t comma = row.find(',', start);
+        if (comma == string_view::npos) {
+            fields_.push_back(row.substr(start));
+            return;
+        }
+        fields_.push_back(row.substr(start, comma - start));
+        start = comma + 1;
+    }
+}
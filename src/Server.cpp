@@ -0,0 +1,405 @@
+#include "Server.hpp"
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include "Interpreter.hpp"
+#include "Metrics.hpp"
+#include "Protocol.hpp"
+#include "utils.hpp"
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#else
+#include <poll.h>
+#endif
+
+using namespace std;
+
+namespace {
+constexpr uint64_t LISTEN_ID = 0;
+constexpr uint64_t WAKE_ID = 1;
+constexpr size_t READ_CHUNK = 64 * 1024;
+
+Gauge& sessionsGauge() {
+    static Gauge& gauge = Metrics::instance().gauge(
+        "lmkdb_server_sessions", "Client sessions connected to the server");
+    return gauge;
+}
+
+bool setNonBlocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    return flags != -1 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) != -1;
+}
+}  // namespace
+
+/* Readiness notification over epoll, with a poll() fallback for platforms
+ * without it. Every registered fd carries the id it is reported under.
+ * Hangups and errors are reported as readable whatever was asked for. */
+class Server::Poller {
+   public:
+    struct Event {
+        uint64_t id;
+        bool readable;
+        bool writable;
+    };
+
+#ifdef __linux__
+    Poller() : epoll_fd_(epoll_create1(0)) {
+        if (epoll_fd_ == -1) {
+            throw runtime_error(string("epoll_create1: ") + strerror(errno));
+        }
+    }
+
+    ~Poller() { close(epoll_fd_); }
+
+    void add(int fd, uint64_t id, bool want_read, bool want_write) {
+        control(EPOLL_CTL_ADD, fd, id, want_read, want_write);
+    }
+
+    void modify(int fd, uint64_t id, bool want_read, bool want_write) {
+        control(EPOLL_CTL_MOD, fd, id, want_read, want_write);
+    }
+
+    void remove(int fd) { epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, fd, nullptr); }
+
+    void wait(vector<Event>& events) {
+        epoll_event ready[64];
+        int n = epoll_wait(epoll_fd_, ready, 64, -1);
+
+        events.clear();
+        for (int i = 0; i < n; ++i) {
+            uint32_t ev = ready[i].events;
+            events.push_back(
+                {.id = ready[i].data.u64,
+                 .readable = (ev & (EPOLLIN | EPOLLHUP | EPOLLERR)) != 0,
+                 .writable = (ev & EPOLLOUT) != 0});
+        }
+    }
+
+   private:
+    int epoll_fd_;
+
+    void control(int op, int fd, uint64_t id, bool want_read,
+                 bool want_write) {
+        epoll_event ev{};
+        ev.events = (want_read ? uint32_t(EPOLLIN) : 0u) |
+                    (want_write ? uint32_t(EPOLLOUT) : 0u);
+        ev.data.u64 = id;
+        epoll_ctl(epoll_fd_, op, fd, &ev);
+    }
+#else
+    void add(int fd, uint64_t id, bool want_read, bool want_write) {
+        fds_[fd] = {id, want_read, want_write};
+    }
+
+    void modify(int fd, uint64_t id, bool want_read, bool want_write) {
+        fds_[fd] = {id, want_read, want_write};
+    }
+
+    void remove(int fd) { fds_.erase(fd); }
+
+    void wait(vector<Event>& events) {
+        vector<pollfd> pfds;
+        vector<uint64_t> ids;
+        for (const auto& [fd, reg] : fds_) {
+            short mask = 0;
+            if (reg.want_read) mask |= POLLIN;
+            if (reg.want_write) mask |= POLLOUT;
+            pfds.push_back({.fd = fd, .events = mask, .revents = 0});
+            ids.push_back(reg.id);
+        }
+
+        events.clear();
+        if (::poll(pfds.data(), pfds.size(), -1) <= 0) return;
+
+        for (size_t i = 0; i < pfds.size(); ++i) {
+            short ev = pfds[i].revents;
+            if (ev == 0) continue;
+            events.push_back(
+                {.id = ids[i],
+                 .readable = (ev & (POLLIN | POLLHUP | POLLERR)) != 0,
+                 .writable = (ev & POLLOUT) != 0});
+        }
+    }
+
+   private:
+    struct Registration {
+        uint64_t id;
+        bool want_read;
+        bool want_write;
+    };
+
+    unordered_map<int, Registration> fds_;
+#endif
+};
+
+Server::Server(string socket_path, Interpreter& interpreter,
+               size_t num_workers)
+    : socket_path_(std::move(socket_path)),
+      interpreter_(interpreter),
+      pool_(make_unique<ThreadPool>(num_workers)),
+      listen_fd_(-1),
+      wake_pipe_{-1, -1},
+      next_session_id_(WAKE_ID + 1) {}
+
+Server::~Server() {
+    // Let in-flight commands finish before tearing down what they report to
+    pool_.reset();
+
+    for (auto& [_, session] : sessions_) {
+        close(session.fd);
+    }
+    if (listen_fd_ != -1) {
+        close(listen_fd_);
+        unlink(socket_path_.c_str());
+    }
+    if (wake_pipe_[0] != -1) close(wake_pipe_[0]);
+    if (wake_pipe_[1] != -1) close(wake_pipe_[1]);
+}
+
+void Server::stop() {
+    if (wake_pipe_[1] != -1) {
+        char c = 's';
+        (void)!write(wake_pipe_[1], &c, 1);
+    }
+}
+
+bool Server::run() {
+    signal(SIGPIPE, SIG_IGN);
+
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    if (socket_path_.size() >= sizeof(addr.sun_path)) {
+        errStream() << "Socket path too long: " << socket_path_ << endl;
+        return false;
+    }
+    strncpy(addr.sun_path, socket_path_.c_str(), sizeof(addr.sun_path) - 1);
+
+    listen_fd_ = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listen_fd_ == -1) {
+        errStream() << "socket: " << strerror(errno) << endl;
+        return false;
+    }
+
+    unlink(socket_path_.c_str());
+    if (bind(listen_fd_, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) ==
+            -1 ||
+        listen(listen_fd_, SOMAXCONN) == -1) {
+        errStream() << "Failed to listen on " << socket_path_ << ": "
+                    << strerror(errno) << endl;
+        return false;
+    }
+
+    if (pipe(wake_pipe_) == -1 || !setNonBlocking(listen_fd_) ||
+        !setNonBlocking(wake_pipe_[0]) || !setNonBlocking(wake_pipe_[1])) {
+        errStream() << "Failed to set up event loop: " << strerror(errno)
+                    << endl;
+        return false;
+    }
+
+    Poller poller;
+    poller.add(listen_fd_, LISTEN_ID, true, false);
+    poller.add(wake_pipe_[0], WAKE_ID, true, false);
+
+    outStream() << "Serving on " << socket_path_ << " with " << pool_->size()
+                << " workers" << endl;
+
+    vector<Poller::Event> events;
+    while (true) {
+        poller.wait(events);
+
+        for (const auto& event : events) {
+            if (event.id == LISTEN_ID) {
+                acceptClients(poller);
+            } else if (event.id == WAKE_ID) {
+                char buf[256];
+                ssize_t n;
+                while ((n = read(wake_pipe_[0], buf, sizeof(buf))) > 0) {
+                    if (memchr(buf, 's', n) != nullptr) return true;
+                }
+                drainCompleted(poller);
+            } else {
+                if (event.readable) readFromSession(poller, event.id);
+                if (event.writable) writeToSession(poller, event.id);
+            }
+        }
+    }
+}
+
+void Server::acceptClients(Poller& poller) {
+    while (true) {
+        int fd = accept(listen_fd_, nullptr, nullptr);
+        if (fd == -1) return;
+
+        if (!setNonBlocking(fd)) {
+            close(fd);
+            continue;
+        }
+
+        uint64_t id = next_session_id_++;
+        sessions_.emplace(id, Session{.fd = fd,
+                                      .read_buffer = {},
+                                      .write_buffer = {},
+                                      .pending = {},
+                                      .busy = false,
+                                      .closing = false,
+                                      .polled = true});
+        poller.add(fd, id, true, false);
+        sessionsGauge().set(sessions_.size());
+    }
+}
+
+void Server::readFromSession(Poller& poller, uint64_t id) {
+    auto it = sessions_.find(id);
+    if (it == sessions_.end()) return;
+    Session& session = it->second;
+
+    if (session.closing) {
+        // A hangup while responses are still being written, writing finds
+        // out whether the peer still reads them
+        writeToSession(poller, id);
+        return;
+    }
+
+    char buf[READ_CHUNK];
+    while (true) {
+        ssize_t n = read(session.fd, buf, sizeof(buf));
+        if (n > 0) {
+            session.read_buffer.append(buf, n);
+            continue;
+        }
+        if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+        if (n == -1 && errno == EINTR) continue;
+
+        // Peer shut down its side: the requests already read still run
+        // and are answered before the session is closed
+        session.closing = true;
+        break;
+    }
+
+    try {
+        while (auto request =
+                   takeFrame(session.read_buffer, MAX_REQUEST_SIZE)) {
+            session.pending.push_back(std::move(*request));
+        }
+    } catch (const length_error& e) {
+        errStream() << "Closing session: " << e.what() << endl;
+        closeSession(poller, id);
+        return;
+    }
+
+    dispatch(id, session);
+    updateSession(poller, id);
+}
+
+void Server::dispatch(uint64_t id, Session& session) {
+    if (session.busy || session.pending.empty()) return;
+
+    session.busy = true;
+    string command = std::move(session.pending.front());
+    session.pending.pop_front();
+
+    pool_->post([this, id, command = std::move(command)]() {
+        ostringstream output;
+        {
+            OutputRedirect redirect(output, output);
+            try {
+                interpreter_.processCommand(command);
+            } catch (const exception& e) {
+                errStream() << "Error: " << e.what() << endl;
+            }
+        }
+
+        {
+            lock_guard<mutex> lock(completed_mutex_);
+            completed_.emplace_back(id, std::move(output).str());
+        }
+
+        char c = 'c';
+        (void)!write(wake_pipe_[1], &c, 1);
+    });
+}
+
+void Server::drainCompleted(Poller& poller) {
+    vector<pair<uint64_t, string>> completed;
+    {
+        lock_guard<mutex> lock(completed_mutex_);
+        completed.swap(completed_);
+    }
+
+    for (auto& [id, response] : completed) {
+        auto it = sessions_.find(id);
+        if (it == sessions_.end()) continue;
+
+        Session& session = it->second;
+        session.busy = false;
+        session.write_buffer += encodeFrame(response);
+        dispatch(id, session);
+        writeToSession(poller, id);
+    }
+}
+
+void Server::writeToSession(Poller& poller, uint64_t id) {
+    auto it = sessions_.find(id);
+    if (it == sessions_.end()) return;
+    Session& session = it->second;
+
+    size_t written = 0;
+    while (written < session.write_buffer.size()) {
+        ssize_t n = write(session.fd, session.write_buffer.data() + written,
+                          session.write_buffer.size() - written);
+        if (n > 0) {
+            written += n;
+            continue;
+        }
+        if (n == -1 && errno == EINTR) continue;
+        if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+
+        closeSession(poller, id);
+        return;
+    }
+    session.write_buffer.erase(0, written);
+    updateSession(poller, id);
+}
+
+void Server::updateSession(Poller& poller, uint64_t id) {
+    auto it = sessions_.find(id);
+    if (it == sessions_.end()) return;
+    Session& session = it->second;
+
+    if (session.closing && !session.busy && session.pending.empty() &&
+        session.write_buffer.empty()) {
+        closeSession(poller, id);
+        return;
+    }
+
+    // A shut down peer is only waited on while responses are left to write
+    bool want_read = !session.closing;
+    bool want_write = !session.write_buffer.empty();
+    if (!want_read && !want_write) {
+        if (session.polled) poller.remove(session.fd);
+        session.polled = false;
+    } else if (session.polled) {
+        poller.modify(session.fd, id, want_read, want_write);
+    } else {
+        poller.add(session.fd, id, want_read, want_write);
+        session.polled = true;
+    }
+}
+
+void Server::closeSession(Poller& poller, uint64_t id) {
+    auto it = sessions_.find(id);
+    if (it == sessions_.end()) return;
+
+    if (it->second.polled) poller.remove(it->second.fd);
+    close(it->second.fd);
+    sessions_.erase(it);
+    sessionsGauge().set(sessions_.size());
+}
@@ -0,0 +1,123 @@
+#include "Settings.hpp"
+#include <algorithm>
+#include <cctype>
+#include <string_view>
+
+using namespace std;
+
+namespace {
+struct SettingEntry {
+    string_view name;
+    atomic<size_t> Settings::*member;
+    string_view description;
+    // Names of the values 0, 1, ... if the setting takes names
+    const string_view* values = nullptr;
+    size_t value_count = 0;
+};
+
+constexpr string_view WAL_MODES[] = {"none", "group", "sync"};
+
+constexpr SettingEntry ENTRIES[] = {
+    {"sort_memory", &Settings::sort_memory,
+     "bytes an order by buffers in memory before spilling to disk"},
+    {"memory_limit", &Settings::memory_limit,
+     "bytes of hash tables and buffers all queries may hold, 0 for no limit"},
+    {"query_memory_limit", &Settings::query_memory_limit,
+     "bytes of hash tables and buffers one query may hold, 0 for no limit"},
+    {"buffer_pool_memory", &Settings::buffer_pool_memory,
+     "bytes of shard pages cached in memory across all tables"},
+    {"join_cache_size", &Settings::join_cache_size,
+     "bytes of join results kept to answer repeated joins, 0 to disable"},
+    {"seal_size", &Settings::seal_size,
+     "bytes after which compressed tables compress their tail shard"},
+    {"cluster_delta_size", &Settings::cluster_delta_size,
+     "bytes of unsorted rows after which a clustered table merges them"},
+    {"cluster_shard_size", &Settings::cluster_shard_size,
+     "bytes a sorted shard of a clustered table grows to before it splits"},
+    {"prefetch_tables", &Settings::prefetch_tables,
+     "1 to open all tables in the background when a database is opened"},
+    {"join_batch_size", &Settings::join_batch_size,
+     "probe rows a join hashes and looks up together, 0 for one at a time"},
+    {"readahead_pages", &Settings::readahead_pages,
+     "shard pages a scan reads ahead asynchronously, 0 to disable"},
+    {"wal_mode", &Settings::wal_mode,
+     "durability of inserts: none, group (share log fsyncs) or sync",
+     WAL_MODES, size(WAL_MODES)},
+    {"wal_group_ms", &Settings::wal_group_ms,
+     "milliseconds a group commit waits for more inserts, 0 for none"},
+    {"wal_group_records", &Settings::wal_group_records,
+     "pending inserts that end the wait of a group commit early"},
+    {"wal_checkpoint_size", &Settings::wal_checkpoint_size,
+     "bytes of write-ahead log after which shards are synced and it emptied"},
+};
+
+bool parseSize(const string& value, size_t& result) {
+    size_t pos = 0;
+    unsigned long long number;
+
+    try {
+        number = stoull(value, &pos);
+    } catch (const exception&) {
+        return false;
+    }
+
+    if (pos + 1 == value.size()) {
+        switch (toupper(static_cast<unsigned char>(value[pos]))) {
+            case 'K':
+                number <<= 10;
+                break;
+            case 'M':
+                number <<= 20;
+                break;
+            case 'G':
+                number <<= 30;
+                break;
+            default:
+                return false;
+        }
+    } else if (pos != value.size()) {
+        return false;
+    }
+
+    result = number;
+    return true;
+}
+}  // namespace
+
+Settings& Settings::instance() {
+    static Settings settings;
+    return settings;
+}
+
+bool Settings::set(const string& name, const string& value) {
+    for (const auto& entry : ENTRIES) {
+        if (entry.name != name) continue;
+
+        size_t parsed;
+        if (entry.values) {
+            auto it = find(entry.values, entry.values + entry.value_count,
+                           value);
+            if (it == entry.values + entry.value_count) return false;
+            parsed = it - entry.values;
+        } else if (!parseSize(value, parsed)) {
+            return false;
+        }
+
+        (this->*entry.member).store(parsed);
+        return true;
+    }
+    return false;
+}
+
+void Settings::print(ostream& out) const {
+    for (const auto& entry : ENTRIES) {
+        size_t value = (this->*entry.member).load();
+        out << entry.name << " = ";
+        if (entry.values && value < entry.value_count) {
+            out << entry.values[value];
+        } else {
+            out << value;
+        }
+        out << "\n\t" << entry.description << "\n";
+    }
+}
@@ -1,5 +1,6 @@
-
 #include <Shard.hpp>
+#include <fcntl.h>
+#include <unistd.h>
 #include <filesystem>
 #include <future>
 #include <memory>
@@ -7,6 +8,11 @@
 #include <string>
 #include <vector>
 #include <worker.hpp>
+#include "Memory.hpp"
+#include "Profile.hpp"
+#include "Settings.hpp"
+#include "Trace.hpp"
+#include "utils.hpp"
 
 namespace fs = std::filesystem;
 using namespace std;
@@ -25,47 +31,405 @@ fs::path Shard::generateTempPath(const string& prefix) {
     return temp_dir / unique_name;
 }
 
-Shard::Shard(const string& file_path) : path_(file_path), temp_(false) {}
-Shard::Shard() : path_(generateTempPath()), temp_(true) {}
+namespace {
+shared_ptr<const BlockIndex> readBlocks(const fs::path& path) {
+    if (path.extension() != Shard::COMPRESSED_EXTENSION) return nullptr;
+
+    auto blocks = BlockIndex::read(path);
+    if (!blocks) {
+        errStream() << "Invalid block index in " << path << endl;
+        blocks = make_shared<const BlockIndex>();
+    }
+    return blocks;
+}
+}  // namespace
+
+Shard::File::File(fs::path file_path, bool temporary)
+    : path(std::move(file_path)), temp(temporary), retired(false) {}
+
+Shard::File::~File() {
+    if ((temp || retired) && fs::exists(path)) {
+        if (!temp) BufferPool::instance().invalidate(path.string());
+        fs::remove(path);
+    }
+}
+
+Shard::Shard(const string& file_path)
+    : file_(make_shared<File>(file_path, false)),
+      blocks_(readBlocks(file_->path)),
+      size_(blocks_                      ? blocks_->raw_size
+            : fs::exists(file_->path) ? fs::file_size(file_->path)
+                                      : 0) {}
+
+Shard::Shard(const string& file_path, uintmax_t size)
+    : file_(make_shared<File>(file_path, false)),
+      blocks_(readBlocks(file_->path)),
+      size_(size) {}
+
+Shard::Shard(const Shard& previous, uintmax_t size)
+    : file_(previous.file_), blocks_(previous.blocks_), size_(size) {}
+
+Shard::Shard()
+    : file_(make_shared<File>(generateTempPath(), true)), size_(0) {}
 
 string Shard::path() const {
-    return path_.string();
+    return file_->path.string();
 }
 
-Shard::~Shard() {
-    if (temp_ && fs::exists(path_)) {
-        fs::remove(path_);
+uintmax_t Shard::size() const {
+    return size_;
+}
+
+uintmax_t Shard::storedSize() const {
+    return blocks_ ? blocks_->stored_size : size_;
+}
+
+size_t Shard::numberOf(const fs::path& path) {
+    string stem = path.stem().string();
+    size_t start = stem.find('_');
+    if (start == string::npos) return 0;
+
+    try {
+        return stoul(stem.substr(start + 1));
+    } catch (const exception&) {
+        return 0;
     }
-};
+}
+
+size_t Shard::versionOf(const fs::path& path) {
+    string stem = path.stem().string();
+    size_t dot = stem.find('.');
+    if (dot == string::npos) return 0;
+
+    try {
+        return stoul(stem.substr(dot + 1));
+    } catch (const exception&) {
+        return 0;
+    }
+}
+
+fs::path Shard::nextVersionPath(bool compressed) const {
+    const fs::path& path = file_->path;
+    return path.parent_path() /
+           ("shard_" + to_string(numberOf(path)) + "." +
+            to_string(versionOf(path) + 1) +
+            (compressed ? COMPRESSED_EXTENSION : ".csv"));
+}
+
+void Shard::commit() {
+    size_ = fs::exists(file_->path) ? fs::file_size(file_->path) : 0;
+}
+
+void Shard::retire() {
+    file_->retired = true;
+}
+
+ShardIoMetrics& ShardIoMetrics::get() {
+    static ShardIoMetrics metrics{
+        Metrics::instance().counter("lmkdb_shard_read_bytes_total",
+                                    "Bytes read from shard files"),
+        Metrics::instance().counter("lmkdb_shard_read_rows_total",
+                                    "Rows read from shard files"),
+        Metrics::instance().counter("lmkdb_shard_written_bytes_total",
+                                    "Bytes written to shard files"),
+        Metrics::instance().counter("lmkdb_shard_written_rows_total",
+                                    "Rows written to shard files"),
+        Metrics::instance().counter("lmkdb_shards_rewritten_total",
+                                    "New shard versions written by rewrites"),
+        Metrics::instance().counter("lmkdb_fsyncs_total",
+                                    "fsync calls made on data files"),
+        Metrics::instance().counter("lmkdb_compressed_raw_bytes_total",
+                                    "Raw bytes written to compressed shards"),
+        Metrics::instance().counter(
+            "lmkdb_compressed_stored_bytes_total",
+            "Bytes compressed shards take on disk, index included"),
+        Metrics::instance().counter(
+            "lmkdb_shard_readahead_pages_total",
+            "Shard pages a scan used after reading them ahead"),
+    };
+    return metrics;
+}
+
+ShardWriter::ShardWriter(const fs::path& path, bool compressed)
+    : out_(path, ios::binary | ios::trunc), compressed_(compressed), size_(0) {}
+
+void ShardWriter::write(string_view line) {
+    size_ += line.size() + 1;
+    if (!compressed_) {
+        out_ << line << '\n';
+        return;
+    }
+
+    // Lines are split over blocks wherever a block fills up
+    auto append = [this](string_view data) {
+        while (!data.empty()) {
+            size_t part =
+                min(data.size(), BlockIndex::BLOCK_SIZE - block_.size());
+            block_.append(data.substr(0, part));
+            data.remove_prefix(part);
+
+            if (block_.size() == BlockIndex::BLOCK_SIZE) writeBlock();
+        }
+    };
+    append(line);
+    append("\n");
+}
+
+void ShardWriter::writeBlock() {
+    if (block_.empty()) return;
+
+    stored_.clear();
+    lzCompress(block_, stored_);
+
+    // Blocks that do not get smaller are stored as they are
+    const string& data = stored_.size() < block_.size() ? stored_ : block_;
+    index_.blocks.push_back({index_.stored_size,
+                             static_cast<uint32_t>(data.size()),
+                             static_cast<uint32_t>(block_.size())});
+    out_.write(data.data(), static_cast<streamsize>(data.size()));
+
+    index_.stored_size += data.size();
+    block_.clear();
+}
+
+bool ShardWriter::close() {
+    if (compressed_) {
+        writeBlock();
+        index_.raw_size = size_;
+        index_.write(out_);
+
+        ShardIoMetrics& metrics = ShardIoMetrics::get();
+        metrics.compressed_raw_bytes.add(size_);
+        metrics.compressed_stored_bytes.add(out_.tellp());
+    }
+    out_.close();
+    return static_cast<bool>(out_);
+}
+
+ShardReader::ShardReader(const Shard& shard)
+    : path_(shard.path()),
+      size_(shard.size()),
+      cache_(!shard.temporary()),
+      blocks_(shard.blocks()),
+      readahead_(true),
+      page_number_(0),
+      offset_(0),
+      next_offset_(0),
+      bytes_(0),
+      rows_(0),
+      queue_(nullptr),
+      fd_(-1),
+      ahead_(0),
+      pages_ahead_(0) {}
+
+ShardReader::~ShardReader() {
+    // Pages still in flight are read into buffers this reader owns
+    for (auto& [number, pending] : pending_) {
+        queue_->wait(*pending.request);
+    }
+    if (fd_ >= 0) close(fd_);
+
+    // Counted once per reader, scans would otherwise contend on the
+    // counters for every line
+    ShardIoMetrics& metrics = ShardIoMetrics::get();
+    metrics.bytes_read.add(bytes_);
+    metrics.rows_read.add(rows_);
+    metrics.readahead_pages.add(pages_ahead_);
+}
+
+bool ShardReader::next(string& line) {
+    string_view view;
+    if (!next(view)) return false;
+
+    line.assign(view);
+    return true;
+}
+
+bool ShardReader::readAhead(size_t number, size_t needed) {
+    constexpr size_t PAGE_SIZE = BufferPool::PAGE_SIZE;
+    size_t depth = Settings::instance().readahead_pages;
+    if (!depth) return false;
+
+    if (!queue_) {
+        queue_ = &IoQueue::forThread();
+        fd_ = open(path_.c_str(), O_RDONLY | O_CLOEXEC);
+    }
+    if (fd_ < 0) return false;
+
+    // Keep the next depth pages in flight, skipping those already cached
+    BufferPool& pool = BufferPool::instance();
+    size_t pages = (size_ + PAGE_SIZE - 1) / PAGE_SIZE;
+    ahead_ = max(ahead_, number);
+    for (; ahead_ < min(pages, number + depth); ++ahead_) {
+        uintmax_t start = uintmax_t(ahead_) * PAGE_SIZE;
+        size_t length = min<uintmax_t>(PAGE_SIZE, size_ - start);
+        if (cache_ && pool.contains(path_, ahead_, length)) continue;
+
+        auto page = make_shared<BufferPool::Page>();
+        page->data.resize(length);
+        auto request = queue_->read(fd_, start, page->data.data(), length);
+        pending_.emplace(ahead_, Pending{std::move(page), std::move(request)});
+    }
+    queue_->submit();
+
+    auto it = pending_.find(number);
+    if (it == pending_.end()) return false;
+
+    Pending pending = std::move(it->second);
+    pending_.erase(it);
+    queue_->wait(*pending.request);
+
+    // Errors and short reads go through the buffer pool instead. A read
+    // short of the page but covering the line keeps only the bytes read,
+    // never the zeroes past them
+    ssize_t result = pending.request->result;
+    if (result < static_cast<ssize_t>(needed)) return false;
+    pending.page->data.resize(static_cast<size_t>(result));
+
+    pages_ahead_++;
+    page_ = cache_ ? pool.adopt(path_, number, std::move(pending.page))
+                   : BufferPool::PageHandle(std::move(pending.page));
+    page_number_ = number;
+    return true;
+}
+
+void ShardReader::fetch(size_t number, size_t needed) {
+    BufferPool& pool = BufferPool::instance();
+    if (!blocks_) {
+        if (readahead_ && readAhead(number, needed)) return;
+
+        page_ = pool.fetch(path_, number, needed, cache_);
+        page_number_ = number;
+        return;
+    }
+
+    // Decoding shows up as its own operator, with stored bytes read and raw
+    // bytes written
+    if (!decode_timer_) {
+        decode_timer_ = make_unique<OperatorTimer>(
+            "decompress", fs::path(path_).filename().string(), true);
+    }
+    decode_timer_->resume();
+    OperatorStats* stats = decode_timer_->stats();
+
+    size_t depth = Settings::instance().readahead_pages;
+    if (readahead_ && depth && number % depth == 0) {
+        pool.prefetch(path_, number, depth, *blocks_, stats);
+    }
+    page_ = pool.fetch(path_, number, needed, cache_, blocks_.get(), stats);
+    page_number_ = number;
+
+    decode_timer_->pause();
+}
+
+bool ShardReader::next(string_view& line) {
+    constexpr size_t PAGE_SIZE = BufferPool::PAGE_SIZE;
+    if (next_offset_ >= size_) return false;
+
+    uintmax_t pos = next_offset_;
+    bool spans = false;
+    line = {};
+
+    // A line may continue over several pages, only then is it copied
+    while (pos < size_) {
+        size_t number = pos / PAGE_SIZE;
+        uintmax_t page_start = uintmax_t(number) * PAGE_SIZE;
+        size_t needed = min<uintmax_t>(PAGE_SIZE, size_ - page_start);
+
+        if (!page_ || page_number_ != number) {
+            if (!line.empty() && !spans) {
+                spanning_.assign(line);
+                spans = true;
+            }
+            fetch(number, needed);
+        }
+
+        string_view data = page_.data();
+        size_t start = pos - page_start;
+        size_t end = min(data.size(), needed);
+        if (start >= end) {
+            // File is shorter than its committed size
+            pos = size_;
+            break;
+        }
+
+        size_t newline = data.find('\n', start);
+        size_t stop = newline < end ? newline : end;
+        string_view part = data.substr(start, stop - start);
+
+        if (spans) {
+            spanning_.append(part);
+            line = spanning_;
+        } else {
+            line = part;
+        }
+
+        if (newline < end) {
+            pos = page_start + newline + 1;
+            break;
+        }
+        pos = page_start + end;
+    }
+
+    bytes_ += pos - next_offset_;
+    offset_ = next_offset_;
+    next_offset_ = pos;
+    rows_++;
+
+    return true;
+}
 
 future<Shard::JoinResult> Shard::joinShards(
-    const vector<shared_ptr<Shard>>& others, const string& this_join_attr,
-    const string& other_join_attr,
-    const unordered_map<string, int>& this_metadata,
-    const unordered_map<string, int>& other_metadata) const {
+    const vector<shared_ptr<Shard>>& others,
+    shared_ptr<const JoinKeys> keys) const {
+    // Shard tasks report to the profile of the command that started them
+    QueryProfile* profile = QueryProfile::current();
+    MemoryTracker* memory = &MemoryTracker::current();
+    auto queued = chrono::steady_clock::now();
+
     return async(
         launch::async,
-        [others, this_metadata, this_join_attr, other_metadata, other_join_attr,
-         this]() -> JoinResult {
-            JoinResult result;
-            auto result_shard = make_shared<Shard>();
+        [others, keys, this, profile, memory, queued]() -> JoinResult {
+            static Histogram& queue_time = Metrics::instance().histogram(
+                "lmkdb_join_task_queue_seconds",
+                "Time join shard tasks wait before they start");
+            static Histogram& run_time = Metrics::instance().histogram(
+                "lmkdb_join_task_run_seconds",
+                "Time join shard tasks take to run");
 
-            vector<string> other_paths{};
-            other_paths.reserve(others.size());
+            queue_time.record(chrono::duration_cast<chrono::nanoseconds>(
+                                  chrono::steady_clock::now() - queued)
+                                  .count());
+            LatencyTimer run_timer(run_time);
 
-            for (const auto& shard : others) {
-                other_paths.push_back(shard->path());
+            // Start-up delay of the task's thread, then the task itself
+            string task;
+            if (Tracer::enabled()) {
+                task = fs::path(path()).filename().string();
+                uint64_t queued_ns =
+                    chrono::duration_cast<chrono::nanoseconds>(
+                        queued.time_since_epoch())
+                        .count();
+                Tracer::instance().nameThread("join task");
+                Tracer::instance().record({"task start", "task", queued_ns,
+                                           Tracer::now() - queued_ns, task,
+                                           nullopt});
             }
+            TraceSpan span("join task", "task", task);
+
+            QueryProfile::Activate activate(profile);
+            MemoryTracker::Activate charge(memory);
+            JoinResult result;
+            auto result_shard = make_shared<Shard>();
 
             JoinWorker worker(result_shard->path());
 
-            bool success = worker.processShardBatch(
-                this->path(), other_paths, this_metadata.at(this_join_attr),
-                other_metadata.at(other_join_attr));
+            bool success = worker.processShardBatch(*this, others, *keys);
+            result_shard->commit();
 
             result.success = success;
             result.result_shard = success ? result_shard : nullptr;
-            result.error_message = success ? "" : "Failed to join shards";
+            result.error_message = success ? "" : worker.error();
 
             return result;
         });
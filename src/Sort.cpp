@@ -0,0 +1,271 @@
+#include "Sort.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <future>
+#include <queue>
+#include <stdexcept>
+#include <thread>
+#include <utility>
+
+using namespace std;
+
+bool parseNumber(string_view value, double& number) {
+    char buf[64];
+    if (value.empty() || value.size() >= sizeof(buf)) return false;
+
+    // strtod accepts leading whitespace, hex and inf/nan, values don't
+    char first = value.front();
+    if (!isdigit(static_cast<unsigned char>(first)) && first != '-' &&
+        first != '+' && first != '.') {
+        return false;
+    }
+
+    memcpy(buf, value.data(), value.size());
+    buf[value.size()] = '\0';
+
+    char* end;
+    number = strtod(buf, &end);
+    return end == buf + value.size() && isfinite(number) &&
+           value.find_first_of("xX") == string_view::npos;
+}
+
+int compareValues(string_view a, string_view b) {
+    double num_a, num_b;
+    bool a_numeric = parseNumber(a, num_a);
+    bool b_numeric = parseNumber(b, num_b);
+
+    if (a_numeric != b_numeric) return a_numeric ? -1 : 1;
+    if (a_numeric) return num_a < num_b ? -1 : (num_b < num_a ? 1 : 0);
+
+    int cmp = a.compare(b);
+    return cmp < 0 ? -1 : (cmp > 0 ? 1 : 0);
+}
+
+RowSorter::RowSorter(int key_column, bool descending, optional<size_t> limit,
+                     size_t memory_budget)
+    : key_column_(key_column),
+      descending_(descending),
+      limit_(limit),
+      memory_budget_(memory_budget),
+      buffered_bytes_(0),
+      peak_bytes_(0),
+      spilled_bytes_(0),
+      next_sequence_(0),
+      use_heap_(limit && *limit <= TOP_K_HEAP_LIMIT) {}
+
+RowSorter::~RowSorter() = default;
+
+RowSorter::Entry RowSorter::makeEntry(string row, size_t sequence) const {
+    string_view key = fieldAt(row, key_column_);
+    size_t offset = key.empty() ? 0 : key.data() - row.data();
+
+    Entry entry{.row = std::move(row),
+                .key_offset = offset,
+                .key_length = key.size(),
+                .sequence = sequence,
+                .number = 0,
+                .numeric = false};
+    entry.numeric = parseNumber(entry.key(), entry.number);
+    return entry;
+}
+
+bool RowSorter::before(const Entry& a, const Entry& b) const {
+    int cmp;
+    if (a.numeric != b.numeric) {
+        cmp = a.numeric ? -1 : 1;
+    } else if (a.numeric) {
+        cmp = a.number < b.number ? -1 : (b.number < a.number ? 1 : 0);
+    } else {
+        cmp = a.key().compare(b.key());
+    }
+
+    if (cmp != 0) return descending_ ? cmp > 0 : cmp < 0;
+    return a.sequence < b.sequence;
+}
+
+void RowSorter::add(string row) {
+    if (limit_ && *limit_ == 0) return;
+
+    Entry entry = makeEntry(std::move(row), next_sequence_++);
+    auto cmp = [this](const Entry& a, const Entry& b) { return before(a, b); };
+
+    if (use_heap_) {
+        // Max-heap on sort order, its top is the worst row kept so far
+        if (buffer_.size() < *limit_) {
+            buffered_bytes_ += entry.row.capacity() + sizeof(Entry);
+            peak_bytes_ = max(peak_bytes_, buffered_bytes_);
+            buffer_.push_back(std::move(entry));
+            push_heap(buffer_.begin(), buffer_.end(), cmp);
+        } else if (before(entry, buffer_.front())) {
+            pop_heap(buffer_.begin(), buffer_.end(), cmp);
+            buffer_.back() = std::move(entry);
+            push_heap(buffer_.begin(), buffer_.end(), cmp);
+        }
+        return;
+    }
+
+    buffered_bytes_ += entry.row.capacity() + sizeof(Entry);
+    peak_bytes_ = max(peak_bytes_, buffered_bytes_);
+    buffer_.push_back(std::move(entry));
+
+    // A refused reservation spills too, but never runs of fewer than
+    // MIN_RUN_BYTES, however little of the limit is left
+    if (buffered_bytes_ >= memory_budget_ ||
+        (!reserveBuffer() && buffered_bytes_ >= MIN_RUN_BYTES)) {
+        spill();
+    }
+}
+
+bool RowSorter::reserveBuffer() {
+    if (buffered_bytes_ <= memory_.bytes()) return true;
+    return memory_.resize(buffered_bytes_ + RESERVE_STEP) ||
+           memory_.resize(buffered_bytes_);
+}
+
+void RowSorter::sortBuffer() {
+    auto cmp = [this](const Entry& a, const Entry& b) { return before(a, b); };
+
+    size_t threads = max(1u, thread::hardware_concurrency());
+    size_t chunk = (buffer_.size() + threads - 1) / threads;
+
+    if (threads == 1 || buffer_.size() < 2 * 4096) {
+        sort(buffer_.begin(), buffer_.end(), cmp);
+        return;
+    }
+
+    // Sort chunks in parallel, then merge neighbouring chunks pairwise
+    vector<size_t> bounds;
+    for (size_t start = 0; start < buffer_.size(); start += chunk) {
+        bounds.push_back(start);
+    }
+    bounds.push_back(buffer_.size());
+
+    vector<future<void>> tasks;
+    for (size_t i = 0; i + 1 < bounds.size(); ++i) {
+        tasks.push_back(async(launch::async, [&, i]() {
+            sort(buffer_.begin() + bounds[i], buffer_.begin() + bounds[i + 1],
+                 cmp);
+        }));
+    }
+    for (auto& task : tasks) task.get();
+
+    while (bounds.size() > 2) {
+        vector<size_t> merged_bounds;
+        tasks.clear();
+
+        for (size_t i = 0; i + 1 < bounds.size(); i += 2) {
+            merged_bounds.push_back(bounds[i]);
+            if (i + 2 >= bounds.size()) continue;
+
+            tasks.push_back(async(launch::async, [&, i]() {
+                inplace_merge(buffer_.begin() + bounds[i],
+                              buffer_.begin() + bounds[i + 1],
+                              buffer_.begin() + bounds[i + 2], cmp);
+            }));
+        }
+        merged_bounds.push_back(buffer_.size());
+
+        for (auto& task : tasks) task.get();
+        bounds = std::move(merged_bounds);
+    }
+}
+
+void RowSorter::spill() {
+    if (buffer_.empty()) return;
+
+    sortBuffer();
+
+    // A limited sort never needs more than limit rows of any run
+    size_t count = limit_ ? min(*limit_, buffer_.size()) : buffer_.size();
+
+    auto run = make_shared<Shard>();
+    {
+        ofstream out(run->path());
+        for (size_t i = 0; i < count; ++i) {
+            out << buffer_[i].row << "\n";
+            spilled_bytes_ += buffer_[i].row.size() + 1;
+        }
+        if (!out) {
+            throw runtime_error("Failed to write sort run " + run->path());
+        }
+    }
+    run->commit();
+    ShardIoMetrics::get().recordWrite(run->size(), count);
+    runs_.push_back(run);
+
+    buffer_.clear();
+    buffered_bytes_ = 0;
+    memory_.resize(0);
+}
+
+void RowSorter::merge(const function<void(const string&)>& emit) {
+    struct Cursor {
+        unique_ptr<ShardReader> reader;
+        Entry current;
+    };
+
+    vector<Cursor> cursors;
+    cursors.reserve(runs_.size());
+
+    for (size_t i = 0; i < runs_.size(); ++i) {
+        auto reader = make_unique<ShardReader>(*runs_[i]);
+        string row;
+        if (reader->next(row)) {
+            // Runs hold consecutive input, so the run index orders ties
+            cursors.push_back(
+                {std::move(reader), makeEntry(std::move(row), i)});
+        }
+    }
+
+    auto worse = [this, &cursors](size_t a, size_t b) {
+        return before(cursors[b].current, cursors[a].current);
+    };
+    priority_queue<size_t, vector<size_t>, decltype(worse)> heap(worse);
+    for (size_t i = 0; i < cursors.size(); ++i) heap.push(i);
+
+    size_t emitted = 0;
+    string row;
+    while (!heap.empty() && (!limit_ || emitted < *limit_)) {
+        size_t i = heap.top();
+        heap.pop();
+
+        emit(cursors[i].current.row);
+        emitted++;
+
+        if (cursors[i].reader->next(row)) {
+            size_t run = cursors[i].current.sequence;
+            cursors[i].current = makeEntry(std::move(row), run);
+            heap.push(i);
+        }
+    }
+}
+
+void RowSorter::finish(const function<void(const string&)>& emit) {
+    if (!runs_.empty()) {
+        spill();
+        merge(emit);
+        runs_.clear();
+        return;
+    }
+
+    if (use_heap_) {
+        auto cmp = [this](const Entry& a, const Entry& b) {
+            return before(a, b);
+        };
+        sort_heap(buffer_.begin(), buffer_.end(), cmp);
+    } else {
+        sortBuffer();
+    }
+
+    size_t count = limit_ ? min(*limit_, buffer_.size()) : buffer_.size();
+    for (size_t i = 0; i < count; ++i) {
+        emit(buffer_[i].row);
+    }
+
+    buffer_.clear();
+    buffered_bytes_ = 0;
+    memory_.resize(0);
+}
@@ -1,26 +1,275 @@
 #include "Table.hpp"
 #include <algorithm>
+#include <charconv>
+#include <deque>
 #include <filesystem>
 #include <fstream>
 #include <future>
 #include <iostream>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <sstream>
 #include <stdexcept>
+#include <thread>
 #include <unordered_map>
+#include "Arrow.hpp"
+#include "Batch.hpp"
+#include "BufferPool.hpp"
+#include "Catalog.hpp"
+#include "Profile.hpp"
+#include "Settings.hpp"
+#include "ThreadPool.hpp"
+#include "Wal.hpp"
+#include "utils.hpp"
+#include "worker.hpp"
 
 namespace fs = std::filesystem;
 using namespace std;
 
+namespace {
+// Table versions are drawn from one counter, so a table dropped and created
+// again never repeats a version the join cache may still hold
+uint64_t nextVersion() {
+    static atomic<uint64_t> counter = 0;
+    return ++counter;
+}
+
+size_t countRecords(const Shard& shard) {
+    if (shard.compressed()) {
+        ShardReader reader(shard);
+        string_view line;
+        size_t records = 0;
+        while (reader.next(line)) records++;
+        return records;
+    }
+
+    ifstream file(shard.path(), ios::binary);
+    uintmax_t remaining = shard.size();
+    size_t records = 0;
+    char buf[64 * 1024];
+
+    while (remaining > 0 && file) {
+        file.read(buf, static_cast<streamsize>(min<uintmax_t>(
+                           remaining, sizeof(buf))));
+        streamsize n = file.gcount();
+        if (n <= 0) break;
+
+        records += count(buf, buf + n, '\n');
+        remaining -= n;
+    }
+    return records;
+}
+
+// Reads the first row starting at or after offset, false if there is none
+bool rowAtOrAfter(ShardReader& reader, uintmax_t offset, string_view& line) {
+    if (offset > 0) {
+        // The rest of the row holding offset - 1 ends where the next starts
+        reader.seek(offset - 1);
+        if (!reader.next(line)) return false;
+    } else {
+        reader.seek(0);
+    }
+    return reader.next(line);
+}
+
+/* Offset of the first row of a sorted shard whose key is not below bounds,
+ * or the shard size if there is none. Probes of the binary search read the
+ * first row after a byte offset; the last few KB are scanned. */
+uintmax_t lowerBound(const Shard& shard, int column, const KeyBounds& bounds,
+                     uint64_t& rows, uintmax_t& bytes) {
+    constexpr uintmax_t SCAN_BYTES = 4096;
+    ShardReader reader(shard);
+    string_view line;
+
+    // Rows starting before lo are below bounds, the row at hi is not
+    uintmax_t lo = 0;
+    uintmax_t hi = shard.size();
+
+    while (hi - lo > SCAN_BYTES) {
+        uintmax_t mid = lo + (hi - lo) / 2;
+        if (!rowAtOrAfter(reader, mid, line) || reader.offset() >= hi) break;
+
+        rows++;
+        if (bounds.below(fieldAt(line, column))) {
+            lo = reader.offset() + 1;
+        } else {
+            hi = reader.offset();
+        }
+    }
+
+    uintmax_t result = hi;
+    if (rowAtOrAfter(reader, lo, line)) {
+        do {
+            rows++;
+            if (reader.offset() >= hi ||
+                !bounds.below(fieldAt(line, column))) {
+                result = min(reader.offset(), hi);
+                break;
+            }
+        } while (reader.next(line));
+    }
+    bytes += reader.bytesRead();
+    return result;
+}
+
+/* Rows of a clustered table in key order, limited to bounds: its sorted
+ * shards one after the other, each entered at its binary searched lower
+ * bound and left at the first key above bounds, merged with the rows of
+ * the unsorted delta within bounds, which are sorted in memory. Of equal
+ * keys, rows of the sorted shards come first. */
+class ClusteredScan {
+   public:
+    ClusteredScan(const ShardList& shards, int column, KeyBounds bounds)
+        : column_(column), bounds_(std::move(bounds)) {
+        for (const auto& shard : shards) {
+            const auto& range = shard->keyRange();
+            if (!range) {
+                readDelta(*shard);
+            } else if (bounds_.overlaps(range->min, range->max)) {
+                sorted_.push_back(shard);
+            }
+        }
+        ranges::stable_sort(delta_, [this](const string& a, const string& b) {
+            return compareValues(fieldAt(a, column_), fieldAt(b, column_)) < 0;
+        });
+    }
+
+    // The view is valid until the next call
+    bool next(string_view& line) {
+        if (!current_) advance();
+
+        bool from_delta =
+            next_delta_ < delta_.size() &&
+            (!current_ || compareValues(fieldAt(delta_[next_delta_], column_),
+                                        fieldAt(*current_, column_)) < 0);
+        if (from_delta) {
+            line = delta_[next_delta_++];
+            return true;
+        }
+        if (!current_) return false;
+
+        line = *current_;
+        current_.reset();
+        return true;
+    }
+
+    size_t shardsSearched() const { return sorted_.size(); }
+    uint64_t rowsRead() const { return rows_; }
+    uintmax_t bytesRead() const {
+        return bytes_ + (reader_ ? reader_->bytesRead() : 0);
+    }
+
+   private:
+    int column_;
+    KeyBounds bounds_;
+    ShardList sorted_;
+    vector<string> delta_;
+    size_t next_delta_ = 0;
+
+    size_t shard_ = 0;
+    unique_ptr<ShardReader> reader_;
+    optional<string_view> current_;
+    uint64_t rows_ = 0;
+    uintmax_t bytes_ = 0;
+
+    void readDelta(const Shard& shard) {
+        ShardReader reader(shard);
+        string_view line;
+        while (reader.next(line)) {
+            rows_++;
+            if (bounds_.contains(fieldAt(line, column_))) {
+                delta_.emplace_back(line);
+            }
+        }
+        bytes_ += reader.bytesRead();
+    }
+
+    void closeShard() {
+        bytes_ += reader_->bytesRead();
+        reader_.reset();
+        shard_++;
+    }
+
+    // Reads the next row of the sorted shards within bounds into current_
+    void advance() {
+        string_view line;
+        while (shard_ < sorted_.size()) {
+            if (!reader_) {
+                const Shard& shard = *sorted_[shard_];
+                uintmax_t start =
+                    bounds_.lower
+                        ? lowerBound(shard, column_, bounds_, rows_, bytes_)
+                        : 0;
+                reader_ = make_unique<ShardReader>(shard);
+                if (start > 0) reader_->seek(start);
+            }
+            if (!reader_->next(line)) {
+                closeShard();
+                continue;
+            }
+
+            rows_++;
+            string_view key = fieldAt(line, column_);
+            if (bounds_.above(key)) {
+                // Later shards only hold larger keys
+                closeShard();
+                shard_ = sorted_.size();
+                return;
+            }
+            if (!bounds_.below(key)) {
+                current_ = line;
+                return;
+            }
+        }
+    }
+};
+}  // namespace
+
 Table::Table(const string& name, const fs::path& base_path, bool temporary)
-    : name_(name), path_(base_path / name), temp_(temporary) {
+    : name_(name),
+      path_(base_path / name),
+      temp_(temporary),
+      catalog_(nullptr),
+      compressed_(false),
+      width_(0),
+      shards_(make_shared<const ShardList>()),
+      version_(nextVersion()) {
     if (!temp_) {
         loadMetadata();
         loadShards();
+        width_ = metadata_.size();
     } else {
         fs::create_directory(path_);
     }
 }
 
+Table::Table(const string& name, const fs::path& base_path,
+             const vector<string>& attributes,
+             const vector<string>& shard_files,
+             const map<string, KeyRange>& key_ranges)
+    : name_(name),
+      path_(base_path / name),
+      temp_(false),
+      catalog_(nullptr),
+      compressed_(false),
+      width_(attributes.size()),
+      shards_(make_shared<const ShardList>()),
+      version_(nextVersion()) {
+    for (size_t i = 0; i < attributes.size(); ++i) {
+        metadata_[attributes[i]] = static_cast<int>(i);
+    }
+
+    auto shards = make_shared<ShardList>();
+    for (const auto& file : shard_files) {
+        shards->push_back(make_shared<Shard>((path_ / file).string()));
+        if (auto range = key_ranges.find(file); range != key_ranges.end()) {
+            shards->back()->setKeyRange(range->second);
+        }
+    }
+    publish(shards);
+}
+
 string Table::tablePath() const {
     return path_.string();
 }
@@ -29,20 +278,107 @@ string Table::getName() const {
     return name_;
 }
 
+size_t Table::shardCount() const {
+    return snapshot()->size();
+}
+
+uintmax_t Table::dataSize() const {
+    auto shards = snapshot();
+    uintmax_t total = 0;
+    for (const auto& shard : *shards) {
+        total += shard->size();
+    }
+    return total;
+}
+
+uintmax_t Table::storedSize() const {
+    auto shards = snapshot();
+    uintmax_t total = 0;
+    for (const auto& shard : *shards) {
+        total += shard->storedSize();
+    }
+    return total;
+}
+
+bool Table::coPartitioned(const Table& other, const string& this_attr,
+                          const string& other_attr) const {
+    return partitioning_ && other.partitioning_ &&
+           partitioning_->attribute == this_attr &&
+           other.partitioning_->attribute == other_attr &&
+           partitioning_->count == other.partitioning_->count;
+}
+
+optional<KeyBounds> Table::clusterBounds(
+    const vector<Condition>& where) const {
+    if (!cluster_attribute_) return nullopt;
+
+    KeyBounds bounds;
+    for (const auto& condition : where) {
+        if (condition.attribute == *cluster_attribute_) bounds.add(condition);
+    }
+    return bounds;
+}
+
+bool Table::clusteredOrder(const optional<OrderBy>& order) const {
+    return cluster_attribute_ && order && !order->descending &&
+           order->attribute == *cluster_attribute_;
+}
+
+size_t Table::partitionOf(string_view value, size_t count) {
+    // 64 bit FNV-1a
+    uint64_t hash = 14695981039346656037ull;
+    for (char c : value) {
+        hash ^= static_cast<unsigned char>(c);
+        hash *= 1099511628211ull;
+    }
+    return hash % count;
+}
+
 bool Table::isTemp() const {
     return temp_;
 }
 
 void Table::loadShards() {
-    vector<shared_ptr<Shard>> shards{};
+    // Latest version of each shard, by shard number
+    map<size_t, fs::path> latest{};
+    vector<fs::path> stale{};
+
+    for (const auto& entry : fs::directory_iterator(tablePath())) {
+        const fs::path& shard_path = entry.path();
+
+        if (shard_path.extension() == ".tmp") {
+            // Rewrite that never got published
+            stale.push_back(shard_path);
+            continue;
+        }
+        if (shard_path.extension() != ".csv" &&
+            shard_path.extension() != Shard::COMPRESSED_EXTENSION) {
+            continue;
+        }
 
-    for (const auto& shard_path : fs::directory_iterator(tablePath())) {
-        if (shard_path.path().extension() == ".csv") {
-            auto shard = make_shared<Shard>(Shard(shard_path.path().string()));
-            shards.push_back(shard);
+        size_t number = Shard::numberOf(shard_path);
+        auto it = latest.find(number);
+        if (it == latest.end()) {
+            latest.emplace(number, shard_path);
+        } else if (Shard::versionOf(shard_path) >
+                   Shard::versionOf(it->second)) {
+            stale.push_back(it->second);
+            it->second = shard_path;
+        } else {
+            stale.push_back(shard_path);
         }
     }
-    shards_ = shards;
+
+    for (const auto& path : stale) {
+        BufferPool::instance().invalidate(path.string());
+        fs::remove(path);
+    }
+
+    auto shards = make_shared<ShardList>();
+    for (const auto& [_, path] : latest) {
+        shards->push_back(make_shared<Shard>(path.string()));
+    }
+    publish(shards);
 }
 
 bool Table::loadMetadata() {
@@ -66,7 +402,7 @@ bool Table::loadMetadata() {
 
         size_t pos = line.find(',');
         if (pos == string::npos) {
-            cerr << "Invalid mapping format in line: " << line << endl;
+            errStream() << "Invalid mapping format in line: " << line << endl;
             continue;
         }
 
@@ -80,10 +416,71 @@ bool Table::loadMetadata() {
     return true;
 }
 
-const vector<shared_ptr<Shard>>& Table::getShards() const {
+shared_ptr<const ShardList> Table::snapshot() const {
+    lock_guard<mutex> lock(snapshot_mutex_);
     return shards_;
 }
 
+bool Table::publish(shared_ptr<const ShardList> shards,
+                    bool rebuild_indexes) {
+    bool files_changed;
+    unique_lock<shared_mutex> index_lock(index_mutex_);
+    shared_ptr<const ShardList> before = shards;
+    {
+        lock_guard<mutex> lock(snapshot_mutex_);
+        files_changed =
+            !equal(shards_->begin(), shards_->end(), shards->begin(),
+                   shards->end(), [](const auto& a, const auto& b) {
+                       return a->path() == b->path();
+                   });
+        swap(before, shards_);
+        version_ = nextVersion();
+    }
+
+    if (rebuild_indexes) {
+        for (const auto& [attr, index] : indexes_) {
+            buildIndex(*index, getMetadata().at(attr), *shards);
+        }
+    } else if (!indexes_.empty()) {
+        updateIndexes(*before, *shards);
+    }
+    index_lock.unlock();
+
+    // Appends only grow the tail shard, the catalog is not affected
+    return !files_changed || !catalog_ || catalog_->persist();
+}
+
+vector<string> Table::attributes() const {
+    vector<string> result(metadata_.size());
+    for (const auto& [attr, index] : metadata_) {
+        if (index >= 0 && static_cast<size_t>(index) < result.size()) {
+            result[index] = attr;
+        }
+    }
+    return result;
+}
+
+vector<string> Table::shardFiles() const {
+    auto shards = snapshot();
+    vector<string> result;
+    for (const auto& shard : *shards) {
+        result.push_back(fs::path(shard->path()).filename().string());
+    }
+    return result;
+}
+
+map<string, KeyRange> Table::keyRanges() const {
+    auto shards = snapshot();
+    map<string, KeyRange> result;
+    for (const auto& shard : *shards) {
+        if (shard->keyRange()) {
+            result[fs::path(shard->path()).filename().string()] =
+                *shard->keyRange();
+        }
+    }
+    return result;
+}
+
 void Table::setMetadata(const unordered_map<string, int>& metadata) {
     if (isTemp()) {
         metadata_ = metadata;
@@ -100,23 +497,399 @@ bool Table::validateAttributes(
 
     for (const auto& [attr, _] : attributes) {
         if (metadata.find(attr) == metadata.end()) {
-            cerr << "Invalid attribute for table " << getName() << ": " << attr
-                 << endl;
+            errStream() << "Invalid attribute for table " << getName()
+                        << ": " << attr << endl;
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool Table::indexable(const unordered_map<string, string>& values) const {
+    for (const auto& attr : indexedAttributes()) {
+        auto value = values.find(attr);
+        if (value != values.end() && !BTreeIndex::indexable(value->second)) {
+            errStream() << "Value of indexed attribute " << attr
+                        << " is longer than " << BTreeIndex::MAX_KEY_SIZE
+                        << " bytes" << endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+shared_ptr<Dictionary> Table::dictionary(int column) const {
+    if (column < 0 || static_cast<size_t>(column) >= dictionaries_.size()) {
+        return nullptr;
+    }
+    return dictionaries_[column];
+}
+
+bool Table::encoded(const string& attr) const {
+    auto column = getMetadata().find(attr);
+    return column != getMetadata().end() && dictionary(column->second);
+}
+
+vector<string> Table::encodedAttributes() const {
+    vector<string> result;
+    for (const auto& attr : attributes()) {
+        if (encoded(attr)) result.push_back(attr);
+    }
+    return result;
+}
+
+bool Table::encodeValues(unordered_map<string, string>& values,
+                         bool add) const {
+    if (dictionaries_.empty()) return true;
+
+    for (auto& [attr, value] : values) {
+        auto column = getMetadata().find(attr);
+        if (column == getMetadata().end()) continue;
+
+        auto dictionary = this->dictionary(column->second);
+        if (!dictionary) continue;
+
+        auto code = add ? dictionary->encode(value) : dictionary->find(value);
+        if (!code) return false;
+        value = to_string(*code);
+    }
+    return true;
+}
+
+void Table::decodeRow(string_view line, RecordView& record,
+                      string& decoded) const {
+    record.parse(line);
+    decoded.clear();
+
+    for (size_t i = 0; i < record.size(); ++i) {
+        if (i > 0) decoded += ',';
+
+        string_view field = record[i];
+        if (auto dictionary = i < dictionaries_.size() ? dictionaries_[i].get()
+                                                       : nullptr) {
+            auto code = Dictionary::parseCode(field);
+            if (code && *code < dictionary->size()) {
+                field = dictionary->decode(*code);
+            }
+        }
+        decoded += field;
+    }
+
+    // Keeps the trailing empty field the parse dropped
+    if (line.ends_with(',')) decoded += ',';
+}
+
+void Table::loadDictionary(const string& attr) {
+    auto column = getMetadata().find(attr);
+    if (column == getMetadata().end()) {
+        errStream() << "Invalid encoded attribute for table " << getName()
+                    << ": " << attr << endl;
+        return;
+    }
+
+    dictionaries_.resize(width_);
+    dictionaries_[column->second] =
+        make_shared<Dictionary>(path_ / ("dict_" + attr + ".txt"));
+}
+
+string_view Table::fieldValue(string_view line, int column) const {
+    string_view field = fieldAt(line, column);
+    if (auto* dictionary = static_cast<size_t>(column) < dictionaries_.size()
+                               ? dictionaries_[column].get()
+                               : nullptr) {
+        auto code = Dictionary::parseCode(field);
+        if (code && *code < dictionary->size()) {
+            field = dictionary->decode(*code);
+        }
+    }
+    return field;
+}
+
+bool Table::compileWhere(const vector<Condition>& where,
+                         PredicateProgram& program) const {
+    for (const auto& condition : where) {
+        auto column = getMetadata().find(condition.attribute);
+        if (column == getMetadata().end()) {
+            errStream() << "Invalid attribute for table " << getName() << ": "
+                        << condition.attribute << endl;
             return false;
         }
+        program.add(column->second, dictionary(column->second).get(),
+                    condition);
+    }
+    return true;
+}
+
+bool Table::buildIndex(BTreeIndex& index, int column,
+                       const ShardList& shards) const {
+    OperatorTimer timer("index build", getName());
+    vector<BTreeIndex::Entry> entries;
+    uintmax_t bytes = 0;
+
+    for (const auto& shard : shards) {
+        auto number = static_cast<uint32_t>(Shard::numberOf(shard->path()));
+        ShardReader reader(*shard);
+        string_view line;
+        while (reader.next(line)) {
+            string_view value = fieldValue(line, column);
+            if (!BTreeIndex::indexable(value)) {
+                errStream() << "Cannot index a value longer than "
+                            << BTreeIndex::MAX_KEY_SIZE << " bytes in table "
+                            << getName() << endl;
+                return false;
+            }
+            entries.push_back({string(value), number, reader.offset()});
+        }
+        bytes += reader.bytesRead();
+    }
+
+    // Loading leaves in index order writes every page once
+    ranges::sort(entries, BTreeIndex::less);
+    if (auto* stats = timer.stats()) {
+        stats->rows_in = entries.size();
+        stats->rows_out = entries.size();
+        stats->bytes_read = bytes;
+    }
+    return index.bulkLoad(entries) && index.flush(true);
+}
+
+void Table::updateIndexes(const ShardList& before, const ShardList& after) {
+    vector<pair<int, BTreeIndex*>> columns;
+    for (const auto& [attr, index] : indexes_) {
+        columns.emplace_back(getMetadata().at(attr), index.get());
+    }
+
+    // Entries of the rows of shard from offset on
+    auto apply = [&](const Shard& shard, uintmax_t offset, bool insert) {
+        auto number = static_cast<uint32_t>(Shard::numberOf(shard.path()));
+        ShardReader reader(shard);
+        if (offset > 0) reader.seek(offset);
+        string_view line;
+        while (reader.next(line)) {
+            for (auto [column, index] : columns) {
+                BTreeIndex::Entry entry{string(fieldValue(line, column)),
+                                        number, reader.offset()};
+                if (insert) {
+                    index->insert(entry);
+                } else {
+                    index->erase(entry);
+                }
+            }
+        }
+    };
+
+    // Appends grow the tail shard under the same file, any other change
+    // replaces shards by new files
+    unordered_map<string, const Shard*> removed;
+    for (const auto& shard : before) removed[shard->path()] = shard.get();
+    vector<pair<const Shard*, uintmax_t>> added;
+    for (const auto& shard : after) {
+        auto it = removed.find(shard->path());
+        if (it == removed.end()) {
+            added.emplace_back(shard.get(), 0);
+            continue;
+        }
+        if (shard->size() > it->second->size()) {
+            added.emplace_back(shard.get(), it->second->size());
+        }
+        removed.erase(it);
+    }
+
+    for (const auto& [path, shard] : removed) apply(*shard, 0, false);
+    for (const auto& [shard, offset] : added) apply(*shard, offset, true);
+    for (auto [column, index] : columns) index->flush();
+}
+
+bool Table::createIndex(const string& attr) {
+    auto column = getMetadata().find(attr);
+    if (isTemp() || column == getMetadata().end()) {
+        errStream() << "Invalid attribute for table " << getName() << ": "
+                    << attr << endl;
+        return false;
+    }
+    if (index(attr)) {
+        errStream() << "Attribute " << attr << " of table " << getName()
+                    << " is already indexed" << endl;
+        return false;
     }
 
+    // No write publishes until the index holds the rows of this snapshot
+    lock_guard<mutex> lock(write_mutex_);
+    fs::path path = path_ / ("index_" + attr + ".bt");
+    fs::remove(path);
+    auto index = make_shared<BTreeIndex>(path);
+    if (!buildIndex(*index, column->second, *snapshot())) {
+        index.reset();
+        fs::remove(path);
+        return false;
+    }
+
+    unique_lock<shared_mutex> index_lock(index_mutex_);
+    indexes_[attr] = index;
     return true;
 }
 
-RecordLocation Table::findRecord(size_t target_idx) const {
+void Table::openIndex(const string& attr) {
+    auto column = getMetadata().find(attr);
+    if (column == getMetadata().end()) {
+        errStream() << "Invalid indexed attribute for table " << getName()
+                    << ": " << attr << endl;
+        return;
+    }
+
+    lock_guard<mutex> lock(write_mutex_);
+    auto index = make_shared<BTreeIndex>(path_ / ("index_" + attr + ".bt"));
+    // Changes after the last sync may be missing or half written
+    if (!index->clean()) buildIndex(*index, column->second, *snapshot());
+
+    unique_lock<shared_mutex> index_lock(index_mutex_);
+    indexes_[attr] = index;
+}
+
+vector<string> Table::indexedAttributes() const {
+    shared_lock<shared_mutex> lock(index_mutex_);
+    vector<string> result;
+    for (const auto& [attr, index] : indexes_) result.push_back(attr);
+    return result;
+}
+
+shared_ptr<BTreeIndex> Table::index(const string& attr) const {
+    shared_lock<shared_mutex> lock(index_mutex_);
+    auto it = indexes_.find(attr);
+    return it != indexes_.end() ? it->second : nullptr;
+}
+
+optional<IndexScan> Table::indexScan(const vector<Condition>& where) const {
+    optional<IndexScan> result;
+    bool equality = false;
+
+    for (const auto& attr : indexedAttributes()) {
+        IndexScan scan;
+        scan.attribute = attr;
+        bool has_equality = false;
+        for (const auto& condition : where) {
+            if (condition.attribute != attr) continue;
+            scan.bounds.add(condition);
+            has_equality |= condition.op == CompareOp::Equal;
+            if (condition.op == CompareOp::Prefix &&
+                textPrefix(condition.value) &&
+                condition.value.size() > scan.prefix.size()) {
+                scan.prefix = condition.value;
+            }
+        }
+
+        if (!scan.bounds.bounded() || (result && (equality || !has_equality))) {
+            continue;
+        }
+        result = std::move(scan);
+        equality = has_equality;
+    }
+    return result;
+}
+
+RowOffsets Table::lookup(const IndexScan& scan) const {
+    RowOffsets rows;
+    indexes_.at(scan.attribute)
+        ->scan(scan.bounds, scan.prefix, [&](const BTreeIndex::Entry& entry) {
+            rows[entry.shard].push_back(entry.offset);
+        });
+    for (auto& [shard, offsets] : rows) ranges::sort(offsets);
+    return rows;
+}
+
+bool Table::encodeColumn(const string& attr) {
+    auto column = getMetadata().find(attr);
+    if (isTemp() || column == getMetadata().end()) {
+        errStream() << "Invalid attribute for table " << getName() << ": "
+                    << attr << endl;
+        return false;
+    }
+    if (dictionary(column->second)) {
+        errStream() << "Attribute " << attr << " of table " << getName()
+                    << " is already dictionary encoded" << endl;
+        return false;
+    }
+    // Codes do not sort like the values
+    if (attr == cluster_attribute_) {
+        errStream() << "Cannot encode " << attr << ", table " << getName()
+                    << " is clustered by it" << endl;
+        return false;
+    }
+
+    lock_guard<mutex> lock(write_mutex_);
+    auto current = snapshot();
+
+    fs::path dictionary_path = path_ / ("dict_" + attr + ".txt");
+    fs::remove(dictionary_path);
+    auto new_dictionary = make_shared<Dictionary>(dictionary_path);
+
+    auto shards = make_shared<ShardList>(*current);
+    vector<shared_ptr<Shard>> replaced;
+    bool failed = false;
+    size_t position = column->second;
+    size_t fields = max(width_, position + 1);
+    RecordView record;
+
+    for (auto& shard : *shards) {
+        auto new_shard = rewriteShard(
+            *shard, compressOnRewrite(*current, *shard),
+            [&](string_view line, size_t, string& replacement) {
+                record.parse(line);
+                auto code = new_dictionary->encode(record[position]);
+                if (!code) {
+                    failed = true;
+                    return RowAction::Keep;
+                }
+
+                replacement.clear();
+                for (size_t i = 0; i < max(record.size(), fields); ++i) {
+                    if (i > 0) replacement += ",";
+                    if (i == position) {
+                        replacement += to_string(*code);
+                    } else {
+                        replacement += record[i];
+                    }
+                }
+                return RowAction::Replace;
+            });
+
+        if (new_shard) {
+            replaced.push_back(shard);
+            shard = new_shard;
+        }
+        if (failed) break;
+    }
+
+    if (failed) {
+        // Nothing was published, the new versions are just files
+        for (const auto& shard : *shards) {
+            if (ranges::find(*current, shard) == current->end()) {
+                fs::remove(shard->path());
+            }
+        }
+        fs::remove(dictionary_path);
+        return false;
+    }
+
+    dictionaries_.resize(width_);
+    dictionaries_[position] = new_dictionary;
+
+    // Rows of the old versions are not decoded with the new dictionary,
+    // the indexes are loaded again from the new ones
+    if (!publish(shards, true)) return false;
+    for (const auto& shard : replaced) {
+        shard->retire();
+    }
+    return true;
+}
+
+RecordLocation Table::findRecord(const ShardList& shards,
+                                 size_t target_idx) const {
     size_t current_index = 0;
 
-    for (const auto& shard : getShards()) {
-        // Count records in this shard
-        ifstream file(shard->path());
-        size_t shard_records = count(istreambuf_iterator<char>(file),
-                                     istreambuf_iterator<char>(), '\n');
+    for (const auto& shard : shards) {
+        size_t shard_records = countRecords(*shard);
 
         // Check if target record is in this shard
         if (current_index + shard_records > target_idx) {
@@ -127,27 +900,50 @@ RecordLocation Table::findRecord(size_t target_idx) const {
     return {.shard = nullptr, .record_index = 0};
 }
 
-bool Table::insert(const unordered_map<string, string>& updated_record) {
-    if (!loadMetadata()) return false;
-    auto shards = getShards();
-
-    if (shards.empty() ||
-        fs::file_size(shards.back()->path()) >= MAX_SHARD_SIZE) {
-        shared_ptr<Shard> new_shard = make_shared<Shard>(
-            tablePath() + "/shard_" + to_string(shards.size()) + ".csv");
+bool Table::sealTail(ShardList& shards, shared_ptr<Shard>& replaced) {
+    if (!compressed_ || shards.empty() || shards.back()->compressed() ||
+        shards.back()->size() < Settings::instance().seal_size) {
+        return true;
+    }
 
-        shards_.push_back(new_shard);
+    shared_ptr<Shard> tail = shards.back();
+    shared_ptr<Shard> sealed;
+    try {
+        sealed = rewriteShard(*tail, true, [](string_view, size_t, string&) {
+            return RowAction::Keep;
+        });
+    } catch (const exception& e) {
+        errStream() << e.what() << endl;
+        return false;
     }
 
-    auto table_columns = getMetadata();
+    // Published together with the append that follows, the caller retires
+    // the plain version once it is
+    shards.back() = sealed;
+    replaced = tail;
+    return true;
+}
+
+bool Table::insert(const unordered_map<string, string>& updated_record) {
+    const auto& table_columns = getMetadata();
+    if (!indexable(updated_record)) return false;
     vector<string> values(table_columns.size(), "");
 
-    for (const auto& [attr, val] : updated_record) {
-        if (table_columns.find(attr) != table_columns.end()) {
-            values[table_columns[attr]] = val;
+    // Missing values are stored as codes of the empty string, like the
+    // empty fields of rows that were encoded later
+    unordered_map<string, string> encoded_record = updated_record;
+    for (const auto& attr : encodedAttributes()) {
+        encoded_record.try_emplace(attr, "");
+    }
+    if (!encodeValues(encoded_record, true)) return false;
+
+    for (const auto& [attr, val] : encoded_record) {
+        auto column = table_columns.find(attr);
+        if (column != table_columns.end()) {
+            values[column->second] = val;
         } else {
-            cerr << "Unknown attribute: " << attr << " for table: " << getName()
-                 << endl;
+            errStream() << "Unknown attribute: " << attr
+                        << " for table: " << getName() << endl;
             return false;
         }
     }
@@ -157,120 +953,1056 @@ bool Table::insert(const unordered_map<string, string>& updated_record) {
         record += values[i];
         if (i < values.size() - 1) record += ",";
     }
+    record += "\n";
+
+    // Partitions are chosen on values, not on their dictionary codes
+    optional<size_t> partition;
+    if (partitioning_) {
+        auto key = updated_record.find(partitioning_->attribute);
+        partition = partitionOf(
+            key != updated_record.end() ? key->second : string_view(),
+            partitioning_->count);
+    }
+
+    Wal* wal = catalog_ ? catalog_->wal() : nullptr;
+    uint64_t lsn = 0;
+    if (!appendRecord(record, partition, wal, lsn)) return false;
+
+    // The row is visible already, the insert succeeds once it is durable
+    return !wal || wal->commit(lsn);
+}
+
+bool Table::appendRecord(const string& record, optional<size_t> partition,
+                         Wal* wal, uint64_t& lsn) {
+    lock_guard<mutex> lock(write_mutex_);
+    auto shards = make_shared<ShardList>(*snapshot());
+
+    shared_ptr<Shard> sealed_tail;
+    if (!sealTail(*shards, sealed_tail)) return false;
+
+    // Compressed shards are never appended to, partitions never roll over
+    if (partition) {
+        if (*partition >= shards->size()) {
+            errStream() << "Table " << name_ << " has no shard for partition "
+                        << *partition << endl;
+            return false;
+        }
+    } else if (shards->empty() || shards->back()->compressed() ||
+               shards->back()->size() >= MAX_SHARD_SIZE) {
+        shards->push_back(make_shared<Shard>(
+            tablePath() + "/shard_" + to_string(shards->size()) + ".csv", 0));
+    }
 
-    ofstream file(shards.back()->path(), ios::app);
+    shared_ptr<Shard>& target =
+        partition ? (*shards)[*partition] : shards->back();
+    const Shard& tail = *target;
+    if (wal) {
+        auto logged =
+            wal->logAppend(name_, tail.path(), tail.size(),
+                           string_view(record).substr(0, record.size() - 1),
+                           dictionaries_);
+        if (!logged) return false;
+        lsn = *logged;
+    }
+
+    OperatorTimer timer("append", fs::path(tail.path()).filename().string());
+    ofstream file(tail.path(), ios::app);
 
     if (!file.is_open()) {
-        cerr << "Failed to open shard for writing" << endl;
+        errStream() << "Failed to open shard for writing" << endl;
+        return false;
+    }
+
+    file << record;
+    file.close();
+
+    if (!file) {
+        errStream() << "Failed to write to shard " << tail.path() << endl;
+        return false;
+    }
+
+    ShardIoMetrics::get().recordWrite(record.size(), 1);
+    if (auto* stats = timer.stats()) {
+        stats->rows_in = 1;
+        stats->rows_out = 1;
+        stats->bytes_written = record.size();
+    }
+
+    // Appends go to the same file, readers of older versions just stop
+    // before the new row
+    target = make_shared<Shard>(tail, tail.size() + record.size());
+    if (!publish(shards)) return false;
+    if (sealed_tail) sealed_tail->retire();
+
+    // The row is stored either way, a failed merge is retried by the next
+    // insert
+    if (cluster_attribute_ &&
+        target->size() >= Settings::instance().cluster_delta_size) {
+        mergeDelta();
+    }
+    return true;
+}
+
+bool Table::mergeDelta() {
+    OperatorTimer timer("merge delta", name_);
+    auto current = snapshot();
+    int column = getMetadata().at(*cluster_attribute_);
+
+    ShardList sorted;
+    shared_ptr<Shard> delta;
+    vector<shared_ptr<Shard>> replaced;
+    vector<string> rows;
+    size_t next_number = 0;
+
+    for (const auto& shard : *current) {
+        next_number = max(next_number, Shard::numberOf(shard->path()) + 1);
+        if (shard->keyRange()) {
+            sorted.push_back(shard);
+            continue;
+        }
+
+        delta = shard;
+        replaced.push_back(shard);
+        ShardReader reader(*shard);
+        string_view line;
+        while (reader.next(line)) rows.emplace_back(line);
+    }
+
+    auto key = [column](string_view row) { return fieldAt(row, column); };
+    ranges::stable_sort(rows, [&](const string& a, const string& b) {
+        return compareValues(key(a), key(b)) < 0;
+    });
+
+    auto shards = make_shared<ShardList>();
+    try {
+        // A row goes to the first shard whose keys reach its own, rows
+        // above all of them to the last shard
+        span<const string> remaining(rows);
+        for (size_t i = 0; i < sorted.size(); ++i) {
+            size_t count = remaining.size();
+            if (i + 1 < sorted.size()) {
+                const string& max = sorted[i]->keyRange()->max;
+                count = ranges::find_if(remaining,
+                                        [&](const string& row) {
+                                            return compareValues(key(row),
+                                                                 max) > 0;
+                                        }) -
+                        remaining.begin();
+            }
+            if (count == 0) {
+                shards->push_back(sorted[i]);
+                continue;
+            }
+
+            writeMerged(sorted[i].get(), remaining.first(count), next_number,
+                        *shards);
+            replaced.push_back(sorted[i]);
+            remaining = remaining.subspan(count);
+        }
+        if (sorted.empty() && !rows.empty()) {
+            writeMerged(nullptr, rows, next_number, *shards);
+        }
+    } catch (const exception& e) {
+        // Nothing was published, the new shards are just files
+        for (const auto& shard : *shards) {
+            if (ranges::find(sorted, shard) == sorted.end()) {
+                fs::remove(shard->path());
+            }
+        }
+        errStream() << e.what() << endl;
         return false;
     }
 
-    file << record << "\n";
+    // Appends continue in a new empty delta
+    fs::path delta_path =
+        delta ? delta->nextVersionPath()
+              : path_ / ("shard_" + to_string(next_number) + ".csv");
+    ofstream(delta_path).close();
+    shards->push_back(make_shared<Shard>(delta_path.string(), 0));
+
+    if (auto* stats = timer.stats()) {
+        stats->rows_in = rows.size();
+        stats->rows_out = rows.size();
+    }
 
+    if (!publish(shards)) return false;
+    for (const auto& shard : replaced) {
+        shard->retire();
+    }
     return true;
 }
 
-void Table::read(const vector<int>& lines) {
-    if (!loadMetadata()) return;
+void Table::writeMerged(const Shard* shard, span<const string> rows,
+                        size_t& next_number, ShardList& merged) const {
+    int column = getMetadata().at(*cluster_attribute_);
+    uintmax_t limit = max<size_t>(1, Settings::instance().cluster_shard_size);
+
+    unique_ptr<ShardReader> reader;
+    string_view line;
+    bool has_line = false;
+    if (shard) {
+        reader = make_unique<ShardReader>(*shard);
+        has_line = reader->next(line);
+    }
+    auto row = rows.begin();
+
+    // Shard being written
+    unique_ptr<ShardWriter> out;
+    fs::path path;
+    fs::path temp_path;
+    uintmax_t written = 0;
+    size_t count = 0;
+    KeyRange range;
+
+    auto close = [&]() {
+        bool write_ok = out->close();
+        out.reset();
+        if (!write_ok || !renameDurably(temp_path, path)) {
+            fs::remove(temp_path);
+            throw runtime_error("Failed to write sorted shard " +
+                                path.string());
+        }
+        ShardIoMetrics::get().recordWrite(written, count);
+        merged.push_back(make_shared<Shard>(path.string(), written));
+        merged.back()->setKeyRange(range);
+    };
+
+    bool first = true;
+    while (has_line || row != rows.end()) {
+        // Of equal keys the rows already sorted were inserted first
+        bool from_shard =
+            has_line && (row == rows.end() ||
+                         compareValues(fieldAt(line, column),
+                                       fieldAt(*row, column)) <= 0);
+        string_view next = from_shard ? line : string_view(*row);
+
+        if (!out) {
+            path = shard && first
+                       ? shard->nextVersionPath()
+                       : path_ / ("shard_" + to_string(next_number++) +
+                                  ".csv");
+            temp_path = path.string() + ".tmp";
+            out = make_unique<ShardWriter>(temp_path, false);
+            written = 0;
+            count = 0;
+            range.min = fieldAt(next, column);
+            first = false;
+        }
+        range.max = fieldAt(next, column);
+        out->write(next);
+        written += next.size() + 1;
+        count++;
+
+        if (from_shard) {
+            has_line = reader->next(line);
+        } else {
+            ++row;
+        }
+        if (written >= limit) close();
+    }
+    if (out) close();
+    if (shard) ShardIoMetrics::get().shards_rewritten.add();
+}
+
+bool Table::redoAppend(const string& shard_file, uint64_t offset,
+                       string_view row, bool& applied) {
+    applied = false;
+    lock_guard<mutex> lock(write_mutex_);
+    auto shards = make_shared<ShardList>(*snapshot());
+    fs::path path = path_ / shard_file;
+
+    auto it = ranges::find_if(*shards, [&](const auto& shard) {
+        return fs::path(shard->path()).filename() == shard_file;
+    });
+    if (it == shards->end()) {
+        // Either a later version of the shard holds the row, or the append
+        // started a tail shard the catalog had not recorded yet
+        if (Shard::numberOf(path) != shards->size()) return true;
+        shards->push_back(make_shared<Shard>(path.string(), 0));
+        it = prev(shards->end());
+    }
+
+    string line = string(row) + "\n";
+    error_code ec;
+    uintmax_t file_size = fs::exists(path) ? fs::file_size(path, ec) : 0;
+    if (ec || file_size < offset) {
+        errStream() << "Cannot replay append to " << path
+                    << ": rows before offset " << offset << " are missing"
+                    << endl;
+        return false;
+    }
+
+    if (file_size >= offset + line.size()) {
+        string stored(line.size(), '\0');
+        ifstream in(path, ios::binary);
+        in.seekg(static_cast<streamoff>(offset));
+        in.read(stored.data(), static_cast<streamsize>(stored.size()));
+        applied = !in || stored != line;
+    } else {
+        applied = true;
+    }
+
+    uintmax_t size = max<uintmax_t>((*it)->size(), offset + line.size());
+    if (applied) {
+        // Whatever follows offset is a torn append nobody was told about
+        if (file_size > offset) fs::resize_file(path, offset, ec);
+        ofstream out(path, ios::binary | ios::app);
+        out << line;
+        out.close();
+        if (ec || !out) {
+            errStream() << "Failed to replay append to " << path << endl;
+            return false;
+        }
+        BufferPool::instance().invalidate(path.string());
+        size = offset + line.size();
+    }
+
+    *it = make_shared<Shard>(**it, size);
+    return publish(shards);
+}
+
+void Table::read(const vector<int>& lines, const vector<Condition>& where,
+                 const optional<OrderBy>& order) {
+    PredicateProgram program;
+    if (!compileWhere(where, program)) return;
+
+    // Clustered tables search their sorted shards for reads limited on the
+    // clustering attribute, and return rows ordered by it without a sort
+    auto bounds = clusterBounds(where);
+    bool clustered = bounds && lines.empty() &&
+                     (bounds->bounded() || clusteredOrder(order));
+    bool presorted = clustered && clusteredOrder(order);
+    unique_ptr<RowSorter> sorter;
+
+    // Other reads limited on an indexed attribute search its index
+    optional<IndexScan> index_scan;
+    if (!clustered && lines.empty()) index_scan = indexScan(where);
+
+    if (order && !presorted) {
+        auto column = getMetadata().find(order->attribute);
+        if (column == getMetadata().end()) {
+            errStream() << "Invalid attribute for table " << getName() << ": "
+                        << order->attribute << endl;
+            return;
+        }
+        sorter = make_unique<RowSorter>(
+            column->second, order->descending, order->limit,
+            Settings::instance().sort_memory.load());
+    }
+
+    OperatorTimer output_timer("output", "stdout", true);
+
+    auto print = [&output_timer](string_view line) {
+        output_timer.resume();
+
+        // Printed field by field as read with getline, which drops one
+        // trailing empty field
+        if (line.ends_with(',')) line.remove_suffix(1);
+        outStream() << line << endl;
+
+        if (auto* stats = output_timer.stats()) {
+            stats->rows_in++;
+            stats->rows_out++;
+            stats->bytes_written += line.size() + 1;
+        }
+        output_timer.pause();
+    };
+
+    unique_ptr<OperatorTimer> sort_timer;
+    if (sorter) {
+        sort_timer = make_unique<OperatorTimer>("sort", order->attribute, true);
+    }
 
+    auto output = [&](string_view line) {
+        if (sorter) {
+            sort_timer->resume();
+            if (auto* stats = sort_timer->stats()) stats->rows_in++;
+            sorter->add(string(line));
+            sort_timer->pause();
+        } else {
+            print(line);
+        }
+    };
+
+    // The index holds the rows of the snapshot taken with it
+    shared_lock<shared_mutex> index_lock(index_mutex_, defer_lock);
+    if (index_scan) index_lock.lock();
+    auto shards = snapshot();
     int index = 0;
 
-    // Find which shard contains the record
-    for (const auto& shard : getShards()) {
-        ifstream file(shard->path());
-        string line;
+    // Encoded columns are decoded once a row is selected, the sort and the
+    // output only see values
+    RecordView record;
+    string decoded;
+
+    // Outputs a row read by scan_timer's scan if it matches
+    auto select = [&](string_view line, OperatorTimer& scan_timer) {
+        if (!program.matches(line)) return false;
+        if (!dictionaries_.empty()) {
+            decodeRow(line, record, decoded);
+            line = decoded;
+        }
 
-        while (getline(file, line)) {
-            istringstream ss(line);
-            string field;
-            bool first = true;
+        if (auto* stats = scan_timer.stats()) stats->rows_out++;
+        scan_timer.pause();
+        output(line);
+        scan_timer.resume();
+        return true;
+    };
+
+    // Filters a batch on its columns, then outputs what is left of it
+    ColumnBatch batch;
+    auto selectBatch = [&](OperatorTimer& scan_timer) {
+        program.apply(batch);
+        if (auto* stats = scan_timer.stats()) {
+            stats->rows_in += batch.size();
+            stats->rows_out += batch.selection().size();
+        }
 
-            if (!lines.empty() && ranges::find(lines, index) == lines.end()) {
-                index++;
-                continue;
+        scan_timer.pause();
+        for (uint32_t row : batch.selection()) {
+            string_view line = batch.row(row);
+            if (!dictionaries_.empty()) {
+                decodeRow(line, record, decoded);
+                line = decoded;
+            }
+            output(line);
+        }
+        scan_timer.resume();
+    };
+
+    if (clustered) {
+        OperatorTimer scan_timer(
+            bounds->bounded() ? "range scan" : "ordered scan",
+            *cluster_attribute_);
+        ClusteredScan scan(*shards, getMetadata().at(*cluster_attribute_),
+                           *bounds);
+        size_t limit =
+            presorted && order->limit ? *order->limit : SIZE_MAX;
+        size_t printed = 0;
+        string_view line;
+
+        while (printed < limit && scan.next(line)) {
+            if (select(line, scan_timer)) printed++;
+        }
+
+        if (auto* stats = scan_timer.stats()) {
+            stats->rows_in = scan.rowsRead();
+            stats->bytes_read = scan.bytesRead();
+        }
+    } else if (index_scan) {
+        OperatorTimer scan_timer("index scan", index_scan->attribute);
+        RowOffsets rows = lookup(*index_scan);
+        index_lock.unlock();
+        uintmax_t bytes = 0;
+
+        // Rows the index found are read by offset, in table order
+        for (const auto& shard : *shards) {
+            auto offsets = rows.find(Shard::numberOf(shard->path()));
+            if (offsets == rows.end()) continue;
+
+            BatchScan scan(*shard, program.columns(),
+                           BatchScan::DEFAULT_CAPACITY, &offsets->second);
+            while (scan.next(batch)) selectBatch(scan_timer);
+            bytes += scan.bytesRead();
+        }
+
+        if (auto* stats = scan_timer.stats()) stats->bytes_read = bytes;
+    } else {
+        for (const auto& shard : *shards) {
+            OperatorTimer scan_timer(
+                "scan", fs::path(shard->path()).filename().string());
+            BatchScan scan(*shard, program.columns());
+
+            while (scan.next(batch)) {
+                // Rows are numbered across shards, before any filter
+                if (!lines.empty()) {
+                    erase_if(batch.selection(), [&](uint32_t row) {
+                        return ranges::find(lines, index + int(row)) ==
+                               lines.end();
+                    });
+                }
+                index += static_cast<int>(batch.size());
+                selectBatch(scan_timer);
             }
 
-            while (getline(ss, field, ',')) {
-                if (!first) cout << ",";
-                cout << field;
-                first = false;
+            if (auto* stats = scan_timer.stats()) {
+                stats->bytes_read = scan.bytesRead();
             }
-            cout << endl;
-            index++;
+        }
+    }
+
+    if (sorter) {
+        size_t rows_out = 0;
+        sort_timer->resume();
+        sorter->finish([&](const string& line) {
+            sort_timer->pause();
+            print(line);
+            rows_out++;
+            sort_timer->resume();
+        });
+        sort_timer->pause();
+
+        if (auto* stats = sort_timer->stats()) {
+            stats->rows_out = rows_out;
+            stats->bytes_written = sorter->spilledBytes();
+            stats->peak_memory = sorter->peakMemory();
         }
     }
 }
 
+bool Table::compressOnRewrite(const ShardList& shards,
+                              const Shard& shard) const {
+    bool plain_tail = !shard.compressed() && !shards.empty() &&
+                      shards.back().get() == &shard;
+    return compressed_ && !plain_tail;
+}
+
+template <typename F>
+shared_ptr<Shard> Table::rewriteShard(const Shard& shard, bool compress,
+                                      F&& rewrite) const {
+    OperatorTimer timer("rewrite", fs::path(shard.path()).filename().string());
+    fs::path new_path = shard.nextVersionPath(compress);
+    fs::path temp_path = new_path.string() + ".tmp";
+
+    ShardReader reader(shard);
+    ShardWriter out_file(temp_path, compress);
+
+    string_view line;
+    string replacement;
+    size_t current_index = 0;
+    uintmax_t written = 0;
+    size_t kept = 0;
+    bool changed = false;
+
+    while (reader.next(line)) {
+        RowAction action = rewrite(line, current_index++, replacement);
+        if (action == RowAction::Replace) line = replacement;
+
+        if (action != RowAction::Drop) {
+            out_file.write(line);
+            written += line.size() + 1;
+            kept++;
+        }
+        changed |= action != RowAction::Keep;
+    }
+    changed |= compress != shard.compressed();
+
+    if (auto* stats = timer.stats()) {
+        stats->rows_in = current_index;
+        stats->rows_out = kept;
+        stats->bytes_read = reader.bytesRead();
+        stats->bytes_written = written;
+    }
+
+    bool write_ok = out_file.close();
+
+    if (!changed || !write_ok) {
+        fs::remove(temp_path);
+        if (!write_ok) {
+            throw runtime_error("Failed to write new version of shard " +
+                                shard.path());
+        }
+        return nullptr;
+    }
+
+    // The new version only becomes visible once it is complete
+    if (!renameDurably(temp_path, new_path)) {
+        fs::remove(temp_path);
+        throw runtime_error("Failed to store new version of shard " +
+                            shard.path());
+    }
+
+    ShardIoMetrics& metrics = ShardIoMetrics::get();
+    metrics.recordWrite(written, kept);
+    metrics.shards_rewritten.add();
+
+    // Rewrites keep the order of the rows, so the range still bounds them
+    auto result = make_shared<Shard>(new_path.string(), written);
+    result->setKeyRange(shard.keyRange());
+    return result;
+}
+
 bool Table::update(size_t id, const unordered_map<string, string>& updates) {
-    if (!validateAttributes(updates)) {
+    if (!validateAttributes(updates) || !indexable(updates)) {
+        return false;
+    }
+    // The row would have to move to another partition
+    if (partitioning_ && updates.contains(partitioning_->attribute)) {
+        errStream() << "Cannot update " << partitioning_->attribute
+                    << ", table " << getName() << " is partitioned by it"
+                    << endl;
+        return false;
+    }
+    // The row would have to move within the sorted shards
+    if (cluster_attribute_ && updates.contains(*cluster_attribute_)) {
+        errStream() << "Cannot update " << *cluster_attribute_ << ", table "
+                    << getName() << " is clustered by it" << endl;
         return false;
     }
 
-    if (!loadMetadata()) return false;
+    unordered_map<string, string> encoded_updates = updates;
+    if (!encodeValues(encoded_updates, true)) return false;
 
-    auto location = findRecord(id);
+    lock_guard<mutex> lock(write_mutex_);
+    auto current = snapshot();
+
+    auto location = findRecord(*current, id);
     if (!location.shard) {
-        cerr << "Record " << id << " not found in table " << getName() << endl;
+        errStream() << "Record " << id << " not found in table " << getName()
+                    << endl;
         return false;
     }
 
-    fs::path temp_path = location.shard->path() + ".tmp";
-    ifstream in_file(location.shard->path());
-    ofstream out_file(temp_path);
+    // Column to new value, resolved once instead of per field
+    vector<const string*> new_values(getMetadata().size(), nullptr);
+    for (const auto& [attr, value] : encoded_updates) {
+        new_values[getMetadata().at(attr)] = &value;
+    }
 
-    string line;
-    size_t current_index = 0;
-    auto metadata = getMetadata();
+    auto new_shard = rewriteShard(
+        *location.shard, compressOnRewrite(*current, *location.shard),
+        [&](string_view line, size_t current_index, string& replacement) {
+            if (current_index != location.record_index) {
+                return RowAction::Keep;
+            }
 
-    while (getline(in_file, line)) {
-        if (current_index != location.record_index) {
-            out_file << line << "\n";
-        } else {
-            vector<string> record;
-            istringstream ss(line);
-            string field;
+            RecordView record(line);
+            replacement.clear();
+            for (size_t i = 0; i < new_values.size(); ++i) {
+                if (i > 0) replacement += ",";
+                if (new_values[i]) {
+                    replacement += *new_values[i];
+                } else {
+                    replacement += record[i];
+                }
+            }
+            return RowAction::Replace;
+        });
+
+    auto shards = make_shared<ShardList>(*current);
+    ranges::replace(*shards, location.shard, new_shard);
+    if (!publish(shards)) return false;
+    location.shard->retire();
+
+    return true;
+};
+
+bool Table::replaceWith(const Table& source) {
+    lock_guard<mutex> lock(write_mutex_);
+    auto current = snapshot();
+    auto rows = source.snapshot();
+
+    fs::path new_path =
+        current->empty()
+            ? path_ / (string("shard_0") +
+                       (compressed_ ? Shard::COMPRESSED_EXTENSION : ".csv"))
+            : current->front()->nextVersionPath(compressed_);
+    fs::path temp_path = new_path.string() + ".tmp";
+    uintmax_t written = 0;
+    size_t count = 0;
+
+    {
+        OperatorTimer timer("materialize", new_path.filename().string());
+        ShardWriter out(temp_path, compressed_);
+        RecordView record;
+        string decoded;
+
+        for (const auto& shard : *rows) {
+            ShardReader reader(*shard);
+            string_view line;
+            while (reader.next(line)) {
+                // Views store values, their columns are not encoded
+                if (!source.dictionaries_.empty()) {
+                    source.decodeRow(line, record, decoded);
+                    line = decoded;
+                }
+                out.write(line);
+                written += line.size() + 1;
+                count++;
+            }
+        }
+
+        if (!out.close()) {
+            fs::remove(temp_path);
+            errStream() << "Failed to write " << temp_path << endl;
+            return false;
+        }
+        if (auto* stats = timer.stats()) {
+            stats->rows_in = count;
+            stats->rows_out = count;
+            stats->bytes_written = written;
+        }
+    }
+
+    if (!renameDurably(temp_path, new_path)) {
+        fs::remove(temp_path);
+        errStream() << "Failed to store " << new_path << endl;
+        return false;
+    }
+    ShardIoMetrics::get().recordWrite(written, count);
 
-            while (getline(ss, field, ',')) {
-                record.push_back(field);
+    if (!publish(make_shared<ShardList>(
+            ShardList{make_shared<Shard>(new_path.string(), written)}))) {
+        return false;
+    }
+    for (const auto& shard : *current) {
+        shard->retire();
+    }
+    return true;
+}
+
+bool Table::exportTo(const fs::path& file) const {
+    auto shards = snapshot();
+    vector<string> fields = attributes();
+    size_t width = fields.size();
+    QueryProfile* profile = QueryProfile::current();
+
+    // Record batches of one shard, with the values of encoded columns
+    auto convert = [&, profile](const Shard& shard) {
+        QueryProfile::Activate activate(profile);
+        OperatorTimer timer("export",
+                            fs::path(shard.path()).filename().string());
+        vector<ArrowMessage> batches;
+        ArrowBatchBuilder builder(width);
+        ShardReader reader(shard);
+        RecordView record;
+        string decoded;
+        vector<string_view> row(width);
+        uint64_t rows = 0;
+        uintmax_t written = 0;
+
+        auto finish = [&]() {
+            batches.push_back(builder.finish());
+            written += batches.back().bytes.size();
+        };
+
+        string_view line;
+        while (reader.next(line)) {
+            if (!dictionaries_.empty()) {
+                decodeRow(line, record, decoded);
+                line = decoded;
             }
+            record.parse(line);
+            for (size_t i = 0; i < width; ++i) row[i] = record[i];
+            builder.add(row);
+
+            if (++rows % 1024 == 0 && (builder.rows() >= EXPORT_BATCH_ROWS ||
+                                       builder.bytes() >= EXPORT_BATCH_SIZE)) {
+                finish();
+            }
+        }
+        if (builder.rows() > 0) finish();
+
+        if (auto* stats = timer.stats()) {
+            stats->rows_in = rows;
+            stats->rows_out = rows;
+            stats->bytes_read = reader.bytesRead();
+            stats->bytes_written = written;
+        }
+        return batches;
+    };
+
+    ArrowWriter writer(file, fields);
+    size_t threads = clamp<size_t>(thread::hardware_concurrency(), 1,
+                                   max<size_t>(shards->size(), 1));
+    ThreadPool pool(threads);
+
+    // Batches are written in shard order, shards converted up to two per
+    // thread ahead of the writer
+    deque<future<vector<ArrowMessage>>> pending;
+    size_t next = 0;
+    bool stored = true;
+    while (next < shards->size() || !pending.empty()) {
+        while (next < shards->size() && pending.size() < 2 * threads) {
+            const Shard& shard = *(*shards)[next++];
+            pending.push_back(
+                pool.submit([&convert, &shard]() { return convert(shard); }));
+        }
+        for (const auto& batch : pending.front().get()) {
+            stored = writer.write(batch) && stored;
+        }
+        pending.pop_front();
+    }
+
+    if (!writer.close() || !stored) {
+        errStream() << "Failed to write " << file.string() << endl;
+        return false;
+    }
+    return true;
+}
+
+bool Table::importFrom(const ArrowReader& reader) {
+    if (partitioning_ || cluster_attribute_) {
+        errStream() << "Cannot import into partitioned or clustered table "
+                    << name_ << endl;
+        return false;
+    }
+
+    // Field of the file stored in every column, -1 for none
+    size_t width = getMetadata().size();
+    vector<int> field_of(width, -1);
+    const auto& fields = reader.fields();
+    for (size_t f = 0; f < fields.size(); ++f) {
+        auto column = getMetadata().find(fields[f]);
+        if (column == getMetadata().end() || field_of[column->second] >= 0) {
+            errStream() << "Unknown or repeated attribute: " << fields[f]
+                        << " for table: " << name_ << endl;
+            return false;
+        }
+        field_of[column->second] = static_cast<int>(f);
+    }
+
+    vector<bool> indexed(width);
+    for (const auto& attr : indexedAttributes()) {
+        indexed[getMetadata().at(attr)] = true;
+    }
+
+    // Missing values of encoded columns are stored as the code of the
+    // empty string, like insert does
+    vector<string> missing(width);
+    for (size_t c = 0; c < width; ++c) {
+        auto dictionary = this->dictionary(c);
+        if (field_of[c] >= 0 || !dictionary) continue;
+        auto code = dictionary->encode("");
+        if (!code) {
+            errStream() << "Dictionary of " << attributes()[c] << " is full"
+                        << endl;
+            return false;
+        }
+        missing[c] = to_string(*code);
+    }
+
+    lock_guard<mutex> lock(write_mutex_);
+    auto current = snapshot();
+    size_t next_number = 0;
+    for (const auto& shard : *current) {
+        next_number = max(next_number, Shard::numberOf(shard->path()) + 1);
+    }
+
+    // An empty plain tail is replaced by the first new shard, as its next
+    // version, rather than left plain in the middle of the table
+    shared_ptr<Shard> empty_tail;
+    if (!current->empty() && !current->back()->compressed() &&
+        current->back()->size() == 0) {
+        empty_tail = current->back();
+        next_number = Shard::numberOf(empty_tail->path());
+    }
+
+    // Consecutive record batches of up to IMPORT_SHARD_SIZE body bytes go
+    // to one new shard
+    struct NewShard {
+        size_t first_batch = 0, end_batch = 0;
+        fs::path path;
+        uintmax_t size = 0;
+        uint64_t rows = 0;
+        string error;
+    };
+    vector<NewShard> added;
+    int64_t bytes = 0;
+    for (size_t i = 0; i < reader.batches(); ++i) {
+        if (added.empty() || bytes >= IMPORT_SHARD_SIZE) {
+            added.emplace_back();
+            added.back().first_batch = i;
+            added.back().path =
+                empty_tail && added.size() == 1
+                    ? empty_tail->nextVersionPath(compressed_)
+                    : path_ / ("shard_" +
+                               to_string(next_number + added.size() - 1) +
+                               (compressed_ ? Shard::COMPRESSED_EXTENSION
+                                            : ".csv"));
+            bytes = 0;
+        }
+        added.back().end_batch = i + 1;
+        bytes += reader.batchBytes(i);
+    }
+    if (added.empty()) return true;
+
+    // Rows are joined from the columns of each batch, only the values of
+    // encoded columns are looked up
+    QueryProfile* profile = QueryProfile::current();
+    auto write = [&, profile](NewShard& shard) {
+        QueryProfile::Activate activate(profile);
+        OperatorTimer timer("import", shard.path.filename().string());
+        ShardWriter out(shard.path.string() + ".tmp", compressed_);
+        ArrowBatch batch;
+        string line;
 
-            for (const auto& [attr, value] : updates) {
-                record[metadata.at(attr)] = value;
+        for (size_t i = shard.first_batch; i < shard.end_batch; ++i) {
+            if (!reader.read(i, batch, shard.error)) return false;
+            for (size_t c = 0; c < width; ++c) {
+                if (field_of[c] < 0) continue;
+                if (batch.contains(field_of[c], ",\n")) {
+                    shard.error = "Cannot import a value with a comma or "
+                                  "line break in column " +
+                                  fields[field_of[c]];
+                    return false;
+                }
+                if (indexed[c] &&
+                    batch.maxLength(field_of[c]) > BTreeIndex::MAX_KEY_SIZE) {
+                    shard.error = "Cannot index a value longer than " +
+                                  to_string(BTreeIndex::MAX_KEY_SIZE) +
+                                  " bytes in column " + fields[field_of[c]];
+                    return false;
+                }
             }
 
-            // Write updated record to temp
-            bool first = true;
-            for (const auto& field : record) {
-                if (!first) out_file << ",";
-                out_file << field;
-                first = false;
+            for (size_t row = 0; row < batch.rows(); ++row) {
+                line.clear();
+                for (size_t c = 0; c < width; ++c) {
+                    if (c > 0) line += ',';
+                    if (field_of[c] < 0) {
+                        line += missing[c];
+                        continue;
+                    }
+                    string_view value = batch.value(field_of[c], row);
+                    Dictionary* dictionary = c < dictionaries_.size()
+                                                 ? dictionaries_[c].get()
+                                                 : nullptr;
+                    if (!dictionary) {
+                        line += value;
+                        continue;
+                    }
+                    auto code = dictionary->encode(value);
+                    if (!code) {
+                        shard.error = "Dictionary of " + fields[field_of[c]] +
+                                      " is full";
+                        return false;
+                    }
+                    char digits[16];
+                    line.append(digits,
+                                to_chars(digits, end(digits), *code).ptr);
+                }
+                out.write(line);
+                shard.size += line.size() + 1;
+                shard.rows++;
             }
-            out_file << "\n";
         }
-        current_index++;
+
+        if (!out.close()) {
+            shard.error = "Failed to write " + shard.path.string() + ".tmp";
+            return false;
+        }
+        if (auto* stats = timer.stats()) {
+            stats->rows_in = shard.rows;
+            stats->rows_out = shard.rows;
+            stats->bytes_written = out.size();
+        }
+        return true;
+    };
+
+    bool imported = true;
+    {
+        ThreadPool pool(clamp<size_t>(thread::hardware_concurrency(), 1,
+                                      added.size()));
+        vector<future<bool>> written;
+        for (auto& shard : added) {
+            written.push_back(pool.submit([&]() { return write(shard); }));
+        }
+        for (auto& shard : written) imported = shard.get() && imported;
+    }
+
+    // Codes are durable before the rows holding them become visible
+    for (const auto& dictionary : dictionaries_) {
+        if (dictionary && !dictionary->sync()) imported = false;
     }
 
-    in_file.close();
-    out_file.close();
+    auto shards = make_shared<ShardList>(*current);
+    if (empty_tail) shards->pop_back();
+    for (auto& shard : added) {
+        fs::path temp_path = shard.path.string() + ".tmp";
+        if (imported && !renameDurably(temp_path, shard.path)) {
+            shard.error = "Failed to store " + shard.path.string();
+        }
+        if (!shard.error.empty()) {
+            errStream() << shard.error << endl;
+            imported = false;
+        }
+        error_code ec;
+        fs::remove(temp_path, ec);
+        shards->push_back(make_shared<Shard>(shard.path.string(), shard.size));
+    }
+    if (!imported) {
+        for (const auto& shard : added) {
+            error_code ec;
+            fs::remove(shard.path, ec);
+        }
+        return false;
+    }
+    for (const auto& shard : added) {
+        ShardIoMetrics::get().recordWrite(shard.size, shard.rows);
+    }
 
-    fs::rename(temp_path, location.shard->path());
+    // The old tail no longer receives appends, a compressed table stores it
+    // compressed like its other shards
+    shared_ptr<Shard> sealed;
+    if (compressed_ && !empty_tail && !current->empty() &&
+        !current->back()->compressed()) {
+        sealed = current->back();
+        (*shards)[current->size() - 1] = rewriteShard(
+            *sealed, true,
+            [](string_view, size_t, string&) { return RowAction::Keep; });
+    }
+
+    if (!publish(shards)) return false;
+    if (sealed) sealed->retire();
+    if (empty_tail) empty_tail->retire();
     return true;
-};
+}
 
 shared_ptr<Table> Table::join(const Table& other, const string& this_join_attr,
                               const string& other_join_attr) {
-    if (!loadMetadata()) {
-        throw runtime_error("Failed loading metadata before join");
-    }
+    // Both sides are pinned for the duration of the join, concurrent writers
+    // publish new versions without affecting it
+    auto this_shards = snapshot();
+    auto other_shards = other.snapshot();
+
+    // Both sides come in key order, so one pass over them pairs the keys
+    bool merge = cluster_attribute_ == this_join_attr &&
+                 other.cluster_attribute_ == other_join_attr;
 
+    OperatorTimer timer(merge ? "merge join" : "hash join",
+                        name_ + " x " + other.getName());
     vector<future<Shard::JoinResult>> join_futures;
-    vector<shared_ptr<Shard>> joined_shards;
+    auto joined_shards = make_shared<ShardList>();
+
+    auto keys = make_shared<JoinKeys>();
+    keys->left_column = getMetadata().at(this_join_attr);
+    keys->right_column = other.getMetadata().at(other_join_attr);
+    keys->left_dictionary = dictionary(keys->left_column);
+    keys->right_dictionary = other.dictionary(keys->right_column);
+
+    // Codes of rows in the pinned snapshot are below the current size of
+    // the dictionary, values are added before rows use them
+    if (keys->integer() && keys->left_dictionary != keys->right_dictionary) {
+        const Dictionary& left = *keys->left_dictionary;
+        const Dictionary& right = *keys->right_dictionary;
+
+        keys->right_to_left.resize(right.size());
+        for (uint32_t code = 0; code < keys->right_to_left.size(); ++code) {
+            keys->right_to_left[code] =
+                left.find(right.decode(code)).value_or(Dictionary::MAX_CODES);
+        }
+    }
 
-    join_futures.reserve(getShards().size());
-    for (const auto& shard : getShards()) {
-        join_futures.push_back(shard->joinShards(
-            other.getShards(), this_join_attr, other_join_attr, getMetadata(),
-            other.getMetadata()));
+    // Partitions only hold keys of their own hash, so co-partitioned tables
+    // join partition i with partition i
+    bool pairwise = coPartitioned(other, this_join_attr, other_join_attr) &&
+                    this_shards->size() == partitioning_->count &&
+                    other_shards->size() == partitioning_->count;
+
+    if (merge) {
+        joined_shards->push_back(mergeJoin(*this_shards, *other_shards,
+                                           keys->left_column,
+                                           keys->right_column, timer));
+    }
+
+    join_futures.reserve(this_shards->size());
+    for (size_t i = 0; !merge && i < this_shards->size(); ++i) {
+        const auto& shard = (*this_shards)[i];
+        join_futures.push_back(
+            pairwise ? shard->joinShards(ShardList{(*other_shards)[i]}, keys)
+                     : shard->joinShards(*other_shards, keys));
     }
 
     for (auto& future : join_futures) {
@@ -278,7 +2010,12 @@ shared_ptr<Table> Table::join(const Table& other, const string& this_join_attr,
         if (!result.success) {
             throw runtime_error("Join failed: " + result.error_message);
         }
-        joined_shards.push_back(result.result_shard);
+        joined_shards->push_back(result.result_shard);
+
+        if (auto* stats = timer.stats()) {
+            stats->rows_out += countRecords(*result.result_shard);
+            stats->bytes_written += result.result_shard->size();
+        }
     }
 
     // Create new temporary table for result and write metadata for the
@@ -307,78 +2044,234 @@ shared_ptr<Table> Table::join(const Table& other, const string& this_join_attr,
     metadata_file.close();
 
     result_table->setMetadata(combined_metadata);
-    result_table->shards_ = joined_shards;
+
+    // Result rows keep the codes of both sides and are decoded on output
+    result_table->width_ = width_ + other.width_;
+    if (!dictionaries_.empty() || !other.dictionaries_.empty()) {
+        result_table->dictionaries_ = dictionaries_;
+        result_table->dictionaries_.resize(width_);
+        result_table->dictionaries_.insert(result_table->dictionaries_.end(),
+                                           other.dictionaries_.begin(),
+                                           other.dictionaries_.end());
+        result_table->dictionaries_.resize(result_table->width_);
+    }
+    result_table->publish(joined_shards);
+
+    // Result partition i only holds rows of partition i, so the result can
+    // join the next table pairwise too
+    if (pairwise) {
+        result_table->partitioning_ = {this_join_attr,
+                                       partitioning_->count};
+    }
+    // Merge join results are sorted on the join key
+    if (merge) result_table->cluster_attribute_ = this_join_attr;
 
     return result_table;
 };
 
+shared_ptr<Shard> Table::mergeJoin(const ShardList& left,
+                                   const ShardList& right, int left_column,
+                                   int right_column,
+                                   OperatorTimer& timer) const {
+    ClusteredScan left_rows(left, left_column, {});
+    ClusteredScan right_rows(right, right_column, {});
+
+    auto result = make_shared<Shard>();
+    ofstream out(result->path(), ios::binary);
+    optional<KeyRange> range;
+    uintmax_t written = 0;
+    uint64_t rows = 0;
+
+    // Right rows with the key being joined, kept while the left rows with
+    // it are read
+    vector<string> group;
+    string_view l, r;
+    bool has_left = left_rows.next(l);
+    bool has_right = right_rows.next(r);
+
+    while (has_left && has_right) {
+        int order = compareValues(fieldAt(l, left_column),
+                                  fieldAt(r, right_column));
+        if (order < 0) {
+            has_left = left_rows.next(l);
+            continue;
+        }
+        if (order > 0) {
+            has_right = right_rows.next(r);
+            continue;
+        }
+
+        string key(fieldAt(r, right_column));
+        group.clear();
+        do {
+            group.emplace_back(r);
+            has_right = right_rows.next(r);
+        } while (has_right &&
+                 compareValues(fieldAt(r, right_column), key) == 0);
+
+        do {
+            // Numbers equal by value may still be spelled differently, keys
+            // match bytewise like in a hash join
+            string_view left_key = fieldAt(l, left_column);
+            for (const auto& row : group) {
+                if (fieldAt(row, right_column) != left_key) continue;
+
+                out << l << ',' << row << '\n';
+                written += l.size() + row.size() + 2;
+                rows++;
+                if (!range) range = KeyRange{string(left_key), ""};
+                range->max = left_key;
+            }
+            has_left = left_rows.next(l);
+        } while (has_left && compareValues(fieldAt(l, left_column), key) == 0);
+    }
+
+    out.close();
+    if (!out) {
+        throw runtime_error("Failed to write merge join result " +
+                            result->path());
+    }
+    result->commit();
+    result->setKeyRange(range);
+    ShardIoMetrics::get().recordWrite(written, rows);
+
+    if (auto* stats = timer.stats()) {
+        stats->rows_in = left_rows.rowsRead() + right_rows.rowsRead();
+        stats->rows_out = rows;
+        stats->bytes_read = left_rows.bytesRead() + right_rows.bytesRead();
+        stats->bytes_written = written;
+    }
+    return result;
+}
+
 struct IndexCriteria {
     size_t target_index;
 
-    bool operator()(const vector<string>& record, size_t current_index,
-                    const unordered_map<string, int>& metadata) const {
+    bool operator()(string_view, size_t current_index) {
         return current_index == target_index;
     }
 };
 
-struct AttributeCriteria {
-    unordered_map<string, string> attr_values;
+template <typename T>
+bool Table::deleteRecord(T criteria) {
+    lock_guard<mutex> lock(write_mutex_);
+    auto current = snapshot();
+    auto shards = make_shared<ShardList>(*current);
 
-    bool operator()(const vector<string>& record, size_t current_index,
-                    const unordered_map<string, int>& metadata) const {
-        for (const auto& [attr, value] : attr_values) {
-            if (record[metadata.at(attr)] != value) {
-                return false;
-            }
+    vector<shared_ptr<Shard>> replaced;
+    size_t current_index = 0;
+
+    for (auto& shard : *shards) {
+        auto new_shard = rewriteShard(
+            *shard, compressOnRewrite(*current, *shard),
+            [&](string_view line, size_t, string&) {
+                bool matches = criteria(line, current_index++);
+                return matches ? RowAction::Drop : RowAction::Keep;
+            });
+
+        if (new_shard) {
+            replaced.push_back(shard);
+            shard = new_shard;
         }
-        return true;
     }
-};
 
-template <typename T>
-bool Table::deleteRecord(const T& criteria) {
-    bool deleted_any = false;
+    if (replaced.empty()) return false;
 
-    for (const auto& shard : getShards()) {
-        fs::path temp_path = shard->path() + ".tmp";
-        ifstream in_file(shard->path());
-        ofstream out_file(temp_path);
+    // All rewritten shards become visible together
+    if (!publish(shards)) return false;
+    for (const auto& shard : replaced) {
+        shard->retire();
+    }
 
-        string line;
-        size_t current_index = 0;
-
-        while (getline(in_file, line)) {
-            vector<string> record;
-            istringstream ss(line);
-            string field;
-            while (getline(ss, field, ',')) {
-                record.push_back(field);
-            }
+    return true;
+}
 
-            if (!criteria(record, current_index, getMetadata())) {
-                out_file << line << "\n";
-            } else {
-                deleted_any = true;
-            }
-            current_index++;
+bool Table::dropRows(const ShardList& current, const RowOffsets& rows) {
+    auto shards = make_shared<ShardList>(current);
+    vector<shared_ptr<Shard>> replaced;
+
+    for (auto& shard : *shards) {
+        auto dropped = rows.find(Shard::numberOf(shard->path()));
+        if (dropped == rows.end()) continue;
+
+        uintmax_t offset = 0;
+        auto new_shard = rewriteShard(
+            *shard, compressOnRewrite(current, *shard),
+            [&](string_view line, size_t, string&) {
+                uintmax_t row = offset;
+                offset += line.size() + 1;
+                return ranges::binary_search(dropped->second, row)
+                           ? RowAction::Drop
+                           : RowAction::Keep;
+            });
+
+        if (new_shard) {
+            replaced.push_back(shard);
+            shard = new_shard;
         }
-
-        in_file.close();
-        out_file.close();
-        fs::rename(temp_path, shard->path());
     }
 
-    return deleted_any;
+    if (replaced.empty()) return false;
+
+    if (!publish(shards)) return false;
+    for (const auto& shard : replaced) {
+        shard->retire();
+    }
+    return true;
 }
 
 bool Table::deleteByIndex(size_t index) {
     return deleteRecord(IndexCriteria{index});
 }
 
-bool Table::deleteByAttributes(
-    const unordered_map<string, string>& attr_values) {
-    if (!validateAttributes(attr_values)) {
-        return false;
+bool Table::deleteWhere(const vector<Condition>& where) {
+    PredicateProgram program;
+    if (!compileWhere(where, program)) return false;
+    auto scan = indexScan(where);
+
+    lock_guard<mutex> lock(write_mutex_);
+    auto current = snapshot();
+
+    // Nothing publishes while the write lock is held, the index matches
+    // current
+    optional<RowOffsets> candidates;
+    if (scan) {
+        shared_lock<shared_mutex> index_lock(index_mutex_);
+        candidates = lookup(*scan);
+    }
+
+    // Matching rows are found batch by batch, then only the shards holding
+    // some are rewritten
+    RowOffsets matches;
+    ColumnBatch batch;
+    for (const auto& shard : *current) {
+        size_t number = Shard::numberOf(shard->path());
+        const vector<uint64_t>* offsets = nullptr;
+        if (candidates) {
+            auto it = candidates->find(number);
+            if (it == candidates->end()) continue;
+            offsets = &it->second;
+        }
+
+        OperatorTimer timer(scan ? "index scan" : "scan",
+                            fs::path(shard->path()).filename().string());
+        BatchScan batch_scan(*shard, program.columns(),
+                             BatchScan::DEFAULT_CAPACITY, offsets);
+        size_t selected = 0;
+        while (batch_scan.next(batch)) {
+            program.apply(batch);
+            for (uint32_t row : batch.selection()) {
+                matches[number].push_back(batch.offset(row));
+            }
+            selected += batch.selection().size();
+        }
+
+        if (auto* stats = timer.stats()) {
+            stats->rows_in = batch_scan.rowsRead();
+            stats->rows_out = selected;
+            stats->bytes_read = batch_scan.bytesRead();
+        }
     }
-    return deleteRecord(AttributeCriteria{attr_values});
+
+    return dropRows(*current, matches);
 }
@@ -0,0 +1,54 @@
+#include "ThreadPool.hpp"
+#include <utility>
+
+using namespace std;
+
+ThreadPool::ThreadPool(size_t num_threads) : stopping_(false) {
+    if (num_threads == 0) num_threads = 1;
+
+    workers_.reserve(num_threads);
+    for (size_t i = 0; i < num_threads; ++i) {
+        workers_.emplace_back([this]() { workerLoop(); });
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        lock_guard<mutex> lock(mutex_);
+        stopping_ = true;
+    }
+    cv_.notify_all();
+
+    for (auto& worker : workers_) {
+        worker.join();
+    }
+}
+
+size_t ThreadPool::size() const {
+    return workers_.size();
+}
+
+void ThreadPool::post(function<void()> task) {
+    {
+        lock_guard<mutex> lock(mutex_);
+        tasks_.push_back(std::move(task));
+    }
+    cv_.notify_one();
+}
+
+void ThreadPool::workerLoop() {
+    while (true) {
+        function<void()> task;
+        {
+            unique_lock<mutex> lock(mutex_);
+            cv_.wait(lock, [this]() { return stopping_ || !tasks_.empty(); });
+
+            // Drain remaining work before shutting down
+            if (tasks_.empty()) return;
+
+            task = std::move(tasks_.front());
+            tasks_.pop_front();
+        }
+        task();
+    }
+}
@@ -0,0 +1,170 @@
+#include "Trace.hpp"
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <utility>
+
+namespace fs = std::filesystem;
+using namespace std;
+
+namespace {
+thread_local shared_ptr<Tracer::ThreadEvents> thread_events;
+
+void writeString(ostream& out, string_view text) {
+    out << '"';
+    for (char c : text) {
+        if (c == '"' || c == '\\') {
+            out << '\\' << c;
+        } else if (static_cast<unsigned char>(c) < 0x20) {
+            char escaped[8];
+            snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+            out << escaped;
+        } else {
+            out << c;
+        }
+    }
+    out << '"';
+}
+
+// Trace-event timestamps are in microseconds
+void writeMicros(ostream& out, uint64_t ns) {
+    char micros[32];
+    snprintf(micros, sizeof(micros), "%.3f", ns / 1e3);
+    out << micros;
+}
+}  // namespace
+
+atomic<bool> Tracer::enabled_{false};
+
+Tracer& Tracer::instance() {
+    static Tracer tracer;
+    return tracer;
+}
+
+uint64_t Tracer::now() {
+    return chrono::duration_cast<chrono::nanoseconds>(
+               chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+Tracer::ThreadEvents& Tracer::local() {
+    if (!thread_events) {
+        thread_events = make_shared<ThreadEvents>();
+        lock_guard<mutex> lock(mutex_);
+        thread_events->tid = next_tid_++;
+        threads_.push_back(thread_events);
+    }
+    return *thread_events;
+}
+
+bool Tracer::start(const fs::path& path) {
+    lock_guard<mutex> lock(mutex_);
+    if (enabled()) return false;
+
+    // Spans that ended after the last trace was written are dropped
+    for (auto& thread : threads_) {
+        lock_guard<mutex> events_lock(thread->mutex);
+        thread->events.clear();
+    }
+    path_ = path;
+    enabled_.store(true, memory_order_relaxed);
+    return true;
+}
+
+optional<size_t> Tracer::stop() {
+    lock_guard<mutex> lock(mutex_);
+    if (!enabled()) return nullopt;
+    enabled_.store(false, memory_order_relaxed);
+
+    int pid = static_cast<int>(getpid());
+    uint64_t origin = UINT64_MAX;
+    for (auto& thread : threads_) {
+        lock_guard<mutex> events_lock(thread->mutex);
+        for (const auto& event : thread->events) {
+            origin = min(origin, event.start_ns);
+        }
+    }
+
+    ofstream out(path_);
+    out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+    size_t written = 0;
+    auto separator = [&]() { out << (written++ ? ",\n" : "\n"); };
+
+    for (auto& thread : threads_) {
+        lock_guard<mutex> events_lock(thread->mutex);
+        if (thread->events.empty()) continue;
+
+        separator();
+        out << "{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":" << pid
+            << ",\"tid\":" << thread->tid << ",\"args\":{\"name\":";
+        writeString(out, thread->name.empty()
+                             ? "thread " + to_string(thread->tid)
+                             : thread->name);
+        out << "}}";
+
+        for (const auto& event : thread->events) {
+            separator();
+            out << "{\"ph\":\"X\",\"name\":";
+            writeString(out, event.name);
+            out << ",\"cat\":\"" << event.category << "\",\"pid\":" << pid
+                << ",\"tid\":" << thread->tid << ",\"ts\":";
+            writeMicros(out, event.start_ns - origin);
+            out << ",\"dur\":";
+            writeMicros(out, event.duration_ns);
+            out << ",\"args\":{";
+            if (!event.detail.empty()) {
+                out << "\"detail\":";
+                writeString(out, event.detail);
+            }
+            if (event.active_ns) {
+                out << (event.detail.empty() ? "" : ",") << "\"active_ms\":";
+                writeMicros(out, *event.active_ns / 1000);
+            }
+            out << "}}";
+        }
+        thread->events.clear();
+    }
+    out << "\n]}\n";
+    out.close();
+
+    // Buffers of threads that exited are only held here
+    erase_if(threads_, [](const auto& thread) {
+        return thread.use_count() == 1;
+    });
+
+    if (!out) return nullopt;
+    return written;
+}
+
+void Tracer::record(Event event) {
+    ThreadEvents& events = local();
+    lock_guard<mutex> lock(events.mutex);
+    events.events.push_back(std::move(event));
+}
+
+void Tracer::nameThread(const string& name) {
+    ThreadEvents& events = local();
+    lock_guard<mutex> lock(events.mutex);
+    events.name = name;
+}
+
+TraceSpan::TraceSpan(string_view name, const char* category,
+                     string_view detail)
+    : category_(category), start_ns_(0) {
+    if (!Tracer::enabled()) return;
+
+    name_ = name;
+    detail_ = detail;
+    start_ns_ = Tracer::now();
+}
+
+TraceSpan::~TraceSpan() {
+    if (!start_ns_ || !Tracer::enabled()) return;
+
+    Tracer::instance().record({std::move(name_), category_, start_ns_,
+                               Tracer::now() - start_ns_, std::move(detail_),
+                               nullopt});
+}
@@ -0,0 +1,329 @@
+#include "Wal.hpp"
+#include <fcntl.h>
+#include <unistd.h>
+#include <charconv>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include "Dictionary.hpp"
+#include "Metrics.hpp"
+#include "Settings.hpp"
+#include "Shard.hpp"
+#include "utils.hpp"
+
+namespace fs = std::filesystem;
+using namespace std;
+
+namespace {
+constexpr size_t HEADER_SIZE = 8;
+
+struct WalMetrics {
+    Counter& records;
+    Counter& syncs;
+    Histogram& commit_time;
+
+    static WalMetrics& get() {
+        static WalMetrics metrics{
+            Metrics::instance().counter(
+                "lmkdb_wal_records_total",
+                "Appends written to the write-ahead log"),
+            Metrics::instance().counter(
+                "lmkdb_wal_syncs_total",
+                "Syncs of the write-ahead log, each covering a group of "
+                "records"),
+            Metrics::instance().histogram(
+                "lmkdb_wal_commit_seconds",
+                "Time an insert waited for its log record to be durable"),
+        };
+        return metrics;
+    }
+};
+
+// FNV-1a, enough to tell a torn record from a complete one
+uint32_t checksum(string_view data) {
+    uint32_t hash = 2166136261u;
+    for (unsigned char c : data) {
+        hash = (hash ^ c) * 16777619u;
+    }
+    return hash;
+}
+
+bool syncFd(int fd) {
+    ShardIoMetrics::get().fsyncs.add();
+    return fsync(fd) == 0;
+}
+
+bool syncPath(const fs::path& path, int flags) {
+    int fd = open(path.c_str(), flags | O_CLOEXEC);
+    if (fd < 0) return false;
+    bool synced = syncFd(fd);
+    close(fd);
+    return synced;
+}
+
+bool writeAll(int fd, string_view data) {
+    while (!data.empty()) {
+        ssize_t n = write(fd, data.data(), data.size());
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        data.remove_prefix(static_cast<size_t>(n));
+    }
+    return true;
+}
+
+void putU32(string& out, size_t at, uint32_t value) {
+    memcpy(out.data() + at, &value, sizeof(value));
+}
+
+uint32_t getU32(const char* p) {
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+}  // namespace
+
+WalMode walMode() {
+    size_t mode = Settings::instance().wal_mode;
+    return mode <= size_t(WalMode::Sync) ? WalMode(mode) : WalMode::Sync;
+}
+
+bool syncFile(const fs::path& path) {
+    return syncPath(path, O_RDONLY);
+}
+
+bool syncDirectory(const fs::path& path) {
+    return syncPath(path.empty() ? fs::path(".") : path, O_RDONLY);
+}
+
+bool renameDurably(const fs::path& from, const fs::path& to) {
+    bool durable = walMode() != WalMode::None;
+    if (durable && !syncFile(from)) return false;
+
+    error_code ec;
+    fs::rename(from, to, ec);
+    if (ec) return false;
+
+    return !durable || syncDirectory(to.parent_path());
+}
+
+Wal::Wal(const fs::path& db_path) : path_(db_path / FILE_NAME) {
+    error_code ec;
+    fs::create_directories(db_path, ec);
+
+    fd_ = open(path_.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd_ < 0) {
+        errStream() << "Failed to open write-ahead log " << path_ << endl;
+    }
+    size_ = fs::exists(path_, ec) ? fs::file_size(path_, ec) : 0;
+
+    flusher_ = thread([this]() { flush(); });
+}
+
+Wal::~Wal() {
+    {
+        lock_guard<mutex> lock(mutex_);
+        stopping_ = true;
+    }
+    flush_cv_.notify_one();
+    flusher_.join();
+
+    if (fd_ >= 0) close(fd_);
+}
+
+optional<uint64_t> Wal::logAppend(
+    const string& table, const fs::path& shard, uint64_t offset,
+    string_view row, const vector<shared_ptr<Dictionary>>& dictionaries) {
+    WalMode mode = walMode();
+    if (mode == WalMode::None) return 0;
+
+    string frame(HEADER_SIZE, '\0');
+    frame += table;
+    frame += '\t';
+    frame += shard.filename().string();
+    frame += '\t';
+    frame += to_string(offset);
+    frame += '\t';
+    frame += row;
+
+    string_view payload = string_view(frame).substr(HEADER_SIZE);
+    putU32(frame, 0, static_cast<uint32_t>(payload.size()));
+    putU32(frame, 4, checksum(payload));
+
+    unique_lock<mutex> lock(mutex_);
+    if (fd_ < 0 || !writeAll(fd_, frame)) {
+        // Drop a partial record, it would hide every record after it
+        if (fd_ >= 0 && ftruncate(fd_, static_cast<off_t>(size_)) != 0) {
+            errStream() << "Failed to truncate " << path_ << endl;
+        }
+        errStream() << "Failed to write to write-ahead log " << path_ << endl;
+        return nullopt;
+    }
+
+    uint64_t lsn = ++written_lsn_;
+    size_ += frame.size();
+    dirty_.insert(shard);
+    for (const auto& dictionary : dictionaries) {
+        if (dictionary) dictionaries_.insert(dictionary);
+    }
+    WalMetrics::get().records.add();
+
+    if (mode == WalMode::Sync) {
+        sync(lock, false);
+    } else {
+        flush_cv_.notify_one();
+    }
+    return lsn;
+}
+
+bool Wal::commit(uint64_t lsn) {
+    if (lsn == 0) return true;
+
+    LatencyTimer timer(WalMetrics::get().commit_time);
+    unique_lock<mutex> lock(mutex_);
+    durable_cv_.wait(lock, [&]() {
+        return durable_lsn_ >= lsn || failed_lsn_ >= lsn;
+    });
+
+    if (lsn > failed_after_ && lsn <= failed_lsn_) {
+        errStream() << "Failed to sync write-ahead log " << path_ << endl;
+        return false;
+    }
+    return true;
+}
+
+bool Wal::sync(unique_lock<mutex>& lock, bool unlock) {
+    uint64_t target = written_lsn_;
+    uint64_t durable = durable_lsn_;
+    auto dictionaries = std::move(dictionaries_);
+    dictionaries_.clear();
+
+    if (unlock) lock.unlock();
+
+    // Codes in the records must decode after a crash
+    bool synced = true;
+    for (const auto& dictionary : dictionaries) {
+        synced = dictionary->sync() && synced;
+    }
+    synced = synced && syncFd(fd_);
+    WalMetrics::get().syncs.add();
+
+    if (unlock) lock.lock();
+
+    if (synced) {
+        durable_lsn_ = max(durable_lsn_, target);
+    } else {
+        failed_after_ = durable;
+        failed_lsn_ = max(failed_lsn_, target);
+    }
+    durable_cv_.notify_all();
+    return synced;
+}
+
+void Wal::flush() {
+    unique_lock<mutex> lock(mutex_);
+    auto pending = [&]() {
+        return written_lsn_ - max(durable_lsn_, failed_lsn_);
+    };
+
+    while (true) {
+        flush_cv_.wait(lock, [&]() { return stopping_ || pending() > 0; });
+        if (pending() == 0) return;
+
+        // Give more writers the chance to join the group
+        Settings& settings = Settings::instance();
+        auto delay = chrono::milliseconds(settings.wal_group_ms.load());
+        if (delay.count() > 0 && !stopping_) {
+            size_t group = max<size_t>(settings.wal_group_records, 1);
+            flush_cv_.wait_for(lock, delay, [&]() {
+                return stopping_ || pending() >= group;
+            });
+        }
+
+        sync(lock, true);
+    }
+}
+
+void Wal::touched(const fs::path& shard) {
+    lock_guard<mutex> lock(mutex_);
+    dirty_.insert(shard);
+}
+
+bool Wal::needsCheckpoint() const {
+    lock_guard<mutex> lock(mutex_);
+    return size_ >= Settings::instance().wal_checkpoint_size;
+}
+
+bool Wal::checkpoint() {
+    unique_lock<mutex> lock(mutex_);
+    if (size_ == 0 && dirty_.empty()) return true;
+
+    // Once the rows are synced in their shards the log is not needed
+    bool synced = true;
+    set<fs::path> directories;
+    for (const auto& shard : dirty_) {
+        // Files removed since were rewritten, and synced, first
+        if (!fs::exists(shard)) continue;
+        synced = syncFile(shard) && synced;
+        directories.insert(shard.parent_path());
+    }
+    for (const auto& directory : directories) {
+        synced = syncDirectory(directory) && synced;
+    }
+    for (const auto& dictionary : dictionaries_) {
+        synced = dictionary->sync() && synced;
+    }
+
+    if (!synced || fd_ < 0 || ftruncate(fd_, 0) != 0 || !syncFd(fd_)) {
+        errStream() << "Failed to checkpoint write-ahead log " << path_
+                    << endl;
+        return false;
+    }
+
+    dirty_.clear();
+    dictionaries_.clear();
+    size_ = 0;
+    durable_lsn_ = written_lsn_;
+    durable_cv_.notify_all();
+    return true;
+}
+
+vector<Wal::Append> Wal::read(const fs::path& path) {
+    vector<Append> records;
+    ifstream file(path, ios::binary);
+    string data((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
+
+    size_t pos = 0;
+    while (data.size() - pos >= HEADER_SIZE) {
+        uint32_t length = getU32(data.data() + pos);
+        uint32_t sum = getU32(data.data() + pos + 4);
+        if (data.size() - pos - HEADER_SIZE < length) break;
+
+        string_view payload(data.data() + pos + HEADER_SIZE, length);
+        if (checksum(payload) != sum) break;
+        pos += HEADER_SIZE + length;
+
+        // <table>\t<shard file>\t<offset>\t<row>, the row may hold tabs
+        size_t table_end = payload.find('\t');
+        size_t file_end = payload.find('\t', table_end + 1);
+        size_t offset_end = payload.find('\t', file_end + 1);
+        if (table_end == string_view::npos || file_end == string_view::npos ||
+            offset_end == string_view::npos) {
+            break;
+        }
+
+        Append record;
+        record.table = payload.substr(0, table_end);
+        record.shard_file =
+            payload.substr(table_end + 1, file_end - table_end - 1);
+        string_view offset =
+            payload.substr(file_end + 1, offset_end - file_end - 1);
+        auto [end, ec] = from_chars(offset.data(),
+                                    offset.data() + offset.size(),
+                                    record.offset);
+        if (ec != errc() || end != offset.data() + offset.size()) break;
+        record.row = payload.substr(offset_end + 1);
+
+        records.push_back(std::move(record));
+    }
+    return records;
+}
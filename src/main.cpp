@@ -1,9 +1,16 @@
 #include "main.hpp"
 #include <readline/history.h>
 #include <readline/readline.h>
+#include <csignal>
+#include <cstring>
 #include <filesystem>
 #include <iostream>
+#include <string>
+#include <thread>
 #include "Interpreter.hpp"
+#include "Metrics.hpp"
+#include "Server.hpp"
+#include "Settings.hpp"
 
 namespace fs = std::filesystem;
 using namespace std;
@@ -40,7 +47,63 @@ void exit_lmk() {
     write_history(histpath.c_str());
 }
 
-int main() {
+Server* active_server = nullptr;
+
+void stop_server(int) {
+    if (active_server) active_server->stop();
+}
+
+int serve(const string& socket_path, size_t num_workers) {
+    Interpreter interpreter(dbDir);
+    Server server(socket_path, interpreter, num_workers);
+
+    active_server = &server;
+    signal(SIGINT, stop_server);
+    signal(SIGTERM, stop_server);
+
+    bool ok = server.run();
+    active_server = nullptr;
+
+    return ok ? 0 : 1;
+}
+
+int main(int argc, char* argv[]) {
+    string socket_path;
+    size_t num_workers = thread::hardware_concurrency();
+    string metrics_path;
+    size_t metrics_interval = 10;
+
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--serve") == 0 && i + 1 < argc) {
+            socket_path = argv[++i];
+        } else if (strcmp(argv[i], "--workers") == 0 && i + 1 < argc) {
+            num_workers = stoul(argv[++i]);
+        } else if (strcmp(argv[i], "--metrics-file") == 0 && i + 1 < argc) {
+            metrics_path = argv[++i];
+        } else if (strcmp(argv[i], "--metrics-interval") == 0 &&
+                   i + 1 < argc) {
+            metrics_interval = max<size_t>(1, stoul(argv[++i]));
+        } else if (strcmp(argv[i], "--prefetch-tables") == 0) {
+            Settings::instance().prefetch_tables = 1;
+        } else {
+            cerr << "Usage: " << argv[0]
+                 << " [--serve <socket> [--workers <n>]]"
+                    " [--metrics-file <path> [--metrics-interval <s>]]"
+                    " [--prefetch-tables]"
+                 << endl;
+            return 1;
+        }
+    }
+
+    if (!metrics_path.empty()) {
+        Metrics::instance().dumpPeriodically(
+            metrics_path, chrono::seconds(metrics_interval));
+    }
+
+    if (!socket_path.empty()) {
+        return serve(socket_path, num_workers);
+    }
+
     Interpreter interpreter(dbDir);
     string command;
 
@@ -4,45 +4,115 @@
 
 using namespace std;
 
+namespace {
+thread_local ostream* current_out = nullptr;
+thread_local ostream* current_err = nullptr;
+}  // namespace
+
+ostream& outStream() {
+    return current_out ? *current_out : cout;
+}
+
+ostream& errStream() {
+    return current_err ? *current_err : cerr;
+}
+
+OutputRedirect::OutputRedirect(ostream& out, ostream& err)
+    : prev_out_(current_out), prev_err_(current_err) {
+    current_out = &out;
+    current_err = &err;
+}
+
+OutputRedirect::~OutputRedirect() {
+    current_out = prev_out_;
+    current_err = prev_err_;
+}
+
 string bold(const string& text) {
     return BOLD + text + RESET;
 }
 
 void printUsage() {
-    cout << "Usage:\n"
-         << bold("create <name> [attr...]")
-         << "\n\tCreate a "
-            "table with "
-            "name "
-            "<name> and list of attribute names [attr...]\n\n"
-         << bold("insert <name> [attr:val...]")
-         << "\n\tInsert a row to a table <name> "
-            "with values val for each attribute attr\n\n"
-         << bold("read <name> ") << "\n\tRead all rows from table <name>\n"
-         << bold("read <name> id:<id>")
-         << "\n\tRead row from table <name> with index "
-            "<id>\n\n"
-         << bold("delete <name>")
-         << "\n\tDelete all rows from table "
-            "<name>\n"
-         << bold("delete <name> id:<id>")
-         << "\n\tDelete row with "
-            "index <id> from table <name>\n"
-         << bold("delete <name> id:<id> attr1 atr2...")
-         << "\n\tDelete values for specified attributes from row with "
-            "index <id> from table <name>\n"
-         << bold("delete <name> [attr:val...]")
-         << "\n\tDelete rows matching _all_ attr:val "
-            "combination from table <name>\n\n"
-         << bold("update <name> id:<id> [attr:val...]")
-         << "\n\tUpdate attributes attr with "
-            "values val... for row with index <id> from table "
-            "<name>\n\n"
-         << bold(
-                "join <table1>.<attr1> <table2>.<attr2> "
-                "[<table_n>.<attr_n>...]")
-         << "\n\tJoin tables <table1> and <table2> (and up to "
-            "<table_n>) on attributes <attr1> "
-            "and <attr2> (and up to <attr_n>), performs inner join"
-         << endl;
+    outStream() << "Usage:\n"
+                << bold("create <name> [attr...]")
+                << "\n\tCreate a "
+                   "table with "
+                   "name "
+                   "<name> and list of attribute names [attr...]\n"
+                << bold("create <name> [attr...] with compression")
+                << "\n\tCreate a table whose shards are stored as compressed "
+                   "blocks once they reach seal_size\n"
+                << bold("create <name> [attr...] partition by <attr> into <n>")
+                << "\n\tCreate a table of <n> shards, each row stored in the "
+                   "shard chosen by a hash of its value of <attr>\n"
+                << bold("create <name> [attr...] cluster by <attr>")
+                << "\n\tCreate a table kept sorted on <attr>, read by binary "
+                   "search for conditions on <attr>\n\n"
+                << bold("insert <name> [attr:val...]")
+                << "\n\tInsert a row to a table <name> "
+                   "with values val for each attribute attr\n\n"
+                << bold("read <name> ")
+                << "\n\tRead all rows from table <name>\n"
+                << bold("read <name> id:<id>")
+                << "\n\tRead row from table <name> with index "
+                   "<id>\n"
+                << bold("read <name> [attr:val | attr<val | attr>=val ...]")
+                << "\n\tRead rows matching all conditions, comparing like "
+                   "order by (also <=, >, and attr:prefix* for values "
+                   "starting with prefix)\n"
+                << bold("read <name> ... order by <attr> [desc] [limit <k>]")
+                << "\n\tSort rows read from table <name> on attribute <attr>, "
+                   "optionally keeping only the first <k>\n\n"
+                << bold("delete <name>")
+                << "\n\tDelete all rows from table "
+                   "<name>\n"
+                << bold("delete <name> id:<id>")
+                << "\n\tDelete row with "
+                   "index <id> from table <name>\n"
+                << bold("delete <name> id:<id> attr1 atr2...")
+                << "\n\tDelete values for specified attributes from row with "
+                   "index <id> from table <name>\n"
+                << bold("delete <name> [attr:val | attr<val ...]")
+                << "\n\tDelete rows matching all conditions from table "
+                   "<name>, written like the ones of read\n\n"
+                << bold("update <name> id:<id> [attr:val...]")
+                << "\n\tUpdate attributes attr with "
+                   "values val... for row with index <id> from table "
+                   "<name>\n\n"
+                << bold(
+                       "join <table1>.<attr1> <table2>.<attr2> "
+                       "[<table_n>.<attr_n>...]")
+                << "\n\tJoin tables <table1> and <table2> (and up to "
+                   "<table_n>) on attributes <attr1> "
+                   "and <attr2> (and up to <attr_n>), performs inner join\n"
+                << bold("join ... order by <attr> [desc] [limit <k>]")
+                << "\n\tSort the join result on attribute <attr>\n"
+                << bold(
+                       "create materialized <name> as join "
+                       "<table1>.<attr1> ...")
+                << "\n\tStore the result of a join as table <name>, recomputed "
+                   "when read after the joined tables changed\n\n"
+                << bold("encode <name> <attr>")
+                << "\n\tStore dictionary codes instead of the values of "
+                   "attribute <attr> of table <name>, for columns with few "
+                   "distinct values\n"
+                << bold("create index <name> <attr> using btree")
+                << "\n\tBuild a persistent B+tree index of attribute <attr>, "
+                   "used by reads and deletes with conditions on it\n"
+                << bold("export <name> <file> | import <name> <file>")
+                << "\n\tWrite table <name> to, or append the rows of, an Arrow "
+                   "IPC file of string columns\n\n"
+                << bold("explain [analyze] <command>")
+                << "\n\tShow the physical plan of <command>. With analyze, run "
+                   "it and report time, rows, bytes, memory and allocations "
+                   "per operator and shard task\n"
+                << bold("set [<name> <value>]")
+                << "\n\tList runtime settings, or change setting <name>\n"
+                << bold("stats")
+                << "\n\tShow command latency percentiles and I/O counters\n"
+                << bold("trace on <file> | trace off")
+                << "\n\tRecord commands, operators and shard tasks of every "
+                   "thread and write them to <file> as Chrome trace-event "
+                   "JSON"
+                << endl;
 }
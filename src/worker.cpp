@@ -1,68 +1,391 @@
 #include "worker.hpp"
+#include <filesystem>
 #include <fstream>
 #include <iostream>
-#include <map>
-#include <sstream>
+#include <optional>
 #include <string>
+#include <type_traits>
 #include <utility>
 #include <vector>
+#include "Batch.hpp"
+#include "Profile.hpp"
+#include "Settings.hpp"
+#include "Trace.hpp"
 
 using namespace std;
 
-multimap<string, pair<string, streampos>> JoinWorker::buildHashTable(
-    const string& shard_path, int attr_pos) {
-    multimap<string, pair<string, streampos>> index{};
+namespace {
+string taskName(const Shard& shard) {
+    return filesystem::path(shard.path()).filename().string();
+}
 
-    ifstream file(shard_path);
-    string line;
-    streampos pos = 0;
+string memoryError(const string& task, size_t bytes) {
+    return "memory limit exceeded: the join task of " + task + " needs " +
+           "more than " + formatBytes(bytes) +
+           " (see memory_limit and query_memory_limit)";
+}
 
-    while (getline(file, line)) {
-        istringstream ss(line);
-        string field;
-        int current_pos = 0;
+// Takes the result lock, recording the wait in the trace when another task
+// holds it
+unique_lock<mutex> lockOutput(mutex& output_mutex) {
+    unique_lock<mutex> lock(output_mutex, try_to_lock);
+    if (!lock.owns_lock()) {
+        TraceSpan wait("output lock wait", "lock");
+        lock.lock();
+    }
+    return lock;
+}
+}  // namespace
 
-        while (getline(ss, field, ',')) {
-            if (current_pos == attr_pos) {
-                index.insert({field, {shard_path, pos}});
-                break;
-            }
-            current_pos++;
+template <typename Key, typename KeyOf>
+optional<JoinWorker::HashTable<Key>> JoinWorker::buildHashTable(
+    const Shard& shard, int column, KeyOf&& key_of, Arena& arena,
+    MemoryReservation& memory) {
+    OperatorTimer timer("hash build", taskName(shard));
+
+    // Roughly sized from the shard so that building rarely rehashes, every
+    // discarded bucket array stays in the arena until the task ends
+    HashTable<Key> index(shard.size() / 64 + 16, hash<Key>(), equal_to<Key>(),
+                         ArenaAllocator<pair<const Key, uint64_t>>(arena));
+
+    ShardReader reader(shard);
+    string_view line;
+
+    while (reader.next(line)) {
+        if (auto* stats = timer.stats()) stats->rows_in++;
+
+        optional<Key> key = key_of(fieldAt(line, column));
+        if (!key) continue;
+
+        // String keys are copied into the arena, the page the line points
+        // into may be evicted once the reader moves on
+        if constexpr (is_same_v<Key, string_view>) {
+            index.emplace(arena.copy(*key), reader.offset());
+        } else {
+            index.emplace(*key, reader.offset());
         }
-        pos = file.tellg();
+
+        if (auto* stats = timer.stats()) stats->rows_out++;
+
+        // Nodes, keys and buckets are all in the arena
+        if (arena.bytesReserved() != memory.bytes() &&
+            !memory.resize(arena.bytesReserved())) {
+            return nullopt;
+        }
+    }
+
+    if (auto* stats = timer.stats()) {
+        stats->bytes_read = reader.bytesRead();
+        stats->peak_memory = arena.bytesReserved();
     }
     return index;
 }
 
-bool JoinWorker::processShardBatch(const string& shard_A,
-                                   const vector<string>& all_shards_B,
-                                   int attr_pos_A, int attr_pos_B) {
+template <typename Key, typename BuildKey, typename ProbeKey>
+bool JoinWorker::hashJoin(const Shard& shard_A, const ShardList& all_shards_B,
+                          const JoinKeys& keys, BuildKey&& build_key,
+                          ProbeKey&& probe_key) {
     ofstream out(output_path, ios::app);
-    auto index = buildHashTable(shard_A, attr_pos_A);
-    string line{};
+    Arena arena;
+    MemoryReservation memory;
+    string task = taskName(shard_A);
+    auto built = buildHashTable<Key>(shard_A, keys.left_column, build_key,
+                                     arena, memory);
+    if (!built) {
+        error_ = memoryError(task, arena.bytesReserved());
+        return false;
+    }
+    auto& index = *built;
+    string_view line;
+
+    OperatorTimer probe_timer("probe", task);
+    OperatorTimer fetch_timer("match fetch", task, true);
+    OperatorTimer write_timer("result write", task, true);
+    uint64_t written_bytes = 0, written_rows = 0;
+
+    // Matches are fetched back from shard A by offset
+    ShardReader matches(shard_A);
 
     for (const auto& shard_B : all_shards_B) {
-        ifstream file_B(shard_B);
-        while (getline(file_B, line)) {
-            istringstream ss(line);
-            string join_key;
+        ShardReader reader_B(*shard_B);
+        while (reader_B.next(line)) {
+            if (auto* stats = probe_timer.stats()) stats->rows_in++;
 
-            for (int i = 0; i <= attr_pos_B; i++) {
-                getline(ss, join_key, ',');
-            }
+            optional<Key> key = probe_key(fieldAt(line, keys.right_column));
+            if (!key) continue;
 
-            auto range = index.equal_range(join_key);
+            auto range = index.equal_range(*key);
             for (auto it = range.first; it != range.second; ++it) {
-                ifstream reader(it->second.first);
-                reader.seekg(it->second.second);
+                probe_timer.pause();
+                fetch_timer.resume();
+
+                string_view matching_record;
+                matches.seek(it->second);
+                matches.next(matching_record);
 
-                string matching_record;
-                getline(reader, matching_record);
+                if (auto* stats = fetch_timer.stats()) {
+                    stats->rows_in++;
+                    stats->rows_out++;
+                    stats->bytes_read += matching_record.size() + 1;
+                }
+                fetch_timer.pause();
+                write_timer.resume();
 
-                lock_guard<mutex> lock(output_mutex);
+                auto lock = lockOutput(output_mutex);
                 out << matching_record << "," << line << "\n";
+                written_bytes += matching_record.size() + line.size() + 2;
+                written_rows++;
+
+                if (auto* stats = write_timer.stats()) {
+                    stats->rows_in++;
+                    stats->rows_out++;
+                    stats->bytes_written +=
+                        matching_record.size() + line.size() + 2;
+                }
+                write_timer.pause();
+                probe_timer.resume();
+
+                if (auto* stats = probe_timer.stats()) stats->rows_out++;
             }
         }
+        if (auto* stats = probe_timer.stats()) {
+            stats->bytes_read += reader_B.bytesRead();
+        }
     }
+
+    // Flush before the write timer reports
+    write_timer.resume();
+    out.close();
+    write_timer.pause();
+
+    ShardIoMetrics& metrics = ShardIoMetrics::get();
+    metrics.recordWrite(written_bytes, written_rows);
+
     return true;
 }
+
+template <typename Key, typename BuildKey, typename ProbeKey>
+bool JoinWorker::batchedHashJoin(const Shard& shard_A,
+                                 const ShardList& all_shards_B,
+                                 const JoinKeys& keys, BuildKey&& build_key,
+                                 ProbeKey&& probe_key, size_t batch_size) {
+    ofstream out(output_path, ios::app);
+    Arena arena;
+    MemoryReservation memory;
+    string task = taskName(shard_A);
+    JoinTable<Key> table;
+    ColumnBatch batch;
+
+    {
+        OperatorTimer timer("hash build", task);
+        vector<Key> build_keys;
+        vector<uint64_t> offsets;
+        BatchScan scan(shard_A, {{keys.left_column}}, batch_size);
+
+        auto held = [&]() {
+            return arena.bytesReserved() + build_keys.capacity() * sizeof(Key) +
+                   offsets.capacity() * sizeof(uint64_t) + batch.memory();
+        };
+
+        while (scan.next(batch)) {
+            const auto& fields = batch.column(0);
+            for (size_t row = 0; row < batch.size(); ++row) {
+                optional<Key> key = build_key(fields[row]);
+                if (!key) continue;
+
+                if constexpr (is_same_v<Key, string_view>) {
+                    build_keys.push_back(arena.copy(*key));
+                } else {
+                    build_keys.push_back(*key);
+                }
+                offsets.push_back(batch.offset(row));
+            }
+
+            if (held() != memory.bytes() && !memory.resize(held())) {
+                error_ = memoryError(task, held());
+                return false;
+            }
+        }
+
+        size_t building =
+            held() + JoinTable<Key>::buildMemory(build_keys.size());
+        if (!memory.resize(building)) {
+            error_ = memoryError(task, building);
+            return false;
+        }
+        table.build(build_keys, offsets);
+
+        if (auto* stats = timer.stats()) {
+            stats->rows_in = scan.rowsRead();
+            stats->rows_out = build_keys.size();
+            stats->bytes_read = scan.bytesRead();
+            stats->peak_memory = arena.bytesReserved() + table.memory();
+        }
+    }
+    size_t table_bytes = arena.bytesReserved() + table.memory();
+    memory.resize(table_bytes);
+
+    OperatorTimer probe_timer("probe", task);
+    OperatorTimer fetch_timer("match fetch", task, true);
+    OperatorTimer write_timer("result write", task, true);
+    uint64_t written_bytes = 0, written_rows = 0;
+
+    ShardReader matches(shard_A);
+    vector<Key> probe_keys;
+    vector<uint32_t> hashes;
+    vector<pair<uint32_t, uint64_t>> found;
+    string output;
+
+    // Keys are taken from the key column of the batch and hashed in one
+    // loop, their slots prefetched in a second and matched in a third, and
+    // the matches are written with one locked write per batch
+    auto probe = [&]() {
+        auto& selection = batch.selection();
+        const auto& fields = batch.column(0);
+        probe_keys.clear();
+        size_t kept = 0;
+        for (uint32_t row : selection) {
+            optional<Key> key = probe_key(fields[row]);
+            if (!key) continue;
+            selection[kept++] = row;
+            probe_keys.push_back(*key);
+        }
+        selection.resize(kept);
+
+        // A separate loop over plain arrays, vectorized for integer keys
+        hashes.resize(probe_keys.size());
+        for (size_t i = 0; i < probe_keys.size(); ++i) {
+            hashes[i] = joinHash(probe_keys[i]);
+        }
+        for (uint32_t hash : hashes) table.prefetch(hash);
+
+        found.clear();
+        for (size_t i = 0; i < probe_keys.size(); ++i) {
+            for (uint64_t offset : table.rows(hashes[i], probe_keys[i])) {
+                found.emplace_back(selection[i], offset);
+            }
+        }
+        if (auto* stats = probe_timer.stats()) stats->rows_out += found.size();
+        probe_timer.pause();
+
+        fetch_timer.resume();
+        output.clear();
+        for (const auto& [row, offset] : found) {
+            string_view matching_record;
+            matches.seek(offset);
+            matches.next(matching_record);
+            output += matching_record;
+            output += ',';
+            output += batch.row(row);
+            output += '\n';
+
+            if (auto* stats = fetch_timer.stats()) {
+                stats->rows_in++;
+                stats->rows_out++;
+                stats->bytes_read += matching_record.size() + 1;
+            }
+        }
+        fetch_timer.pause();
+
+        // Batch and result buffers only grow to their largest batch
+        size_t buffers = batch.memory() + output.capacity() +
+                         probe_keys.capacity() * sizeof(Key) +
+                         hashes.capacity() * sizeof(uint32_t) +
+                         found.capacity() * sizeof(found[0]);
+        if (!memory.resize(table_bytes + buffers)) {
+            error_ = memoryError(task, table_bytes + buffers);
+            return false;
+        }
+
+        write_timer.resume();
+        {
+            auto lock = lockOutput(output_mutex);
+            out.write(output.data(), static_cast<streamsize>(output.size()));
+        }
+        written_bytes += output.size();
+        written_rows += found.size();
+        if (auto* stats = write_timer.stats()) {
+            stats->rows_in += found.size();
+            stats->rows_out += found.size();
+            stats->bytes_written += output.size();
+        }
+        write_timer.pause();
+        probe_timer.resume();
+        return true;
+    };
+
+    for (const auto& shard_B : all_shards_B) {
+        BatchScan scan(*shard_B, {{keys.right_column}}, batch_size);
+        while (scan.next(batch)) {
+            if (auto* stats = probe_timer.stats()) {
+                stats->rows_in += batch.size();
+            }
+            if (!probe()) return false;
+        }
+        if (auto* stats = probe_timer.stats()) {
+            stats->bytes_read += scan.bytesRead();
+        }
+    }
+
+    // Flush before the write timer reports
+    write_timer.resume();
+    out.close();
+    write_timer.pause();
+
+    ShardIoMetrics::get().recordWrite(written_bytes, written_rows);
+    return true;
+}
+
+bool JoinWorker::processShardBatch(const Shard& shard_A,
+                                   const ShardList& all_shards_B,
+                                   const JoinKeys& keys) {
+    size_t batch_size = Settings::instance().join_batch_size;
+    auto join = [&]<typename Key>(auto&& build_key, auto&& probe_key) {
+        if (batch_size == 0) {
+            return hashJoin<Key>(shard_A, all_shards_B, keys, build_key,
+                                 probe_key);
+        }
+        return batchedHashJoin<Key>(shard_A, all_shards_B, keys, build_key,
+                                    probe_key, batch_size);
+    };
+
+    const Dictionary* left = keys.left_dictionary.get();
+    const Dictionary* right = keys.right_dictionary.get();
+
+    // Code of an encoded field, empty for fields that are not valid codes
+    auto code = [](const Dictionary* dictionary,
+                   string_view field) -> optional<uint32_t> {
+        auto code = Dictionary::parseCode(field);
+        if (!code || *code >= dictionary->size()) return nullopt;
+        return code;
+    };
+
+    if (keys.integer()) {
+        auto build_key = [&](string_view field) { return code(left, field); };
+        auto probe_key = [&](string_view field) -> optional<uint32_t> {
+            auto right_code = code(right, field);
+            if (!right_code || keys.right_to_left.empty()) return right_code;
+            if (*right_code >= keys.right_to_left.size()) return nullopt;
+
+            uint32_t left_code = keys.right_to_left[*right_code];
+            if (left_code == Dictionary::MAX_CODES) return nullopt;
+            return left_code;
+        };
+        return join.operator()<uint32_t>(build_key, probe_key);
+    }
+
+    // Keys of a side that is not encoded are its fields as they are
+    auto string_key = [&](const Dictionary* dictionary,
+                          string_view field) -> optional<string_view> {
+        if (!dictionary) return field;
+
+        auto field_code = code(dictionary, field);
+        if (!field_code) return nullopt;
+        return dictionary->decode(*field_code);
+    };
+    auto build_key = [&](string_view field) { return string_key(left, field); };
+    auto probe_key = [&](string_view field) {
+        return string_key(right, field);
+    };
+    return join.operator()<string_view>(build_key, probe_key);
+}
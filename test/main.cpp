@@ -1,5 +1,37 @@
+#include <fcntl.h>
 #include <gtest/gtest.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <random>
+#include <sstream>
+#include <thread>
+#include "Arena.hpp"
+#include "Arrow.hpp"
+#include "AsyncIo.hpp"
+#include "Batch.hpp"
+#include "Compression.hpp"
+#include "DBManager.hpp"
+#include "Datagen.hpp"
 #include "Interpreter.hpp"
+#include "Memory.hpp"
+#include "Metrics.hpp"
+#include "Profile.hpp"
+#include "Protocol.hpp"
+#include "Record.hpp"
+#include "Server.hpp"
+#include "Settings.hpp"
+#include "Sort.hpp"
+#include "ThreadPool.hpp"
+#include "Trace.hpp"
+#include "Wal.hpp"
+#include "utils.hpp"
 
 std::string hw() {
     return "hello world";
@@ -24,6 +56,1262 @@ TEST(ValidateInteger, validatesInteger) {
         << "negative integers are integers too";
 }
 
+TEST(Protocol, roundTripsFrames) {
+    std::string buffer = encodeFrame("read t") + encodeFrame("");
+    buffer += encodeFrame("join a.x b.y").substr(0, 6);
+
+    EXPECT_EQ(takeFrame(buffer), "read t");
+    EXPECT_EQ(takeFrame(buffer), "");
+    EXPECT_EQ(takeFrame(buffer), std::nullopt) << "partial frame";
+
+    buffer += encodeFrame("join a.x b.y").substr(6);
+    EXPECT_EQ(takeFrame(buffer), "join a.x b.y");
+    EXPECT_TRUE(buffer.empty());
+}
+
+TEST(Protocol, rejectsOversizedFrames) {
+    std::string buffer = encodeFrame(std::string(100, 'x'));
+    EXPECT_THROW(takeFrame(buffer, 10), std::length_error);
+}
+
+TEST(Server, answersEveryRequestSentBeforeAHalfClose) {
+    std::filesystem::path dir =
+        std::filesystem::temp_directory_path() /
+        ("lmkdb_server_test_" + std::to_string(getpid()));
+    std::filesystem::remove_all(dir);
+    std::filesystem::create_directories(dir);
+    std::string socket_path = (dir / "lmkdb.sock").string();
+
+    Interpreter interpreter((dir / "db").string() + "/");
+    Server server(socket_path, interpreter, 2);
+    std::thread loop([&]() {
+        std::ostringstream banner;
+        OutputRedirect redirect(banner, banner);
+        server.run();
+    });
+
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, socket_path.c_str(), sizeof(addr.sun_path) - 1);
+    auto request = [&](const std::vector<std::string>& commands) {
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        for (int i = 0; i < 1000; ++i) {
+            if (connect(fd, reinterpret_cast<sockaddr*>(&addr),
+                        sizeof(addr)) == 0) {
+                break;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+
+        // All requests and the end of the stream arrive together
+        std::string frames;
+        for (const auto& command : commands) frames += encodeFrame(command);
+        EXPECT_EQ(write(fd, frames.data(), frames.size()),
+                  ssize_t(frames.size()));
+        shutdown(fd, SHUT_WR);
+
+        std::string buffer;
+        char buf[4096];
+        for (ssize_t n; (n = read(fd, buf, sizeof(buf))) > 0;) {
+            buffer.append(buf, n);
+        }
+        close(fd);
+
+        std::vector<std::string> responses;
+        while (auto response = takeFrame(buffer)) {
+            responses.push_back(*response);
+        }
+        return responses;
+    };
+
+    auto responses = request({"create t k", "insert t k:1", "read t"});
+    ASSERT_EQ(responses.size(), 3u);
+    EXPECT_EQ(responses[2], "1\n");
+
+    std::vector<std::string> reads(50, "read t");
+    EXPECT_EQ(request(reads), std::vector<std::string>(50, "1\n"));
+
+    server.stop();
+    loop.join();
+    std::filesystem::remove_all(dir);
+}
+
+TEST(ThreadPool, runsSubmittedTasks) {
+    ThreadPool pool(4);
+    std::vector<std::future<int>> results;
+    for (int i = 0; i < 100; ++i) {
+        results.push_back(pool.submit([i]() { return i * i; }));
+    }
+    for (int i = 0; i < 100; ++i) {
+        EXPECT_EQ(results[i].get(), i * i);
+    }
+}
+
+TEST(Histogram, reportsPercentilesWithinBucketError) {
+    Histogram histogram;
+    for (uint64_t i = 1; i <= 100000; ++i) histogram.record(i);
+
+    EXPECT_EQ(histogram.count(), 100000u);
+    EXPECT_EQ(histogram.max(), 100000u);
+    EXPECT_NEAR(histogram.percentile(0.5), 50000, 50000 * 0.04);
+    EXPECT_NEAR(histogram.percentile(0.99), 99000, 99000 * 0.04);
+    EXPECT_NEAR(histogram.percentile(0.999), 99900, 99900 * 0.04);
+
+    for (size_t bucket = 1; bucket < Histogram::NUM_BUCKETS; ++bucket) {
+        ASSERT_EQ(Histogram::bucketLow(bucket),
+                  Histogram::bucketHigh(bucket - 1) + 1);
+        ASSERT_EQ(Histogram::bucketOf(Histogram::bucketLow(bucket)), bucket);
+    }
+}
+
+TEST(Metrics, rejectsANameRegisteredAsAnotherKind) {
+    Metrics& metrics = Metrics::instance();
+    Counter& counter =
+        metrics.counter("lmkdb_test_kind_total", "Test counter", "a=\"1\"");
+    EXPECT_EQ(&metrics.counter("lmkdb_test_kind_total", "", "a=\"1\""),
+              &counter);
+    EXPECT_THROW(
+        metrics.histogram("lmkdb_test_kind_total", "", "a=\"1\""),
+        std::logic_error);
+    EXPECT_THROW(metrics.gauge("lmkdb_test_kind_total", ""),
+                 std::logic_error);
+}
+
+TEST(RecordView, splitsLikeGetlineWithoutAllocating) {
+    RecordView record("a,,c,");
+    ASSERT_EQ(record.size(), 3u);
+    EXPECT_EQ(record[0], "a");
+    EXPECT_EQ(record[1], "");
+    EXPECT_EQ(record[2], "c");
+    EXPECT_EQ(record[7], "") << "missing fields read as empty";
+
+    std::string row = "1,2,3";
+    uint64_t before = threadAllocations();
+    for (int i = 0; i < 1000; ++i) record.parse(row);
+    EXPECT_EQ(threadAllocations(), before);
+}
+
+TEST(Arena, copiesAlignedAndOversizedAllocations) {
+    Arena arena;
+    std::string_view small = arena.copy("key");
+    EXPECT_EQ(small, "key");
+
+    auto* aligned = static_cast<char*>(arena.allocate(24, 16));
+    EXPECT_EQ(reinterpret_cast<uintptr_t>(aligned) % 16, 0u);
+
+    std::string large(Arena::BLOCK_SIZE * 2, 'x');
+    EXPECT_EQ(arena.copy(large), large);
+    EXPECT_EQ(small, "key") << "earlier allocations stay valid";
+
+    arena.reset();
+    EXPECT_EQ(arena.bytesReserved(), Arena::BLOCK_SIZE);
+}
+
+TEST(Lz, roundTripsRepetitiveAndRandomData) {
+    std::string rows;
+    for (int i = 0; i < 2000; ++i) {
+        rows += "King's Cross St. Pancras," + std::to_string(i % 7) +
+                ",2024-01-01 08:00:00\n";
+    }
+    std::string noise(5000, '\0');
+    std::mt19937 rng(7);
+    for (char& c : noise) c = static_cast<char>(rng());
+
+    for (const std::string& input : {rows, noise, std::string("aaaaaaa"),
+                                     std::string()}) {
+        std::string compressed, output;
+        lzCompress(input, compressed);
+        ASSERT_TRUE(lzDecompress(compressed, input.size(), output));
+        EXPECT_EQ(output, input);
+    }
+
+    std::string compressed, output;
+    lzCompress(rows, compressed);
+    EXPECT_LT(compressed.size() * 10, rows.size());
+    EXPECT_FALSE(lzDecompress(compressed, rows.size() + 1, output));
+    EXPECT_FALSE(lzDecompress(compressed.substr(0, 100), rows.size(), output));
+}
+
+TEST(Shard, retiredFileOutlivesEveryPinnedVersion) {
+    std::filesystem::path path =
+        std::filesystem::temp_directory_path() /
+        ("lmkdb_shard_retire_test_" + std::to_string(getpid()) + ".csv");
+    std::ofstream(path) << "1,a\n";
+
+    auto first = std::make_shared<Shard>(path.string());
+    std::ofstream(path, std::ios::app) << "2,b\n";
+    auto second = std::make_shared<Shard>(*first, 8);
+    EXPECT_EQ(first->size(), 4u);
+    EXPECT_EQ(second->size(), 8u);
+
+    // A rewrite retires the newest version while a reader still pins the
+    // first one
+    second->retire();
+    second.reset();
+    ASSERT_TRUE(std::filesystem::exists(path));
+    std::string line;
+    ShardReader reader(*first);
+    ASSERT_TRUE(reader.next(line));
+    EXPECT_EQ(line, "1,a");
+    EXPECT_FALSE(reader.next(line));
+
+    first.reset();
+    EXPECT_FALSE(std::filesystem::exists(path));
+}
+
+TEST(IoQueue, readsMatchPreadWithMoreReadsThanSlots) {
+    std::string path =
+        (std::filesystem::temp_directory_path() / "lmkdb_io_queue_test")
+            .string();
+    std::string contents(250000, '\0');
+    std::mt19937 rng(11);
+    for (char& c : contents) c = static_cast<char>(rng());
+    std::ofstream(path, std::ios::binary) << contents;
+
+    int fd = open(path.c_str(), O_RDONLY);
+    ASSERT_GE(fd, 0);
+
+    // Reads overlap and the last ones run past the end of the file
+    constexpr size_t READS = IoQueue::DEPTH * 3, LENGTH = 4000;
+    for (bool uring : {true, false}) {
+        IoQueue queue(uring);
+        std::vector<std::string> buffers(READS, std::string(LENGTH, '\0'));
+        std::vector<std::shared_ptr<IoQueue::Request>> requests;
+        for (size_t i = 0; i < READS; ++i) {
+            requests.push_back(
+                queue.read(fd, i * 1300, buffers[i].data(), LENGTH));
+        }
+        queue.submit();
+
+        for (size_t i = READS; i-- > 0;) {
+            queue.wait(*requests[i]);
+            std::string expected = contents.substr(i * 1300, LENGTH);
+            ASSERT_EQ(requests[i]->result, ssize_t(expected.size()));
+            EXPECT_EQ(buffers[i].substr(0, expected.size()), expected);
+        }
+        EXPECT_EQ(queue.inFlight(), 0u);
+    }
+
+    close(fd);
+    std::filesystem::remove(path);
+}
+
+TEST(CompareValues, ordersNumbersBeforeText) {
+    EXPECT_LT(compareValues("9", "10"), 0) << "numbers compare by value";
+    EXPECT_LT(compareValues("-1.5", "0"), 0);
+    EXPECT_LT(compareValues("100", "abc"), 0);
+    EXPECT_GT(compareValues("b", "a"), 0);
+    EXPECT_EQ(compareValues("2.0", "2"), 0);
+}
+
+std::vector<std::string> sortRows(const std::vector<std::string>& rows,
+                                  bool descending,
+                                  std::optional<size_t> limit,
+                                  size_t memory_budget) {
+    RowSorter sorter(1, descending, limit, memory_budget);
+    for (const auto& row : rows) sorter.add(row);
+
+    std::vector<std::string> sorted;
+    sorter.finish([&](const std::string& row) { sorted.push_back(row); });
+    return sorted;
+}
+
+TEST(RowSorter, heapSpillAndMemoryPathsAgree) {
+    std::vector<std::string> rows;
+    for (int i = 0; i < 20000; ++i) {
+        rows.push_back("r" + std::to_string(i) + "," +
+                       std::to_string((i * 7919) % 1000));
+    }
+
+    auto in_memory = sortRows(rows, true, std::nullopt, 1 << 30);
+    auto spilled = sortRows(rows, true, std::nullopt, 64 << 10);
+    auto top_k = sortRows(rows, true, 100, 1 << 30);
+
+    ASSERT_EQ(in_memory.size(), rows.size());
+    EXPECT_EQ(in_memory, spilled);
+    EXPECT_EQ(top_k, std::vector<std::string>(in_memory.begin(),
+                                              in_memory.begin() + 100));
+    EXPECT_EQ(in_memory.front(), "r321,999") << "ties keep input order";
+
+    // A limit too small for a single row still spills runs of a useful size
+    std::atomic<size_t> limit = 64;
+    MemoryTracker query(limit, &MemoryTracker::global());
+    MemoryTracker::Activate charge(&query);
+    RowSorter sorter(1, true, std::nullopt, 1 << 30);
+    for (const auto& row : rows) sorter.add(row);
+    EXPECT_GT(sorter.spilledRuns(), 1u);
+    EXPECT_LT(sorter.spilledRuns(), 100u);
+    std::vector<std::string> limited;
+    sorter.finish([&](const std::string& row) { limited.push_back(row); });
+    EXPECT_EQ(limited, in_memory);
+}
+
+class DatabaseTest : public testing::Test {
+   protected:
+    std::filesystem::path db_path;
+
+    void SetUp() override {
+        std::string test_name =
+            testing::UnitTest::GetInstance()->current_test_info()->name();
+        db_path = std::filesystem::temp_directory_path() /
+                  ("lmkdb_test_" + std::to_string(getpid()) + "_" + test_name);
+        std::filesystem::remove_all(db_path);
+    }
+
+    void TearDown() override { std::filesystem::remove_all(db_path); }
+
+    std::string dbDir() const { return db_path.string() + "/"; }
+};
+
+TEST_F(DatabaseTest, readersSeeConsistentSnapshotsDuringUpdates) {
+    DBManager db(dbDir());
+    ASSERT_TRUE(db.createTable("t", {"k", "v"}));
+    for (int i = 0; i < 50; ++i) {
+        db.insertRecord("t", {{"k", std::to_string(i)}, {"v", "0"}});
+    }
+
+    std::atomic<bool> done = false;
+    std::thread writer([&]() {
+        for (int i = 0; i < 100; ++i) {
+            db.updateRecord("t", i % 50, {{"v", std::to_string(i)}});
+        }
+        done = true;
+    });
+
+    while (!done) {
+        std::ostringstream out;
+        {
+            OutputRedirect redirect(out, out);
+            db.readTable("t", {});
+        }
+        std::string rows = out.str();
+        ASSERT_EQ(std::count(rows.begin(), rows.end(), '\n'), 50);
+    }
+    writer.join();
+}
+
+TEST_F(DatabaseTest, explainOnlyPlansCreateAndDelete) {
+    Interpreter interpreter(dbDir());
+    auto run = [&](const std::string& command) {
+        std::ostringstream out;
+        OutputRedirect redirect(out, out);
+        interpreter.processCommand(command);
+        return out.str();
+    };
+    run("create t k v");
+    run("insert t k:1 v:x");
+
+    EXPECT_NE(run("explain delete t").find("Drop table t"),
+              std::string::npos);
+    EXPECT_EQ(run("read t"), "1,x\n");
+
+    EXPECT_NE(run("explain create u x y").find("Create table u"),
+              std::string::npos);
+    EXPECT_NE(run("read u").find("Table does not exist"), std::string::npos);
+    EXPECT_EQ(run("create u x y").find("already exists"), std::string::npos);
+
+    EXPECT_NE(run("explain create materialized v as join t.k u.x")
+                  .find("Create materialized view v"),
+              std::string::npos);
+    EXPECT_NE(run("read v").find("Table does not exist"), std::string::npos);
+
+    // Session commands are refused rather than run
+    size_t sort_memory = Settings::instance().sort_memory;
+    EXPECT_NE(run("explain set sort_memory 1").find("cannot explain set"),
+              std::string::npos);
+    EXPECT_EQ(Settings::instance().sort_memory, sort_memory);
+    EXPECT_NE(run("explain analyze trace on " + (db_path / "t.json").string())
+                  .find("cannot explain trace"),
+              std::string::npos);
+    EXPECT_FALSE(Tracer::enabled());
+}
+
+TEST_F(DatabaseTest, catalogSurvivesRestartAndBootstrapsLegacyTables) {
+    std::filesystem::create_directories(db_path / "legacy");
+    std::ofstream(db_path / "legacy" / "metadata.txt") << "a,0\nb,1\n";
+    std::ofstream(db_path / "legacy" / "shard_0.csv") << "1,2\n";
+
+    {
+        DBManager db(dbDir());
+        ASSERT_TRUE(db.createTable("t", {"k", "v"}));
+        db.insertRecord("t", {{"k", "1"}, {"v", "x"}});
+        db.updateRecord("t", 0, {{"v", "y"}});
+    }
+    ASSERT_TRUE(std::filesystem::exists(db_path / Catalog::FILE_NAME));
+
+    DBManager db(dbDir());
+    std::ostringstream out;
+    {
+        OutputRedirect redirect(out, out);
+        db.readTable("t", {});
+        db.readTable("legacy", {});
+    }
+    EXPECT_EQ(out.str(), "1,y\n1,2\n");
+}
+
+TEST_F(DatabaseTest, catalogCleansTableDirectoriesAndReportsFailedWrites) {
+    {
+        DBManager db(dbDir());
+        ASSERT_TRUE(db.createTable("t", {"k", "v"}));
+        db.insertRecord("t", {{"k", "1"}, {"v", "x"}});
+    }
+    // Leftovers of a rewrite, an encode and a catalog write cut short
+    std::ofstream(db_path / "t" / "shard_0.1.csv.tmp") << "2,y\n";
+    std::ofstream(db_path / "t" / "shard_0.1.csv") << "2,y\n";
+    std::ofstream(db_path / "t" / "dict_v.txt") << "y\n";
+    std::ofstream(db_path / "catalog.txt.tmp") << "version,9\n";
+
+    DBManager db(dbDir());
+    auto read = [&]() {
+        std::ostringstream out;
+        OutputRedirect redirect(out, out);
+        db.readTable("t", {});
+        return out.str();
+    };
+    EXPECT_EQ(read(), "1,x\n");
+    std::vector<std::string> files;
+    for (const auto& entry :
+         std::filesystem::directory_iterator(db_path / "t")) {
+        files.push_back(entry.path().filename().string());
+    }
+    EXPECT_EQ(files, std::vector<std::string>{"shard_0.csv"});
+    EXPECT_FALSE(std::filesystem::exists(db_path / "catalog.txt.tmp"));
+
+    // The catalog cannot be written while its temporary file is a directory
+    std::filesystem::create_directory(db_path / "catalog.txt.tmp");
+    {
+        std::ostringstream out;
+        OutputRedirect redirect(out, out);
+        EXPECT_FALSE(db.createTable("u", {"k"}));
+        EXPECT_FALSE(db.createIndex("t", "k"));
+        EXPECT_FALSE(db.deleteTable("t"));
+        EXPECT_FALSE(db.encodeAttribute("t", "v"));
+    }
+    EXPECT_FALSE(std::filesystem::exists(db_path / "u"));
+    EXPECT_EQ(read(), "1,x\n");
+    std::filesystem::remove(db_path / "catalog.txt.tmp");
+}
+
+TEST_F(DatabaseTest, tablesOpenOnFirstUseOrInBackground) {
+    {
+        DBManager db(dbDir());
+        ASSERT_TRUE(db.createTable("a", {"k"}));
+        ASSERT_TRUE(db.createTable("b", {"k"}));
+        db.insertRecord("a", {{"k", "1"}});
+    }
+
+    Catalog catalog(db_path);
+    catalog.load();
+    EXPECT_EQ(catalog.openCount(), 0u);
+
+    auto a = catalog.find("a");
+    ASSERT_TRUE(a);
+    EXPECT_EQ(a->dataSize(), 2u);
+    EXPECT_EQ(catalog.find("a"), a);
+    EXPECT_EQ(catalog.openCount(), 1u);
+    EXPECT_FALSE(catalog.find("missing"));
+
+    // Unopened tables are persisted as they were read
+    catalog.persist();
+    Catalog reloaded(db_path);
+    reloaded.load();
+    EXPECT_TRUE(reloaded.find("b"));
+
+    catalog.prefetch();
+    for (int i = 0; i < 1000 && catalog.openCount() < 2; ++i) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    EXPECT_EQ(catalog.openCount(), 2u);
+}
+
+TEST_F(DatabaseTest, datagenWritesReproducibleJoinableTables) {
+    DatagenOptions options;
+    options.scale = 0.002;
+    options.stations = 50;
+    options.match_rate = 0.5;
+    options.shard_rows = 700;
+
+    auto generate = [&]() {
+        Catalog catalog(db_path);
+        catalog.load();
+        Datagen generator(catalog, options);
+        EXPECT_TRUE(generator.trips("trips"));
+        EXPECT_TRUE(generator.stations("stations"));
+        EXPECT_EQ(catalog.find("trips")->shardCount(), 3u);
+
+        std::ifstream shard(db_path / "trips" / "shard_1.csv");
+        return std::string(std::istreambuf_iterator<char>(shard), {});
+    };
+    std::string first = generate();
+    EXPECT_EQ(std::count(first.begin(), first.end(), '\n'), 700);
+    EXPECT_EQ(generate(), first) << "regenerated tables are replaced";
+
+    DBManager db(dbDir());
+    std::ostringstream out;
+    {
+        OutputRedirect redirect(out, out);
+        std::unordered_map<std::string, std::string> attrs = {
+            {"trips", "start_station_name"}, {"stations", "station_name"}};
+        ASSERT_TRUE(db.joinTables({"trips", "stations"}, attrs));
+    }
+    std::string rows = out.str();
+    auto matched = std::count(rows.begin(), rows.end(), '\n');
+    EXPECT_GT(matched, 800);
+    EXPECT_LT(matched, 1200);
+}
+
+TEST_F(DatabaseTest, batchedJoinProbeMatchesRowByRowProbe) {
+    DatagenOptions options;
+    options.scale = 0.003;
+    options.stations = 300;
+    options.match_rate = 0.7;
+    options.shard_rows = 1000;
+    {
+        Catalog catalog(db_path);
+        catalog.load();
+        Datagen generator(catalog, options);
+        ASSERT_TRUE(generator.trips("trips"));
+        ASSERT_TRUE(generator.stations("stations"));
+    }
+
+    Settings& settings = Settings::instance();
+    size_t batch_size = settings.join_batch_size;
+    size_t cache_size = settings.join_cache_size;
+    settings.join_cache_size = 0;
+
+    DBManager db(dbDir());
+    auto join = [&](size_t batch) {
+        settings.join_batch_size = batch;
+        std::ostringstream out;
+        {
+            OutputRedirect redirect(out, out);
+            std::unordered_map<std::string, std::string> attrs = {
+                {"stations", "station_name"}, {"trips", "end_station_name"}};
+            EXPECT_TRUE(db.joinTables({"stations", "trips"}, attrs));
+        }
+        std::vector<std::string> rows;
+        std::istringstream lines(out.str());
+        for (std::string row; std::getline(lines, row);) rows.push_back(row);
+        std::sort(rows.begin(), rows.end());
+        return rows;
+    };
+
+    // Batches ending mid shard and holding several shards
+    auto expected = join(0);
+    EXPECT_GT(expected.size(), 1800u);
+    EXPECT_EQ(join(7), expected);
+    EXPECT_EQ(join(4096), expected);
+
+    ASSERT_TRUE(db.encodeAttribute("stations", "station_name"));
+    ASSERT_TRUE(db.encodeAttribute("trips", "end_station_name"));
+    EXPECT_EQ(join(0), expected);
+    EXPECT_EQ(join(100), expected) << "join on dictionary codes";
+
+    settings.join_batch_size = batch_size;
+    settings.join_cache_size = cache_size;
+}
+
+TEST_F(DatabaseTest, traceRecordsCommandsOperatorsAndShardTasks) {
+    DatagenOptions options;
+    options.scale = 0.002;
+    options.shard_rows = 500;
+    {
+        Catalog catalog(db_path);
+        catalog.load();
+        Datagen generator(catalog, options);
+        ASSERT_TRUE(generator.trips("trips"));
+        ASSERT_TRUE(generator.stations("stations"));
+    }
+
+    std::filesystem::path trace = db_path / "trace.json";
+    std::ostringstream out, err;
+    {
+        OutputRedirect redirect(out, err);
+        Interpreter interpreter(dbDir());
+        interpreter.processCommand("trace on " + trace.string());
+        interpreter.processCommand(
+            "join trips.end_station_name stations.station_name");
+        interpreter.processCommand("trace on " + trace.string());
+        interpreter.processCommand("trace off");
+        interpreter.processCommand("trace off");
+    }
+    EXPECT_NE(out.str().find("trace events to"), std::string::npos);
+    EXPECT_NE(err.str().find("already tracing"), std::string::npos);
+    EXPECT_NE(err.str().find("not tracing"), std::string::npos);
+
+    std::ifstream in(trace);
+    std::string json((std::istreambuf_iterator<char>(in)),
+                     std::istreambuf_iterator<char>());
+    auto count = [&](const std::string& text) {
+        size_t n = 0;
+        for (size_t at = json.find(text); at != std::string::npos;
+             at = json.find(text, at + 1)) {
+            n++;
+        }
+        return n;
+    };
+    EXPECT_EQ(json.rfind("{\"displayTimeUnit\":\"ms\"", 0), 0u);
+    EXPECT_EQ(count("\"name\":\"join\",\"cat\":\"command\""), 1u);
+    EXPECT_EQ(count("\"name\":\"join task\",\"cat\":\"task\""), 4u)
+        << "one task per shard of trips";
+    EXPECT_EQ(count("\"name\":\"task start\""), 4u);
+    EXPECT_GE(count("\"name\":\"probe\",\"cat\":\"operator\""), 4u);
+    EXPECT_GE(count("\"name\":\"thread_name\""), 5u);
+}
+
+TEST_F(DatabaseTest, memoryLimitsFailJoinsAndSpillSorts) {
+    DatagenOptions options;
+    options.scale = 0.003;
+    {
+        Catalog catalog(db_path);
+        catalog.load();
+        Datagen generator(catalog, options);
+        ASSERT_TRUE(generator.trips("trips"));
+        ASSERT_TRUE(generator.stations("stations"));
+    }
+
+    Settings& settings = Settings::instance();
+    size_t batch_size = settings.join_batch_size;
+    size_t cache_size = settings.join_cache_size;
+    settings.join_cache_size = 0;
+
+    Interpreter interpreter(dbDir());
+    auto run = [&](const std::string& command, std::string* err = nullptr) {
+        std::ostringstream out, errors;
+        {
+            OutputRedirect redirect(out, errors);
+            interpreter.processCommand(command);
+        }
+        if (err) *err = errors.str();
+        return out.str();
+    };
+    const std::string join =
+        "join trips.end_station_name stations.station_name";
+    const std::string sort = "read trips order by duration";
+    std::string expected_sort = run(sort);
+
+    settings.query_memory_limit = 16 << 10;
+    for (size_t batch : {0, 1024}) {
+        settings.join_batch_size = batch;
+        std::string err;
+        EXPECT_EQ(run(join, &err), "");
+        EXPECT_NE(err.find("memory limit exceeded"), std::string::npos)
+            << "batch size " << batch << ": " << err;
+    }
+    EXPECT_EQ(MemoryTracker::global().used(), 0u);
+
+    // The sort spills runs instead of failing
+    std::string err;
+    EXPECT_EQ(run(sort, &err), expected_sort);
+    EXPECT_EQ(err, "");
+
+    settings.query_memory_limit = 0;
+    settings.memory_limit = 16 << 10;
+    run(join, &err);
+    EXPECT_NE(err.find("memory limit exceeded"), std::string::npos);
+
+    settings.memory_limit = 0;
+    std::string analyzed = run("explain analyze " + join, &err);
+    EXPECT_EQ(err, "");
+    EXPECT_NE(analyzed.find("Peak query memory: "), std::string::npos);
+    EXPECT_EQ(analyzed.find("Peak query memory: 0 B"), std::string::npos);
+    EXPECT_EQ(MemoryTracker::global().used(), 0u);
+
+    settings.join_batch_size = batch_size;
+    settings.join_cache_size = cache_size;
+}
+
+TEST_F(DatabaseTest, partitionedTablesJoinPartitionPairs) {
+    Settings& settings = Settings::instance();
+    size_t cache_size = settings.join_cache_size;
+    settings.join_cache_size = 0;
+
+    auto run = [&](Interpreter& interpreter, const std::string& command) {
+        std::ostringstream out;
+        OutputRedirect redirect(out, out);
+        interpreter.processCommand(command);
+        return out.str();
+    };
+    auto sorted = [](const std::string& text) {
+        std::vector<std::string> rows;
+        std::istringstream lines(text);
+        for (std::string row; std::getline(lines, row);) rows.push_back(row);
+        std::sort(rows.begin(), rows.end());
+        return rows;
+    };
+
+    std::string plain, pairwise;
+    {
+        Interpreter interpreter(dbDir());
+        run(interpreter, "create a k v partition by k into 4");
+        run(interpreter, "create b k w partition by k into 4");
+        run(interpreter, "create c k w");
+        for (int i = 0; i < 200; ++i) {
+            std::string k = std::to_string(i % 37);
+            run(interpreter, "insert a k:" + k + " v:" + std::to_string(i));
+            run(interpreter, "insert b k:" + k + " w:" + std::to_string(i));
+            run(interpreter, "insert c k:" + k + " w:" + std::to_string(i));
+        }
+        EXPECT_NE(run(interpreter, "update a id:0 k:1").find("partitioned"),
+                  std::string::npos);
+
+        plain = run(interpreter, "join a.k c.k");
+        pairwise = run(interpreter, "join a.k b.k");
+        EXPECT_EQ(sorted(pairwise), sorted(plain));
+        // 15 keys of 6 rows on each side, 22 of 5
+        EXPECT_EQ(sorted(pairwise).size(), 1090u);
+    }
+
+    // Every row is stored in the partition of its key
+    for (int i = 0; i < 4; ++i) {
+        std::ifstream shard(db_path / "a" / ("shard_" + std::to_string(i) +
+                                             ".csv"));
+        size_t rows = 0;
+        for (std::string row; std::getline(shard, row); ++rows) {
+            EXPECT_EQ(Table::partitionOf(row.substr(0, row.find(',')), 4),
+                      size_t(i));
+        }
+        EXPECT_GT(rows, 0u);
+    }
+
+    // Partitioning survives a restart
+    Interpreter interpreter(dbDir());
+    EXPECT_NE(run(interpreter, "explain join a.k b.k")
+                  .find("one per co-partitioned pair"),
+              std::string::npos);
+    EXPECT_EQ(run(interpreter, "explain join a.k c.k")
+                  .find("co-partitioned"),
+              std::string::npos);
+    EXPECT_EQ(sorted(run(interpreter, "join a.k b.k")), sorted(pairwise));
+
+    settings.join_cache_size = cache_size;
+}
+
+TEST_F(DatabaseTest, clusteredTablesSearchSortedShards) {
+    Settings& settings = Settings::instance();
+    size_t delta_size = settings.cluster_delta_size;
+    size_t shard_size = settings.cluster_shard_size;
+    settings.cluster_delta_size = 512;
+    settings.cluster_shard_size = 2048;
+
+    auto run = [&](Interpreter& interpreter, const std::string& command) {
+        std::ostringstream out;
+        OutputRedirect redirect(out, out);
+        interpreter.processCommand(command);
+        return out.str();
+    };
+    auto keys = [](const std::string& text) {
+        std::vector<std::string> result;
+        std::istringstream lines(text);
+        for (std::string row; std::getline(lines, row);) {
+            result.push_back(row.substr(0, row.find(',')));
+        }
+        return result;
+    };
+
+    // Keys 0 to 299 inserted out of order, half of them twice
+    std::map<int, int> c_rows;
+    size_t join_rows = 0;
+    std::vector<std::string> expected;
+    {
+        Interpreter interpreter(dbDir());
+        run(interpreter, "create c k v cluster by k");
+        run(interpreter, "create d k w cluster by k");
+        for (int i = 0; i < 450; ++i) {
+            std::string k = std::to_string(i * 7 % 300);
+            run(interpreter, "insert c k:" + k + " v:" + std::to_string(i));
+            c_rows[i * 7 % 300]++;
+        }
+        for (int i = 0; i < 450; i += 3) {
+            run(interpreter, "insert d k:" + std::to_string(i * 7 % 300) +
+                                 " w:x");
+            join_rows += c_rows[i * 7 % 300];
+        }
+        EXPECT_NE(run(interpreter, "update c id:0 k:1").find("clustered"),
+                  std::string::npos);
+
+        for (int k = 100; k < 120; ++k) {
+            expected.insert(expected.end(), c_rows[k], std::to_string(k));
+        }
+        EXPECT_EQ(keys(run(interpreter, "read c k>=100 k<120")), expected);
+    }
+
+    // The delta was merged into several sorted shards with key ranges
+    std::ifstream catalog(db_path / "catalog.txt");
+    std::string text((std::istreambuf_iterator<char>(catalog)),
+                     std::istreambuf_iterator<char>());
+    EXPECT_NE(text.find("cluster,c,k"), std::string::npos);
+    size_t sorted_shards = 0;
+    for (size_t pos = 0; (pos = text.find("\nrange,", pos)) !=
+                         std::string::npos;
+         ++pos) {
+        sorted_shards++;
+    }
+    EXPECT_GT(sorted_shards, 2u);
+
+    Interpreter interpreter(dbDir());
+    EXPECT_EQ(keys(run(interpreter, "read c k>=100 k<120")), expected);
+    EXPECT_EQ(keys(run(interpreter, "read c k:42")).size(), size_t(c_rows[42]));
+    EXPECT_NE(run(interpreter, "explain read c k>=100 k<120")
+                  .find("binary search"),
+              std::string::npos);
+
+    // Ordered reads and joins on the clustering attribute need no sort
+    std::vector<std::string> ordered = keys(run(interpreter,
+                                                "read c order by k"));
+    EXPECT_EQ(ordered.size(), 450u);
+    EXPECT_TRUE(std::is_sorted(ordered.begin(), ordered.end(),
+                               [](const auto& a, const auto& b) {
+                                   return std::stoi(a) < std::stoi(b);
+                               }));
+    std::string plan = run(interpreter, "explain join c.k d.k order by k");
+    EXPECT_NE(plan.find("Merge join"), std::string::npos);
+    EXPECT_NE(plan.find("Sort on k: none"), std::string::npos);
+
+    std::vector<std::string> joined =
+        keys(run(interpreter, "join c.k d.k order by k limit 1000"));
+    EXPECT_EQ(joined.size(), join_rows);
+    EXPECT_TRUE(std::is_sorted(joined.begin(), joined.end(),
+                               [](const auto& a, const auto& b) {
+                                   return std::stoi(a) < std::stoi(b);
+                               }));
+
+    settings.cluster_delta_size = delta_size;
+    settings.cluster_shard_size = shard_size;
+}
+
+TEST_F(DatabaseTest, btreeIndexesServeRangeAndPrefixPredicates) {
+    auto run = [&](Interpreter& interpreter, const std::string& command) {
+        std::ostringstream out;
+        OutputRedirect redirect(out, out);
+        interpreter.processCommand(command);
+        return out.str();
+    };
+    auto rows = [](const std::string& text) {
+        return std::count(text.begin(), text.end(), '\n');
+    };
+
+    {
+        Interpreter interpreter(dbDir());
+        run(interpreter, "create calls duration name");
+        // Durations 0 to 1199 out of order, every fourth name shared
+        for (int i = 0; i < 1200; ++i) {
+            std::string name = i % 4 == 0 ? "abc" + std::to_string(i)
+                                          : "n" + std::to_string(i);
+            run(interpreter, "insert calls duration:" +
+                                 std::to_string(i * 7 % 1200) +
+                                 " name:" + name);
+        }
+        EXPECT_NE(run(interpreter, "create index calls duration using btree")
+                      .find("Index created"),
+                  std::string::npos);
+        run(interpreter, "create index calls name using btree");
+
+        // Rows written after the bulk load are indexed as they are written
+        for (int i = 1200; i < 1500; ++i) {
+            run(interpreter, "insert calls duration:" + std::to_string(i) +
+                                 " name:x");
+        }
+        run(interpreter, "update calls id:1 name:abc9999");
+        EXPECT_EQ(rows(run(interpreter, "read calls duration>1400")), 99);
+        EXPECT_EQ(rows(run(interpreter, "read calls name:abc1*")), 77);
+        run(interpreter, "delete calls duration<100");
+    }
+
+    // The index was synced on close and is used as is
+    Interpreter interpreter(dbDir());
+    std::string plan =
+        run(interpreter, "explain read calls duration>=1000 duration<1100");
+    EXPECT_NE(plan.find("Index range scan calls on duration"),
+              std::string::npos);
+    EXPECT_NE(plan.find("height 2"), std::string::npos);
+    EXPECT_EQ(rows(run(interpreter, "read calls duration>=1000 "
+                                    "duration<1100")),
+              100);
+    EXPECT_EQ(rows(run(interpreter, "read calls duration<200")), 100);
+    EXPECT_EQ(rows(run(interpreter, "read calls name:abc1* duration<500")),
+              18);
+    EXPECT_NE(run(interpreter, "explain delete calls name:abc*")
+                  .find("Index prefix scan"),
+              std::string::npos);
+}
+
+TEST_F(DatabaseTest, predicateProgramsNarrowTheSelectionOfColumnBatches) {
+    std::filesystem::create_directories(db_path);
+    std::string path = (db_path / "shard_0.csv").string();
+    std::ofstream(path) << "0,x,5\n1,y,12\n2,z,7\n3,y,30\n4,y,1\n"
+                        << "5,y,abc\n6,y,-8.5\n";
+    Shard shard(path);
+
+    PredicateProgram program;
+    program.add(2, nullptr, {"v", CompareOp::Greater, "6"});
+    program.add(1, nullptr, {"k", CompareOp::Equal, "y"});
+    program.add(2, nullptr, {"v", CompareOp::LessEqual, "30"});
+    ASSERT_EQ(program.columns().size(), 2u) << "one slot per column";
+
+    BatchScan scan(shard, program.columns(), 3);
+    ColumnBatch batch;
+    std::vector<std::string> selected;
+    std::vector<uint64_t> offsets;
+    while (scan.next(batch)) {
+        EXPECT_LE(batch.size(), 3u);
+        program.apply(batch);
+        for (uint32_t row : batch.selection()) {
+            selected.emplace_back(batch.row(row));
+            offsets.push_back(batch.offset(row));
+        }
+    }
+    EXPECT_EQ(scan.rowsRead(), 7u);
+    EXPECT_EQ(selected, (std::vector<std::string>{"1,y,12", "3,y,30"}));
+
+    // Rows evaluated one at a time agree with the batches
+    for (std::string row : {"1,y,12", "3,y,30"}) {
+        EXPECT_TRUE(program.matches(row)) << row;
+    }
+    for (std::string row : {"0,x,5", "5,y,abc", "6,y,-8.5", "7,y,31.5"}) {
+        EXPECT_FALSE(program.matches(row)) << row;
+    }
+
+    // Reading by offset yields the same rows
+    BatchScan by_offset(shard, {{2}}, 3, &offsets);
+    ASSERT_TRUE(by_offset.next(batch));
+    ASSERT_EQ(batch.size(), 2u);
+    EXPECT_EQ(batch.column(0)[0], "12");
+    EXPECT_EQ(batch.row(1), "3,y,30");
+    EXPECT_FALSE(by_offset.next(batch));
+}
+
+TEST_F(DatabaseTest, arrowExportAndImportRoundTripTables) {
+    auto run = [&](Interpreter& interpreter, const std::string& command) {
+        std::ostringstream out;
+        OutputRedirect redirect(out, out);
+        interpreter.processCommand(command);
+        return out.str();
+    };
+
+    Interpreter interpreter(dbDir());
+    run(interpreter, "create trips station bike with compression");
+    for (int i = 0; i < 500; ++i) {
+        run(interpreter, "insert trips station:s" + std::to_string(i % 37) +
+                             (i % 5 ? " bike:" + std::to_string(i) : ""));
+    }
+    run(interpreter, "encode trips station");
+
+    std::string file = (db_path / "trips.arrow").string();
+    Histogram& export_latency = Metrics::instance().histogram(
+        "lmkdb_command_duration_seconds", "Command latency",
+        "command=\"export\"");
+    uint64_t exports = export_latency.count();
+    EXPECT_NE(run(interpreter, "export trips " + file).find("exported"),
+              std::string::npos);
+    EXPECT_EQ(export_latency.count(), exports + 1);
+
+    // A new table takes the columns of the file
+    EXPECT_NE(run(interpreter, "import copy " + file).find("Imported"),
+              std::string::npos);
+    std::string original = run(interpreter, "read trips station:s3");
+    EXPECT_EQ(std::count(original.begin(), original.end(), '\n'), 14);
+    EXPECT_EQ(run(interpreter, "read copy station:s3"), original);
+
+    // Imports append, also to tables with other columns first
+    run(interpreter, "create other bike station extra");
+    run(interpreter, "import other " + file);
+    run(interpreter, "import other " + file);
+    EXPECT_EQ(run(interpreter, "read other bike:7"), "7,s7\n7,s7\n");
+
+    // The empty tail of a new compressed table is replaced, not sealed
+    run(interpreter, "create packed station bike with compression");
+    run(interpreter, "import packed " + file);
+    for (const auto& entry :
+         std::filesystem::directory_iterator(db_path / "packed")) {
+        EXPECT_EQ(entry.path().extension(), ".lz") << entry.path();
+    }
+    run(interpreter, "insert packed station:new bike:1000");
+    EXPECT_EQ(run(interpreter, "read packed station:s3"), original);
+    EXPECT_EQ(run(interpreter, "read packed station:new"), "new,1000\n");
+
+    std::ofstream(db_path / "rows.arrow") << "not,arrow\n";
+    EXPECT_NE(run(interpreter, "import copy " +
+                                   (db_path / "rows.arrow").string())
+                  .find("Invalid Arrow file"),
+              std::string::npos);
+
+    // A footer whose lengths add up past the end of the file only when
+    // their sum overflows
+    ArrowReader reader;
+    ASSERT_TRUE(reader.open(file));
+    int64_t body_length = reader.batchBytes(0);
+    std::string bytes;
+    {
+        std::ifstream in(file, std::ios::binary);
+        bytes.assign(std::istreambuf_iterator<char>(in), {});
+    }
+    std::string field(reinterpret_cast<const char*>(&body_length), 8);
+    size_t at = bytes.rfind(field);
+    ASSERT_NE(at, std::string::npos);
+    int64_t patched = INT64_MAX - 15;
+    bytes.replace(at, 8, reinterpret_cast<const char*>(&patched), 8);
+    std::ofstream(db_path / "bad.arrow", std::ios::binary) << bytes;
+    EXPECT_NE(run(interpreter, "import t2 " +
+                                   (db_path / "bad.arrow").string())
+                  .find("record batch outside the file"),
+              std::string::npos);
+}
+
+TEST_F(DatabaseTest, walReplaysAppendsLostInACrash) {
+    Counter& records = Metrics::instance().counter(
+        "lmkdb_wal_records_total", "Appends written to the write-ahead log");
+    Counter& syncs = Metrics::instance().counter(
+        "lmkdb_wal_syncs_total",
+        "Syncs of the write-ahead log, each covering a group of records");
+    size_t group_ms = Settings::instance().wal_group_ms;
+    std::filesystem::path log = db_path / Wal::FILE_NAME;
+    std::filesystem::path shard = db_path / "t" / "shard_0.csv";
+    std::string saved_log;
+
+    {
+        DBManager db(dbDir());
+        ASSERT_TRUE(db.createTable("t", {"k"}));
+
+        // Concurrent inserts share the syncs of a group commit
+        Settings::instance().wal_group_ms = 5;
+        uint64_t records_before = records.value();
+        uint64_t syncs_before = syncs.value();
+        std::vector<std::thread> writers;
+        for (int w = 0; w < 8; ++w) {
+            writers.emplace_back([&db, w]() {
+                for (int i = 0; i < 10; ++i) {
+                    db.insertRecord("t", {{"k", std::to_string(w * 10 + i)}});
+                }
+            });
+        }
+        for (auto& writer : writers) writer.join();
+        Settings::instance().wal_group_ms = group_ms;
+
+        EXPECT_EQ(records.value() - records_before, 80u);
+        EXPECT_LT(syncs.value() - syncs_before, 80u);
+
+        // What the log holds when the process dies before a checkpoint
+        std::ifstream in(log, std::ios::binary);
+        saved_log.assign(std::istreambuf_iterator<char>(in), {});
+    }
+
+    std::string rows;
+    {
+        std::ifstream in(shard, std::ios::binary);
+        rows.assign(std::istreambuf_iterator<char>(in), {});
+    }
+    ASSERT_EQ(std::count(rows.begin(), rows.end(), '\n'), 80);
+
+    // The last rows never reached the disk and one was torn, the log was
+    // complete but for a torn last record
+    std::filesystem::resize_file(shard, rows.find('\n', 100) + 2);
+    std::ofstream(log, std::ios::binary | std::ios::trunc)
+        << saved_log << std::string(5, '\x7f');
+
+    for (int restart = 0; restart < 2; ++restart) {
+        std::ostringstream out;
+        {
+            OutputRedirect redirect(out, out);
+            DBManager db(dbDir());
+            db.readTable("t", {});
+        }
+        std::string expected = restart == 0 ? "Recovered " : "";
+        EXPECT_EQ(out.str().substr(0, expected.size()), expected);
+        EXPECT_TRUE(out.str().ends_with(rows)) << "restart " << restart;
+        EXPECT_EQ(std::filesystem::file_size(log), 0u);
+    }
+}
+
+TEST_F(DatabaseTest, materializedViewsRefreshAfterBaseTablesChange) {
+    DBManager db(dbDir());
+    ASSERT_TRUE(db.createTable("a", {"k", "x"}));
+    ASSERT_TRUE(db.createTable("b", {"k", "y"}));
+    db.insertRecord("a", {{"k", "1"}, {"x", "p"}});
+    db.insertRecord("b", {{"k", "1"}, {"y", "q"}});
+
+    std::unordered_map<std::string, std::string> spec = {{"a", "k"},
+                                                         {"b", "k"}};
+    ASSERT_TRUE(db.createMaterialized("v", {"a", "b"}, spec));
+
+    auto read = [&](const std::string& table) {
+        std::ostringstream out;
+        OutputRedirect redirect(out, out);
+        db.readTable(table, {});
+        return out.str();
+    };
+    EXPECT_EQ(read("v"), "1,p,1,q\n");
+
+    db.insertRecord("b", {{"k", "1"}, {"y", "r"}});
+    EXPECT_EQ(read("v"), "1,p,1,q\n1,p,1,r\n");
+    EXPECT_FALSE(db.insertRecord("v", {{"x", "z"}}));
+}
+
+TEST_F(DatabaseTest, joinCacheMissesAfterTableIsRecreated) {
+    DBManager db(dbDir());
+    std::unordered_map<std::string, std::string> spec = {{"a", "k"},
+                                                         {"b", "k"}};
+    auto join = [&]() {
+        std::ostringstream out;
+        OutputRedirect redirect(out, out);
+        db.joinTables({"a", "b"}, spec);
+        return out.str();
+    };
+
+    ASSERT_TRUE(db.createTable("a", {"k", "x"}));
+    ASSERT_TRUE(db.createTable("b", {"k", "y"}));
+    db.insertRecord("a", {{"k", "1"}, {"x", "p"}});
+    db.insertRecord("b", {{"k", "1"}, {"y", "q"}});
+    EXPECT_EQ(join(), "1,p,1,q\n");
+
+    // Same name, schema and number of writes as the dropped table
+    {
+        std::ostringstream out;
+        OutputRedirect redirect(out, out);
+        ASSERT_TRUE(db.deleteTable("b"));
+    }
+    ASSERT_TRUE(db.createTable("b", {"k", "y"}));
+    db.insertRecord("b", {{"k", "1"}, {"y", "NEW"}});
+    EXPECT_EQ(join(), "1,p,1,NEW\n");
+}
+
+TEST_F(DatabaseTest, dictionaryEncodedColumnsJoinOnCodes) {
+    auto capture = [](auto&& command) {
+        std::ostringstream out;
+        OutputRedirect redirect(out, out);
+        command();
+        return out.str();
+    };
+    std::unordered_map<std::string, std::string> spec = {{"a", "name"},
+                                                         {"b", "name"}};
+
+    {
+        DBManager db(dbDir());
+        ASSERT_TRUE(db.createTable("a", {"name", "x"}));
+        ASSERT_TRUE(db.createTable("b", {"y", "name"}));
+        db.insertRecord("a", {{"name", "Bank"}, {"x", "1"}});
+        db.insertRecord("a", {{"name", "Angel"}, {"x", "2"}});
+        db.insertRecord("b", {{"y", "3"}, {"name", "Angel"}});
+        db.insertRecord("b", {{"y", "4"}, {"name", "Oval"}});
+        std::string plain = capture([&] { db.joinTables({"a", "b"}, spec); });
+
+        // Encoded left against plain right, then codes on both sides with
+        // dictionaries that assign different codes to the same names
+        ASSERT_TRUE(db.encodeAttribute("a", "name"));
+        EXPECT_EQ(capture([&] { db.joinTables({"a", "b"}, spec); }), plain);
+        db.insertRecord("b", {{"y", "5"}, {"name", "Bank"}});
+        ASSERT_TRUE(db.encodeAttribute("b", "name"));
+        EXPECT_FALSE(db.encodeAttribute("b", "name"));
+
+        EXPECT_EQ(capture([&] { db.joinTables({"a", "b"}, spec); }),
+                  "Angel,2,3,Angel\nBank,1,5,Bank\n");
+    }
+
+    std::ifstream shard(db_path / "b" / "shard_0.1.csv");
+    std::string first_row;
+    std::getline(shard, first_row);
+    EXPECT_EQ(first_row, "3,0") << "shards store codes";
+
+    DBManager db(dbDir());
+    db.insertRecord("a", {{"name", "Oval"}, {"x", "6"}});
+    EXPECT_TRUE(db.deleteByAttributes("a", {{"name", "Bank"}}));
+    EXPECT_FALSE(db.deleteByAttributes("a", {{"name", "Euston"}}));
+    EXPECT_EQ(capture([&] { db.readTable("a", {}); }),
+              "Angel,2\nOval,6\n");
+}
+
+TEST_F(DatabaseTest, compressedTablesSealTailShardsIntoBlocks) {
+    size_t seal_size = Settings::instance().seal_size;
+    Settings::instance().seal_size = 100 * 1024;
+
+    auto read = [](DBManager& db, const std::string& table) {
+        std::ostringstream out;
+        OutputRedirect redirect(out, out);
+        db.readTable(table, {});
+        return out.str();
+    };
+
+    std::string expected;
+    {
+        DBManager db(dbDir());
+        ASSERT_TRUE(db.createTable("t", {"k", "station"}, true));
+        for (int i = 0; i < 10000; ++i) {
+            std::string k = std::to_string(i);
+            db.insertRecord("t", {{"k", k}, {"station", "Paddington"}});
+            expected += k + ",Paddington\n";
+        }
+        EXPECT_EQ(read(db, "t"), expected);
+    }
+
+    std::vector<std::filesystem::path> compressed;
+    for (const auto& entry :
+         std::filesystem::directory_iterator(db_path / "t")) {
+        if (entry.path().extension() == ".lz") {
+            compressed.push_back(entry.path());
+        }
+    }
+    ASSERT_EQ(compressed.size(), 1u);
+    EXPECT_LT(std::filesystem::file_size(compressed[0]) * 3, 100 * 1024u);
+
+    // Rows in the sealed shard are updated through a new compressed version
+    DBManager db(dbDir());
+    ASSERT_TRUE(db.updateRecord("t", 4000, {{"station", "Oval"}}));
+    size_t pos = expected.find("4000,Paddington");
+    expected.replace(pos, 15, "4000,Oval");
+    EXPECT_EQ(read(db, "t"), expected);
+
+    ASSERT_TRUE(db.createTable("s", {"station", "zone"}));
+    db.insertRecord("s", {{"station", "Oval"}, {"zone", "2"}});
+    std::unordered_map<std::string, std::string> spec = {{"t", "station"},
+                                                         {"s", "station"}};
+    std::ostringstream out;
+    {
+        OutputRedirect redirect(out, out);
+        db.joinTables({"t", "s"}, spec);
+    }
+    EXPECT_EQ(out.str(), "4000,Oval,Oval,2\n");
+
+    Settings::instance().seal_size = seal_size;
+}
+
+TEST_F(DatabaseTest, bufferPoolReadsLinesAcrossPagesAndAppends) {
+    std::filesystem::create_directories(db_path);
+    std::string path = (db_path / "shard_0.csv").string();
+    std::string long_a(100000, 'a'), long_c(70000, 'c');
+    std::ofstream(path) << long_a << "\nb\n" << long_c << "\n";
+
+    auto readAll = [](const Shard& shard) {
+        std::vector<std::string> lines;
+        ShardReader reader(shard);
+        for (std::string line; reader.next(line);) lines.push_back(line);
+        return lines;
+    };
+
+    Shard shard(path);
+    std::vector<std::string> expected = {long_a, "b", long_c};
+    EXPECT_EQ(readAll(shard), expected);
+
+    Counter& hits = Metrics::instance().counter(
+        "lmkdb_buffer_pool_hits_total", "Shard page reads served from memory");
+    uint64_t hits_before = hits.value();
+    EXPECT_EQ(readAll(shard), expected);
+    EXPECT_GT(hits.value(), hits_before) << "second scan is served from memory";
+
+    // The cached tail page is shorter than the appended shard needs
+    std::ofstream(path, std::ios::app) << "d\n";
+    expected.push_back("d");
+    EXPECT_EQ(readAll(Shard(path)), expected);
+
+    size_t budget = Settings::instance().buffer_pool_memory;
+    Settings::instance().buffer_pool_memory = BufferPool::PAGE_SIZE;
+    BufferPool::instance().invalidate(path);
+    EXPECT_EQ(readAll(Shard(path)), expected);
+    EXPECT_LE(BufferPool::instance().memoryUsage(), 2 * BufferPool::PAGE_SIZE);
+
+    Settings::instance().buffer_pool_memory = budget;
+    BufferPool::instance().invalidate(path);
+}
+
 int main(int argc, char *argv[]) {
     testing::InitGoogleTest(&argc, argv);
     return RUN_ALL_TESTS();